@@ -1,17 +1,32 @@
 #include "fat_kernel.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
+#include "./util/bcache.h"
+#include "./util/journal.h"
+#include "./util/kstat.h"
 #include "./util/parser.h"
+#include "./util/pipe.h"
+#include "./util/spthread.h"
 
-/** @brief FAT table in memory */
+// POSIX only promises 16; <limits.h> leaves it out without _XOPEN_SOURCE
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/**
+ * @brief FAT table in memory. It is a private copy: changed FAT blocks only
+ * reach the image through the journal (see k_commit()).
+ */
 uint16_t* FAT_TABLE = NULL;
 
 /** @brief Global open file table */
@@ -38,6 +53,107 @@ size_t FS_ENTRY_PER_BLK = 0;
 /** @brief whether a filesystem is mounted at the mooment */
 bool IS_FS_MOUNTED = false;
 
+/** @brief free-space index: bit i is set iff data block i is free */
+static uint64_t* FREE_BITMAP = NULL;
+
+/** @brief number of allocatable blocks tracked by FREE_BITMAP (1..n-1) */
+static size_t FREE_LIMIT = 0;
+
+/** @brief next-fit cursor: allocation resumes scanning here */
+static size_t FREE_CURSOR = 1;
+
+/** @brief number of free data blocks */
+static size_t FREE_COUNT = 0;
+
+/** @brief free blocks held in open files' preallocated extents */
+static size_t FREE_RESERVED = 0;
+
+/** @brief the whole image when mounted with map_data, else NULL */
+static char* FS_IMAGE_MAP = NULL;
+
+/** @brief length of FS_IMAGE_MAP */
+static size_t FS_MAP_SIZE = 0;
+
+/** @brief largest read-ahead window in blocks (see k_readahead()) */
+static size_t FS_READAHEAD_BLOCKS = 0;
+
+/** @brief byte offset of the journal region (right after the data region) */
+static off_t FS_JOURNAL_OFF = 0;
+
+/** @brief bit i set iff FAT block i changed since the last commit */
+static uint32_t FAT_DIRTY = 0;
+
+/** @brief a chain was freed since the last commit */
+static bool FAT_FREED = false;
+
+/** @brief One entry of a directory's name index */
+typedef struct dir_hash_entry {
+  char name[MAX_NAME_LEN];  // empty: unused bucket
+  off_t off;                // offset of the live dirent with this name
+} dir_hash_entry_t;
+
+/**
+ * @brief In-memory index of one directory: its names and its free slots.
+ *
+ * The root directory is indexed at mount time, a subdirectory the first
+ * time a path goes through it. Indexes stay until unmount, rmdir or defrag.
+ */
+typedef struct dir_index {
+  uint16_t first_block;  // identifies the directory (1: the root)
+
+  dir_hash_entry_t* hash;  // name -> dirent offset, linear probing
+  size_t hash_cap;         // number of buckets (a power of two)
+  size_t hash_len;         // number of names
+
+  uint16_t* blocks;  // blocks of the directory in chain order
+  size_t nblocks;
+
+  uint64_t* free;    // bit p set iff dirent slot p (chain order) is deleted
+  size_t end;        // slot where the directory ends (first name[0] == 0)
+  size_t free_hint;  // no deleted slot lies before this one
+
+  struct dir_index* next;  // next indexed directory
+} dir_index_t;
+
+/** @brief every indexed directory; the root is always among them */
+static dir_index_t* DIR_LIST = NULL;
+
+/** @brief index of the directory each block belongs to, or NULL */
+static dir_index_t** BLOCK_DIR = NULL;
+
+/** @brief chain index of each directory block within its directory */
+static uint16_t* BLOCK_POS = NULL;
+
+/** @brief first block of the directory relative paths start from */
+static uint16_t FS_CWD = 1;
+
+/** @brief A path split into the directory it is in and its last name */
+typedef struct path_ref {
+  dir_index_t* dir;         // the directory the last component is in
+  char name[MAX_NAME_LEN];  // the last component; "" for dir itself
+} path_ref_t;
+
+/** @brief A directory being listed: the block last read and where in it */
+struct dir_stream {
+  uint16_t blk;       // block in buf
+  uint16_t next_blk;  // block to read when buf is used up, 0xFFFF at the end
+  size_t pos;         // next entry of buf
+  bool done;          // the end-of-directory entry was reached
+  dir_entry_t buf[];  // one directory block
+};
+
+/** @brief number of buckets in INODE_TABLE */
+#define INODE_BUCKETS 256
+
+/** @brief open files by dirent slot, chained through hash_next */
+static open_inode_t* INODE_TABLE[INODE_BUCKETS] = {0};
+
+/** @brief free GDT slots (3 and up), used as a stack */
+static int GDT_FREE[MAX_GDT_ENTRY];
+
+/** @brief number of slots in GDT_FREE */
+static size_t GDT_FREE_LEN = 0;
+
 //////////////////////////////////////////////////////////////////////////////
 // =================== Static Function Declarations =================== /////
 ////////////////////////////////////////////////////////////////////////////
@@ -46,48 +162,387 @@ bool IS_FS_MOUNTED = false;
  * @brief Initialize the global file descriptor table for standard streams.
  *
  * Allocates and initializes entries 0, 1, and 2 in GLOBAL_FD_TABLE to represent
- * STDIN, STDOUT, and STDERR with appropriate access flags. Must be called
- * before any code relies on the global file descriptor table.
+ * STDIN, STDOUT, and STDERR with appropriate access flags, and puts every
+ * other slot on the free list. Must be called before any code relies on the
+ * global file descriptor table.
  */
 static void k_gdt_init(void);
 
 /**
  * @brief Clean up the global file descriptor table.
  *
- * Frees all non-NULL entries in GLOBAL_FD_TABLE and resets their pointers to
- * NULL. Intended to be called when shutting down or unmounting in order to
- * release all resources associated with global file descriptors.
+ * Frees all non-NULL entries in GLOBAL_FD_TABLE (and the inodes they share)
+ * and resets their pointers to NULL. Intended to be called when shutting
+ * down or unmounting in order to release all resources associated with
+ * global file descriptors.
  */
 static void k_gdt_cleanup(void);
 
 /**
- * @brief Find a free slot in the global descriptor table (GDT).
+ * @brief Find a free slot in the global descriptor table (GDT), in O(1).
+ *
+ * The slot stays on the free list until k_open() installs a file in it.
  *
  * @return Index of the free GDT slot, or -1 if no free slot is available.
  */
 static int k_find_gdt_spot(void);
 
 /**
- * @brief Find the first free data block in the FAT.
+ * @brief Install a new end of pipe @p p in a free GDT slot.
+ *
+ * @param p    The pipe.
+ * @param flag F_READ for a read end, F_WRITE for a write end.
+ * @return The new kernel fd, or -1 with P_ERRNO set (FS_GDT_FULL,
+ * FS_MALLOC_FAIL).
+ */
+static int k_pipe_install(pipe_t* p, uint8_t flag);
+
+/**
+ * @brief Look up the shared state of an open file, in O(1).
+ *
+ * @param dirent_offset the offset used to identify the dirent
+ * @return The inode, or NULL if no descriptor has the file open.
+ */
+static open_inode_t* k_inode_find(off_t dirent_offset);
+
+/**
+ * @brief Take a reference on the shared state of a file that is being
+ * opened, creating it from @p entry if the file is not open yet.
+ *
+ * @return The inode, or NULL if memory ran out.
+ */
+static open_inode_t* k_inode_get(off_t dirent_offset, const dir_entry_t* entry);
+
+/**
+ * @brief Drop a reference taken by k_inode_get(), freeing the inode with the
+ * last one.
+ */
+static void k_inode_put(open_inode_t* inode);
+
+
+/**
+ * @brief Build the free-space index from the FAT.
+ *
+ * Called once by mount(); afterwards the index is kept in sync by
+ * k_alloc_block() and k_free_fat_chain() instead of rescanning the FAT.
+ *
+ * @return FS_SUCCESS on success, or -1 if the bitmap cannot be allocated.
+ */
+static int k_free_index_build(void);
+
+/**
+ * @brief Release the free-space index (on unmount).
+ */
+static void k_free_index_destroy(void);
+
+/**
+ * @brief Mark a block as free (true) or in use (false) in the index.
+ */
+static void k_free_index_set(uint16_t blk, bool free);
+
+/**
+ * @brief Allocate one free data block.
+ *
+ * Uses a next-fit scan of the free bitmap starting at the cursor, so the
+ * amortized cost is O(1). The block is marked as end of chain (0xFFFF) in
+ * the FAT before it is returned.
+ *
+ * @return Index of the allocated block, or 0 if the disk is full.
+ */
+static uint16_t k_alloc_block(void);
+
+/**
+ * @brief Find a run of free blocks, next fit from the cursor.
+ *
+ * @param want Desired run length.
+ * @param len  Output: length of the run found, at most @p want.
+ * @return First block of the first run of @p want blocks, or of the longest
+ *         shorter run if there is none; 0 if no block is free.
+ */
+static uint16_t k_find_free_run(size_t want, size_t* len);
+
+/**
+ * @brief Preallocate a contiguous extent for a file opened for writing.
+ *
+ * The extent is taken out of the free index but stays free in the FAT, so
+ * nothing leaks if the OS dies before k_close(). It continues right after
+ * @p last when that block is free, and is kept small on a nearly full disk.
+ *
+ * @param of   The open file; its previous extent must be empty.
+ * @param last Last block of the file, or 0 if it has none.
+ */
+static void k_reserve_extent(open_file_t* of, uint16_t last);
+
+/**
+ * @brief Return the unused part of a file's extent to the free index.
+ */
+static void k_release_extent(open_file_t* of);
+
+/**
+ * @brief Allocate the block that follows @p last in a file's chain.
+ *
+ * Blocks come from the file's extent (refilled as needed), falling back to
+ * k_alloc_block(). The FAT entry is marked end of chain; linking it after
+ * @p last is up to the caller.
+ *
+ * @return The new block, or 0 if the disk is full.
+ */
+static uint16_t k_alloc_file_block(open_file_t* of, uint16_t last);
+
+/**
+ * @brief Find the last block of the chain starting at @p first_block.
+ *
+ * @return The last block, or 0 if the chain is empty.
+ */
+static uint16_t k_last_block(uint16_t first_block);
+
+/**
+ * @brief Find the @p index-th block of an open file's chain.
+ *
+ * The walk starts from the file's cached cursor when it is at or before
+ * @p index, so sequential access only ever steps over a block or two. The
+ * cursor is moved to the block that was found.
+ *
+ * @return The block, or 0 if the chain is shorter than @p index + 1 blocks.
+ */
+static uint16_t k_seek_block(open_file_t* of, size_t index);
+
+/**
+ * @brief Drop every directory index and index the root directory again.
+ *
+ * Called by mount() and after k_defrag() moved the directories around.
+ * Subdirectories are indexed again when a path next goes through them
+ * (k_dir_index_get()). Afterwards k_dirent_write() keeps the indexes in
+ * sync.
+ *
+ * @return FS_SUCCESS, or -1 if memory ran out.
+ */
+static int k_dir_index_build(void);
+
+/**
+ * @brief Release every directory index (on unmount).
+ */
+static void k_dir_index_destroy(void);
+
+/**
+ * @brief The index of the directory starting at @p first_block, built from
+ * the directory blocks if it does not exist yet.
+ *
+ * @return The index, or NULL with P_ERRNO = FS_MALLOC_FAIL.
+ */
+static dir_index_t* k_dir_index_get(uint16_t first_block);
+
+/**
+ * @brief Release one directory index (the directory is going away).
+ */
+static void k_dir_index_drop(dir_index_t* dir);
+
+/**
+ * @brief Register a directory block, in chain order: while indexing the
+ * directory, or when k_extend_dir() added a freshly zeroed one.
+ *
+ * @return FS_SUCCESS, or -1 if memory ran out.
+ */
+static int k_dir_index_add_block(dir_index_t* dir, uint16_t blk);
+
+/**
+ * @brief Copy @p src into the MAX_NAME_LEN name buffer @p dst, truncating it
+ * to MAX_NAME_LEN - 1 bytes and always terminating it.
+ */
+static void k_name_copy(char* dst, const char* src);
+
+/**
+ * @brief FNV-1a hash of a (bounded) file name.
+ */
+static size_t k_dir_hash(const char* name);
+
+/**
+ * @brief Bucket of @p dir holding @p name, or the empty bucket where it
+ * would go.
+ */
+static size_t k_dir_bucket(const dir_index_t* dir, const char* name);
+
+/**
+ * @brief Add (or move) @p name in the name index, growing it as needed.
+ */
+static int k_dir_hash_insert(dir_index_t* dir, const char* name, off_t off);
+
+/**
+ * @brief Remove @p name from the name index (backward-shift deletion, so no
+ * tombstones are needed).
+ */
+static void k_dir_hash_remove(dir_index_t* dir, const char* name);
+
+/**
+ * @brief Look up the dirent offset of a live file in @p dir, in O(1).
+ *
+ * @return The offset, or -1 if there is no such file.
+ */
+static off_t k_dir_lookup(const dir_index_t* dir, const char* name);
+
+/**
+ * @brief Offset of the first reusable dirent slot of @p dir (deleted, or
+ * the end of the directory), or -1 if all of its blocks are full.
+ */
+static off_t k_dir_free_slot(dir_index_t* dir);
+
+/**
+ * @brief k_dir_lookup(), or else k_dir_free_slot(), as k_find_file() does
+ * for a path.
+ */
+static bool k_dir_find(dir_index_t* dir, const char* name, off_t* offset);
+
+/**
+ * @brief Split a path into the directory holding its last component and
+ * that component.
+ *
+ * Absolute paths start at the root, relative ones at FS_CWD. Empty
+ * components and "." are skipped; ".." goes through the directory's ".."
+ * entry (and stays put at the root). A path ending in a directory itself
+ * ("/", ".", "a/.") comes back with an empty name; a final ".." below the
+ * root is left to be looked up like any entry.
+ *
+ * @return FS_SUCCESS, or -1 with P_ERRNO set: FS_FILE_NOT_FOUND for a
+ * missing directory along the way, FS_NOT_A_DIR for a file used as one,
+ * P_ENAMETOOLONG, FS_IO_ERROR or FS_MALLOC_FAIL.
+ */
+static int k_path_parent(const char* path, path_ref_t* ref);
+
+/**
+ * @brief First block of the directory a path names.
+ *
+ * @return The block, or 0 with P_ERRNO set (as k_path_parent(), or
+ * FS_NOT_A_DIR if the path names a file).
+ */
+static uint16_t k_path_dir(const char* path);
+
+/**
+ * @brief Write a directory entry, keeping the directory index in sync.
+ *
+ * Every dirent update must go through here (instead of k_bcache_write()),
+ * so that creations, renames and deletions are reflected in the index.
+ * The entry is staged in the journal along with the rest of its block and
+ * reaches the image with the next k_commit().
+ *
+ * @return sizeof(dir_entry_t) on success, like pwrite().
+ */
+static ssize_t k_dirent_write(const dir_entry_t* entry, off_t off);
+
+/**
+ * @brief Read a directory entry, as staged in the journal if its block is.
+ *
+ * Every dirent read must go through here (instead of k_bcache_read()).
+ *
+ * @return sizeof(dir_entry_t) on success, like pread().
+ */
+static ssize_t k_dirent_read(dir_entry_t* entry, off_t off);
+
+/**
+ * @brief Read a whole directory block, as it stands in the running
+ * transaction.
+ *
+ * @return FS_SUCCESS, or -1 with P_ERRNO set to FS_IO_ERROR.
+ */
+static int k_dir_block_read(uint16_t blk, void* buf);
+
+/**
+ * @brief Set FAT entry @p blk, marking its FAT block for the next commit.
+ */
+static void k_fat_set(uint16_t blk, uint16_t next);
+
+/**
+ * @brief Commit every metadata change made since the last commit.
+ *
+ * The dirents of open files are brought up to date first, and data blocks
+ * are flushed before the metadata that points at them is journaled. See
+ * util/journal.h for the commit itself.
+ *
+ * @return FS_SUCCESS, or -1 with P_ERRNO set to FS_IO_ERROR.
+ */
+static int k_commit(void);
+
+/**
+ * @brief k_journal_commit() callback: a committed directory block is now in
+ * the image, so any cached copy of it must catch up.
+ */
+static void k_commit_applied(off_t home, const void* block);
+
+/**
+ * @brief Update the directory index for slot @p off changing from @p old
+ * (NULL: an unused slot) to @p entry.
+ *
+ * @return FS_SUCCESS, or -1 if memory ran out.
+ */
+static int k_dir_index_note(const dir_entry_t* old,
+                            const dir_entry_t* entry,
+                            off_t off);
+
+/**
+ * @brief Zero-copy read for images mounted with map_data.
+ *
+ * Instead of copying, returns a pointer into the mapping for the next bytes
+ * of the file: at most @p n, and never more than one contiguous run of
+ * blocks. The file offset advances as with k_read().
  *
- * Scans FAT_TABLE from entry 1 (block 0 is reserved) for an entry with
- * value 0x0000, indicating a free block.
+ * @pre FS_IMAGE_MAP != NULL and @p fd is a PennFAT file (not 0-2).
+ * @param data Output: where the bytes are.
+ * @return Number of bytes available at @p data, 0 at end of file, or -1 on
+ *         error (P_ERRNO set).
+ */
+static ssize_t k_read_mapped(int fd, size_t n, const char** data);
+
+/**
+ * @brief k_read() on an open PennFAT file (not a pipe or stdin).
+ *
+ * @pre @p n > 0 and @p file_data is open for reading.
+ */
+static ssize_t k_read_file(open_file_t* file_data, int n, char* buf);
+
+/**
+ * @brief Sequential-access detection and read-ahead for k_read().
+ *
+ * A read that starts where the previous one on @p of ended doubles its
+ * read-ahead window, up to FS_READAHEAD_BLOCKS; any other read resets it.
+ * Once a sequential read gets within half a window of the blocks read ahead
+ * so far, the blocks up to a window past it are handed to
+ * k_bcache_prefetch(), one run of adjacent blocks at a time.
  *
- * @return Index of the first free block, or 0 if no free block is available.
+ * @param blk   Block holding the first byte of the read.
+ * @param index Index of @p blk within the file.
+ * @param n     Length of the read, already clipped to the file size.
  */
-static int k_find_free_block(void);
+static void k_readahead(open_file_t* of, uint16_t blk, size_t index, size_t n);
+
+/** @brief Scratch state shared by k_defrag() and k_defrag_swap() */
+typedef struct defrag_state {
+  uint16_t* prev;   // predecessor of each block in its chain (0: head/free)
+  int32_t* owner;   // for chain heads: index of the owning file, else -1
+  uint16_t* heads;  // first block of each file, indexed by file
+  char* buf_a;      // block-sized I/O buffers
+  char* buf_b;
+} defrag_state_t;
+
+/**
+ * @brief Exchange the contents and chain positions of blocks @p a and @p b.
+ *
+ * @p a must be in use; @p b may be free. Afterwards every chain that went
+ * through @p a goes through @p b instead, and vice versa.
+ *
+ * @return FS_SUCCESS, or -1 (P_ERRNO = FS_IO_ERROR) if the copy failed.
+ */
+static int k_defrag_swap(defrag_state_t* st, uint16_t a, uint16_t b);
 
 /**
- * @brief Append a new data block to the root directory.
+ * @brief Append a new data block to a directory.
  *
  * This function updates the FAT and zeros the contents of the newly allocated
  * block in the data region.
  *
  * @return On success, the byte offset within the filesystem image of the
- *         start of the newly allocated root-directory block.
+ *         start of the newly allocated directory block.
  *         On failure (no free blocks available), returns -1.
  */
-static off_t k_extend_root(void);
+static off_t k_extend_dir(dir_index_t* dir);
 
 /**
  * @brief this function frees up a given block chain on the FAT.
@@ -99,10 +554,10 @@ static void k_free_fat_chain(uint16_t first_block);
 /**
  * @brief Checks if a file is already open in an exclusive (F_WRITE or F_APPEND)
  * mode.
- * * @param fname The name of the file to check.
+ * * @param dirent_offset the offset used to identify the dirent
  * @return whether an write instance is opened
  */
-static bool k_have_write_opened(const char* fname);
+static bool k_have_write_opened(off_t dirent_offset);
 
 /**
  * @brief caller uses this function to check whether a dirent is still
@@ -116,14 +571,31 @@ static bool k_have_write_opened(const char* fname);
  */
 static bool k_is_file_still_open(off_t dirent_offset);
 
+/**
+ * @brief Note that an open file's size or first block changed.
+ *
+ * Only the inode is updated. The dirent is written back later, once, by
+ * k_update_dirent(): on k_close(), k_fsync(), k_sync() (which the scheduler
+ * calls periodically) and before a directory listing.
+ */
+static void k_inode_dirty(open_inode_t* inode);
+
 /**
  * @brief Updates the directory entry on disk with the current metadata from the
- * open_file_t structure (firstBlock, size, mtime).
+ * file's shared inode (firstBlock, size, mtime), if it has changed since it
+ * was last written.
  *
- * @param file_data The open_file_t structure containing the new metadata.
+ * @param inode The shared state of an open file.
  * @return FS_SUCCESS (0) on success, negative value on error.
  */
-static int k_update_dirent(open_file_t* file_data);
+static int k_update_dirent(open_inode_t* inode);
+
+/**
+ * @brief k_update_dirent() for every open file.
+ *
+ * @return FS_SUCCESS, or -1 if a dirent could not be written.
+ */
+static int k_sync_dirents(void);
 
 /**
  * @brief Print a directory entry in a human-readable format.
@@ -143,9 +615,8 @@ static void k_print_dirent(const dir_entry_t* entry);
  * The directory entry is read from disk at @p offset to populate metadata.
  *
  * On success, @p *new_of_out will point to a newly allocated open_file_t,
- * with its name, size, permissions, first block, and dirent offset copied
- * from @p entry. The reference count is initialized to 1 and the flag is
- * set to F_READ.
+ * with its name and permissions copied from @p entry and pointing to the
+ * file's shared inode (see k_inode_get()). The flag is set to F_READ.
  *
  * @param fname      Name of the file being opened (null-terminated string).
  * @param offset     Byte offset of the corresponding dir_entry_t on disk.
@@ -250,8 +721,8 @@ static int k_pennfat_read_to_host_write(int pennfat_fd, const char* host_path);
 static int k_host_read_to_pennfat_write(const char* host_path, int pennfat_fd);
 
 /**
- * @brief Reads content from input_fd and writes it to output_fd using
- * k_read/k_write. This function performs the core stream copying logic for the
+ * @brief Reads content from input_fd and writes it to output_fd with
+ * k_transfer(). This function performs the core stream copying logic for the
  * 'cat' and 'cp' commands.
  *
  * @param input_fd  The PennFAT file descriptor (0=STDIN, or opened file).
@@ -260,11 +731,91 @@ static int k_host_read_to_pennfat_write(const char* host_path, int pennfat_fd);
  */
 static int copy_stream_content(int input_fd, int output_fd);
 
+/**
+ * @brief Copy up to @p count bytes from @p in_fd to @p out_fd inside the
+ * kernel, SENDFILE_CHUNK bytes per k_read/k_write (or straight out of the
+ * mapping when the image is mapped).
+ *
+ * @param out_fd   Destination: a kernel fd, or a host fd if @p out_host.
+ * @param out_host Whether @p out_fd is a host fd.
+ * @param in_fd    Source: a kernel fd, or a host fd if @p in_host.
+ * @param in_host  Whether @p in_fd is a host fd.
+ * @param count    Most bytes to copy (SIZE_MAX: up to end of input).
+ * @return Bytes copied (less than @p count only at end of input), or -1 on
+ * error with P_ERRNO set. Bytes copied before an error stay copied.
+ */
+static ssize_t k_transfer(int out_fd,
+                          bool out_host,
+                          int in_fd,
+                          bool in_host,
+                          size_t count);
+
+/**
+ * @brief Write all @p len bytes to a kernel fd (or a host fd if @p host).
+ *
+ * @return 0 on success, -1 with P_ERRNO set (FS_DISK_FULL, FS_IO_ERROR, ...).
+ */
+static int k_write_all(int fd, bool host, const char* data, size_t len);
+
+/**
+ * @brief Whether @p kfd names an open GDT entry.
+ */
+static bool k_gdt_valid(int kfd);
+
+// The bodies of the public operations below. The public functions run them
+// with interrupts disabled (spthread_disable_interrupts_nested()), so that a
+// commit, which the scheduler also runs from k_sync(), only ever sees whole
+// operations, and commit where that is due.
+
+/** @brief k_open() */
+static int k_open_locked(const char* fname, int mode);
+
+/** @brief k_write() to a PennFAT file */
+static ssize_t k_write_locked(open_file_t* file_data, const char* str, int n);
+
+/** @brief k_close() of a PennFAT file */
+static int k_close_locked(int kfd);
+
+/** @brief k_unlink() */
+static int k_unlink_locked(const char* fname);
+
+/**
+ * @brief Remove the file whose directory entry is at @p dirent_off, or mark
+ * it deleted-but-open if some descriptor still uses it.
+ */
+static int k_unlink_dirent(off_t dirent_off);
+
+/** @brief k_chmod_update() */
+static int k_chmod_locked(const char* fname, uint8_t new_perm);
+
+/** @brief k_mv() */
+static int k_mv_locked(const char* source, const char* dest);
+
+/**
+ * @brief Whether moving the directory starting at @p first_block into
+ * @p dest would put it inside itself.
+ *
+ * @return 1 if it would, 0 if not, -1 on error (P_ERRNO set).
+ */
+static int k_mv_is_ancestor(uint16_t first_block, dir_index_t* dest);
+
+/** @brief k_mkdir() */
+static int k_mkdir_locked(const char* path);
+
+/** @brief k_rmdir() */
+static int k_rmdir_locked(const char* path);
+
+/** @brief k_defrag(), between the commits */
+static int k_defrag_locked(size_t* moved);
+
 //////////////////////////////////////////////////////////////////////////////
 // =================== Public API Implementation =================== ////////
 ////////////////////////////////////////////////////////////////////////////
 
-int mkfs(const char* fs_name, int blocks_in_fat, int block_size_config) {
+int mkfs(const char* fs_name,
+         int blocks_in_fat,
+         int block_size_config,
+         bool preallocate) {
   if (IS_FS_MOUNTED) {
     k_write(2, "unexpected command.\n", strlen("unexpected command.\n"));
     return -1;
@@ -286,7 +837,9 @@ int mkfs(const char* fs_name, int blocks_in_fat, int block_size_config) {
   size_t data_region_size = block_size * (num_fat_entries - 1);
   size_t total_fs_size = fat_size + data_region_size;
 
-  int fd = open(fs_name, O_CREAT | O_RDWR, 0666);
+  // O_TRUNC drops whatever an old image left behind, so that the resize
+  // below yields a file made of holes, which read back as zeros.
+  int fd = open(fs_name, O_CREAT | O_RDWR | O_TRUNC, 0666);
   if (fd == -1) {
     perror("Error creating file system file");
     return -1;
@@ -297,6 +850,15 @@ int mkfs(const char* fs_name, int blocks_in_fat, int block_size_config) {
     close(fd);
     return -1;
   }
+  if (preallocate) {
+    int err = posix_fallocate(fd, 0, total_fs_size);
+    if (err != 0) {
+      errno = err;
+      perror("Error preallocating file system file");
+      close(fd);
+      return -1;
+    }
+  }
 
   uint16_t* temp_fat =
       mmap(NULL, fat_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
@@ -308,21 +870,20 @@ int mkfs(const char* fs_name, int blocks_in_fat, int block_size_config) {
 
   // FAT[0]: MSB=blocks_in_fat, LSB=block_size_config
   temp_fat[0] = (uint16_t)((blocks_in_fat << 8) | block_size_config);
+  // Block 1 is the Root Directory, marked as last block. Every other entry
+  // is already 0x0000 (free).
+  temp_fat[1] = 0xFFFF;
 
-  // Initialize FAT[1:] and data region
+  // Only the root directory has to be zeroed explicitly: the rest of the
+  // data region is never read before it is written (k_extend_dir() clears
+  // the directory blocks it adds, and file reads stop at the file size).
   char zero_buf[block_size];
-  memset(zero_buf, 0, block_size);  // zero buffer to later cleanse data blocks.
-  for (size_t i = 1; i < num_fat_entries; i++) {
-    if (i == 1) {  // Block 1 is the Root Directory, marked as last block
-      temp_fat[i] = 0xFFFF;
-    } else {  // Mark all other blocks as free (0x0000)
-      temp_fat[i] = 0x0000;
-    }
-    // initialize entire data region to be all zeros.
-    if (pwrite(fd, zero_buf, block_size, fat_size + (i - 1) * block_size) !=
-        block_size) {
-      perror("Error cleansing initial fs");  // don't necessarily need to exit
-    }
+  memset(zero_buf, 0, block_size);
+  if (pwrite(fd, zero_buf, block_size, fat_size) != (ssize_t)block_size) {
+    perror("Error cleansing initial fs");
+    munmap(temp_fat, fat_size);
+    close(fd);
+    return -1;
   }
 
   munmap(temp_fat, fat_size);
@@ -337,7 +898,13 @@ int mkfs(const char* fs_name, int blocks_in_fat, int block_size_config) {
   return FS_SUCCESS;
 }
 
-int mount(const char* fs_name) {
+void k_fs_config_default(fs_config_t* config) {
+  config->cache_blocks = FS_DEFAULT_CACHE_BLOCKS;
+  config->map_data = false;
+  config->readahead = FS_DEFAULT_READAHEAD;
+}
+
+int mount(const char* fs_name, const fs_config_t* config) {
   if (IS_FS_MOUNTED) {
     k_write(2, "unexpected command.\n", strlen("unexpected command.\n"));
     return -1;
@@ -374,24 +941,106 @@ int mount(const char* fs_name) {
   FS_FAT_SIZE = FS_BLOCK_SIZE * FS_FAT_BLOCKS;
   FS_NUM_ENTRIES = FS_FAT_SIZE / sizeof(uint16_t);
   FS_ENTRY_PER_BLK = FS_BLOCK_SIZE / sizeof(dir_entry_t);
+  // the last data block, as mkfs() sized it (see k_free_index_build())
+  size_t last_blk = FS_NUM_ENTRIES < 0xFFFF ? FS_NUM_ENTRIES - 1 : 0xFFFE;
+  FS_JOURNAL_OFF = (off_t)(FS_FAT_SIZE + last_blk * FS_BLOCK_SIZE);
+
+  fs_config_t defaults;
+  if (config == NULL) {
+    k_fs_config_default(&defaults);
+    config = &defaults;
+  }
+
+  // Finish the last commit before anything reads the metadata.
+  size_t replayed = 0;
+  if (k_journal_init(FS_HOST_FD, FS_JOURNAL_OFF, FS_BLOCK_SIZE, &replayed) !=
+      0) {
+    k_write(2, "Error replaying the journal.\n",
+            strlen("Error replaying the journal.\n"));
+    close(FS_HOST_FD);
+    FS_HOST_FD = -1;
+    return -1;
+  }
 
-  FAT_TABLE = mmap(NULL, FS_FAT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
-                   FS_HOST_FD, 0);
-  if (FAT_TABLE == MAP_FAILED) {
-    perror("Error mmaping FAT region");
+  FAT_TABLE = malloc(FS_FAT_SIZE);
+  if (FAT_TABLE == NULL ||
+      pread(FS_HOST_FD, FAT_TABLE, FS_FAT_SIZE, 0) != (ssize_t)FS_FAT_SIZE) {
+    k_write(2, "Error reading FAT region.\n",
+            strlen("Error reading FAT region.\n"));
+    free(FAT_TABLE);
+    FAT_TABLE = NULL;
+    k_journal_destroy();
     close(FS_HOST_FD);
     FS_HOST_FD = -1;
+    return -1;
+  }
+  FAT_DIRTY = 0;
+
+  // map_data: the image up to the journal, so that block offsets can be
+  // used on the mapping as they are
+  struct stat st;
+  FS_IMAGE_MAP = NULL;
+  FS_MAP_SIZE = 0;
+  if (config->map_data && fstat(FS_HOST_FD, &st) == 0 &&
+      (size_t)st.st_size > FS_FAT_SIZE) {
+    FS_MAP_SIZE = (size_t)st.st_size < (size_t)FS_JOURNAL_OFF
+                      ? (size_t)st.st_size
+                      : (size_t)FS_JOURNAL_OFF;
+    FS_IMAGE_MAP = mmap(NULL, FS_MAP_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, FS_HOST_FD, 0);
+    if (FS_IMAGE_MAP == MAP_FAILED) {
+      perror("Error mmaping the image");
+      FS_IMAGE_MAP = NULL;
+      FS_MAP_SIZE = 0;
+    } else {
+      // file data is mostly streamed
+      madvise(FS_IMAGE_MAP + FS_FAT_SIZE, FS_MAP_SIZE - FS_FAT_SIZE,
+              MADV_SEQUENTIAL);
+    }
+  }
+
+  // a window must fit in the cache a few times over, or the blocks read
+  // ahead evict each other before they are used
+  FS_READAHEAD_BLOCKS = config->readahead / FS_BLOCK_SIZE;
+  if (!config->map_data && config->cache_blocks > 0 &&
+      FS_READAHEAD_BLOCKS > config->cache_blocks / 4) {
+    FS_READAHEAD_BLOCKS = config->cache_blocks / 4;
+  }
+
+  if (k_free_index_build() != FS_SUCCESS ||
+      k_bcache_init(FS_HOST_FD, FS_FAT_SIZE, FS_BLOCK_SIZE, FS_NUM_ENTRIES,
+                    config->cache_blocks, FS_IMAGE_MAP, FS_MAP_SIZE) != 0 ||
+      k_dir_index_build() != FS_SUCCESS) {
+    k_dir_index_destroy();
+    k_bcache_destroy();
+    k_free_index_destroy();
+    k_journal_destroy();
+    if (FS_IMAGE_MAP != NULL) {
+      munmap(FS_IMAGE_MAP, FS_MAP_SIZE);
+      FS_IMAGE_MAP = NULL;
+    }
+    free(FAT_TABLE);
     FAT_TABLE = NULL;
+    close(FS_HOST_FD);
+    FS_HOST_FD = -1;
     return -1;
   }
 
+  FS_CWD = 1;
   IS_FS_MOUNTED = true;
   k_gdt_init();
 
   char buf[256];
-  int len =
-      snprintf(buf, sizeof(buf),
-               "PennFAT filesystem '%s' mounted successfully.\n", fs_name);
+  int len;
+  if (replayed > 0) {
+    len = snprintf(buf, sizeof(buf),
+                   "PennFAT: recovered the last commit from the journal "
+                   "(%zu blocks).\n",
+                   replayed);
+    k_write(1, buf, len);
+  }
+  len = snprintf(buf, sizeof(buf),
+                 "PennFAT filesystem '%s' mounted successfully.\n", fs_name);
   k_write(1, buf, len);
   return FS_SUCCESS;
 }
@@ -405,14 +1054,26 @@ int unmount(void) {
 
   int result = FS_SUCCESS;
 
+  if (k_commit() != FS_SUCCESS) {  // includes the files left open
+    k_write(2, "Error committing the journal.\n",
+            strlen("Error committing the journal.\n"));
+    result = -1;
+  }
   k_gdt_cleanup();
-
-  if (FAT_TABLE != NULL) {
-    if (munmap(FAT_TABLE, FS_FAT_SIZE) == -1) {
-      perror("Error unmapping FAT region");
+  k_free_index_destroy();
+  k_dir_index_destroy();
+  k_bcache_destroy();  // writes back every dirty block
+  k_journal_destroy();
+
+  if (FS_IMAGE_MAP != NULL) {
+    if (munmap(FS_IMAGE_MAP, FS_MAP_SIZE) == -1) {
+      perror("Error unmapping the image");
       result = -1;
     }
+    FS_IMAGE_MAP = NULL;
   }
+  free(FAT_TABLE);
+  FAT_TABLE = NULL;
 
   if (FS_HOST_FD != -1) {
     if (close(FS_HOST_FD) == -1) {
@@ -433,110 +1094,47 @@ int unmount(void) {
   return result;
 }
 
-bool k_find_file(const char* fname, off_t* offset) {
-  dir_entry_t entry;
-  off_t first_free = -1;  // This is to mark the first seen free entry space.
-
-  uint16_t blknum = 1;
-  while (blknum != 0xFFFF) {  // traverse through root directory
-    for (int i = 0; i < FS_ENTRY_PER_BLK; i++) {
-      // calculate the offset of the current dirent and load the dirent
-      off_t off =
-          FS_FAT_SIZE + (blknum - 1) * FS_BLOCK_SIZE + i * sizeof(dir_entry_t);
-      pread(FS_HOST_FD, &entry, sizeof(dir_entry_t), off);
-
-      if (entry.name[0] == 0) {
-        // If we reached the end of directory:
-        //   - this means we didn't find the file.
-        //   - if no previous free dirent found, set it to current offset and
-        //   return false.
-
-        // TODO not sure if initalized in mkfs
-        if (first_free == -1)
-          first_free = off;
-        *offset = first_free;
-        return false;
-      }
-      if (entry.name[0] == 1) {
-        // If we found a deleated dirent:
-        //   - if this is the first time, mark its location (might need later).
-        if (first_free == -1)
-          first_free = off;
-        continue;
-      }
-      if (entry.name[0] == 2) {
-        continue;  // File is technically "deleted" but actually still in use.
-      }
-      // If found: great
-      if (strcmp(entry.name, fname) == 0) {
-        *offset = off;
-        return true;
-      }
-    }
-    blknum = FAT_TABLE[blknum];
-  }
-
-  // getting here means we traversed the whole root directory yet didn't reach
-  // the "end of directory". First free might be -1 or not. Return false.
-  *offset = first_free;
-  return false;
-}
-
-int k_open(const char* fname, int mode) {
+int k_block_usage(size_t* free_blocks, size_t* total_blocks) {
   if (!IS_FS_MOUNTED) {
     P_ERRNO = FS_NOT_MOUNTED;
     return -1;
   }
-  if (mode != F_WRITE && mode != F_READ && mode != F_APPEND) {
-    P_ERRNO = FS_INVALID_MODE;
-    return -1;
-  }
+  *free_blocks = FREE_COUNT + FREE_RESERVED;
+  *total_blocks = FREE_LIMIT - 1;  // block 0 is not a data block
+  return FS_SUCCESS;
+}
 
-  int fd = k_find_gdt_spot();
-  if (fd == -1) {
-    P_ERRNO = FS_GDT_FULL;
-    return -1;
+int k_defrag(size_t* moved) {
+  // Blocks are swapped in place, which the journal cannot cover; only the
+  // metadata before and after is committed as a whole.
+  bool locked = spthread_disable_interrupts_nested();
+  int result = IS_FS_MOUNTED ? k_commit() : FS_SUCCESS;
+  if (result == FS_SUCCESS) {
+    result = k_defrag_locked(moved);
   }
-
-  off_t offset = 0;
-  bool found = k_find_file(fname, &offset);
-
-  // If file not found and directory is full, try to extend root.
-  if (!found && offset == -1) {
-    offset = k_extend_root();
-    if (offset == -1) {
-      P_ERRNO = FS_DISK_FULL;
-      return -1;
-    }
+  if (result == FS_SUCCESS) {
+    result = k_commit();
   }
+  spthread_restore_interrupts(locked);
+  return result;
+}
 
-  open_file_t* new_of = NULL;
-  dir_entry_t entry;
-  int result = FS_SUCCESS;
-
-  // check for multiple write
-  if (found && (mode == F_WRITE || mode == F_APPEND)) {
-    if (k_have_write_opened(fname)) {
-      P_ERRNO = FS_FILE_IN_USE;
-      return -1;
-    }
+bool k_find_file(const char* fname, off_t* offset) {
+  path_ref_t ref;
+  if (k_path_parent(fname, &ref) != FS_SUCCESS) {
+    *offset = -1;
+    return false;
   }
+  return k_dir_find(ref.dir, ref.name, offset);
+}
 
-  if (mode == F_READ) {
-    result = k_open_mode_read(fname, offset, &new_of, found, &entry);
-  } else if (mode == F_WRITE) {
-    result = k_open_mode_write(fname, offset, &new_of, found, &entry);
-  } else if (mode == F_APPEND) {
-    result = k_open_mode_append(fname, offset, &new_of, found, &entry);
-  } else {
-    P_ERRNO = FS_INVALID_MODE;
-    return -1;
-  }
-  if (result != FS_SUCCESS) {
-    // allocation failed inside the mode function
-    return -1;
+int k_open(const char* fname, int mode) {
+  bool locked = spthread_disable_interrupts_nested();
+  int fd = k_open_locked(fname, mode);
+  if (fd >= 0 && FAT_FREED) {
+    k_commit();  // truncated: the freed blocks may only be reused after it
   }
-  GLOBAL_FD_TABLE[fd] = new_of;
+  spthread_restore_interrupts(locked);
   return fd;
 }
 
@@ -553,10 +1151,24 @@ ssize_t k_read(int fd, int n, char* buf) {
   }
   if (n <= 0)
     return 0;
+  if (file_data->pipe) {
+    return k_pipe_read(file_data, (size_t)n, buf);
+  }
+
+  KSTAT_TIMER_START(start);
+  ssize_t result = k_read_file(file_data, n, buf);
+  KSTAT_TIMER_STOP(KSTAT_T_READ, start);
+  KSTAT_INC(KSTAT_READ_CALLS);
+  if (result > 0) {
+    KSTAT_ADD(KSTAT_READ_BYTES, result);
+  }
+  return result;
+}
 
+static ssize_t k_read_file(open_file_t* file_data, int n, char* buf) {
   uint64_t current_offset = file_data->offset;
-  uint16_t current_block_num = file_data->first_block;
-  uint32_t file_size = file_data->size;
+  uint16_t current_block_num = file_data->inode->first_block;
+  uint32_t file_size = file_data->inode->size;
 
   if (current_offset >= file_size)
     return 0;
@@ -569,14 +1181,13 @@ ssize_t k_read(int fd, int n, char* buf) {
   size_t bytes_in_block = current_offset % FS_BLOCK_SIZE;
 
   // Find the actual starting block number for the current offset
-  for (size_t i = 0; i < block_index; i++) {
-    current_block_num = FAT_TABLE[current_block_num];
+  current_block_num = k_seek_block(file_data, block_index);
+  if (current_block_num == 0) {
     // If hit EOF while skipping, the offset is invalid
-    if (current_block_num == 0xFFFF || current_block_num == 0) {
-      P_ERRNO = FS_INVALID_OFFSET;
-      return -1;
-    }
+    P_ERRNO = FS_INVALID_OFFSET;
+    return -1;
   }
+  k_readahead(file_data, current_block_num, block_index, (size_t)n);
 
   while (total_bytes_read < n) {
     if (current_block_num == 0xFFFF)
@@ -590,8 +1201,20 @@ ssize_t k_read(int fd, int n, char* buf) {
                                ? block_remaining
                                : requested_remaining;
 
+    // Grow the transfer over every following block that is physically
+    // adjacent, so a contiguous chain is read with a single cache request
+    // (and its misses with a single preadv).
+    while (bytes_to_read < requested_remaining &&
+           FAT_TABLE[current_block_num] == current_block_num + 1) {
+      KSTAT_INC(KSTAT_FAT_STEPS);
+      current_block_num++;
+      block_index++;
+      size_t more = requested_remaining - bytes_to_read;
+      bytes_to_read += (more < FS_BLOCK_SIZE) ? more : FS_BLOCK_SIZE;
+    }
+
     ssize_t bytes_read_this_step =
-        pread(FS_HOST_FD, buf + total_bytes_read, bytes_to_read,
+        k_bcache_read(buf + total_bytes_read, bytes_to_read,
               block_disk_offset + bytes_in_block);
 
     if (bytes_read_this_step <= 0) {
@@ -599,12 +1222,24 @@ ssize_t k_read(int fd, int n, char* buf) {
     }
 
     total_bytes_read += bytes_read_this_step;
+    if ((size_t)bytes_read_this_step < bytes_to_read) {
+      // short read of the image: report what we have, cursor untouched
+      file_data->offset += total_bytes_read;
+      return total_bytes_read;
+    }
 
     if (total_bytes_read < n) {
+      KSTAT_INC(KSTAT_FAT_STEPS);
       current_block_num = FAT_TABLE[current_block_num];
       bytes_in_block = 0;
+      block_index++;
     }
   }
+  if (current_block_num != 0xFFFF) {
+    file_data->cur_block = current_block_num;
+    file_data->cur_index = block_index;
+    file_data->cur_gen = file_data->inode->generation;
+  }
   file_data->offset += total_bytes_read;
 
   return total_bytes_read;
@@ -623,109 +1258,20 @@ ssize_t k_write(int fd, const char* str, int n) {
   if (n <= 0) {
     return 0;
   }
-
-  uint64_t current_offset = file_data->offset;
-  uint16_t current_block_num = file_data->first_block;
-  uint32_t old_file_size = file_data->size;
-
-  ssize_t total_bytes_written = 0;
-
-  size_t block_index = current_offset / FS_BLOCK_SIZE;
-  size_t byte_in_block = current_offset % FS_BLOCK_SIZE;
-
-  bool check_has_block = false;
-  if (byte_in_block == 0 && current_offset > 0) {
-    check_has_block = true;
-  }
-  // Traverse to the starting block
-  if (current_block_num != 0) {  // Only traverse if the file has blocks
-    for (size_t i = 0; i < block_index; i++) {
-      if (check_has_block && i == block_index - 1 &&
-          FAT_TABLE[current_block_num] == 0xFFFF) {
-        block_index -= 1;
-        byte_in_block = FS_BLOCK_SIZE;
-        break;
-      }
-
-      current_block_num = FAT_TABLE[current_block_num];
-      // If hit EOF while skipping, the offset is invalid
-      if (current_block_num == 0xFFFF || current_block_num == 0) {
-        P_ERRNO = FS_INVALID_OFFSET;
-        return -1;
-      }
-    }
-  }
-
-  while (total_bytes_written < n) {
-    uint16_t next_block_num;
-    //  Check if current block needs allocation/extension
-    if (current_block_num == 0 || byte_in_block == FS_BLOCK_SIZE) {
-      // Find a free block
-      next_block_num = k_find_free_block();
-      if (next_block_num == 0) {
-        // Disk full, stop writing
-        k_write(1, "Disk is full\n", strlen("Disk is full\n"));
-        break;
-      }
-
-      if (current_block_num == 0) {
-        // This is the first block being written
-        file_data->first_block = next_block_num;
-        k_update_dirent(file_data);
-      } else {
-        FAT_TABLE[current_block_num] = next_block_num;
-      }
-
-      // Set up the new block's metadata
-      current_block_num = next_block_num;
-      FAT_TABLE[current_block_num] = 0xFFFF;
-      byte_in_block = 0;
-    }
-
-    // Calculate Write Size
-    size_t block_remaining = FS_BLOCK_SIZE - byte_in_block;
-    size_t requested_remaining = n - total_bytes_written;
-    size_t bytes_to_write = (block_remaining < requested_remaining)
-                                ? block_remaining
-                                : requested_remaining;
-
-    // Write
-    off_t block_disk_offset =
-        FS_FAT_SIZE + (current_block_num - 1) * FS_BLOCK_SIZE;
-
-    ssize_t bytes_written_this_step = pwrite(
-        FS_HOST_FD,
-        str + total_bytes_written,  // Buffer offset
-        bytes_to_write,
-        block_disk_offset + byte_in_block  // Disk offset + byte within block
-    );
-
-    if (bytes_written_this_step <= 0) {
-      // Error, return bytes written so far (or error code if nothing written)
-      return (total_bytes_written > 0) ? total_bytes_written
-                                       : bytes_written_this_step;
-    }
-
-    // D. Update Counters
-    total_bytes_written += bytes_written_this_step;
-    byte_in_block += bytes_written_this_step;
-
-    // Move to the next block in the FAT chain if necessary
-
-    // if (byte_in_block == FS_BLOCK_SIZE) {
-    //   current_block_num = FAT_TABLE[current_block_num];
-    // }
+  if (file_data->pipe) {
+    return k_pipe_write(file_data, str, (size_t)n);
   }
 
-  file_data->offset += total_bytes_written;
-
-  // Update size if the offset grew beyond the old file size
-  if (file_data->offset > old_file_size) {
-    file_data->size = file_data->offset;
-    k_update_dirent(file_data);
+  KSTAT_TIMER_START(start);
+  bool locked = spthread_disable_interrupts_nested();
+  ssize_t written = k_write_locked(file_data, str, n);
+  spthread_restore_interrupts(locked);
+  KSTAT_TIMER_STOP(KSTAT_T_WRITE, start);
+  KSTAT_INC(KSTAT_WRITE_CALLS);
+  if (written > 0) {
+    KSTAT_ADD(KSTAT_WRITE_BYTES, written);
   }
-
-  return total_bytes_written;
+  return written;
 }
 
 int k_close(int kfd) {
@@ -733,7 +1279,7 @@ int k_close(int kfd) {
     P_ERRNO = FS_NOT_MOUNTED;
     return -1;
   }
-  if (kfd < 0 || kfd >= MAX_FD || GLOBAL_FD_TABLE[kfd] == NULL) {
+  if (kfd < 0 || kfd >= MAX_GDT_ENTRY || GLOBAL_FD_TABLE[kfd] == NULL) {
     P_ERRNO = FS_BAD_FD;
     return -1;
   }
@@ -747,110 +1293,193 @@ int k_close(int kfd) {
     return FS_SUCCESS;
   }
 
-  // remove of entry from gdt so that later we can safely traverse through gdt
-  // to search for entries of same file.
-  GLOBAL_FD_TABLE[kfd] = NULL;
-
-  off_t dirent_off = of->dirent_offset;
-  dir_entry_t entry;
-  ssize_t n = pread(FS_HOST_FD, &entry, sizeof(entry), dirent_off);
-  if (n != (ssize_t)sizeof(entry)) {  // really should not happen
+  // a pipe end has no dirent: detaching it is all there is to do
+  if (of->pipe) {
+    GLOBAL_FD_TABLE[kfd] = NULL;
+    GDT_FREE[GDT_FREE_LEN++] = kfd;
+    k_pipe_detach(of);
     free(of);
-    P_ERRNO = FS_IO_ERROR;
-    return -1;
+    return FS_SUCCESS;
   }
 
-  if (of->flag & (F_WRITE | F_APPEND)) {
-    entry.size = of->size;
-    entry.mtime = time(NULL);
-    // note: k_write() should keep these information updated.
+  bool locked = spthread_disable_interrupts_nested();
+  int result = k_close_locked(kfd);
+  if (result == FS_SUCCESS) {
+    result = k_commit();
   }
+  spthread_restore_interrupts(locked);
+  return result;
+}
 
-  // entry.name[0] == 2 means this file has been unlinked but there still are
-  // some fds referencing it (deleted but still in use). Therefore we need to
-  // check if the current fd we're closing is the last one referencing it. If
-  // so, we can truly mark this file as deleted (name[0] == 1).
-  if (entry.name[0] == 2) {
-    if (!k_is_file_still_open(dirent_off)) {
-      k_free_fat_chain(entry.firstBlock);
-      entry.name[0] = 1;
-    }
-    // If this is not the last fd referencing the file, do nothing
+int k_pipe(int kfds[2]) {
+  if (!IS_FS_MOUNTED) {
+    P_ERRNO = FS_NOT_MOUNTED;
+    return -1;
   }
-
-  // write the entry back to disk
-  n = pwrite(FS_HOST_FD, &entry, sizeof(entry), dirent_off);
-  if (n != (ssize_t)sizeof(entry)) {  // again, this shouldn't happen
-    free(of);
-    P_ERRNO = FS_IO_ERROR;
+  if (GDT_FREE_LEN < 2) {
+    P_ERRNO = FS_GDT_FULL;
     return -1;
   }
 
-  free(of);
+  pipe_t* p = k_pipe_create();
+  if (p == NULL) {
+    P_ERRNO = FS_MALLOC_FAIL;
+    return -1;
+  }
+  kfds[0] = k_pipe_install(p, F_READ);
+  if (kfds[0] < 0) {
+    free(p);
+    return -1;
+  }
+  kfds[1] = k_pipe_install(p, F_WRITE);
+  if (kfds[1] < 0) {
+    k_close(kfds[0]);  // frees the pipe with its only end
+    return -1;
+  }
   return FS_SUCCESS;
 }
 
-int k_unlink(const char* fname) {
+int k_pipe_dup(int kfd) {
+  if (!k_is_pipe(kfd)) {
+    P_ERRNO = FS_BAD_FD;
+    return -1;
+  }
+  open_file_t* of = GLOBAL_FD_TABLE[kfd];
+  return k_pipe_install(of->pipe, of->flag);
+}
+
+bool k_is_pipe(int kfd) {
+  return k_gdt_valid(kfd) && GLOBAL_FD_TABLE[kfd]->pipe != NULL;
+}
+
+bool k_is_tty(int kfd) {
+  return kfd <= 2 && k_gdt_valid(kfd) &&
+         GLOBAL_FD_TABLE[kfd]->inode == NULL &&
+         GLOBAL_FD_TABLE[kfd]->pipe == NULL;
+}
+
+ssize_t k_readv(int kfd, const struct iovec* iov, int iovcnt) {
   if (!IS_FS_MOUNTED) {
     P_ERRNO = FS_NOT_MOUNTED;
     return -1;
   }
-
-  off_t dirent_off;
-  bool found = k_find_file(fname, &dirent_off);
-  if (!found) {
-    P_ERRNO = FS_FILE_NOT_FOUND;
+  if (!k_gdt_valid(kfd)) {
+    P_ERRNO = FS_BAD_FD;
+    return -1;
+  }
+  if (iovcnt < 0 || (iovcnt > 0 && iov == NULL)) {
+    P_ERRNO = FS_INVALID_ARG;
     return -1;
   }
+  if (kfd == 0) {
+    return readv(0, iov, iovcnt);
+  }
 
-  dir_entry_t entry;
-  ssize_t n = pread(FS_HOST_FD, &entry, sizeof(entry), dirent_off);
-  if (n != (ssize_t)sizeof(entry)) {
-    P_ERRNO = FS_IO_ERROR;
+  ssize_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    size_t len = iov[i].iov_len < INT_MAX ? iov[i].iov_len : INT_MAX;
+    if (len == 0) {
+      continue;
+    }
+    ssize_t n = k_read(kfd, (int)len, iov[i].iov_base);
+    if (n < 0) {
+      return total > 0 ? total : -1;
+    }
+    total += n;
+    // a pipe blocks when it runs dry, so take what it had and stop there
+    if ((size_t)n < len || GLOBAL_FD_TABLE[kfd]->pipe != NULL) {
+      break;
+    }
+  }
+  return total;
+}
+
+ssize_t k_writev(int kfd, const struct iovec* iov, int iovcnt) {
+  if (!IS_FS_MOUNTED) {
+    P_ERRNO = FS_NOT_MOUNTED;
     return -1;
   }
-  if (entry.type == 2) {  // directory
-    P_ERRNO = FS_NOT_A_FILE;
+  if (!k_gdt_valid(kfd)) {
+    P_ERRNO = FS_BAD_FD;
+    return -1;
+  }
+  if (iovcnt < 0 || (iovcnt > 0 && iov == NULL)) {
+    P_ERRNO = FS_INVALID_ARG;
     return -1;
   }
+  ssize_t total = 0;
+  if (kfd == 1 || kfd == 2) {
+    // one host syscall per IOV_MAX buffers
+    for (int i = 0; i < iovcnt; i += IOV_MAX) {
+      int cnt = iovcnt - i < IOV_MAX ? iovcnt - i : IOV_MAX;
+      ssize_t n = writev(kfd, iov + i, cnt);
+      if (n < 0) {
+        return total > 0 ? total : -1;
+      }
+      total += n;
+    }
+    return total;
+  }
 
-  // See if this file is still referenced by some other fds.
-  if (k_is_file_still_open(dirent_off)) {
-    // deleted-but-still-in-use. Mark as 2.
-    entry.name[0] = 2;
-    n = pwrite(FS_HOST_FD, &entry, sizeof(entry), dirent_off);
-    if (n != (ssize_t)sizeof(entry)) {
-      P_ERRNO = FS_IO_ERROR;
-      return -1;
+  for (int i = 0; i < iovcnt; i++) {
+    size_t len = iov[i].iov_len < INT_MAX ? iov[i].iov_len : INT_MAX;
+    if (len == 0) {
+      continue;
     }
-  } else {
-    // No other fds using this file, can do the cleaning.
-    k_free_fat_chain(entry.firstBlock);
-    entry.name[0] = 1;  // mark as 1.
-    n = pwrite(FS_HOST_FD, &entry, sizeof(entry), dirent_off);
-    if (n != (ssize_t)sizeof(entry)) {
-      P_ERRNO = FS_IO_ERROR;
-      return -1;
+    ssize_t n = k_write(kfd, iov[i].iov_base, (int)len);
+    if (n < 0) {
+      return total > 0 ? total : -1;
+    }
+    total += n;
+    if ((size_t)n < len) {
+      break;  // disk full (or no reader left)
     }
   }
-  return FS_SUCCESS;
+  return total;
 }
 
-int k_lseek(int kfd, int offset, int whence) {
+ssize_t k_sendfile(int out_kfd, int in_kfd, size_t count) {
   if (!IS_FS_MOUNTED) {
     P_ERRNO = FS_NOT_MOUNTED;
     return -1;
   }
-  if (kfd < 0 || kfd >= MAX_FD || GLOBAL_FD_TABLE[kfd] == NULL) {
+  if (!k_gdt_valid(out_kfd) || !k_gdt_valid(in_kfd)) {
     P_ERRNO = FS_BAD_FD;
     return -1;
   }
+  return k_transfer(out_kfd, false, in_kfd, false, count);
+}
 
-  open_file_t* of = GLOBAL_FD_TABLE[kfd];
+int k_unlink(const char* fname) {
+  bool locked = spthread_disable_interrupts_nested();
+  int result = k_unlink_locked(fname);
+  if (result == FS_SUCCESS) {
+    result = k_commit();
+  }
+  spthread_restore_interrupts(locked);
+  return result;
+}
 
-  // calculate the new offset based on whence mode.
-  int64_t new_pos;
-  switch (whence) {
+int k_lseek(int kfd, int offset, int whence) {
+  if (!IS_FS_MOUNTED) {
+    P_ERRNO = FS_NOT_MOUNTED;
+    return -1;
+  }
+  if (kfd < 0 || kfd >= MAX_GDT_ENTRY || GLOBAL_FD_TABLE[kfd] == NULL) {
+    P_ERRNO = FS_BAD_FD;
+    return -1;
+  }
+
+  open_file_t* of = GLOBAL_FD_TABLE[kfd];
+  if (of->pipe) {
+    P_ERRNO = P_ESPIPE;
+    return -1;
+  }
+  uint32_t size = of->inode ? of->inode->size : 0;  // 0-2 have no inode
+
+  // calculate the new offset based on whence mode.
+  int64_t new_pos;
+  switch (whence) {
     case F_SEEK_SET:
       new_pos = offset;
       break;
@@ -858,7 +1487,7 @@ int k_lseek(int kfd, int offset, int whence) {
       new_pos = (int64_t)of->offset + offset;
       break;
     case F_SEEK_END:
-      new_pos = (int64_t)of->size + offset;
+      new_pos = (int64_t)size + offset;
       break;
     default:
       P_ERRNO = FS_INVALID_WHENCE;
@@ -875,16 +1504,43 @@ int k_lseek(int kfd, int offset, int whence) {
   // allocation should happen in k_write, while writing the updated metadata
   // back to disk dirent should happen in k_close. Therefore, k_read and k_write
   // must stick to metadata from open file entries, not dirent on disk.
-  if (new_pos > of->size && (of->flag & (F_WRITE | F_APPEND))) {
-    of->size = (uint32_t)new_pos;
+  if (new_pos > size && of->inode && (of->flag & (F_WRITE | F_APPEND))) {
+    of->inode->size = (uint32_t)new_pos;
+    k_inode_dirty(of->inode);
   }
 
+  // The block cursor maps a block index to a block, not to the offset, so it
+  // stays valid here: a forward seek walks on from it and a backward seek
+  // restarts from the inode's first_block (see k_seek_block()).
+
   of->offset = (uint64_t)new_pos;
   return FS_SUCCESS;
 }
 
+int k_fsync(int kfd) {
+  if (!IS_FS_MOUNTED) {
+    P_ERRNO = FS_NOT_MOUNTED;
+    return -1;
+  }
+  if (kfd < 0 || kfd >= MAX_GDT_ENTRY || GLOBAL_FD_TABLE[kfd] == NULL) {
+    P_ERRNO = FS_BAD_FD;
+    return -1;
+  }
+
+  return k_commit();  // the whole transaction: a group commit
+}
+
+int k_sync(void) {
+  if (!IS_FS_MOUNTED) {
+    P_ERRNO = FS_NOT_MOUNTED;
+    return -1;
+  }
+
+  return k_commit();
+}
+
 void k_format_dirent(const dir_entry_t* entry, char* buffer, size_t size) {
-  if (strcmp(entry->name, ".") == 0) {
+  if (strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) {
     if (size > 0)
       buffer[0] = '\0';
     return;
@@ -922,62 +1578,105 @@ void k_format_dirent(const dir_entry_t* entry, char* buffer, size_t size) {
 }
 
 int k_scan_dir(const char* filename, void (*callback)(const dir_entry_t*)) {
-  if (!IS_FS_MOUNTED) {
-    P_ERRNO = FS_NOT_MOUNTED;
-    return -1;
-  }
-
-  // If given a filename: attempt to process it directly
-  if (filename != NULL) {
-    off_t dirent_off;
-    bool found = k_find_file(filename, &dirent_off);
-    if (!found) {
-      P_ERRNO = FS_FILE_NOT_FOUND;
+  dir_stream_t* dir = k_opendir(filename);
+  if (dir == NULL) {
+    if (P_ERRNO != FS_NOT_A_DIR) {
       return -1;
     }
+    // a file: process it directly
     dir_entry_t entry;
-    if (pread(FS_HOST_FD, &entry, sizeof(entry), dirent_off) !=
-        (ssize_t)sizeof(entry)) {
-      P_ERRNO = FS_IO_ERROR;
+    off_t dirent_off;
+    if (k_stat(filename, &entry, &dirent_off) != FS_SUCCESS) {
       return -1;
     }
-
     if (callback)
       callback(&entry);
     return FS_SUCCESS;
   }
 
-  // If no filename given: list all files in current directory (root)
-  uint16_t blknum = 1;  // root firstBlock
-  dir_entry_t entry;
+  dir_entry_t entries[READDIR_BATCH];
+  ssize_t n;
+  while ((n = k_readdir(dir, entries, NULL, READDIR_BATCH)) > 0) {
+    for (ssize_t i = 0; i < n; i++) {
+      if (callback)
+        callback(&entries[i]);
+    }
+  }
+  k_closedir(dir);
+  return n < 0 ? -1 : FS_SUCCESS;
+}
 
-  while (blknum != 0xFFFF) {
-    for (int i = 0; i < FS_ENTRY_PER_BLK; i++) {
-      off_t off =
-          FS_FAT_SIZE + (blknum - 1) * FS_BLOCK_SIZE + i * sizeof(dir_entry_t);
+dir_stream_t* k_opendir(const char* path) {
+  if (!IS_FS_MOUNTED) {
+    P_ERRNO = FS_NOT_MOUNTED;
+    return NULL;
+  }
 
-      if (pread(FS_HOST_FD, &entry, sizeof(entry), off) !=
-          (ssize_t)sizeof(entry)) {
-        P_ERRNO = FS_IO_ERROR;
-        return -1;
-      }
+  bool locked = spthread_disable_interrupts_nested();
+  uint16_t first = path != NULL ? k_path_dir(path) : FS_CWD;
+  dir_stream_t* dir = NULL;
+  if (first != 0) {
+    dir = malloc(sizeof(dir_stream_t) + FS_BLOCK_SIZE);
+    if (dir == NULL) {
+      P_ERRNO = FS_MALLOC_FAIL;
+    } else {
+      dir->next_blk = first;
+      dir->pos = FS_ENTRY_PER_BLK;
+      dir->done = false;
+      k_sync_dirents();  // show the sizes of files still being written
+    }
+  }
+  spthread_restore_interrupts(locked);
+  return dir;
+}
+
+ssize_t k_readdir(dir_stream_t* dir,
+                  dir_entry_t* entries,
+                  off_t* offsets,
+                  size_t max) {
+  if (!IS_FS_MOUNTED) {
+    P_ERRNO = FS_NOT_MOUNTED;
+    return -1;
+  }
 
-      if (entry.name[0] == 0) {
-        // finished
-        return FS_SUCCESS;
+  bool locked = spthread_disable_interrupts_nested();
+  size_t n = 0;
+  ssize_t result = 0;
+  while (n < max && !dir->done) {
+    if (dir->pos == FS_ENTRY_PER_BLK) {
+      uint16_t blk = dir->next_blk;
+      // a block freed or reused since (the directory was removed): the end
+      if (blk == 0xFFFF || blk == 0 || blk >= FREE_LIMIT ||
+          FAT_TABLE[blk] == 0) {
+        dir->done = true;
+        break;
       }
-      if (entry.name[0] == 1 || entry.name[0] == 2) {
-        continue;
+      if (k_dir_block_read(blk, dir->buf) != FS_SUCCESS) {
+        result = -1;
+        break;
       }
-
-      if (callback)
-        callback(&entry);
+      dir->blk = blk;
+      dir->next_blk = FAT_TABLE[blk];
+      dir->pos = 0;
     }
 
-    blknum = FAT_TABLE[blknum];
+    const dir_entry_t* entry = &dir->buf[dir->pos++];
+    if (entry->name[0] == 0) {
+      dir->done = true;  // finished
+    } else if (entry->name[0] != 1 && entry->name[0] != 2) {
+      if (offsets != NULL) {
+        offsets[n] = FS_FAT_SIZE + (dir->blk - 1) * FS_BLOCK_SIZE +
+                     (dir->pos - 1) * sizeof(dir_entry_t);
+      }
+      entries[n++] = *entry;
+    }
   }
+  spthread_restore_interrupts(locked);
+  return result < 0 && n == 0 ? -1 : (ssize_t)n;
+}
 
-  return FS_SUCCESS;
+void k_closedir(dir_stream_t* dir) {
+  free(dir);
 }
 
 int k_ls(const char* filename) {
@@ -1071,59 +1770,13 @@ int k_cat(char** args) {
 }
 
 int k_chmod_update(const char* fname, uint8_t new_perm) {
-  if (!IS_FS_MOUNTED) {
-    P_ERRNO = FS_NOT_MOUNTED;
-    return -1;
-  }
-
-  off_t dir_entry_disk_offset = 0;
-
-  if (!k_find_file(fname, &dir_entry_disk_offset)) {
-    P_ERRNO = FS_FILE_NOT_FOUND;
-    return -1;
-  }
-
-  dir_entry_t entry;
-
-  if (pread(FS_HOST_FD, &entry, sizeof(dir_entry_t), dir_entry_disk_offset) !=
-      sizeof(dir_entry_t)) {
-    P_ERRNO = FS_IO_ERROR;
-    return -1;
-  }
-
-  // entry.perm = new_perm;
-
-  uint8_t op_add = 0x80;     // Flag: add permission
-  uint8_t op_remove = 0x40;  // Flag: remove permission
-  uint8_t op_assign = 0x20;  // Flag: assign permission (=)
-  uint8_t val_mask = 0x07;   // Valid permission bits (rwx)
-
-  if (new_perm & op_add) {
-    // Mode: + (add)
-    // Keep original permissions and add new bits
-    entry.perm |= (new_perm & val_mask);
-  } else if (new_perm & op_remove) {
-    // Mode: - (remove)
-    // Keep original permissions and remove specified bits
-    entry.perm &= ~(new_perm & val_mask);
-  } else if (new_perm & op_assign) {
-    // Mode: = (assign)
-    // Directly set new permissions
-    entry.perm = (new_perm & val_mask);
-  } else {
-    // Mode: numeric (assign)
-    entry.perm = (new_perm & val_mask);
-  }
-
-  entry.mtime = time(NULL);
-
-  if (pwrite(FS_HOST_FD, &entry, sizeof(dir_entry_t), dir_entry_disk_offset) !=
-      sizeof(dir_entry_t)) {
-    P_ERRNO = FS_IO_ERROR;
-    return -1;
+  bool locked = spthread_disable_interrupts_nested();
+  int result = k_chmod_locked(fname, new_perm);
+  if (result == FS_SUCCESS) {
+    result = k_commit();
   }
-
-  return FS_SUCCESS;
+  spthread_restore_interrupts(locked);
+  return result;
 }
 
 int k_check_executable(const char* fname) {
@@ -1140,7 +1793,7 @@ int k_check_executable(const char* fname) {
   }
 
   dir_entry_t entry;
-  if (pread(FS_HOST_FD, &entry, sizeof(entry), dirent_off) != sizeof(entry)) {
+  if (k_dirent_read(&entry, dirent_off) != sizeof(entry)) {
     P_ERRNO = FS_IO_ERROR;
     return -1;
   }
@@ -1158,62 +1811,97 @@ int k_check_executable(const char* fname) {
   return FS_SUCCESS;
 }
 
-
-int k_mv(const char* source, const char* dest) {
+int k_stat(const char* fname, dir_entry_t* entry, off_t* dirent_offset) {
   if (!IS_FS_MOUNTED) {
     P_ERRNO = FS_NOT_MOUNTED;
     return -1;
   }
 
-  off_t source_offset = 0;
-  off_t dest_offset = 0;
-
-  // check if the source file exists
-  if (!k_find_file(source, &source_offset)) {
+  path_ref_t ref;
+  if (k_path_parent(fname, &ref) != FS_SUCCESS) {
+    return -1;
+  }
+  if (ref.name[0] == '\0') {
+    // the directory itself; only a subdirectory has an entry of its own
+    if (ref.dir->first_block == 1) {
+      memset(entry, 0, sizeof(*entry));
+      strcpy(entry->name, "/");
+      entry->firstBlock = 1;
+      entry->type = 2;
+      entry->perm = 7;
+      *dirent_offset = 0;
+      return FS_SUCCESS;
+    }
+    strcpy(ref.name, ".");  // it is its own "." entry
+  }
+  off_t dirent_off;
+  if (!k_dir_find(ref.dir, ref.name, &dirent_off)) {
     P_ERRNO = FS_FILE_NOT_FOUND;
     return -1;
   }
-
-  dir_entry_t source_dirent;
-  if (pread(FS_HOST_FD, &source_dirent, sizeof(dir_entry_t), source_offset) !=
-      sizeof(dir_entry_t)) {
+  if (k_dirent_read(entry, dirent_off) != (ssize_t)sizeof(*entry)) {
     P_ERRNO = FS_IO_ERROR;
     return -1;
   }
-  if (!(source_dirent.perm & 4)) {
-    P_ERRNO = FS_NO_PERMISSION;
-    return -1;
+
+  // an open file may be ahead of its dirent
+  open_inode_t* inode = k_inode_find(dirent_off);
+  if (inode != NULL) {
+    entry->size = inode->size;
+    entry->firstBlock = inode->first_block;
+    if (inode->dirty) {
+      entry->mtime = inode->mtime;
+    }
   }
 
-  strncpy(source_dirent.name, dest, 31);
-  source_dirent.name[31] = '\0';
-  source_dirent.mtime = time(NULL);
+  *dirent_offset = dirent_off;
+  return FS_SUCCESS;
+}
 
-  // check if the destination file already exists
-  if (k_find_file(dest, &dest_offset)) {
-    dir_entry_t dest_dirent;
-    if (pread(FS_HOST_FD, &dest_dirent, sizeof(dir_entry_t), dest_offset) !=
-        sizeof(dir_entry_t)) {
-      P_ERRNO = FS_IO_ERROR;
-      return -1;
-    }
-    if (!(dest_dirent.perm & 2)) {
-      P_ERRNO = FS_NO_PERMISSION;
-      return -1;
-    }
-    int result = k_unlink(dest);
-    if (result < 0) {
-      return result;
-    }
+
+int k_mv(const char* source, const char* dest) {
+  bool locked = spthread_disable_interrupts_nested();
+  int result = k_mv_locked(source, dest);
+  if (result == FS_SUCCESS) {
+    result = k_commit();
   }
+  spthread_restore_interrupts(locked);
+  return result;
+}
 
-  if (pwrite(FS_HOST_FD, &source_dirent, sizeof(dir_entry_t), source_offset) !=
-      sizeof(dir_entry_t)) {
-    P_ERRNO = FS_IO_ERROR;
+int k_mkdir(const char* path) {
+  bool locked = spthread_disable_interrupts_nested();
+  int result = k_mkdir_locked(path);
+  if (result == FS_SUCCESS) {
+    result = k_commit();
+  }
+  spthread_restore_interrupts(locked);
+  return result;
+}
+
+int k_rmdir(const char* path) {
+  bool locked = spthread_disable_interrupts_nested();
+  int result = k_rmdir_locked(path);
+  if (result == FS_SUCCESS) {
+    result = k_commit();
+  }
+  spthread_restore_interrupts(locked);
+  return result;
+}
+
+int k_chdir(const char* path) {
+  if (!IS_FS_MOUNTED) {
+    P_ERRNO = FS_NOT_MOUNTED;
     return -1;
   }
 
-  return FS_SUCCESS;
+  bool locked = spthread_disable_interrupts_nested();
+  uint16_t dir = k_path_dir(path);
+  if (dir != 0) {
+    FS_CWD = dir;
+  }
+  spthread_restore_interrupts(locked);
+  return dir != 0 ? FS_SUCCESS : -1;
 }
 
 int k_cp(char** args) {
@@ -1345,395 +2033,2199 @@ static void k_gdt_init(void) {
 
     GLOBAL_FD_TABLE[i] = std_file;
   }
+
+  // pushed in reverse, so fds are handed out lowest first
+  GDT_FREE_LEN = 0;
+  for (int i = MAX_GDT_ENTRY - 1; i >= 3; i--) {
+    GDT_FREE[GDT_FREE_LEN++] = i;
+  }
 }
 
 static void k_gdt_cleanup(void) {
-  for (int i = 0; i < MAX_FD; i++) {
+  for (int i = 0; i < MAX_GDT_ENTRY; i++) {
     if (GLOBAL_FD_TABLE[i] != NULL) {
+      k_release_extent(GLOBAL_FD_TABLE[i]);
+      k_pipe_detach(GLOBAL_FD_TABLE[i]);  // no-op for files
+      if (GLOBAL_FD_TABLE[i]->inode != NULL) {
+        k_inode_put(GLOBAL_FD_TABLE[i]->inode);
+      }
       free(GLOBAL_FD_TABLE[i]);
       GLOBAL_FD_TABLE[i] = NULL;
     }
   }
+  GDT_FREE_LEN = 0;
+}
+
+static off_t k_extend_dir(dir_index_t* dir) {
+  uint16_t last_blk = dir->blocks[dir->nblocks - 1];
+
+  uint16_t i = k_alloc_block();
+  if (i == 0) {
+    // We literally have no space left in the file system (what have we done).
+    return (off_t)-1;
+  }
+
+  // Update the FAT.
+  k_fat_set(last_blk, i);
+  // Cleanse the block
+  char zero_buf[FS_BLOCK_SIZE];
+  memset(zero_buf, 0, FS_BLOCK_SIZE);
+  // calculate new block offset
+  off_t off = FS_FAT_SIZE + (i - 1) * FS_BLOCK_SIZE;
+  k_bcache_write(zero_buf, FS_BLOCK_SIZE, off);
+  if (k_dir_index_add_block(dir, i) != FS_SUCCESS) {
+    return (off_t)-1;
+  }
+  // Since we have a new block, the new dirent offset will be the same as
+  // block offset (first entry).
+  return off;
 }
 
-static off_t k_extend_root() {
-  uint16_t blknum = 1;
-  uint16_t last_blk = 1;
-  while (blknum != 0xFFFF) {
-    last_blk = blknum;
-    blknum = FAT_TABLE[blknum];
+static int k_free_index_build(void) {
+  // 0xFFFF is the end-of-chain marker, so it can never be a block number
+  FREE_LIMIT = FS_NUM_ENTRIES < 0xFFFF ? FS_NUM_ENTRIES : 0xFFFF;
+  FREE_BITMAP = calloc((FREE_LIMIT + 63) / 64, sizeof(uint64_t));
+  if (FREE_BITMAP == NULL) {
+    perror("Error allocating free-block bitmap");
+    return -1;
   }
-  // Above is just to locate the last block of root directory.
 
-  for (int i = 1; i < FS_NUM_ENTRIES; i++) {
+  FREE_COUNT = 0;
+  FREE_CURSOR = 1;
+  for (size_t i = 1; i < FREE_LIMIT; i++) {
     if (FAT_TABLE[i] == 0x0000) {
-      // Update the FAT.
-      FAT_TABLE[last_blk] = i;
-      FAT_TABLE[i] = 0xFFFF;
-      // Cleanse the block
-      char zero_buf[FS_BLOCK_SIZE];
-      memset(zero_buf, 0, FS_BLOCK_SIZE);
-      // calculate new block offset
-      off_t off = FS_FAT_SIZE + (i - 1) * FS_BLOCK_SIZE;
-      pwrite(FS_HOST_FD, zero_buf, FS_BLOCK_SIZE, off);
-      // Since we have a new block, the new dirent offset will be the same as
-      // block offset (first entry).
-      return off;
+      k_free_index_set((uint16_t)i, true);
     }
   }
+  return FS_SUCCESS;
+}
 
-  // We literally have no space left in the file system (what have we done).
-  return (off_t)-1;
+static void k_free_index_destroy(void) {
+  free(FREE_BITMAP);
+  FREE_BITMAP = NULL;
+  FREE_LIMIT = 0;
+  FREE_COUNT = 0;
+  FREE_RESERVED = 0;
 }
 
-static int k_find_free_block() {
-  for (int i = 1; i < FS_NUM_ENTRIES; i++) {
-    if (FAT_TABLE[i] == 0x0000) {
-      return i;
-    }
+static void k_free_index_set(uint16_t blk, bool free) {
+  if (blk == 0 || blk >= FREE_LIMIT) {
+    return;
+  }
+
+  uint64_t bit = 1ULL << (blk % 64);
+  uint64_t* word = &FREE_BITMAP[blk / 64];
+  if (free && !(*word & bit)) {
+    *word |= bit;
+    FREE_COUNT++;
+  } else if (!free && (*word & bit)) {
+    *word &= ~bit;
+    FREE_COUNT--;
   }
-  return 0;
 }
 
-static int k_find_gdt_spot() {
-  int fd = -1;
-  for (int i = 1; i < MAX_GDT_ENTRY; i++) {
-    if (GLOBAL_FD_TABLE[i] == NULL) {
-      fd = i;
-      break;
+static uint16_t k_alloc_block(void) {
+  if (FREE_COUNT == 0) {
+    return 0;
+  }
+
+  // next fit: scan whole words from the cursor, wrapping around once
+  size_t words = (FREE_LIMIT + 63) / 64;
+  size_t w = FREE_CURSOR / 64;
+  KSTAT_INC(KSTAT_ALLOC_SCANS);
+  for (size_t n = 0; n <= words; n++, w = (w + 1) % words) {
+    KSTAT_INC(KSTAT_ALLOC_SCANNED);
+    uint64_t bits = FREE_BITMAP[w];
+    if (n == 0) {
+      bits &= ~0ULL << (FREE_CURSOR % 64);  // skip blocks before the cursor
     }
+    if (bits == 0) {
+      continue;
+    }
+
+    uint16_t blk = (uint16_t)(w * 64 + __builtin_ctzll(bits));
+    k_free_index_set(blk, false);
+    k_fat_set(blk, 0xFFFF);
+    FREE_CURSOR = blk + 1 < FREE_LIMIT ? blk + 1 : 1;
+    return blk;
   }
 
-  return fd;
+  return 0;  // unreachable while FREE_COUNT is accurate
 }
 
-static bool k_have_write_opened(const char* fname) {
-  int write_instances = 0;
-  (void)write_instances;  // NOTE: compiler warned this variable as unused
-
-  // iterate through  GDT slots
-  for (int i = 3; i < MAX_GDT_ENTRY; i++) {
-    open_file_t* of = GLOBAL_FD_TABLE[i];
-    if (of != NULL) {
-      if (strcmp(of->name, fname) == 0) {
-        if (of->flag & (F_WRITE | F_APPEND)) {
-          return true;
+static uint16_t k_find_free_run(size_t want, size_t* len) {
+  size_t best = 0, best_len = 0;
+  size_t run_start = 0, run_len = 0;
+  size_t b = FREE_CURSOR;
+
+  *len = 0;
+  size_t n;
+  for (n = 1; n < FREE_LIMIT; n++) {
+    if (b % 64 == 0 && b + 64 <= FREE_LIMIT && FREE_BITMAP[b / 64] == 0) {
+      // a whole word in use: skip it (without stepping past the wrap point)
+      run_len = 0;
+      b += 63;
+      n += 63;
+    } else if (FREE_BITMAP[b / 64] & (1ULL << (b % 64))) {
+      if (run_len++ == 0) {
+        run_start = b;
+      }
+      if (run_len > best_len) {
+        best = run_start;
+        best_len = run_len;
+        if (best_len >= want) {
+          break;
         }
       }
+    } else {
+      run_len = 0;
+    }
+
+    if (++b >= FREE_LIMIT) {
+      b = 1;  // wrap around; a run never spans the end of the disk
+      run_len = 0;
     }
   }
-  return false;
+
+  KSTAT_INC(KSTAT_ALLOC_SCANS);
+  KSTAT_ADD(KSTAT_ALLOC_SCANNED, n);
+  *len = best_len < want ? best_len : want;
+  return (uint16_t)best;
 }
 
-static void k_free_fat_chain(uint16_t first_block) {
-  uint16_t blk = first_block;
-  while (blk != 0 && blk != 0xFFFF) {
-    uint16_t next = FAT_TABLE[blk];
-    FAT_TABLE[blk] = 0x0000;
-    blk = next;
+static void k_reserve_extent(open_file_t* of, uint16_t last) {
+  // never tie up more than a quarter of what is left
+  size_t want = FS_PREALLOC_BLOCKS;
+  if (want > FREE_COUNT / 4) {
+    want = FREE_COUNT / 4;
+  }
+  if (want == 0 || of->resv_len > 0) {
+    return;
+  }
+
+  uint16_t start;
+  size_t len = 0;
+  if (last != 0 && last + 1 < FREE_LIMIT &&
+      (FREE_BITMAP[(last + 1) / 64] & (1ULL << ((last + 1) % 64)))) {
+    // keep growing the file in place
+    start = last + 1;
+    while (len < want && start + len < FREE_LIMIT &&
+           (FREE_BITMAP[(start + len) / 64] & (1ULL << ((start + len) % 64)))) {
+      len++;
+    }
+  } else {
+    start = k_find_free_run(want, &len);
+  }
+
+  for (size_t i = 0; i < len; i++) {
+    k_free_index_set((uint16_t)(start + i), false);
+  }
+  FREE_RESERVED += len;
+  of->resv_start = start;
+  of->resv_len = (uint16_t)len;
+  if (len > 0) {
+    FREE_CURSOR = start + len < FREE_LIMIT ? start + len : 1;
   }
 }
 
-static int k_update_dirent(open_file_t* file_data) {
-  dir_entry_t entry;
-  ssize_t written_bytes;
+static void k_release_extent(open_file_t* of) {
+  for (uint16_t i = 0; i < of->resv_len; i++) {
+    k_free_index_set(of->resv_start + i, true);
+  }
+  FREE_RESERVED -= of->resv_len;
+  of->resv_start = 0;
+  of->resv_len = 0;
+}
 
-  if (pread(FS_HOST_FD, &entry, sizeof(dir_entry_t),
-            file_data->dirent_offset) != sizeof(dir_entry_t)) {
-    P_ERRNO = FS_IO_ERROR;
-    return -1;
+static uint16_t k_alloc_file_block(open_file_t* of, uint16_t last) {
+  if (of->resv_len == 0 || (last != 0 && of->resv_start != last + 1)) {
+    // extent used up, or the file moved on (lseek): start a new one
+    k_release_extent(of);
+    k_reserve_extent(of, last);
+  }
+  if (of->resv_len == 0) {
+    return k_alloc_block();
   }
 
-  entry.firstBlock = file_data->first_block;
-  entry.size = (uint32_t)file_data->size;
-  entry.mtime = time(NULL);
-  written_bytes =
-      pwrite(FS_HOST_FD, &entry, sizeof(dir_entry_t), file_data->dirent_offset);
+  uint16_t blk = of->resv_start++;
+  of->resv_len--;
+  FREE_RESERVED--;
+  k_fat_set(blk, 0xFFFF);
+  return blk;
+}
 
-  if (written_bytes != sizeof(dir_entry_t)) {
+static int k_defrag_swap(defrag_state_t* st, uint16_t a, uint16_t b) {
+#define SWAP_BLK(x) ((x) == a ? b : (x) == b ? a : (x))
+  bool b_used = FAT_TABLE[b] != 0;
+  off_t off_a = FS_FAT_SIZE + (a - 1) * FS_BLOCK_SIZE;
+  off_t off_b = FS_FAT_SIZE + (b - 1) * FS_BLOCK_SIZE;
+
+  // contents
+  if (k_bcache_read(st->buf_a, FS_BLOCK_SIZE, off_a) !=
+          (ssize_t)FS_BLOCK_SIZE ||
+      (b_used && k_bcache_read(st->buf_b, FS_BLOCK_SIZE, off_b) !=
+                     (ssize_t)FS_BLOCK_SIZE) ||
+      k_bcache_write(st->buf_a, FS_BLOCK_SIZE, off_b) !=
+          (ssize_t)FS_BLOCK_SIZE ||
+      (b_used && k_bcache_write(st->buf_b, FS_BLOCK_SIZE, off_a) !=
+                     (ssize_t)FS_BLOCK_SIZE)) {
     P_ERRNO = FS_IO_ERROR;
     return -1;
   }
 
-  return FS_SUCCESS;
-}
-
-static bool k_is_file_still_open(off_t dirent_offset) {
-  for (int i = 0; i < MAX_GDT_ENTRY; i++) {
-    open_file_t* of = GLOBAL_FD_TABLE[i];
-    if (of && of->dirent_offset == dirent_offset) {
-      return true;
+  // Rename a <-> b in every link that touches them: the FAT entries of a, b
+  // and their predecessors, and the back links of a, b and their successors.
+  uint16_t from[4] = {a, b, st->prev[a], st->prev[b]};
+  uint16_t fat[4];
+  uint16_t to[4] = {a, b, FAT_TABLE[a], FAT_TABLE[b]};
+  uint16_t back[4];
+  for (int i = 0; i < 4; i++) {
+    fat[i] = FAT_TABLE[from[i]];
+    back[i] = (to[i] != 0xFFFF) ? st->prev[to[i]] : 0;
+  }
+  for (int i = 0; i < 4; i++) {
+    if (from[i] != 0) {
+      k_fat_set(SWAP_BLK(from[i]), SWAP_BLK(fat[i]));
+    }
+  }
+  for (int i = 0; i < 4; i++) {
+    if (to[i] != 0 && to[i] != 0xFFFF) {
+      st->prev[SWAP_BLK(to[i])] = SWAP_BLK(back[i]);
     }
   }
-  return false;
-}
 
-static void k_print_dirent(const dir_entry_t* entry) {
-  char buffer[256];
-  k_format_dirent(entry, buffer, sizeof(buffer));
-  if (strlen(buffer) > 0) {
-    k_write(1, buffer, strlen(buffer));
+  int32_t owner = st->owner[a];
+  st->owner[a] = st->owner[b];
+  st->owner[b] = owner;
+  if (st->owner[a] >= 0) {
+    st->heads[st->owner[a]] = a;
+  }
+  if (st->owner[b] >= 0) {
+    st->heads[st->owner[b]] = b;
+  }
+
+  if (!b_used) {
+    k_free_index_set(b, false);
+    k_free_index_set(a, true);
   }
+  return FS_SUCCESS;
+#undef SWAP_BLK
 }
 
-static int k_open_mode_read(const char* fname,
-                            off_t offset,
-                            open_file_t** new_of_out,
-                            bool found,
-                            dir_entry_t* entry) {
-  if (!found) {
-    P_ERRNO = FS_FILE_NOT_FOUND;
-    return -1;
+static uint16_t k_seek_block(open_file_t* of, size_t index) {
+  uint16_t blk = of->inode->first_block;
+  size_t i = 0;
+  // a cursor from before a truncation points into the freed chain
+  if (of->cur_block != 0 && of->cur_gen == of->inode->generation &&
+      of->cur_index <= index) {
+    blk = of->cur_block;
+    i = of->cur_index;
+  }
+
+  size_t from = i;
+  for (; i < index && blk != 0 && blk != 0xFFFF; i++) {
+    blk = FAT_TABLE[blk];
+  }
+  KSTAT_ADD(KSTAT_FAT_STEPS, i - from);
+  if (blk == 0 || blk == 0xFFFF) {
+    return 0;
   }
 
-  pread(FS_HOST_FD, entry, sizeof(dir_entry_t), offset);
+  of->cur_block = blk;
+  of->cur_index = (uint32_t)index;
+  of->cur_gen = of->inode->generation;
+  return blk;
+}
 
-  if (entry->type != 1) {
-    P_ERRNO = FS_NOT_A_FILE;
+static int k_dir_index_build(void) {
+  k_dir_index_destroy();
+
+  BLOCK_DIR = calloc(FREE_LIMIT, sizeof(dir_index_t*));
+  BLOCK_POS = malloc(FREE_LIMIT * sizeof(uint16_t));
+  if (!BLOCK_DIR || !BLOCK_POS || k_dir_index_get(1) == NULL) {
+    k_dir_index_destroy();
     return -1;
   }
+  return FS_SUCCESS;
+}
+
+static void k_dir_index_destroy(void) {
+  while (DIR_LIST != NULL) {
+    k_dir_index_drop(DIR_LIST);
+  }
+  free(BLOCK_DIR);
+  free(BLOCK_POS);
+  BLOCK_DIR = NULL;
+  BLOCK_POS = NULL;
+}
 
-  if (!(entry->perm & 4)) {
-    P_ERRNO = FS_NO_PERMISSION;
-    return -1;
+static dir_index_t* k_dir_index_get(uint16_t first_block) {
+  if (first_block == 0 || first_block >= FREE_LIMIT) {
+    P_ERRNO = FS_IO_ERROR;
+    return NULL;
+  }
+  if (BLOCK_DIR[first_block] != NULL) {
+    return BLOCK_DIR[first_block];
   }
 
-  *new_of_out = (open_file_t*)malloc(sizeof(open_file_t));
-  if (*new_of_out == NULL) {
+  dir_index_t* dir = calloc(1, sizeof(dir_index_t));
+  if (dir == NULL) {
     P_ERRNO = FS_MALLOC_FAIL;
-    return -1;
+    return NULL;
+  }
+  dir->first_block = first_block;
+  dir->hash_cap = 64;
+  dir->hash = calloc(dir->hash_cap, sizeof(dir_hash_entry_t));
+  dir->next = DIR_LIST;
+  DIR_LIST = dir;
+  if (dir->hash == NULL) {
+    k_dir_index_drop(dir);
+    P_ERRNO = FS_MALLOC_FAIL;
+    return NULL;
   }
 
-  open_file_init(*new_of_out);
+  size_t steps = 0;
+  for (uint16_t blk = first_block;
+       blk != 0xFFFF && blk != 0 && steps++ < FREE_LIMIT;
+       blk = FAT_TABLE[blk]) {
+    if (k_dir_index_add_block(dir, blk) != FS_SUCCESS) {
+      k_dir_index_drop(dir);
+      P_ERRNO = FS_MALLOC_FAIL;
+      return NULL;
+    }
+  }
 
-  strncpy((*new_of_out)->name, fname, 31);
-  (*new_of_out)->name[31] = '\0';
-  (*new_of_out)->size = entry->size;
-  (*new_of_out)->perm = entry->perm;
-  (*new_of_out)->first_block = entry->firstBlock;
-  (*new_of_out)->dirent_offset = offset;
-  (*new_of_out)->flag = F_READ;
+  // One scan of the directory, in the same order as the old linear lookup:
+  // it ends at the first never-used entry.
+  dir_entry_t entry;
+  size_t nslots = dir->nblocks * FS_ENTRY_PER_BLK;
+  for (size_t pos = 0; pos < nslots; pos++) {
+    off_t off = FS_FAT_SIZE +
+                (dir->blocks[pos / FS_ENTRY_PER_BLK] - 1) * FS_BLOCK_SIZE +
+                (pos % FS_ENTRY_PER_BLK) * sizeof(dir_entry_t);
+    k_dirent_read(&entry, off);
+    if (entry.name[0] == 0) {
+      break;
+    }
+    dir->end = pos + 1;
+    // a duplicated name resolves to its first entry, as the old scan did
+    if (k_dir_lookup(dir, entry.name) != -1) {
+      continue;
+    }
+    if (k_dir_index_note(NULL, &entry, off) != FS_SUCCESS) {
+      k_dir_index_drop(dir);
+      P_ERRNO = FS_MALLOC_FAIL;
+      return NULL;
+    }
+  }
+  return dir;
+}
+
+static void k_dir_index_drop(dir_index_t* dir) {
+  dir_index_t** link = &DIR_LIST;
+  while (*link != dir) {
+    link = &(*link)->next;
+  }
+  *link = dir->next;
+
+  for (size_t i = 0; i < dir->nblocks; i++) {
+    BLOCK_DIR[dir->blocks[i]] = NULL;
+  }
+  free(dir->hash);
+  free(dir->blocks);
+  free(dir->free);
+  free(dir);
+}
+
+static int k_dir_index_add_block(dir_index_t* dir, uint16_t blk) {
+  size_t old_words = (dir->nblocks * FS_ENTRY_PER_BLK + 63) / 64;
+  size_t new_words = ((dir->nblocks + 1) * FS_ENTRY_PER_BLK + 63) / 64;
+
+  uint16_t* blocks =
+      realloc(dir->blocks, (dir->nblocks + 1) * sizeof(uint16_t));
+  if (blocks == NULL) {
+    return -1;
+  }
+  dir->blocks = blocks;
+  uint64_t* free_bits = realloc(dir->free, new_words * sizeof(uint64_t));
+  if (free_bits == NULL) {
+    return -1;
+  }
+  dir->free = free_bits;
+  memset(dir->free + old_words, 0,
+         (new_words - old_words) * sizeof(uint64_t));
 
+  BLOCK_DIR[blk] = dir;
+  BLOCK_POS[blk] = (uint16_t)dir->nblocks;
+  dir->blocks[dir->nblocks++] = blk;
   return FS_SUCCESS;
 }
 
-static int k_open_mode_write(const char* fname,
-                             off_t offset,
-                             open_file_t** new_of_out,
-                             bool found,
-                             dir_entry_t* entry) {
-  if (!found) {
-    // create a new directory entry structure in memory
-    memset(entry, 0, sizeof(dir_entry_t));
-    strncpy(entry->name, fname, 31);
-    entry->name[31] = '\0';
-    entry->type = 1;  // Regular File
-    entry->perm = 6;  // Read and Write
+static void k_name_copy(char* dst, const char* src) {
+  size_t len = strnlen(src, MAX_NAME_LEN - 1);
+  memcpy(dst, src, len);
+  dst[len] = '\0';
+}
 
-    // Write the new directory entry to disk
-    if (pwrite(FS_HOST_FD, entry, sizeof(dir_entry_t), offset) !=
-        sizeof(dir_entry_t)) {
-      P_ERRNO = FS_IO_ERROR;
-      return -1;
-    }
-  } else {
-    pread(FS_HOST_FD, entry, sizeof(dir_entry_t), offset);
-    if (entry->type != 1) {
-      P_ERRNO = FS_NOT_A_FILE;
-      return -1;
-    }
+static size_t k_dir_hash(const char* name) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < MAX_NAME_LEN && name[i] != '\0'; i++) {
+    hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+  }
+  return hash;
+}
 
-    if (!(entry->perm & 2)) {
-      P_ERRNO = FS_NO_PERMISSION;
+static size_t k_dir_bucket(const dir_index_t* dir, const char* name) {
+  size_t mask = dir->hash_cap - 1;
+  size_t i = k_dir_hash(name) & mask;
+  KSTAT_INC(KSTAT_FIND_SCANNED);
+  while (dir->hash[i].name[0] != '\0' &&
+         strncmp(dir->hash[i].name, name, MAX_NAME_LEN - 1) != 0) {
+    KSTAT_INC(KSTAT_FIND_SCANNED);
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+static int k_dir_hash_insert(dir_index_t* dir, const char* name, off_t off) {
+  if (2 * (dir->hash_len + 1) > dir->hash_cap) {
+    // keep the load factor under 1/2
+    dir_hash_entry_t* old = dir->hash;
+    size_t old_cap = dir->hash_cap;
+    dir->hash = calloc(2 * old_cap, sizeof(dir_hash_entry_t));
+    if (dir->hash == NULL) {
+      dir->hash = old;
       return -1;
     }
+    dir->hash_cap = 2 * old_cap;
+    for (size_t i = 0; i < old_cap; i++) {
+      if (old[i].name[0] != '\0') {
+        dir->hash[k_dir_bucket(dir, old[i].name)] = old[i];
+      }
+    }
+    free(old);
+  }
 
-    if (entry->size > 0) {
-      k_free_fat_chain(entry->firstBlock);
-      entry->size = 0;
-      entry->firstBlock = 0;
-      entry->mtime = time(NULL);
+  size_t i = k_dir_bucket(dir, name);
+  if (dir->hash[i].name[0] == '\0') {
+    k_name_copy(dir->hash[i].name, name);
+    dir->hash_len++;
+  }
+  dir->hash[i].off = off;
+  return FS_SUCCESS;
+}
 
-      // Write the truncated entry back to disk
-      if (pwrite(FS_HOST_FD, entry, sizeof(dir_entry_t), offset) !=
-          sizeof(dir_entry_t)) {
-        P_ERRNO = FS_IO_ERROR;
-        return -1;
+static void k_dir_hash_remove(dir_index_t* dir, const char* name) {
+  size_t mask = dir->hash_cap - 1;
+  size_t i = k_dir_bucket(dir, name);
+  if (dir->hash[i].name[0] == '\0') {
+    return;
+  }
+  dir->hash_len--;
+
+  size_t j = i;
+  while (true) {
+    dir->hash[i].name[0] = '\0';
+    // pull back the next entry that would otherwise become unreachable
+    while (true) {
+      j = (j + 1) & mask;
+      if (dir->hash[j].name[0] == '\0') {
+        return;
+      }
+      size_t home = k_dir_hash(dir->hash[j].name) & mask;
+      if (((j - home) & mask) >= ((j - i) & mask)) {
+        break;
       }
     }
+    dir->hash[i] = dir->hash[j];
+    i = j;
   }
+}
 
-  *new_of_out = (open_file_t*)malloc(sizeof(open_file_t));
-  if (*new_of_out == NULL) {
-    P_ERRNO = FS_MALLOC_FAIL;
+static off_t k_dir_lookup(const dir_index_t* dir, const char* name) {
+  if (name[0] == '\0') {
     return -1;
   }
+  size_t i = k_dir_bucket(dir, name);
+  return dir->hash[i].name[0] != '\0' ? dir->hash[i].off : -1;
+}
 
-  open_file_init(*new_of_out);
-  strncpy((*new_of_out)->name, fname, 31);
-  (*new_of_out)->name[31] = '\0';
-  (*new_of_out)->first_block = entry->firstBlock;
-  (*new_of_out)->dirent_offset = offset;
-  (*new_of_out)->flag = F_WRITE;
-  (*new_of_out)->offset = 0;
-  (*new_of_out)->perm = entry->perm;
+static off_t k_dir_free_slot(dir_index_t* dir) {
+  size_t nslots = dir->nblocks * FS_ENTRY_PER_BLK;
+  size_t pos = dir->end;
 
-  return FS_SUCCESS;
+  // lowest deleted slot, if there is one before the end of the directory
+  for (size_t w = dir->free_hint / 64; w * 64 < dir->end; w++) {
+    if (dir->free[w] != 0) {
+      size_t p = w * 64 + __builtin_ctzll(dir->free[w]);
+      pos = p < dir->end ? p : dir->end;
+      break;
+    }
+  }
+  dir->free_hint = pos;
+
+  if (pos >= nslots) {
+    return -1;
+  }
+  return FS_FAT_SIZE +
+         (dir->blocks[pos / FS_ENTRY_PER_BLK] - 1) * FS_BLOCK_SIZE +
+         (pos % FS_ENTRY_PER_BLK) * sizeof(dir_entry_t);
 }
 
-static int k_open_mode_append(const char* fname,
-                              off_t offset,
-                              open_file_t** new_of_out,
-                              bool found,
-                              dir_entry_t* entry) {
-  if (!found) {
-    memset(entry, 0, sizeof(dir_entry_t));
-    strncpy(entry->name, fname, 31);
-    entry->name[31] = '\0';
-    entry->type = 1;
-    entry->perm = 6;
-    if (pwrite(FS_HOST_FD, entry, sizeof(dir_entry_t), offset) !=
-        sizeof(dir_entry_t)) {
+static bool k_dir_find(dir_index_t* dir, const char* name, off_t* offset) {
+  // The index mirrors the directory (see k_dirent_write()), so neither the
+  // lookup nor finding a free slot touches the disk.
+  KSTAT_TIMER_START(start);
+  KSTAT_INC(KSTAT_FIND_CALLS);
+  off_t off = k_dir_lookup(dir, name);
+  bool found = off != -1;
+  if (found) {
+    *offset = off;
+  } else {
+    // Not found: hand out the first deleted slot or the end of directory, or
+    // -1 if the directory has to be extended.
+    *offset = k_dir_free_slot(dir);
+  }
+  KSTAT_TIMER_STOP(KSTAT_T_FIND, start);
+  return found;
+}
+
+static int k_path_parent(const char* path, path_ref_t* ref) {
+  dir_index_t* dir = k_dir_index_get(path[0] == '/' ? 1 : FS_CWD);
+  if (dir == NULL) {
+    return -1;
+  }
+
+  const char* p = path;
+  while (true) {
+    while (*p == '/') {
+      p++;
+    }
+    const char* comp = p;
+    while (*p != '\0' && *p != '/') {
+      p++;
+    }
+    size_t len = (size_t)(p - comp);
+    const char* rest = p;
+    while (*rest == '/') {
+      rest++;
+    }
+    if (len >= MAX_NAME_LEN) {
+      P_ERRNO = P_ENAMETOOLONG;
+      return -1;
+    }
+
+    char name[MAX_NAME_LEN];
+    memcpy(name, comp, len);
+    name[len] = '\0';
+    bool dot = strcmp(name, ".") == 0 || len == 0;
+    bool dotdot = strcmp(name, "..") == 0;
+    if (*rest == '\0') {  // the last component
+      ref->dir = dir;
+      // at the root there are no "." and ".." entries: they name the root
+      if (dot || (dotdot && dir->first_block == 1)) {
+        ref->name[0] = '\0';
+      } else {
+        memcpy(ref->name, name, len + 1);
+      }
+      return FS_SUCCESS;
+    }
+    if (dot || (dotdot && dir->first_block == 1)) {
+      continue;
+    }
+
+    off_t off = k_dir_lookup(dir, name);
+    dir_entry_t entry;
+    if (off == -1) {
+      P_ERRNO = FS_FILE_NOT_FOUND;
+      return -1;
+    }
+    if (k_dirent_read(&entry, off) != (ssize_t)sizeof(entry)) {
       P_ERRNO = FS_IO_ERROR;
       return -1;
     }
-  } else {
-    pread(FS_HOST_FD, entry, sizeof(dir_entry_t), offset);
-    if (entry->type != 1) {
-      P_ERRNO = FS_NOT_A_FILE;
+    if (entry.type != 2) {
+      P_ERRNO = FS_NOT_A_DIR;
       return -1;
     }
-    if (!(entry->perm & 2)) {
-      P_ERRNO = FS_NO_PERMISSION;
+    dir = k_dir_index_get(entry.firstBlock);
+    if (dir == NULL) {
       return -1;
     }
   }
+}
 
-  *new_of_out = (open_file_t*)malloc(sizeof(open_file_t));
-  if (*new_of_out == NULL) {
-    P_ERRNO = FS_MALLOC_FAIL;
-    return -1;
+static uint16_t k_path_dir(const char* path) {
+  path_ref_t ref;
+  if (k_path_parent(path, &ref) != FS_SUCCESS) {
+    return 0;
+  }
+  if (ref.name[0] == '\0') {
+    return ref.dir->first_block;
   }
 
-  open_file_init(*new_of_out);
-  strncpy((*new_of_out)->name, fname, 31);
-  (*new_of_out)->name[31] = '\0';
-  (*new_of_out)->first_block = entry->firstBlock;
-  (*new_of_out)->dirent_offset = offset;
-  (*new_of_out)->flag = F_APPEND;
-  (*new_of_out)->perm = entry->perm;
+  off_t off = k_dir_lookup(ref.dir, ref.name);
+  dir_entry_t entry;
+  if (off == -1) {
+    P_ERRNO = FS_FILE_NOT_FOUND;
+    return 0;
+  }
+  if (k_dirent_read(&entry, off) != (ssize_t)sizeof(entry)) {
+    P_ERRNO = FS_IO_ERROR;
+    return 0;
+  }
+  if (entry.type != 2) {
+    P_ERRNO = FS_NOT_A_DIR;
+    return 0;
+  }
+  return entry.firstBlock;
+}
 
-  // set offset to the current file size
-  (*new_of_out)->offset = entry->size;
+static ssize_t k_dirent_write(const dir_entry_t* entry, off_t off) {
+  bool locked = spthread_disable_interrupts_nested();
+  off_t home = off - (off - (off_t)FS_FAT_SIZE) % (off_t)FS_BLOCK_SIZE;
+  char* block = k_journal_find(home);
+  if (block == NULL) {
+    char buf[FS_BLOCK_SIZE];
+    if (k_bcache_read(buf, FS_BLOCK_SIZE, home) != (ssize_t)FS_BLOCK_SIZE ||
+        (block = k_journal_add(home, buf)) == NULL) {
+      spthread_restore_interrupts(locked);
+      return -1;
+    }
+  }
 
-  return FS_SUCCESS;
+  dir_entry_t old;
+  memcpy(&old, block + (off - home), sizeof(old));
+  memcpy(block + (off - home), entry, sizeof(*entry));
+  int result = k_dir_index_note(&old, entry, off);
+  spthread_restore_interrupts(locked);
+  return result == FS_SUCCESS ? (ssize_t)sizeof(*entry) : -1;
 }
 
-static int k_host_read_to_pennfat_write(const char* host_path, int pennfat_fd) {
-  int host_fd = open(host_path, O_RDONLY);
-  if (host_fd == -1) {
-    perror("cp: Cannot open host source file");
+static ssize_t k_dirent_read(dir_entry_t* entry, off_t off) {
+  bool locked = spthread_disable_interrupts_nested();
+  off_t home = off - (off - (off_t)FS_FAT_SIZE) % (off_t)FS_BLOCK_SIZE;
+  const char* block = k_journal_find(home);
+  ssize_t n;
+  if (block != NULL) {
+    memcpy(entry, block + (off - home), sizeof(*entry));
+    n = sizeof(*entry);
+  } else {
+    n = k_bcache_read(entry, sizeof(*entry), off);
+  }
+  spthread_restore_interrupts(locked);
+  return n;
+}
+
+static int k_dir_block_read(uint16_t blk, void* buf) {
+  off_t home = FS_FAT_SIZE + (blk - 1) * FS_BLOCK_SIZE;
+  const char* block = k_journal_find(home);
+  if (block != NULL) {
+    memcpy(buf, block, FS_BLOCK_SIZE);
+  } else if (k_bcache_read(buf, FS_BLOCK_SIZE, home) !=
+             (ssize_t)FS_BLOCK_SIZE) {
+    P_ERRNO = FS_IO_ERROR;
     return -1;
   }
+  return FS_SUCCESS;
+}
 
-  char buffer[BUFFER_SIZE];
-  ssize_t bytes_read;
-  int result = 0;
+static void k_fat_set(uint16_t blk, uint16_t next) {
+  FAT_TABLE[blk] = next;
+  FAT_DIRTY |= 1u << (blk * sizeof(uint16_t) / FS_BLOCK_SIZE);
+}
 
-  while ((bytes_read = read(host_fd, buffer, BUFFER_SIZE)) > 0) {
-    // Use k_write on pennfat_fd
-    ssize_t bytes_written = k_write(pennfat_fd, buffer, bytes_read);
-    if (bytes_written != bytes_read) {
-      {
-        char buf[128];
-        int len =
-            snprintf(buf, sizeof(buf),
-                     "cp: Error writing to PennFAT destination. %ld, %ld\n",
-                     bytes_written, bytes_read);
-        k_write(2, buf, len);
-      }
+static int k_commit(void) {
+  bool locked = spthread_disable_interrupts_nested();
+  int result = k_sync_dirents();
+
+  // data first: committed metadata must never point at unwritten blocks
+  if (k_bcache_flush() != 0) {
+    P_ERRNO = FS_IO_ERROR;
+    result = -1;
+  }
+
+  for (size_t i = 0; result == FS_SUCCESS && i < FS_FAT_BLOCKS; i++) {
+    if (!(FAT_DIRTY & (1u << i))) {
+      continue;
+    }
+    off_t home = (off_t)(i * FS_BLOCK_SIZE);
+    const char* fat = (const char*)FAT_TABLE + home;
+    char* block = k_journal_find(home);  // left over from a failed commit
+    if (block != NULL) {
+      memcpy(block, fat, FS_BLOCK_SIZE);
+    } else if (k_journal_add(home, fat) == NULL) {
+      P_ERRNO = FS_MALLOC_FAIL;
       result = -1;
       break;
     }
+    FAT_DIRTY &= ~(1u << i);
   }
 
-  if (bytes_read == -1) {
-    perror("Error reading from host source");
+  if (result == FS_SUCCESS && k_journal_commit(k_commit_applied) != 0) {
+    P_ERRNO = FS_IO_ERROR;
     result = -1;
   }
-
-  close(host_fd);
+  if (result == FS_SUCCESS) {
+    FAT_FREED = false;
+  }
+  spthread_restore_interrupts(locked);
   return result;
 }
 
-static int k_pennfat_read_to_host_write(int pennfat_fd, const char* host_path) {
-  // Open/Create the destination file on the host OS
-  int host_fd = open(host_path, O_CREAT | O_WRONLY | O_TRUNC, 0666);
-  if (host_fd == -1) {
-    perror("cp: Cannot create/open host destination file");
-    return -1;
+static void k_commit_applied(off_t home, const void* block) {
+  if (home >= (off_t)FS_FAT_SIZE) {
+    k_bcache_refresh(block, FS_BLOCK_SIZE, home);
+  }
+}
+
+static int k_dir_index_note(const dir_entry_t* old,
+                            const dir_entry_t* entry,
+                            off_t off) {
+  // only indexed directories are kept in sync; the others are read in
+  // full when they are first used
+  size_t rel = off - FS_FAT_SIZE;
+  uint16_t blk = (uint16_t)(rel / FS_BLOCK_SIZE + 1);
+  dir_index_t* dir = BLOCK_DIR != NULL ? BLOCK_DIR[blk] : NULL;
+  if (dir == NULL) {
+    return FS_SUCCESS;
   }
 
-  char buffer[BUFFER_SIZE];
-  ssize_t bytes_read;
-  int result = 0;
+  // name index: only live entries (not deleted, not deleted-but-open)
+  bool old_live = old && (unsigned char)old->name[0] > 2;
+  bool new_live = (unsigned char)entry->name[0] > 2;
+  bool renamed = !old || strncmp(old->name, entry->name, MAX_NAME_LEN) != 0;
+  if (old_live && (!new_live || renamed)) {
+    k_dir_hash_remove(dir, old->name);
+  }
+  if (new_live && (!old_live || renamed) &&
+      k_dir_hash_insert(dir, entry->name, off) != FS_SUCCESS) {
+    return -1;
+  }
 
-  while ((bytes_read = k_read(pennfat_fd, BUFFER_SIZE, buffer)) > 0) {
-    ssize_t bytes_written = write(host_fd, buffer, bytes_read);
-    if (bytes_written != bytes_read) {
-      perror("cp: Error writing to host destination");
-      result = -1;
-      break;
+  // free slots
+  size_t pos = BLOCK_POS[blk] * FS_ENTRY_PER_BLK +
+               (rel % FS_BLOCK_SIZE) / sizeof(dir_entry_t);
+  if (entry->name[0] == 1) {
+    dir->free[pos / 64] |= 1ULL << (pos % 64);
+    if (pos < dir->free_hint) {
+      dir->free_hint = pos;
     }
+  } else {
+    dir->free[pos / 64] &= ~(1ULL << (pos % 64));
   }
+  if (entry->name[0] != 0 && pos >= dir->end) {
+    dir->end = pos + 1;  // the directory grew into the end-of-directory slot
+  }
+  return FS_SUCCESS;
+}
 
-  if (bytes_read < 0) {
-    k_write(2, "cp: Error reading from PennFAT source.\n",
-            strlen("cp: Error reading from PennFAT source.\n"));
-    result = -1;
+static ssize_t k_read_mapped(int fd, size_t n, const char** data) {
+  open_file_t* of = GLOBAL_FD_TABLE[fd];
+  if (!(of->flag & F_READ)) {
+    P_ERRNO = FS_NO_PERMISSION;
+    return -1;
+  }
+  uint32_t size = of->inode->size;
+  if (of->offset >= size || n == 0) {
+    return 0;
+  }
+  if (n > size - of->offset) {
+    n = size - of->offset;
   }
 
-  close(host_fd);
-  return result;
-}
+  size_t index = of->offset / FS_BLOCK_SIZE;
+  size_t in = of->offset % FS_BLOCK_SIZE;
+  uint16_t first = k_seek_block(of, index);
+  if (first == 0) {
+    P_ERRNO = FS_INVALID_OFFSET;
+    return -1;
+  }
 
-static int copy_stream_content(int input_fd, int output_fd) {
-  char buffer[BUFFER_SIZE];
-  ssize_t bytes_read;
-  ssize_t bytes_written;
-  int result = 0;
+  // extend over physically adjacent blocks, like k_read()
+  uint16_t blk = first;
+  size_t len = FS_BLOCK_SIZE - in < n ? FS_BLOCK_SIZE - in : n;
+  while (len < n && FAT_TABLE[blk] == blk + 1) {
+    blk++;
+    index++;
+    len += n - len < FS_BLOCK_SIZE ? n - len : FS_BLOCK_SIZE;
+  }
 
-  while (1) {
-    bytes_read = k_read(input_fd, BUFFER_SIZE, buffer);
+  *data = FS_IMAGE_MAP + FS_FAT_SIZE + (first - 1) * FS_BLOCK_SIZE + in;
+  of->cur_block = blk;
+  of->cur_index = (uint32_t)index;
+  of->cur_gen = of->inode->generation;
+  of->offset += len;
+  return (ssize_t)len;
+}
 
-    if (bytes_read < 0) {
-      {
-        char buf[128];
-        int len =
-            snprintf(buf, sizeof(buf),
-                     "cat: Error reading input stream (FD %d).\n", input_fd);
-        k_write(2, buf, len);
-      }
-      result = -1;
-      break;
-    }
-    if (bytes_read == 0) {
-      break;
-    }
+static void k_readahead(open_file_t* of, uint16_t blk, size_t index, size_t n) {
+  if (of->offset != of->ra_next) {
+    of->ra_window = 0;  // a seek: wait for the next read to follow this one
+    of->ra_end = 0;
+    of->ra_next = of->offset + n;
+    return;
+  }
+  of->ra_next = of->offset + n;
+  if (FS_READAHEAD_BLOCKS == 0) {
+    return;
+  }
+  size_t window = of->ra_window == 0 ? FS_READAHEAD_MIN_BLOCKS
+                                     : 2 * (size_t)of->ra_window;
+  of->ra_window = window < FS_READAHEAD_BLOCKS ? window : FS_READAHEAD_BLOCKS;
 
-    bytes_written = k_write(output_fd, buffer, bytes_read);
+  size_t next = (of->offset + n + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+  if (next + of->ra_window / 2 <= of->ra_end) {
+    return;  // still far enough ahead
+  }
+  size_t blocks = (of->inode->size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+  size_t end = next + of->ra_window < blocks ? next + of->ra_window : blocks;
+  size_t from = of->ra_end > index ? of->ra_end : index;
+  if (from >= end) {
+    return;
+  }
 
-    if (bytes_written < 0 || bytes_written != bytes_read) {
-      {
-        char buf[128];
-        int len = snprintf(
-            buf, sizeof(buf),
-            "cat: Error writing to output destination (FD %d).\n", output_fd);
-        k_write(2, buf, len);
-      }
-      result = -1;
-      break;
+  for (; index < from && blk != 0 && blk != 0xFFFF; index++) {
+    KSTAT_INC(KSTAT_FAT_STEPS);
+    blk = FAT_TABLE[blk];
+  }
+  uint16_t run = blk;
+  size_t len = 0;
+  for (; index < end && blk != 0 && blk != 0xFFFF; index++, len++) {
+    if (blk != run + len) {
+      KSTAT_ADD(KSTAT_READAHEAD, k_bcache_prefetch(run, len));
+      run = blk;
+      len = 0;
     }
+    KSTAT_INC(KSTAT_FAT_STEPS);
+    blk = FAT_TABLE[blk];
   }
-  return result;
-}
\ No newline at end of file
+  if (len > 0) {
+    KSTAT_ADD(KSTAT_READAHEAD, k_bcache_prefetch(run, len));
+  }
+  of->ra_end = (uint32_t)index;
+}
+
+static uint16_t k_last_block(uint16_t first_block) {
+  uint16_t blk = first_block;
+  if (blk == 0) {
+    return 0;
+  }
+  while (FAT_TABLE[blk] != 0xFFFF && FAT_TABLE[blk] != 0) {
+    KSTAT_INC(KSTAT_FAT_STEPS);
+    blk = FAT_TABLE[blk];
+  }
+  return blk;
+}
+
+static int k_find_gdt_spot() {
+  if (GDT_FREE_LEN == 0) {
+    return -1;
+  }
+  return GDT_FREE[GDT_FREE_LEN - 1];
+}
+
+static bool k_gdt_valid(int kfd) {
+  return kfd >= 0 && kfd < MAX_GDT_ENTRY && GLOBAL_FD_TABLE[kfd] != NULL;
+}
+
+static int k_pipe_install(pipe_t* p, uint8_t flag) {
+  int fd = k_find_gdt_spot();
+  if (fd == -1) {
+    P_ERRNO = FS_GDT_FULL;
+    return -1;
+  }
+  open_file_t* of = malloc(sizeof(open_file_t));
+  if (of == NULL) {
+    P_ERRNO = FS_MALLOC_FAIL;
+    return -1;
+  }
+  open_file_init(of);
+  strcpy(of->name, "PIPE");
+  of->flag = flag;
+  k_pipe_attach(p, of);
+
+  GDT_FREE_LEN--;  // fd was the top of the free list
+  GLOBAL_FD_TABLE[fd] = of;
+  return fd;
+}
+
+static open_inode_t* k_inode_find(off_t dirent_offset) {
+  size_t bucket = (size_t)(dirent_offset / sizeof(dir_entry_t)) % INODE_BUCKETS;
+  open_inode_t* inode = INODE_TABLE[bucket];
+  while (inode != NULL && inode->dirent_offset != dirent_offset) {
+    inode = inode->hash_next;
+  }
+  return inode;
+}
+
+static open_inode_t* k_inode_get(off_t dirent_offset, const dir_entry_t* entry) {
+  open_inode_t* inode = k_inode_find(dirent_offset);
+  if (inode != NULL) {
+    inode->refs++;
+    return inode;
+  }
+
+  inode = (open_inode_t*)malloc(sizeof(open_inode_t));
+  if (inode == NULL) {
+    return NULL;
+  }
+  size_t bucket = (size_t)(dirent_offset / sizeof(dir_entry_t)) % INODE_BUCKETS;
+  inode->dirent_offset = dirent_offset;
+  inode->size = entry->size;
+  inode->first_block = entry->firstBlock;
+  inode->dirty = false;
+  inode->mtime = entry->mtime;
+  inode->refs = 1;
+  inode->writers = 0;
+  inode->generation = 0;
+  inode->hash_next = INODE_TABLE[bucket];
+  INODE_TABLE[bucket] = inode;
+  return inode;
+}
+
+static void k_inode_put(open_inode_t* inode) {
+  if (--inode->refs > 0) {
+    return;
+  }
+
+  size_t bucket =
+      (size_t)(inode->dirent_offset / sizeof(dir_entry_t)) % INODE_BUCKETS;
+  open_inode_t** link = &INODE_TABLE[bucket];
+  while (*link != inode) {
+    link = &(*link)->hash_next;
+  }
+  *link = inode->hash_next;
+  free(inode);
+}
+
+static bool k_have_write_opened(off_t dirent_offset) {
+  open_inode_t* inode = k_inode_find(dirent_offset);
+  return inode != NULL && inode->writers > 0;
+}
+
+static void k_free_fat_chain(uint16_t first_block) {
+  uint16_t blk = first_block;
+  FAT_FREED = FAT_FREED || (blk != 0 && blk != 0xFFFF);
+  while (blk != 0 && blk != 0xFFFF) {
+    uint16_t next = FAT_TABLE[blk];
+    k_fat_set(blk, 0x0000);
+    k_free_index_set(blk, true);
+    blk = next;
+  }
+}
+
+static void k_inode_dirty(open_inode_t* inode) {
+  inode->dirty = true;
+  inode->mtime = time(NULL);
+}
+
+static int k_update_dirent(open_inode_t* inode) {
+  dir_entry_t entry;
+  ssize_t written_bytes;
+
+  if (!inode->dirty) {
+    return FS_SUCCESS;
+  }
+  if (k_dirent_read(&entry, inode->dirent_offset) != sizeof(dir_entry_t)) {
+    P_ERRNO = FS_IO_ERROR;
+    return -1;
+  }
+
+  entry.firstBlock = inode->first_block;
+  entry.size = inode->size;
+  entry.mtime = inode->mtime;
+  written_bytes = k_dirent_write(&entry, inode->dirent_offset);
+
+  if (written_bytes != sizeof(dir_entry_t)) {
+    P_ERRNO = FS_IO_ERROR;
+    return -1;
+  }
+
+  inode->dirty = false;
+  return FS_SUCCESS;
+}
+
+static int k_sync_dirents(void) {
+  int result = FS_SUCCESS;
+  for (size_t i = 0; i < INODE_BUCKETS; i++) {
+    for (open_inode_t* inode = INODE_TABLE[i]; inode; inode = inode->hash_next) {
+      if (k_update_dirent(inode) != FS_SUCCESS) {
+        result = -1;
+      }
+    }
+  }
+  return result;
+}
+
+static bool k_is_file_still_open(off_t dirent_offset) {
+  return k_inode_find(dirent_offset) != NULL;
+}
+
+static void k_print_dirent(const dir_entry_t* entry) {
+  char buffer[256];
+  k_format_dirent(entry, buffer, sizeof(buffer));
+  if (strlen(buffer) > 0) {
+    k_write(1, buffer, strlen(buffer));
+  }
+}
+
+static int k_open_mode_read(const char* fname,
+                            off_t offset,
+                            open_file_t** new_of_out,
+                            bool found,
+                            dir_entry_t* entry) {
+  if (!found) {
+    P_ERRNO = FS_FILE_NOT_FOUND;
+    return -1;
+  }
+
+  k_dirent_read(entry, offset);
+
+  if (entry->type != 1) {
+    P_ERRNO = FS_NOT_A_FILE;
+    return -1;
+  }
+
+  if (!(entry->perm & 4)) {
+    P_ERRNO = FS_NO_PERMISSION;
+    return -1;
+  }
+
+  *new_of_out = (open_file_t*)malloc(sizeof(open_file_t));
+  if (*new_of_out == NULL) {
+    P_ERRNO = FS_MALLOC_FAIL;
+    return -1;
+  }
+
+  open_file_init(*new_of_out);
+
+  k_name_copy((*new_of_out)->name, fname);
+  (*new_of_out)->perm = entry->perm;
+  (*new_of_out)->inode = k_inode_get(offset, entry);
+  if ((*new_of_out)->inode == NULL) {
+    free(*new_of_out);
+    P_ERRNO = FS_MALLOC_FAIL;
+    return -1;
+  }
+  (*new_of_out)->flag = F_READ;
+
+  return FS_SUCCESS;
+}
+
+static int k_open_mode_write(const char* fname,
+                             off_t offset,
+                             open_file_t** new_of_out,
+                             bool found,
+                             dir_entry_t* entry) {
+  if (!found) {
+    // create a new directory entry structure in memory
+    memset(entry, 0, sizeof(dir_entry_t));
+    k_name_copy(entry->name, fname);
+    entry->type = 1;  // Regular File
+    entry->perm = 6;  // Read and Write
+
+    // Write the new directory entry to disk
+    if (k_dirent_write(entry, offset) !=
+        sizeof(dir_entry_t)) {
+      P_ERRNO = FS_IO_ERROR;
+      return -1;
+    }
+  } else {
+    k_dirent_read(entry, offset);
+    if (entry->type != 1) {
+      P_ERRNO = FS_NOT_A_FILE;
+      return -1;
+    }
+
+    if (!(entry->perm & 2)) {
+      P_ERRNO = FS_NO_PERMISSION;
+      return -1;
+    }
+
+    if (entry->size > 0) {
+      // readers of the old contents must not follow the freed chain
+      open_inode_t* inode = k_inode_find(offset);
+      if (inode != NULL) {
+        inode->first_block = 0;
+        inode->size = 0;
+        inode->generation++;
+      }
+      k_free_fat_chain(entry->firstBlock);
+      entry->size = 0;
+      entry->firstBlock = 0;
+      entry->mtime = time(NULL);
+
+      // Write the truncated entry back to disk
+      if (k_dirent_write(entry, offset) !=
+          sizeof(dir_entry_t)) {
+        P_ERRNO = FS_IO_ERROR;
+        return -1;
+      }
+    }
+  }
+
+  *new_of_out = (open_file_t*)malloc(sizeof(open_file_t));
+  if (*new_of_out == NULL) {
+    P_ERRNO = FS_MALLOC_FAIL;
+    return -1;
+  }
+
+  open_file_init(*new_of_out);
+  k_name_copy((*new_of_out)->name, fname);
+  (*new_of_out)->inode = k_inode_get(offset, entry);
+  if ((*new_of_out)->inode == NULL) {
+    free(*new_of_out);
+    P_ERRNO = FS_MALLOC_FAIL;
+    return -1;
+  }
+  (*new_of_out)->flag = F_WRITE;
+  (*new_of_out)->offset = 0;
+  (*new_of_out)->perm = entry->perm;
+
+  return FS_SUCCESS;
+}
+
+static int k_open_mode_append(const char* fname,
+                              off_t offset,
+                              open_file_t** new_of_out,
+                              bool found,
+                              dir_entry_t* entry) {
+  if (!found) {
+    memset(entry, 0, sizeof(dir_entry_t));
+    k_name_copy(entry->name, fname);
+    entry->type = 1;
+    entry->perm = 6;
+    if (k_dirent_write(entry, offset) !=
+        sizeof(dir_entry_t)) {
+      P_ERRNO = FS_IO_ERROR;
+      return -1;
+    }
+  } else {
+    k_dirent_read(entry, offset);
+    if (entry->type != 1) {
+      P_ERRNO = FS_NOT_A_FILE;
+      return -1;
+    }
+    if (!(entry->perm & 2)) {
+      P_ERRNO = FS_NO_PERMISSION;
+      return -1;
+    }
+  }
+
+  *new_of_out = (open_file_t*)malloc(sizeof(open_file_t));
+  if (*new_of_out == NULL) {
+    P_ERRNO = FS_MALLOC_FAIL;
+    return -1;
+  }
+
+  open_file_init(*new_of_out);
+  k_name_copy((*new_of_out)->name, fname);
+  (*new_of_out)->inode = k_inode_get(offset, entry);
+  if ((*new_of_out)->inode == NULL) {
+    free(*new_of_out);
+    P_ERRNO = FS_MALLOC_FAIL;
+    return -1;
+  }
+  (*new_of_out)->flag = F_APPEND;
+  (*new_of_out)->perm = entry->perm;
+
+  // set offset to the current file size (the inode's, if already open)
+  (*new_of_out)->offset = (*new_of_out)->inode->size;
+
+  return FS_SUCCESS;
+}
+
+static int k_host_read_to_pennfat_write(const char* host_path, int pennfat_fd) {
+  int host_fd = open(host_path, O_RDONLY);
+  if (host_fd == -1) {
+    perror("cp: Cannot open host source file");
+    return -1;
+  }
+
+  int result = 0;
+  if (k_transfer(pennfat_fd, false, host_fd, true, SIZE_MAX) < 0) {
+    const char* msg = "cp: Error writing to PennFAT destination.\n";
+    k_write(2, msg, strlen(msg));
+    result = -1;
+  }
+
+  close(host_fd);
+  return result;
+}
+
+static int k_pennfat_read_to_host_write(int pennfat_fd, const char* host_path) {
+  // Open/Create the destination file on the host OS
+  int host_fd = open(host_path, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+  if (host_fd == -1) {
+    perror("cp: Cannot create/open host destination file");
+    return -1;
+  }
+
+  int result = 0;
+  if (k_transfer(host_fd, true, pennfat_fd, false, SIZE_MAX) < 0) {
+    const char* msg = "cp: Error copying to host destination.\n";
+    k_write(2, msg, strlen(msg));
+    result = -1;
+  }
+
+  close(host_fd);
+  return result;
+}
+
+static int copy_stream_content(int input_fd, int output_fd) {
+  if (k_transfer(output_fd, false, input_fd, false, SIZE_MAX) < 0) {
+    char buf[128];
+    int len = snprintf(buf, sizeof(buf), "cat: Error copying FD %d to FD %d.\n",
+                       input_fd, output_fd);
+    k_write(2, buf, len);
+    return -1;
+  }
+  return 0;
+}
+
+static ssize_t k_transfer(int out_fd,
+                          bool out_host,
+                          int in_fd,
+                          bool in_host,
+                          size_t count) {
+  // with a mapped image, PennFAT sources are written out of the mapping, a
+  // whole contiguous run at a time
+  bool mapped =
+      FS_IMAGE_MAP != NULL && !in_host && in_fd > 2 && !k_is_pipe(in_fd);
+  char* buffer = NULL;
+  if (!mapped) {
+    buffer = malloc(SENDFILE_CHUNK);
+    if (buffer == NULL) {
+      P_ERRNO = FS_MALLOC_FAIL;
+      return -1;
+    }
+  }
+
+  size_t done = 0;
+  bool failed = false;
+  while (done < count) {
+    size_t want = count - done < SENDFILE_CHUNK ? count - done : SENDFILE_CHUNK;
+    const char* data = buffer;
+    ssize_t got;
+    if (mapped) {
+      got = k_read_mapped(in_fd, count - done, &data);
+    } else if (in_host) {
+      got = read(in_fd, buffer, want);
+      if (got < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        P_ERRNO = FS_IO_ERROR;
+      }
+    } else {
+      got = k_read(in_fd, (int)want, buffer);
+    }
+    if (got < 0) {
+      failed = true;
+      break;
+    }
+    if (got == 0) {
+      break;  // end of input
+    }
+
+    if (k_write_all(out_fd, out_host, data, (size_t)got) != 0) {
+      failed = true;
+      break;
+    }
+    done += (size_t)got;
+  }
+
+  free(buffer);
+  return failed ? -1 : (ssize_t)done;
+}
+
+static int k_write_all(int fd, bool host, const char* data, size_t len) {
+  while (len > 0) {
+    int chunk = len < INT_MAX ? (int)len : INT_MAX;
+    ssize_t n = host ? write(fd, data, chunk) : k_write(fd, data, chunk);
+    if (n < 0 && host && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      if (host) {
+        P_ERRNO = FS_IO_ERROR;
+      } else if (n == 0) {
+        P_ERRNO = FS_DISK_FULL;  // k_write() stops short only then
+      }
+      return -1;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+static int k_open_locked(const char* fname, int mode) {
+  if (!IS_FS_MOUNTED) {
+    P_ERRNO = FS_NOT_MOUNTED;
+    return -1;
+  }
+  if (mode != F_WRITE && mode != F_READ && mode != F_APPEND) {
+    P_ERRNO = FS_INVALID_MODE;
+    return -1;
+  }
+
+  int fd = k_find_gdt_spot();
+  if (fd == -1) {
+    P_ERRNO = FS_GDT_FULL;
+    return -1;
+  }
+
+  path_ref_t ref;
+  if (k_path_parent(fname, &ref) != FS_SUCCESS) {
+    return -1;
+  }
+  if (ref.name[0] == '\0') {
+    P_ERRNO = FS_NOT_A_FILE;  // names a directory
+    return -1;
+  }
+  off_t offset = 0;
+  bool found = k_dir_find(ref.dir, ref.name, &offset);
+
+  // If file not found and directory is full, try to extend it.
+  if (!found && offset == -1) {
+    offset = k_extend_dir(ref.dir);
+    if (offset == -1) {
+      P_ERRNO = FS_DISK_FULL;
+      return -1;
+    }
+  }
+
+  open_file_t* new_of = NULL;
+  dir_entry_t entry;
+  int result = FS_SUCCESS;
+
+  // check for multiple write
+  if (found && (mode == F_WRITE || mode == F_APPEND)) {
+    if (k_have_write_opened(offset)) {
+      P_ERRNO = FS_FILE_IN_USE;
+      return -1;
+    }
+  }
+
+  if (mode == F_READ) {
+    result = k_open_mode_read(ref.name, offset, &new_of, found, &entry);
+  } else if (mode == F_WRITE) {
+    result = k_open_mode_write(ref.name, offset, &new_of, found, &entry);
+  } else if (mode == F_APPEND) {
+    result = k_open_mode_append(ref.name, offset, &new_of, found, &entry);
+  } else {
+    P_ERRNO = FS_INVALID_MODE;
+    return -1;
+  }
+  if (result != FS_SUCCESS) {
+    // allocation failed inside the mode function
+    return -1;
+  }
+  if (mode != F_READ) {
+    new_of->inode->writers++;
+    k_reserve_extent(new_of, k_last_block(new_of->inode->first_block));
+  }
+  GDT_FREE_LEN--;  // fd was the top of the free list
+  GLOBAL_FD_TABLE[fd] = new_of;
+  return fd;
+}
+
+static int k_unlink_locked(const char* fname) {
+  if (!IS_FS_MOUNTED) {
+    P_ERRNO = FS_NOT_MOUNTED;
+    return -1;
+  }
+
+  off_t dirent_off;
+  bool found = k_find_file(fname, &dirent_off);
+  if (!found) {
+    P_ERRNO = FS_FILE_NOT_FOUND;
+    return -1;
+  }
+  return k_unlink_dirent(dirent_off);
+}
+
+static int k_unlink_dirent(off_t dirent_off) {
+  dir_entry_t entry;
+  ssize_t n = k_dirent_read(&entry, dirent_off);
+  if (n != (ssize_t)sizeof(entry)) {
+    P_ERRNO = FS_IO_ERROR;
+    return -1;
+  }
+  if (entry.type == 2) {  // directory: see k_rmdir()
+    P_ERRNO = FS_NOT_A_FILE;
+    return -1;
+  }
+
+  // See if this file is still referenced by some other fds.
+  if (k_is_file_still_open(dirent_off)) {
+    // deleted-but-still-in-use. Mark as 2.
+    entry.name[0] = 2;
+    n = k_dirent_write(&entry, dirent_off);
+    if (n != (ssize_t)sizeof(entry)) {
+      P_ERRNO = FS_IO_ERROR;
+      return -1;
+    }
+  } else {
+    // No other fds using this file, can do the cleaning.
+    k_free_fat_chain(entry.firstBlock);
+    entry.name[0] = 1;  // mark as 1.
+    n = k_dirent_write(&entry, dirent_off);
+    if (n != (ssize_t)sizeof(entry)) {
+      P_ERRNO = FS_IO_ERROR;
+      return -1;
+    }
+  }
+  return FS_SUCCESS;
+}
+
+static int k_chmod_locked(const char* fname, uint8_t new_perm) {
+  if (!IS_FS_MOUNTED) {
+    P_ERRNO = FS_NOT_MOUNTED;
+    return -1;
+  }
+
+  off_t dir_entry_disk_offset = 0;
+
+  if (!k_find_file(fname, &dir_entry_disk_offset)) {
+    P_ERRNO = FS_FILE_NOT_FOUND;
+    return -1;
+  }
+
+  dir_entry_t entry;
+
+  if (k_dirent_read(&entry, dir_entry_disk_offset) != sizeof(dir_entry_t)) {
+    P_ERRNO = FS_IO_ERROR;
+    return -1;
+  }
+
+  // entry.perm = new_perm;
+
+  uint8_t op_add = 0x80;     // Flag: add permission
+  uint8_t op_remove = 0x40;  // Flag: remove permission
+  uint8_t op_assign = 0x20;  // Flag: assign permission (=)
+  uint8_t val_mask = 0x07;   // Valid permission bits (rwx)
+
+  if (new_perm & op_add) {
+    // Mode: + (add)
+    // Keep original permissions and add new bits
+    entry.perm |= (new_perm & val_mask);
+  } else if (new_perm & op_remove) {
+    // Mode: - (remove)
+    // Keep original permissions and remove specified bits
+    entry.perm &= ~(new_perm & val_mask);
+  } else if (new_perm & op_assign) {
+    // Mode: = (assign)
+    // Directly set new permissions
+    entry.perm = (new_perm & val_mask);
+  } else {
+    // Mode: numeric (assign)
+    entry.perm = (new_perm & val_mask);
+  }
+
+  entry.mtime = time(NULL);
+
+  if (k_dirent_write(&entry, dir_entry_disk_offset) !=
+      sizeof(dir_entry_t)) {
+    P_ERRNO = FS_IO_ERROR;
+    return -1;
+  }
+
+  return FS_SUCCESS;
+}
+
+static int k_mv_locked(const char* source, const char* dest) {
+  if (!IS_FS_MOUNTED) {
+    P_ERRNO = FS_NOT_MOUNTED;
+    return -1;
+  }
+
+  path_ref_t src_ref;
+  path_ref_t dest_ref;
+  if (k_path_parent(source, &src_ref) != FS_SUCCESS) {
+    return -1;
+  }
+  if (src_ref.name[0] == '\0' || strcmp(src_ref.name, "..") == 0) {
+    P_ERRNO = FS_INVALID_ARG;  // a directory is moved by its own name
+    return -1;
+  }
+
+  // check if the source file exists
+  off_t source_offset = 0;
+  if (!k_dir_find(src_ref.dir, src_ref.name, &source_offset)) {
+    P_ERRNO = FS_FILE_NOT_FOUND;
+    return -1;
+  }
+  if (k_path_parent(dest, &dest_ref) != FS_SUCCESS) {
+    return -1;
+  }
+
+  dir_entry_t source_dirent;
+  if (k_dirent_read(&source_dirent, source_offset) != sizeof(dir_entry_t)) {
+    P_ERRNO = FS_IO_ERROR;
+    return -1;
+  }
+  if (!(source_dirent.perm & 4)) {
+    P_ERRNO = FS_NO_PERMISSION;
+    return -1;
+  }
+
+  // an existing directory as the destination: move into it, same name
+  dir_index_t* dest_dir = dest_ref.dir;
+  off_t dest_offset = 0;
+  dir_entry_t dest_dirent;
+  if (dest_ref.name[0] == '\0') {
+    strcpy(dest_ref.name, src_ref.name);
+  } else if (k_dir_find(dest_dir, dest_ref.name, &dest_offset)) {
+    if (k_dirent_read(&dest_dirent, dest_offset) != sizeof(dir_entry_t)) {
+      P_ERRNO = FS_IO_ERROR;
+      return -1;
+    }
+    if (dest_dirent.type == 2) {
+      dest_dir = k_dir_index_get(dest_dirent.firstBlock);
+      if (dest_dir == NULL) {
+        return -1;
+      }
+      strcpy(dest_ref.name, src_ref.name);
+    }
+  }
+
+  bool found = k_dir_find(dest_dir, dest_ref.name, &dest_offset);
+  if (found && dest_offset == source_offset) {
+    return FS_SUCCESS;  // onto itself
+  }
+  if (dest_dir != src_ref.dir) {
+    // the entry changes place, and open files are known by that place
+    if (k_is_file_still_open(source_offset)) {
+      P_ERRNO = FS_FILE_IN_USE;
+      return -1;
+    }
+    if (source_dirent.type == 2) {
+      int inside = k_mv_is_ancestor(source_dirent.firstBlock, dest_dir);
+      if (inside != 0) {
+        if (inside > 0) {
+          P_ERRNO = FS_INVALID_ARG;
+        }
+        return -1;
+      }
+    }
+  }
+
+  // check if the destination file already exists
+  if (found) {
+    if (k_dirent_read(&dest_dirent, dest_offset) != sizeof(dir_entry_t)) {
+      P_ERRNO = FS_IO_ERROR;
+      return -1;
+    }
+    if (dest_dirent.type == 2) {
+      P_ERRNO = FS_FILE_EXISTS;  // a directory is never replaced
+      return -1;
+    }
+    if (source_dirent.type == 2) {
+      P_ERRNO = FS_NOT_A_DIR;
+      return -1;
+    }
+    if (!(dest_dirent.perm & 2)) {
+      P_ERRNO = FS_NO_PERMISSION;
+      return -1;
+    }
+    if (k_unlink_dirent(dest_offset) < 0) {
+      return -1;
+    }
+  }
+
+  k_name_copy(source_dirent.name, dest_ref.name);
+  source_dirent.mtime = time(NULL);
+
+  if (dest_dir == src_ref.dir) {
+    // a rename in place
+    if (k_dirent_write(&source_dirent, source_offset) !=
+        sizeof(dir_entry_t)) {
+      P_ERRNO = FS_IO_ERROR;
+      return -1;
+    }
+    return FS_SUCCESS;
+  }
+
+  // into another directory: a new entry there, the old one deleted
+  k_dir_find(dest_dir, dest_ref.name, &dest_offset);
+  if (dest_offset == -1) {
+    dest_offset = k_extend_dir(dest_dir);
+    if (dest_offset == -1) {
+      P_ERRNO = FS_DISK_FULL;
+      return -1;
+    }
+  }
+  if (k_dirent_write(&source_dirent, dest_offset) != sizeof(dir_entry_t)) {
+    P_ERRNO = FS_IO_ERROR;
+    return -1;
+  }
+  dir_entry_t old = source_dirent;
+  old.name[0] = 1;
+  if (k_dirent_write(&old, source_offset) != sizeof(dir_entry_t)) {
+    P_ERRNO = FS_IO_ERROR;
+    return -1;
+  }
+
+  if (source_dirent.type == 2) {
+    // a moved directory has a new parent
+    dir_index_t* moved = k_dir_index_get(source_dirent.firstBlock);
+    off_t up = moved != NULL ? k_dir_lookup(moved, "..") : -1;
+    if (up == -1 || k_dirent_read(&old, up) != sizeof(dir_entry_t)) {
+      P_ERRNO = FS_IO_ERROR;
+      return -1;
+    }
+    old.firstBlock = dest_dir->first_block;
+    if (k_dirent_write(&old, up) != sizeof(dir_entry_t)) {
+      P_ERRNO = FS_IO_ERROR;
+      return -1;
+    }
+  }
+  return FS_SUCCESS;
+}
+
+static int k_mv_is_ancestor(uint16_t first_block, dir_index_t* dest) {
+  size_t steps = 0;
+  while (dest->first_block != 1 && steps++ < FREE_LIMIT) {
+    if (dest->first_block == first_block) {
+      return 1;
+    }
+    off_t up = k_dir_lookup(dest, "..");
+    dir_entry_t entry;
+    if (up == -1 || k_dirent_read(&entry, up) != sizeof(dir_entry_t)) {
+      P_ERRNO = FS_IO_ERROR;
+      return -1;
+    }
+    dest = k_dir_index_get(entry.firstBlock);
+    if (dest == NULL) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int k_mkdir_locked(const char* path) {
+  if (!IS_FS_MOUNTED) {
+    P_ERRNO = FS_NOT_MOUNTED;
+    return -1;
+  }
+
+  path_ref_t ref;
+  if (k_path_parent(path, &ref) != FS_SUCCESS) {
+    return -1;
+  }
+  off_t offset = 0;
+  if (ref.name[0] == '\0' || k_dir_find(ref.dir, ref.name, &offset)) {
+    P_ERRNO = FS_FILE_EXISTS;
+    return -1;
+  }
+  if (offset == -1) {
+    offset = k_extend_dir(ref.dir);
+    if (offset == -1) {
+      P_ERRNO = FS_DISK_FULL;
+      return -1;
+    }
+  }
+
+  uint16_t blk = k_alloc_block();
+  if (blk == 0) {
+    P_ERRNO = FS_DISK_FULL;
+    return -1;
+  }
+  char zero_buf[FS_BLOCK_SIZE];
+  memset(zero_buf, 0, FS_BLOCK_SIZE);
+  off_t blk_off = FS_FAT_SIZE + (blk - 1) * FS_BLOCK_SIZE;
+  k_bcache_write(zero_buf, FS_BLOCK_SIZE, blk_off);
+
+  // "." and "..", then the entry in the parent
+  dir_entry_t entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.type = 2;
+  entry.perm = 7;
+  entry.mtime = time(NULL);
+  strcpy(entry.name, ".");
+  entry.firstBlock = blk;
+  if (k_dirent_write(&entry, blk_off) != sizeof(dir_entry_t)) {
+    P_ERRNO = FS_IO_ERROR;
+    return -1;
+  }
+  strcpy(entry.name, "..");
+  entry.firstBlock = ref.dir->first_block;
+  if (k_dirent_write(&entry, blk_off + sizeof(dir_entry_t)) !=
+      sizeof(dir_entry_t)) {
+    P_ERRNO = FS_IO_ERROR;
+    return -1;
+  }
+  strcpy(entry.name, ref.name);
+  entry.firstBlock = blk;
+  if (k_dirent_write(&entry, offset) != sizeof(dir_entry_t)) {
+    P_ERRNO = FS_IO_ERROR;
+    return -1;
+  }
+  return FS_SUCCESS;
+}
+
+static int k_rmdir_locked(const char* path) {
+  if (!IS_FS_MOUNTED) {
+    P_ERRNO = FS_NOT_MOUNTED;
+    return -1;
+  }
+
+  path_ref_t ref;
+  if (k_path_parent(path, &ref) != FS_SUCCESS) {
+    return -1;
+  }
+  if (ref.name[0] == '\0' || strcmp(ref.name, "..") == 0) {
+    P_ERRNO = FS_INVALID_ARG;  // the root, or named through "." / ".."
+    return -1;
+  }
+  off_t dirent_off;
+  if (!k_dir_find(ref.dir, ref.name, &dirent_off)) {
+    P_ERRNO = FS_FILE_NOT_FOUND;
+    return -1;
+  }
+  dir_entry_t entry;
+  if (k_dirent_read(&entry, dirent_off) != sizeof(dir_entry_t)) {
+    P_ERRNO = FS_IO_ERROR;
+    return -1;
+  }
+  if (entry.type != 2) {
+    P_ERRNO = FS_NOT_A_DIR;
+    return -1;
+  }
+  if (entry.firstBlock == FS_CWD) {
+    P_ERRNO = FS_FILE_IN_USE;
+    return -1;
+  }
+
+  dir_index_t* dir = k_dir_index_get(entry.firstBlock);
+  if (dir == NULL) {
+    return -1;
+  }
+  dir_entry_t child;
+  for (size_t pos = 0; pos < dir->end; pos++) {
+    off_t off = FS_FAT_SIZE +
+                (dir->blocks[pos / FS_ENTRY_PER_BLK] - 1) * FS_BLOCK_SIZE +
+                (pos % FS_ENTRY_PER_BLK) * sizeof(dir_entry_t);
+    k_dirent_read(&child, off);
+    if (child.name[0] == 2) {
+      P_ERRNO = FS_FILE_IN_USE;  // a removed file that is still open
+      return -1;
+    }
+    if (child.name[0] != 1 && strcmp(child.name, ".") != 0 &&
+        strcmp(child.name, "..") != 0) {
+      P_ERRNO = FS_DIR_NOT_EMPTY;
+      return -1;
+    }
+  }
+
+  k_dir_index_drop(dir);
+  k_free_fat_chain(entry.firstBlock);
+  entry.name[0] = 1;
+  if (k_dirent_write(&entry, dirent_off) != sizeof(dir_entry_t)) {
+    P_ERRNO = FS_IO_ERROR;
+    return -1;
+  }
+  return FS_SUCCESS;
+}
+
+static int k_defrag_locked(size_t* moved) {
+  if (!IS_FS_MOUNTED) {
+    P_ERRNO = FS_NOT_MOUNTED;
+    return -1;
+  }
+  for (int i = 3; i < MAX_GDT_ENTRY; i++) {
+    if (GLOBAL_FD_TABLE[i] != NULL) {
+      P_ERRNO = FS_FILE_IN_USE;
+      return -1;
+    }
+  }
+
+  defrag_state_t st = {
+      .prev = calloc(FREE_LIMIT, sizeof(uint16_t)),
+      .owner = malloc(FREE_LIMIT * sizeof(int32_t)),
+      .buf_a = malloc(FS_BLOCK_SIZE),
+      .buf_b = malloc(FS_BLOCK_SIZE),
+  };
+  int result = FS_SUCCESS;
+  size_t count = 0;
+  int32_t* parent = NULL;  // per file: the directory holding its entry
+  size_t* slot = NULL;     // per file: position of its entry in there
+  bool* is_dir = NULL;
+  if (!st.prev || !st.owner || !st.buf_a || !st.buf_b) {
+    P_ERRNO = FS_MALLOC_FAIL;
+    result = -1;
+    goto out;
+  }
+
+  // reverse links
+  for (size_t b = 0; b < FREE_LIMIT; b++) {
+    st.owner[b] = -1;
+    uint16_t next = FAT_TABLE[b];
+    if (b != 0 && next != 0 && next != 0xFFFF && next < FREE_LIMIT) {
+      st.prev[next] = (uint16_t)b;
+    }
+  }
+
+  // The chain head of every file, breadth first: the root directory (file
+  // 0), then the entries of every directory in directory order. "." and
+  // ".." are not files of their own; they are fixed up at the end.
+  size_t cap = 64;
+  st.heads = malloc(cap * sizeof(uint16_t));
+  parent = malloc(cap * sizeof(int32_t));
+  slot = malloc(cap * sizeof(size_t));
+  is_dir = malloc(cap * sizeof(bool));
+  if (!st.heads || !parent || !slot || !is_dir) {
+    P_ERRNO = FS_MALLOC_FAIL;
+    result = -1;
+    goto out;
+  }
+  st.heads[0] = 1;
+  parent[0] = 0;
+  slot[0] = 0;
+  is_dir[0] = true;
+  st.owner[1] = 0;
+  size_t nfiles = 1;
+  dir_entry_t entry;
+  for (size_t d = 0; d < nfiles; d++) {
+    if (!is_dir[d]) {
+      continue;
+    }
+    size_t pos = 0;
+    size_t steps = 0;
+    for (uint16_t blk = st.heads[d];
+         blk != 0xFFFF && blk != 0 && steps++ < FREE_LIMIT;
+         blk = FAT_TABLE[blk]) {
+      for (int i = 0; i < FS_ENTRY_PER_BLK; i++, pos++) {
+        off_t off =
+            FS_FAT_SIZE + (blk - 1) * FS_BLOCK_SIZE + i * sizeof(dir_entry_t);
+        k_bcache_read(&entry, sizeof(entry), off);
+        if (entry.name[0] == 1 || entry.name[0] == 0) {
+          continue;  // later slots may still be in use after a crash
+        }
+        if (d != 0 &&
+            (strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0)) {
+          continue;
+        }
+        bool valid = entry.firstBlock != 0 && entry.firstBlock < FREE_LIMIT;
+        if (entry.type == 2 && (!valid || st.owner[entry.firstBlock] >= 0)) {
+          continue;  // a directory reached twice: only follow it once
+        }
+        if (nfiles == cap) {
+          cap *= 2;
+          uint16_t* heads = realloc(st.heads, cap * sizeof(uint16_t));
+          st.heads = heads ? heads : st.heads;
+          int32_t* parents = realloc(parent, cap * sizeof(int32_t));
+          parent = parents ? parents : parent;
+          size_t* slots = realloc(slot, cap * sizeof(size_t));
+          slot = slots ? slots : slot;
+          bool* dirs = realloc(is_dir, cap * sizeof(bool));
+          is_dir = dirs ? dirs : is_dir;
+          if (!heads || !parents || !slots || !dirs) {
+            P_ERRNO = FS_MALLOC_FAIL;
+            result = -1;
+            goto out;
+          }
+        }
+        if (valid) {
+          st.owner[entry.firstBlock] = (int32_t)nfiles;
+        }
+        st.heads[nfiles] = entry.firstBlock;
+        parent[nfiles] = (int32_t)d;
+        slot[nfiles] = pos;
+        is_dir[nfiles] = entry.type == 2;
+        nfiles++;
+      }
+    }
+  }
+  int32_t cwd_file = FS_CWD < FREE_LIMIT ? st.owner[FS_CWD] : -1;
+
+  // Lay the chains out back to back in that order: the root directory
+  // first (block 1 is already in place), then every file. Blocks before
+  // `target` are final.
+  uint16_t target = 1;
+  for (size_t f = 0; f < nfiles && result == FS_SUCCESS; f++) {
+    uint16_t cur = st.heads[f];
+    size_t steps = 0;
+    while (cur != 0 && cur != 0xFFFF && steps++ < FREE_LIMIT) {
+      if (cur != target) {
+        if (k_defrag_swap(&st, cur, target) != FS_SUCCESS) {
+          result = -1;
+          break;
+        }
+        cur = target;
+        count++;
+      }
+      cur = FAT_TABLE[cur];
+      target++;
+    }
+  }
+
+  // the directories moved too, so rewrite every entry's first block (and
+  // "." and "..") in order
+  size_t file = 1;
+  for (size_t d = 0; d < nfiles; d++) {
+    if (!is_dir[d]) {
+      continue;
+    }
+    size_t pos = 0;
+    size_t steps = 0;
+    for (uint16_t blk = st.heads[d];
+         blk != 0xFFFF && blk != 0 && steps++ < FREE_LIMIT;
+         blk = FAT_TABLE[blk], pos += FS_ENTRY_PER_BLK) {
+      off_t blk_off = FS_FAT_SIZE + (blk - 1) * FS_BLOCK_SIZE;
+      for (int i = 0; d != 0 && pos == 0 && i < FS_ENTRY_PER_BLK; i++) {
+        off_t off = blk_off + i * sizeof(dir_entry_t);
+        k_bcache_read(&entry, sizeof(entry), off);
+        if (strcmp(entry.name, ".") == 0) {
+          entry.firstBlock = st.heads[d];
+        } else if (strcmp(entry.name, "..") == 0) {
+          entry.firstBlock = st.heads[parent[d]];
+        } else {
+          continue;
+        }
+        k_bcache_write(&entry, sizeof(entry), off);
+      }
+      while (file < nfiles && parent[file] == (int32_t)d &&
+             slot[file] < pos + FS_ENTRY_PER_BLK) {
+        off_t off =
+            blk_off + (slot[file] - pos) * sizeof(dir_entry_t);
+        k_bcache_read(&entry, sizeof(entry), off);
+        entry.firstBlock = st.heads[file++];
+        k_bcache_write(&entry, sizeof(entry), off);  // index rebuilt below
+      }
+    }
+    while (file < nfiles && parent[file] == (int32_t)d) {
+      file++;  // its chain ended early; those entries are gone
+    }
+  }
+  FS_CWD = cwd_file >= 0 ? st.heads[cwd_file] : 1;
+  FREE_CURSOR = target < FREE_LIMIT ? target : 1;
+  if (k_dir_index_build() != FS_SUCCESS) {
+    result = -1;
+  }
+
+out:
+  free(st.prev);
+  free(st.owner);
+  free(st.heads);
+  free(st.buf_a);
+  free(st.buf_b);
+  free(parent);
+  free(slot);
+  free(is_dir);
+  if (moved) {
+    *moved = count;
+  }
+  return result;
+}
+
+static ssize_t k_write_locked(open_file_t* file_data, const char* str, int n) {
+  open_inode_t* inode = file_data->inode;
+  uint64_t current_offset = file_data->offset;
+  uint16_t current_block_num = inode->first_block;
+  uint32_t old_file_size = inode->size;
+
+  ssize_t total_bytes_written = 0;
+
+  size_t block_index = current_offset / FS_BLOCK_SIZE;
+  size_t byte_in_block = current_offset % FS_BLOCK_SIZE;
+
+  // An offset on a block boundary is treated as the end of the previous
+  // block, so that the loop below steps (or grows the chain) into the next.
+  if (byte_in_block == 0 && current_offset > 0) {
+    block_index -= 1;
+    byte_in_block = FS_BLOCK_SIZE;
+  }
+  // Traverse to the starting block
+  if (current_block_num != 0) {  // Only traverse if the file has blocks
+    current_block_num = k_seek_block(file_data, block_index);
+    if (current_block_num == 0) {
+      // If hit EOF while skipping, the offset is invalid
+      P_ERRNO = FS_INVALID_OFFSET;
+      return -1;
+    }
+  } else {
+    block_index = 0;
+  }
+
+  while (total_bytes_written < n) {
+    uint16_t next_block_num;
+    if (current_block_num != 0 && byte_in_block == FS_BLOCK_SIZE &&
+        FAT_TABLE[current_block_num] != 0xFFFF) {
+      // overwriting inside the file: move on to the existing next block
+      KSTAT_INC(KSTAT_FAT_STEPS);
+      current_block_num = FAT_TABLE[current_block_num];
+      block_index++;
+      byte_in_block = 0;
+    }
+    //  Check if current block needs allocation/extension
+    if (current_block_num == 0 || byte_in_block == FS_BLOCK_SIZE) {
+      // Find a free block (already marked as end of chain)
+      next_block_num = k_alloc_file_block(file_data, current_block_num);
+      if (next_block_num == 0) {
+        // Disk full, stop writing
+        k_write(1, "Disk is full\n", strlen("Disk is full\n"));
+        break;
+      }
+
+      if (current_block_num == 0) {
+        // This is the first block being written
+        inode->first_block = next_block_num;
+        k_inode_dirty(inode);
+      } else {
+        k_fat_set(current_block_num, next_block_num);
+        block_index++;
+      }
+
+      // Set up the new block's metadata
+      current_block_num = next_block_num;
+      byte_in_block = 0;
+    }
+
+    // Calculate Write Size
+    size_t block_remaining = FS_BLOCK_SIZE - byte_in_block;
+    size_t requested_remaining = n - total_bytes_written;
+    size_t bytes_to_write = (block_remaining < requested_remaining)
+                                ? block_remaining
+                                : requested_remaining;
+    off_t block_disk_offset =
+        FS_FAT_SIZE + (current_block_num - 1) * FS_BLOCK_SIZE;
+
+    // Grow the transfer over every following block that is physically
+    // adjacent (existing or newly allocated), so a contiguous chain is
+    // written with a single cache request. A non-adjacent new block stays linked
+    // and is picked up by the next iteration.
+    size_t run_blocks = 1;
+    while (bytes_to_write < requested_remaining) {
+      KSTAT_INC(KSTAT_FAT_STEPS);
+      uint16_t next = FAT_TABLE[current_block_num];
+      if (next == 0xFFFF) {
+        next = k_alloc_file_block(file_data, current_block_num);
+        if (next == 0) {
+          break;  // disk full: the next iteration reports it
+        }
+        k_fat_set(current_block_num, next);
+      }
+      if (next != current_block_num + 1) {
+        break;
+      }
+      current_block_num = next;
+      block_index++;
+      run_blocks++;
+      size_t more = requested_remaining - bytes_to_write;
+      bytes_to_write += (more < FS_BLOCK_SIZE) ? more : FS_BLOCK_SIZE;
+    }
+
+    // Write
+
+    ssize_t bytes_written_this_step = k_bcache_write(
+        str + total_bytes_written,  // Buffer offset
+        bytes_to_write,
+        block_disk_offset + byte_in_block  // Disk offset + byte within block
+    );
+
+    if (bytes_written_this_step <= 0) {
+      // Error, return bytes written so far (or error code if nothing written)
+      return (total_bytes_written > 0) ? total_bytes_written
+                                       : bytes_written_this_step;
+    }
+
+    // D. Update Counters
+    total_bytes_written += bytes_written_this_step;
+    if ((size_t)bytes_written_this_step < bytes_to_write) {
+      // short write of the image: keep what made it, cursor untouched
+      file_data->offset += total_bytes_written;
+      if (file_data->offset > old_file_size) {
+        inode->size = file_data->offset;
+        k_inode_dirty(inode);
+      }
+      return total_bytes_written;
+    }
+    byte_in_block += bytes_to_write - (run_blocks - 1) * FS_BLOCK_SIZE;
+
+    // Move to the next block in the FAT chain if necessary
+
+    // if (byte_in_block == FS_BLOCK_SIZE) {
+    //   current_block_num = FAT_TABLE[current_block_num];
+    // }
+  }
+
+  if (current_block_num != 0) {
+    file_data->cur_block = current_block_num;
+    file_data->cur_index = block_index;
+    file_data->cur_gen = inode->generation;
+  }
+  file_data->offset += total_bytes_written;
+
+  // Update size if the offset grew beyond the old file size
+  if (file_data->offset > old_file_size) {
+    inode->size = file_data->offset;
+    k_inode_dirty(inode);
+  }
+
+  return total_bytes_written;
+}
+
+static int k_close_locked(int kfd) {
+  open_file_t* of = GLOBAL_FD_TABLE[kfd];
+
+  // remove of entry from gdt and drop its inode reference first, so that
+  // k_is_file_still_open() only sees the other descriptors of this file.
+  GLOBAL_FD_TABLE[kfd] = NULL;
+  GDT_FREE[GDT_FREE_LEN++] = kfd;
+  k_release_extent(of);
+
+  open_inode_t* inode = of->inode;
+  off_t dirent_off = inode->dirent_offset;
+  uint32_t size = inode->size;
+  uint16_t first_block = inode->first_block;
+  bool writer = of->flag & (F_WRITE | F_APPEND);
+  bool dirty = inode->dirty;
+  time_t mtime = inode->mtime;
+  if (writer) {
+    inode->writers--;
+  }
+  inode->dirty = false;  // written back below
+  k_inode_put(inode);
+
+  dir_entry_t entry;
+  ssize_t n = k_dirent_read(&entry, dirent_off);
+  if (n != (ssize_t)sizeof(entry)) {  // really should not happen
+    free(of);
+    P_ERRNO = FS_IO_ERROR;
+    return -1;
+  }
+
+  if (writer || dirty) {
+    // k_write() only updated the inode; this is where the dirent catches up
+    entry.size = size;
+    entry.firstBlock = first_block;
+    entry.mtime = dirty ? mtime : time(NULL);
+  }
+
+  // entry.name[0] == 2 means this file has been unlinked but there still are
+  // some fds referencing it (deleted but still in use). Therefore we need to
+  // check if the current fd we're closing is the last one referencing it. If
+  // so, we can truly mark this file as deleted (name[0] == 1).
+  if (entry.name[0] == 2) {
+    if (!k_is_file_still_open(dirent_off)) {
+      k_free_fat_chain(entry.firstBlock);
+      entry.name[0] = 1;
+    }
+    // If this is not the last fd referencing the file, do nothing
+  }
+
+  // staged here, committed by k_close()
+  n = k_dirent_write(&entry, dirent_off);
+  if (n != (ssize_t)sizeof(entry)) {  // again, this shouldn't happen
+    free(of);
+    P_ERRNO = FS_IO_ERROR;
+    return -1;
+  }
+
+  free(of);
+  return FS_SUCCESS;
+}
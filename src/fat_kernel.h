@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include "util/p_errno.h"
 #include "util/struct.h"
 
@@ -17,6 +18,9 @@
 #define FS_FILE_NOT_FOUND P_ENOENT
 #define FS_FILE_IN_USE P_EBUSY
 #define FS_NOT_A_FILE P_EISDIR
+#define FS_NOT_A_DIR P_ENOTDIR
+#define FS_DIR_NOT_EMPTY P_ENOTEMPTY
+#define FS_FILE_EXISTS P_EEXIST
 
 #define FS_NO_PERMISSION P_EACCES
 #define FS_READ_ONLY_MODE P_EROFS
@@ -31,6 +35,31 @@
 
 #define MAX_GDT_ENTRY 1024
 #define BUFFER_SIZE 4096
+// bounce buffer of k_sendfile() and the cp / cat copy loops
+#define SENDFILE_CHUNK (64 * 1024)
+
+// Number of contiguous blocks reserved for a file opened for writing, so
+// that growing files get contiguous chains. 0 allocates block by block.
+#define FS_PREALLOC_BLOCKS 16
+
+// Default capacity (in blocks) of the data block cache; 0 disables it.
+#define FS_DEFAULT_CACHE_BLOCKS 256
+
+// Default largest read-ahead window of a sequential reader, in bytes; 0
+// disables read-ahead. A window starts at FS_READAHEAD_MIN_BLOCKS blocks and
+// doubles with every sequential read.
+#define FS_DEFAULT_READAHEAD (64 * 1024)
+#define FS_READAHEAD_MIN_BLOCKS 4
+
+// entries the directory listings ask k_readdir() for at a time
+#define READDIR_BATCH 32
+
+/** @brief Options for mount() */
+typedef struct fs_config {
+  size_t cache_blocks;  // capacity of the block cache; 0 disables it
+  bool map_data;        // mmap the whole image and access data in place
+  size_t readahead;     // largest read-ahead window in bytes; 0 disables it
+} fs_config_t;
 
 // permission flags
 #define F_READ 0x01
@@ -68,6 +97,9 @@ typedef struct {
   char reserved[16];
 } dir_entry_t;
 
+/** @brief A directory opened for reading with k_opendir() */
+typedef struct dir_stream dir_stream_t;
+
 /**
  * @brief Create and initialize a new PennFAT filesystem.
  *
@@ -76,17 +108,30 @@ typedef struct {
  * size determined by @p block_size_config. The function:
  *   - Initializes the FAT, storing configuration in FAT[0].
  *   - Marks block 1 as the root directory, all remaining data blocks as free.
- *   - Zero-fills the entire data region on disk.
+ *   - Zero-fills the root directory block. The rest of the image is left
+ *     as holes of a sparse file (which read as zeros), so creating even the
+ *     largest image takes a handful of syscalls.
  *
  * This function must be called before mounting and using the filesystem.
  *
- * @param fs_name           Path/name of the filesystem image to create.
+ * @param fs_name           Path/name of the filesystem image to create. An
+ *                          existing file is overwritten.
  * @param blocks_in_fat     Number of blocks to allocate for the FAT (1–32).
  * @param block_size_config Index into BLOCK_SIZE_MAP selecting the block size.
+ * @param preallocate       Reserve disk space for the whole image up front
+ *                          (posix_fallocate) instead of leaving it sparse.
  *
  * @return FS_SUCCESS on success, or -1 on invalid configuration or I/O errors.
  */
-int mkfs(const char* fs_name, int blocks_in_fat, int block_size_config);
+int mkfs(const char* fs_name,
+         int blocks_in_fat,
+         int block_size_config,
+         bool preallocate);
+
+/**
+ * @brief Fill @p config with the default mount options.
+ */
+void k_fs_config_default(fs_config_t* config);
 
 /**
  * @brief Mount an existing PennFAT filesystem image.
@@ -95,11 +140,27 @@ int mkfs(const char* fs_name, int blocks_in_fat, int block_size_config);
  * from the FAT header stored in FAT[0]. On success, the filesystem is ready for
  * directory and file operations.
  *
+ * Data and directory blocks are accessed through a write-back block cache
+ * of config->cache_blocks blocks (see util/bcache.h). Dirty blocks reach the
+ * image on eviction, on k_close() and on unmount().
+ *
+ * The FAT is read into memory, and FAT and directory changes only reach the
+ * image through the metadata journal (see util/journal.h), committed by
+ * k_close(), k_unlink(), k_mv(), k_chmod_update(), k_fsync(), k_sync() and
+ * unmount(). A commit that a crash interrupted is finished here, before
+ * anything else is read.
+ *
+ * With config->map_data the whole image is mapped instead, and data is
+ * copied to and from the mapping directly (cp streams out of it without a
+ * bounce buffer).
+ *
  * @param fs_name Path/name of the existing PennFAT filesystem image to mount.
+ * @param config  Mount options, or NULL for the defaults.
  *
- * @return FS_SUCCESS on success; -1 on configuration, I/O, or mmap errors.
+ * @return FS_SUCCESS on success; -1 on configuration, I/O, mmap or memory
+ *         errors.
  */
-int mount(const char* fs_name);
+int mount(const char* fs_name, const fs_config_t* config);
 
 /**
  * @brief Unmount the currently mounted PennFAT filesystem.
@@ -108,7 +169,9 @@ int mount(const char* fs_name);
  * Specifically, this function:
  *   - Verifies that a filesystem is currently mounted.
  *   - Cleans up the global descriptor table via k_gdt_cleanup().
- *   - Unmaps the FAT region from memory (FAT_TABLE).
+ *   - Commits the metadata of the files still open.
+ *   - Writes back and releases the block cache.
+ *   - Frees the in-memory FAT (FAT_TABLE) and unmaps the image if mapped.
  *   - Closes the backing filesystem file (FS_HOST_FD).
  *   - Clears the IS_FS_MOUNTED flag on success.
  *
@@ -122,18 +185,57 @@ int mount(const char* fs_name);
 int unmount(void);
 
 /**
- * @brief Search the root directory for a file with the given name.
+ * @brief Report how many data blocks are free, for `df`-style output.
+ *
+ * The count comes from the in-memory free-space index maintained since
+ * mount(), so no FAT scan is needed.
+ *
+ * @param free_blocks  Output: number of free data blocks.
+ * @param total_blocks Output: number of data blocks (including the root
+ *                     directory's).
+ * @return FS_SUCCESS on success, or -1 if no filesystem is mounted (P_ERRNO
+ *         set to FS_NOT_MOUNTED).
+ */
+int k_block_usage(size_t* free_blocks, size_t* total_blocks);
+
+/**
+ * @brief Compact every FAT chain into one contiguous run of blocks.
+ *
+ * The root directory is laid out first, starting at block 1, followed by
+ * each file in directory order. Blocks are moved by swapping them with the
+ * block that occupies their target slot, so no extra disk space is needed.
+ * Intended for offline use (the standalone pennfat tool).
+ *
+ * @param moved Output: number of blocks that were relocated (may be NULL).
+ * @retval FS_SUCCESS     The filesystem was defragmented.
+ * @retval FS_NOT_MOUNTED The filesystem is not mounted.
+ * @retval FS_FILE_IN_USE A file is currently open.
+ * @retval FS_MALLOC_FAIL Out of memory for the block maps.
+ * @retval FS_IO_ERROR    Moving block contents failed.
+ */
+int k_defrag(size_t* moved);
+
+/**
+ * @brief Resolve a path and look up its last component.
+ *
+ * A path starting with '/' is resolved from the root directory, any other
+ * from the current directory (see k_chdir()). Every component but the last
+ * must name a directory; "." and ".." work as usual, ".." of the root
+ * being the root. Each directory has a name index of its own, built the
+ * first time a path goes through it, so a lookup never scans a directory.
  *
  * The @p offset out-parameter is set as follows:
  *  - If the function returns @c true:  byte offset of the existing matching
  *    directory entry within the filesystem image.
- *  - If the function returns @c false and a reusable/free slot exists
+ *  - If the function returns @c false and a reusable/free slot exists in the
+ *    directory of the last component
  *    (deleted entry or first end-of-directory entry): byte offset of the
  *    first such slot where a new entry can be created.
- *  - If the function returns @c false and no free slot exists in any root
- *    directory block: set to -1.
+ *  - If the function returns @c false and no free slot exists in any block
+ *    of that directory, or the path could not be resolved (P_ERRNO set to
+ *    FS_FILE_NOT_FOUND, FS_NOT_A_DIR, P_ENAMETOOLONG, ...): set to -1.
  *
- * @param [in]  fname  filename to search for in the root directory.
+ * @param [in]  fname  path of the file to search for.
  * @param [out] offset Output pointer that receives the byte offset of either
  * the found entry or the first suitable free slot (or -1 if none).
  *
@@ -149,9 +251,9 @@ bool k_find_file(const char* fname, off_t* offset);
  * It:
  *   - Verifies that a filesystem is mounted and that @p mode is valid.
  *   - Finds a free slot in the global descriptor table (GDT).
- *   - Looks up @p fname in the root directory via k_find_file().
- *   - If not found and the directory is full, attempts to extend the root
- *     directory via k_extend_root().
+ *   - Looks up @p fname in its directory via k_find_file().
+ *   - If not found and the directory is full, attempts to extend that
+ *     directory via k_extend_dir().
  *   - Prevents multiple writers by checking existing open files when
  *     opening in F_WRITE or F_APPEND (k_have_write_opened()).
  *   - Dispatches to the appropriate helper:
@@ -183,6 +285,8 @@ int k_open(const char* fname, int mode);
  * Special cases and behavior:
  *   - If @p fd is 0, the read is delegated directly to the host
  *     standard input via read(0, buf, n).
+ *   - If @p fd is a pipe end, the read blocks until the pipe has data (or
+ *     has no writer left) and returns what is there.
  *   - The file must have read permission; otherwise, FS_NO_PERMISSION is
  *     returned.
  *   - At most @p n bytes are read, but fewer bytes may be returned:
@@ -213,11 +317,14 @@ ssize_t k_read(int fd, int n, char* buf);
  * Writes up to @p n bytes from @p str to the file associated with the
  * global descriptor @p fd, starting at the file's current offset. The
  * offset is advanced by the number of bytes actually written, and the
- * file size is extended if necessary.
+ * file size is extended if necessary. The new size and the blocks it
+ * added to the FAT are committed by k_close(), k_fsync() or k_sync().
  *
  * Special handling:
  *   - If @p fd is 1 or 2, the write is delegated directly to the host
  *     STDOUT or STDERR via write(fd, str, n).
+ *   - If @p fd is a pipe end, the write blocks until all @p n bytes are in
+ *     the pipe (see k_pipe()).
  *   - If the disk becomes full, the function stops early and returns the
  *     number of bytes successfully written so far.
  *
@@ -242,13 +349,16 @@ ssize_t k_write(int fd, const char* str, int n);
  *   open entry in the global file descriptor table.
  * - For standard descriptors (0, 1, 2), only the in-memory open_file_t is
  *   freed; no directory entry is read or written.
+ * - For pipe ends, the end is detached from its pipe (see k_pipe()).
  * - For other descriptors, the directory entry is read, and if the file was
- *   opened with write/append flags, its size and modification time are
- *   updated.
+ *   opened with write/append flags (or has metadata that k_write() left
+ *   pending), its size, first block and modification time are updated.
  * - If the file has been previously unlinked (directory entry name[0] == 2),
  *   this function checks whether this is the last open descriptor referencing
  *   it. If so, it frees the file's FAT chain and marks the directory entry as
  *   truly deleted (name[0] == 1).
+ * - Then everything staged since the last commit, by any file, is committed
+ *   to the image (a group commit, see util/journal.h).
  *
  * @param kfd Kernel file descriptor to close (0..MAX_FD-1).
  *
@@ -261,6 +371,90 @@ ssize_t k_write(int fd, const char* str, int n);
  */
 int k_close(int kfd);
 
+/**
+ * @brief Read into several buffers with one call.
+ *
+ * Fills @p iov in order with k_read() and stops at the first short read
+ * (end of file) or, for a pipe, after the first buffer that got data. Host
+ * STDIN (0) is read with one readv().
+ *
+ * @param kfd    Kernel file descriptor.
+ * @param iov    The buffers.
+ * @param iovcnt Number of buffers.
+ * @return Total bytes read (0 at end of file), or -1 on error with P_ERRNO
+ * set (FS_BAD_FD, FS_INVALID_ARG, or whatever k_read() reports first).
+ */
+ssize_t k_readv(int kfd, const struct iovec* iov, int iovcnt);
+
+/**
+ * @brief Write several buffers with one call.
+ *
+ * Writes @p iov in order with k_write() and stops at the first short write
+ * (disk full). Host STDOUT / STDERR (1, 2) get one writev().
+ *
+ * @param kfd    Kernel file descriptor.
+ * @param iov    The buffers.
+ * @param iovcnt Number of buffers.
+ * @return Total bytes written, or -1 on error with P_ERRNO set.
+ */
+ssize_t k_writev(int kfd, const struct iovec* iov, int iovcnt);
+
+/**
+ * @brief Copy up to @p count bytes from @p in_kfd to @p out_kfd without
+ * leaving the kernel.
+ *
+ * Data moves SENDFILE_CHUNK bytes per k_read/k_write, or straight out of
+ * the mapping when the image is mapped. Any kernel fds work: PennFAT files,
+ * pipes and host STDIN/STDOUT/STDERR. The offsets of both fds advance.
+ *
+ * @param out_kfd Destination kernel fd.
+ * @param in_kfd  Source kernel fd.
+ * @param count   Most bytes to copy; SIZE_MAX copies up to end of input.
+ * @return Bytes copied, less than @p count only at end of input, or -1 on
+ * error with P_ERRNO set. Bytes copied before an error stay copied.
+ */
+ssize_t k_sendfile(int out_kfd, int in_kfd, size_t count);
+
+/**
+ * @brief Create a pipe and install both of its ends in the GDT.
+ *
+ * k_read() and k_write() on the ends go to the pipe's ring buffer and block
+ * while it is empty / full (see util/pipe.h). Reading returns 0 once every
+ * write end is closed; writing fails with P_EPIPE once every read end is.
+ * k_lseek() fails with P_ESPIPE.
+ *
+ * @param kfds Set to the read end (kfds[0]) and the write end (kfds[1]).
+ *
+ * @retval FS_SUCCESS     The pipe was created.
+ * @retval FS_NOT_MOUNTED The filesystem is not mounted (there is no GDT).
+ * @retval FS_GDT_FULL    Fewer than two GDT slots are free.
+ * @retval FS_MALLOC_FAIL Out of memory.
+ */
+int k_pipe(int kfds[2]);
+
+/**
+ * @brief Install another end of the pipe that @p kfd is an end of.
+ *
+ * The pipe stays open until every end is closed, so each process holding
+ * an end gets its own (see k_proc_create()).
+ *
+ * @param kfd A pipe end.
+ * @return The new kernel fd, or -1 with P_ERRNO set (FS_BAD_FD if @p kfd is
+ * not a pipe end, FS_GDT_FULL, FS_MALLOC_FAIL).
+ */
+int k_pipe_dup(int kfd);
+
+/**
+ * @brief Whether @p kfd is an open pipe end.
+ */
+bool k_is_pipe(int kfd);
+
+/**
+ * @brief Whether @p kfd is one of the host terminal streams (STDIN, STDOUT,
+ * STDERR) rather than a PennFAT file or a pipe.
+ */
+bool k_is_tty(int kfd);
+
 /**
  * @brief Unlink (delete) a file from the filesystem namespace.
  *
@@ -293,7 +487,7 @@ int k_unlink(const char* fname);
  *
  * If the resulting position is greater than the current in-memory file size and
  * the file is opened with F_WRITE or F_APPEND, this function updates the
- * in-memory size (open file table entry) to @p new_pos.
+ * in-memory size (the file's shared inode) to @p new_pos.
  *
  * @param kfd    Kernel file descriptor index in GLOBAL_FD_TABLE.
  * @param offset Offset value interpreted according to @p whence.
@@ -308,6 +502,37 @@ int k_unlink(const char* fname);
  */
 int k_lseek(int kfd, int offset, int whence);
 
+/**
+ * @brief Write an open file's metadata and all dirty blocks to the image.
+ *
+ * k_write() only updates the in-memory inode when a file grows; the
+ * directory entry is written back by k_close(), k_sync() or this function.
+ * Like them it commits the metadata of every file, not only this one's.
+ *
+ * @param kfd Kernel file descriptor index in GLOBAL_FD_TABLE.
+ *
+ * @retval FS_SUCCESS     The file's dirent and the block cache were written.
+ * @retval FS_NOT_MOUNTED The filesystem is not mounted.
+ * @retval FS_BAD_FD      @p kfd is out of range or not associated with an
+ *                        open file.
+ * @retval FS_IO_ERROR    Writing the journal, the metadata or a cached block
+ *                        failed.
+ */
+int k_fsync(int kfd);
+
+/**
+ * @brief k_fsync() for every open file at once.
+ *
+ * The scheduler calls this every SCHED_SYNC_TICKS ticks, which bounds how
+ * stale the image can be while files stay open, and how much work a crash
+ * can lose.
+ *
+ * @retval FS_SUCCESS     Everything was written back.
+ * @retval FS_NOT_MOUNTED The filesystem is not mounted.
+ * @retval FS_IO_ERROR    Writing a dirent or a cached block failed.
+ */
+int k_sync(void);
+
 /**
  * @brief List directory contents or show information about a single file.
  *
@@ -340,15 +565,55 @@ void k_format_dirent(const dir_entry_t* entry, char* buffer, size_t size);
 /**
  * @brief Iterate over directory entries.
  *
- * If filename is provided, invokes callback for that specific file.
- * If filename is NULL, invokes callback for all files in the root directory.
+ * If filename names a file, invokes callback for that specific file. If it
+ * names a directory, or is NULL (the current directory), invokes callback
+ * for every entry in that directory, "." and ".." included.
  *
- * @param filename Optional filename to search for.
+ * @param filename Optional path of the file or directory.
  * @param callback Function to call for each found entry.
  * @return FS_SUCCESS on success, or error code.
  */
 int k_scan_dir(const char* filename, void (*callback)(const dir_entry_t*));
 
+/**
+ * @brief Open a directory for reading its entries in order.
+ *
+ * The directory is read one block at a time, when k_readdir() gets to it,
+ * so a listing only ever holds one block however big the directory is. A
+ * block is read whole with one call; entries changed after that show up
+ * in a later listing, not this one.
+ *
+ * @param path Path of the directory, or NULL for the current directory.
+ * @return The stream, to be released with k_closedir(), or NULL with
+ * P_ERRNO set (FS_NOT_MOUNTED, FS_NOT_A_DIR if @p path names a file,
+ * FS_MALLOC_FAIL, or a path error of k_find_file()).
+ */
+dir_stream_t* k_opendir(const char* path);
+
+/**
+ * @brief Read the next entries of a directory.
+ *
+ * Only live entries are returned ("." and ".." included; deleted ones are
+ * skipped).
+ *
+ * @param dir     Stream from k_opendir().
+ * @param entries Receives up to @p max entries.
+ * @param offsets Receives the offset of each entry in the image (see
+ *                k_stat()), or NULL.
+ * @param max     Capacity of @p entries (and @p offsets).
+ * @return Number of entries stored, 0 at the end of the directory, or -1
+ * with P_ERRNO set (FS_NOT_MOUNTED, FS_IO_ERROR).
+ */
+ssize_t k_readdir(dir_stream_t* dir,
+                  dir_entry_t* entries,
+                  off_t* offsets,
+                  size_t max);
+
+/**
+ * @brief Release a stream from k_opendir().
+ */
+void k_closedir(dir_stream_t* dir);
+
 /**
  * @brief Implementation of the PennFAT cat command.
  *
@@ -396,6 +661,24 @@ int k_chmod_update(const char* fname, uint8_t new_perm);
  */
  int k_check_executable(const char* fname);
 
+/**
+ * @brief Looks up a file's directory entry, as it stands in memory.
+ *
+ * For a file that is open and being written, the size, first block and
+ * mtime come from its open inode, so they are current even before the
+ * dirent is written back.
+ *
+ * @param fname The path of the file. For a directory named by a path that
+ * ends in "." (or is "/"), this is its "." entry; the root has no entry,
+ * so it gets a made-up one named "/" at offset 0.
+ * @param entry Receives the entry.
+ * @param dirent_offset Receives the offset of the entry in the image, which
+ * identifies the file for as long as it exists.
+ * @return FS_SUCCESS, or -1 with P_ERRNO set (FS_NOT_MOUNTED,
+ * FS_FILE_NOT_FOUND, FS_IO_ERROR).
+ */
+int k_stat(const char* fname, dir_entry_t* entry, off_t* dirent_offset);
+
 /**
  * @brief Rename (move) a file within the PennFAT filesystem.
  *
@@ -416,9 +699,53 @@ int k_chmod_update(const char* fname, uint8_t new_perm);
  *                           directory entries to disk.
  * @retval Other negative FS_* error codes propagated from k_unlink() when
  *         removing an existing destination.
+ *
+ * If @p dest is an existing directory, or lies in another directory than
+ * @p source, the entry moves there instead (a directory along with
+ * everything in it); that fails with FS_FILE_IN_USE for an open file and
+ * with FS_INVALID_ARG for a directory moved into itself. An existing
+ * directory is never replaced (FS_FILE_EXISTS).
  */
 int k_mv(const char* source, const char* dest);
 
+/**
+ * @brief Create an empty directory.
+ *
+ * The new directory holds "." and ".." only; the index of its entries is
+ * built the first time a path goes through it.
+ *
+ * @param path Path of the directory, relative to the current directory
+ *             unless it starts with '/'.
+ * @return FS_SUCCESS, or -1 with P_ERRNO set (FS_NOT_MOUNTED,
+ * FS_FILE_EXISTS, FS_DISK_FULL, FS_IO_ERROR, or a path error of
+ * k_find_file()).
+ */
+int k_mkdir(const char* path);
+
+/**
+ * @brief Remove an empty directory.
+ *
+ * @param path Path of the directory.
+ * @return FS_SUCCESS, or -1 with P_ERRNO set: FS_NOT_MOUNTED,
+ * FS_FILE_NOT_FOUND, FS_NOT_A_DIR, FS_DIR_NOT_EMPTY, FS_INVALID_ARG (the
+ * root, or a path ending in "." or ".."), FS_FILE_IN_USE (the current
+ * directory, or it still holds a removed file that is open), FS_IO_ERROR.
+ */
+int k_rmdir(const char* path);
+
+/**
+ * @brief Change the current directory of the filesystem, which relative
+ * paths start from.
+ *
+ * PennOS keeps a current directory per process and hands the filesystem
+ * absolute paths (see fat_syscalls.c); this one serves pennfat.
+ *
+ * @param path Path of the new current directory.
+ * @return FS_SUCCESS, or -1 with P_ERRNO set (FS_NOT_MOUNTED,
+ * FS_FILE_NOT_FOUND, FS_NOT_A_DIR, or another path error).
+ */
+int k_chdir(const char* path);
+
 /**
  * @brief Copy files between host and PennFAT, or within PennFAT.
  *
@@ -1,5 +1,6 @@
 #include "fat_syscalls.h"
 #include <errno.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -24,6 +25,144 @@ static int s_find_local_fd_spot(void) {
   return -1;
 }
 
+/**
+ * @brief Makes a PennFAT path absolute against the current directory of the
+ * calling process, and resolves "." and ".." in it.
+ *
+ * The filesystem itself has one current directory (see k_chdir()); each
+ * process has its own, so it only ever gets absolute paths from here.
+ *
+ * @param path The path as the program gave it.
+ * @param buf  Receives the absolute path (MAX_PATH_LEN bytes).
+ * @return @p buf, @p path itself if there is no current process, or NULL
+ * with P_ERRNO set to P_ENAMETOOLONG.
+ */
+static const char* s_abspath(const char* path, char* buf) {
+  pcb_t* proc = get_current_process();
+  if (proc == NULL) {
+    return path;
+  }
+
+  size_t len = 0;
+  for (int pass = path[0] == '/' ? 1 : 0; pass < 2; pass++) {
+    const char* p = pass == 0 ? proc->cwd : path;
+    while (*p != '\0') {
+      while (*p == '/') {
+        p++;
+      }
+      const char* comp = p;
+      while (*p != '\0' && *p != '/') {
+        p++;
+      }
+      size_t n = (size_t)(p - comp);
+      if (n == 0 || (n == 1 && comp[0] == '.')) {
+        continue;
+      }
+      if (n == 2 && comp[0] == '.' && comp[1] == '.') {
+        while (len > 0 && buf[--len] != '/') {
+        }
+        continue;
+      }
+      if (len + 1 + n >= MAX_PATH_LEN) {
+        P_ERRNO = P_ENAMETOOLONG;
+        return NULL;
+      }
+      buf[len++] = '/';
+      memcpy(buf + len, comp, n);
+      len += n;
+    }
+  }
+  if (len == 0) {
+    buf[len++] = '/';
+  }
+  buf[len] = '\0';
+  return buf;
+}
+
+/**
+ * @brief Fills a file_stat_t from a directory entry at @p dirent_off.
+ */
+static void s_stat_fill(const dir_entry_t* entry,
+                        off_t dirent_off,
+                        file_stat_t* st) {
+  *st = (file_stat_t){
+      .id = dirent_off,
+      .size = entry->size,
+      .first_block = entry->firstBlock,
+      .type = entry->type,
+      .perm = entry->perm,
+      .mtime = entry->mtime,
+  };
+}
+
+/**
+ * @brief Returns the output buffer for a local FD, allocating it on first
+ * use. It is line buffered if the FD refers to the terminal.
+ * @return The buffer, or NULL with P_ERRNO set to FS_MALLOC_FAIL.
+ */
+static obuf_t* s_obuf_get(pcb_t* proc, int fd) {
+  if (proc->obuf[fd] == NULL) {
+    obuf_t* buf = malloc(sizeof(obuf_t));
+    if (!buf) {
+      P_ERRNO = FS_MALLOC_FAIL;
+      return NULL;
+    }
+    buf->len = 0;
+    buf->line = k_is_tty(proc->fd_table[fd]);
+    proc->obuf[fd] = buf;
+  }
+  return proc->obuf[fd];
+}
+
+/**
+ * @brief Writes out the pending output of a local FD, if any.
+ *
+ * The pending bytes are dropped even if the write fails.
+ * @return 0 on success, or -1 on error.
+ */
+static int s_obuf_flush(pcb_t* proc, int fd) {
+  obuf_t* buf = proc->obuf[fd];
+  if (buf == NULL || buf->len == 0) {
+    return 0;
+  }
+  int kfd = proc->fd_table[fd];
+  size_t len = buf->len;
+  buf->len = 0;
+
+  ssize_t n = k_write(kfd, buf->data, (int)len);
+  if (n >= 0 && (size_t)n < len) {
+    P_ERRNO = k_is_pipe(kfd) ? P_EPIPE : FS_DISK_FULL;
+  }
+  return n == (ssize_t)len ? 0 : -1;
+}
+
+/**
+ * @brief Takes the @p n bytes just placed behind the pending output of a
+ * local FD, flushing at a newline if the buffer is line buffered.
+ * @return 0 on success, or -1 on error.
+ */
+static int s_obuf_commit(pcb_t* proc, int fd, size_t n) {
+  obuf_t* buf = proc->obuf[fd];
+  const char* added = buf->data + buf->len;
+  buf->len += n;
+  if (buf->len == OBUF_SIZE ||
+      (buf->line && memchr(added, '\n', n) != NULL)) {
+    return s_obuf_flush(proc, fd);
+  }
+  return 0;
+}
+
+/**
+ * @brief Flushes and frees the output buffer of a local FD.
+ * @return 0 on success, or -1 if the flush failed.
+ */
+static int s_obuf_release(pcb_t* proc, int fd) {
+  int status = s_obuf_flush(proc, fd);
+  free(proc->obuf[fd]);
+  proc->obuf[fd] = NULL;
+  return status;
+}
+
 /**
  * @brief Opens a file, delegating to k_open and linking the result to the PCB.
  */
@@ -34,6 +173,11 @@ int s_open(const char* fname, int mode) {
     return -1;
   }
 
+  char path[MAX_PATH_LEN];
+  fname = s_abspath(fname, path);
+  if (fname == NULL) {
+    return -1;
+  }
   int kfd_status = k_open(fname, mode);
 
   if (kfd_status < 0) {
@@ -83,6 +227,9 @@ ssize_t s_write(int fd, const char* str, int n) {
     return -1;
   }
   int kfd = current_proc->fd_table[fd];
+  if (s_obuf_flush(current_proc, fd) < 0) {
+    return -1;
+  }
 
   ssize_t bytes_written = k_write(kfd, str, n);
 
@@ -101,6 +248,7 @@ int s_close(int fd) {
     return -1;
   }
   int kfd = current_proc->fd_table[fd];
+  s_obuf_release(current_proc, fd);  // a failed flush does not stop the close
 
   int status = k_close(kfd);
 
@@ -111,6 +259,211 @@ int s_close(int fd) {
   return status;
 }
 
+/**
+ * @brief Reads into several buffers from the file.
+ */
+ssize_t s_readv(int fd, const struct iovec* iov, int iovcnt) {
+  pcb_t* current_proc = get_current_process();
+  if (fd < 0 || fd >= MAX_FD || current_proc == NULL ||
+      current_proc->fd_table[fd] == -1) {
+    P_ERRNO = FS_BAD_FD;
+    return -1;
+  }
+  return k_readv(current_proc->fd_table[fd], iov, iovcnt);
+}
+
+/**
+ * @brief Writes several buffers to the file.
+ */
+ssize_t s_writev(int fd, const struct iovec* iov, int iovcnt) {
+  pcb_t* current_proc = get_current_process();
+  if (fd < 0 || fd >= MAX_FD || current_proc == NULL ||
+      current_proc->fd_table[fd] == -1) {
+    P_ERRNO = FS_BAD_FD;
+    return -1;
+  }
+  if (s_obuf_flush(current_proc, fd) < 0) {
+    return -1;
+  }
+  return k_writev(current_proc->fd_table[fd], iov, iovcnt);
+}
+
+/**
+ * @brief Copies between two of the process's open files in the kernel.
+ */
+ssize_t s_sendfile(int out_fd, int in_fd, size_t count) {
+  pcb_t* current_proc = get_current_process();
+  if (out_fd < 0 || out_fd >= MAX_FD || in_fd < 0 || in_fd >= MAX_FD ||
+      current_proc == NULL || current_proc->fd_table[out_fd] == -1 ||
+      current_proc->fd_table[in_fd] == -1) {
+    P_ERRNO = FS_BAD_FD;
+    return -1;
+  }
+  if (s_obuf_flush(current_proc, out_fd) < 0) {
+    return -1;
+  }
+  return k_sendfile(current_proc->fd_table[out_fd],
+                    current_proc->fd_table[in_fd], count);
+}
+
+/**
+ * @brief Creates a pipe and maps both of its ends into the PCB.
+ */
+int s_pipe(int fds[2]) {
+  pcb_t* current_proc = get_current_process();
+  if (!current_proc) {
+    P_ERRNO = P_EPID;
+    return -1;
+  }
+  int rd = s_find_local_fd_spot();
+  if (rd == -1) {
+    P_ERRNO = P_EMFILE;
+    return -1;
+  }
+  current_proc->fd_table[rd] = -2;  // hold the spot while finding another
+  int wr = s_find_local_fd_spot();
+  current_proc->fd_table[rd] = -1;
+  if (wr == -1) {
+    P_ERRNO = P_EMFILE;
+    return -1;
+  }
+
+  int kfds[2];
+  if (k_pipe(kfds) < 0) {
+    return -1;  // k_pipe set P_ERRNO
+  }
+  current_proc->fd_table[rd] = kfds[0];
+  current_proc->fd_table[wr] = kfds[1];
+  fds[0] = rd;
+  fds[1] = wr;
+  return 0;
+}
+
+/**
+ * @brief Formats into the process's output buffer for a file.
+ */
+int s_printf(int fd, const char* fmt, ...) {
+  pcb_t* current_proc = get_current_process();
+  if (fd < 0 || fd >= MAX_FD || current_proc == NULL ||
+      current_proc->fd_table[fd] == -1) {
+    P_ERRNO = FS_BAD_FD;
+    return -1;
+  }
+  obuf_t* buf = s_obuf_get(current_proc, fd);
+  if (!buf) {
+    return -1;
+  }
+
+  va_list ap;
+  va_start(ap, fmt);
+  int len =
+      vsnprintf(buf->data + buf->len, OBUF_SIZE + 1 - buf->len, fmt, ap);
+  va_end(ap);
+  if (len < 0) {
+    P_ERRNO = FS_INVALID_ARG;
+    return -1;
+  }
+
+  if (buf->len + (size_t)len > OBUF_SIZE) {
+    // It did not fit behind the pending output: flush that and format again,
+    // into the buffer if it fits there now and into a heap copy otherwise
+    if (s_obuf_flush(current_proc, fd) < 0) {
+      return -1;
+    }
+    char* dst = len <= OBUF_SIZE ? buf->data : malloc((size_t)len + 1);
+    if (!dst) {
+      P_ERRNO = FS_MALLOC_FAIL;
+      return -1;
+    }
+    va_start(ap, fmt);
+    vsnprintf(dst, (size_t)len + 1, fmt, ap);
+    va_end(ap);
+    if (dst != buf->data) {
+      ssize_t n = k_write(current_proc->fd_table[fd], dst, len);
+      free(dst);
+      return n == len ? len : -1;
+    }
+  }
+  return s_obuf_commit(current_proc, fd, (size_t)len) < 0 ? -1 : len;
+}
+
+/**
+ * @brief Appends to the process's output buffer for a file.
+ */
+ssize_t s_bwrite(int fd, const char* str, size_t n) {
+  pcb_t* current_proc = get_current_process();
+  if (fd < 0 || fd >= MAX_FD || current_proc == NULL ||
+      current_proc->fd_table[fd] == -1) {
+    P_ERRNO = FS_BAD_FD;
+    return -1;
+  }
+  obuf_t* buf = s_obuf_get(current_proc, fd);
+  if (!buf) {
+    return -1;
+  }
+
+  if (buf->len + n > OBUF_SIZE) {
+    if (s_obuf_flush(current_proc, fd) < 0) {
+      return -1;
+    }
+    if (n > OBUF_SIZE) {
+      return k_write(current_proc->fd_table[fd], str, (int)n);  // too big
+    }
+  }
+  memcpy(buf->data + buf->len, str, n);
+  return s_obuf_commit(current_proc, fd, n) < 0 ? -1 : (ssize_t)n;
+}
+
+/**
+ * @brief Writes out the process's pending output for a file.
+ */
+int s_flush(int fd) {
+  pcb_t* current_proc = get_current_process();
+  if (fd < 0 || fd >= MAX_FD || current_proc == NULL ||
+      current_proc->fd_table[fd] == -1) {
+    P_ERRNO = FS_BAD_FD;
+    return -1;
+  }
+  return s_obuf_flush(current_proc, fd);
+}
+
+/**
+ * @brief Writes out all of the process's pending output.
+ */
+void s_flush_all(void) {
+  pcb_t* current_proc = get_current_process();
+  if (!current_proc) {
+    return;
+  }
+  for (int fd = 0; fd < MAX_FD; fd++) {
+    if (current_proc->fd_table[fd] != -1) {
+      s_obuf_flush(current_proc, fd);
+    }
+  }
+}
+
+/**
+ * @brief Switches a file's output buffer between line and full buffering.
+ */
+int s_setvbuf(int fd, int mode) {
+  pcb_t* current_proc = get_current_process();
+  if (fd < 0 || fd >= MAX_FD || current_proc == NULL ||
+      current_proc->fd_table[fd] == -1) {
+    P_ERRNO = FS_BAD_FD;
+    return -1;
+  }
+  if (mode != S_BUF_LINE && mode != S_BUF_FULL) {
+    P_ERRNO = FS_INVALID_ARG;
+    return -1;
+  }
+  obuf_t* buf = s_obuf_get(current_proc, fd);
+  if (!buf) {
+    return -1;
+  }
+  buf->line = mode == S_BUF_LINE;
+  return buf->line ? s_obuf_flush(current_proc, fd) : 0;
+}
+
 /**
  * @brief Repositions the file pointer for a process's open file.
  */
@@ -122,6 +475,9 @@ off_t s_lseek(int fd, int offset, int whence) {
     return -1;
   }
   int kfd = current_proc->fd_table[fd];
+  if (s_obuf_flush(current_proc, fd) < 0) {
+    return -1;
+  }
 
   off_t new_offset = k_lseek(kfd, offset, whence);
 
@@ -129,54 +485,177 @@ off_t s_lseek(int fd, int offset, int whence) {
 }
 
 /**
- * @brief Unlinks (removes) a file from the file system.
+ * @brief Writes a process's open file back to the image.
  */
-int s_unlink(const char* fname) {
-  return k_unlink(fname);
+int s_fsync(int fd) {
+  pcb_t* current_proc = get_current_process();
+  if (fd < 0 || fd >= MAX_FD || current_proc == NULL ||
+      current_proc->fd_table[fd] == -1) {
+    P_ERRNO = FS_BAD_FD;
+    return -1;
+  }
+  int kfd = current_proc->fd_table[fd];
+
+  return k_fsync(kfd);
 }
 
-// Helper function to format and write a directory entry
-static void s_ls_callback(const dir_entry_t* entry) {
-  char line[256];
-  k_format_dirent(entry, line, sizeof(line));
-  size_t len = strlen(line);
-  if (len > 0) {
-    s_write(STDOUT_FILENO, line, len);
+/**
+ * @brief Reports a file's attributes from its directory entry.
+ */
+int s_stat(const char* fname, file_stat_t* st) {
+  dir_entry_t entry;
+  off_t dirent_off;
+  char path[MAX_PATH_LEN];
+  fname = s_abspath(fname, path);
+  if (fname == NULL || k_stat(fname, &entry, &dirent_off) < 0) {
+    return -1;
   }
+  s_stat_fill(&entry, dirent_off, st);
+  return 0;
+}
+
+/**
+ * @brief Unlinks (removes) a file from the file system.
+ */
+int s_unlink(const char* fname) {
+  char path[MAX_PATH_LEN];
+  fname = s_abspath(fname, path);
+  return fname != NULL ? k_unlink(fname) : -1;
 }
 
 /**
- * @brief Lists files in the root directory.
+ * @brief Lists a file, or the files in a directory (by default the current
+ * one), through the output buffer of STDOUT.
  */
 int s_ls(const char* filename) {
-  // Use k_scan_dir to avoid duplicating FAT traversal logic.
-  return k_scan_dir(filename, s_ls_callback);
+  char path[MAX_PATH_LEN];
+  filename = s_abspath(filename != NULL ? filename : ".", path);
+  if (filename == NULL) {
+    return -1;
+  }
+
+  char line[256];
+  dir_stream_t* dir = s_opendir(filename);
+  if (dir == NULL) {
+    dir_entry_t entry;
+    off_t dirent_off;
+    if (P_ERRNO != FS_NOT_A_DIR ||
+        k_stat(filename, &entry, &dirent_off) < 0) {
+      return -1;
+    }
+    k_format_dirent(&entry, line, sizeof(line));
+    if (s_bwrite(STDOUT_FILENO, line, strlen(line)) < 0) {
+      return -1;
+    }
+    return s_flush(STDOUT_FILENO);
+  }
+
+  // a batch at a time; a failed write (the reader went away) ends it early
+  s_dirent_t entries[READDIR_BATCH];
+  int result = 0;
+  ssize_t n;
+  while (result == 0 &&
+         (n = s_readdir(dir, entries, READDIR_BATCH)) != 0) {
+    if (n < 0) {
+      result = -1;
+    }
+    for (ssize_t i = 0; i < n && result == 0; i++) {
+      dir_entry_t entry = {
+          .size = entries[i].st.size,
+          .firstBlock = entries[i].st.first_block,
+          .type = entries[i].st.type,
+          .perm = entries[i].st.perm,
+          .mtime = entries[i].st.mtime,
+      };
+      memcpy(entry.name, entries[i].name, MAX_NAME_LEN);
+      k_format_dirent(&entry, line, sizeof(line));
+      size_t len = strlen(line);
+      if (len > 0 && s_bwrite(STDOUT_FILENO, line, len) < 0) {
+        result = -1;
+      }
+    }
+  }
+  s_closedir(dir);
+  if (s_flush(STDOUT_FILENO) < 0) {
+    result = -1;
+  }
+  return result;
+}
+
+dir_stream_t* s_opendir(const char* path) {
+  char abs[MAX_PATH_LEN];
+  path = s_abspath(path != NULL ? path : ".", abs);
+  return path != NULL ? k_opendir(path) : NULL;
+}
+
+ssize_t s_readdir(dir_stream_t* dir, s_dirent_t* entries, size_t max) {
+  if (dir == NULL) {
+    P_ERRNO = FS_INVALID_ARG;
+    return -1;
+  }
+
+  dir_entry_t batch[READDIR_BATCH];
+  off_t offsets[READDIR_BATCH];
+  size_t want = max < READDIR_BATCH ? max : READDIR_BATCH;
+  ssize_t n = k_readdir(dir, batch, offsets, want);
+  for (ssize_t i = 0; i < n; i++) {
+    memcpy(entries[i].name, batch[i].name, MAX_NAME_LEN);
+    s_stat_fill(&batch[i], offsets[i], &entries[i].st);
+  }
+  return n;
+}
+
+void s_closedir(dir_stream_t* dir) {
+  k_closedir(dir);
 }
 
 int s_mv(const char* src, const char* dest) {
+  char src_path[MAX_PATH_LEN];
+  char dest_path[MAX_PATH_LEN];
+  src = s_abspath(src, src_path);
+  dest = s_abspath(dest, dest_path);
+  if (src == NULL || dest == NULL) {
+    return -1;
+  }
   return k_mv(src, dest);
 }
 
 int s_cp(char** args) {
-  return k_cp(args);
+  // every PennFAT path made absolute; the one after -h is a host path
+  size_t argc = 0;
+  while (args[argc] != NULL) {
+    argc++;
+  }
+  char** abs_args = malloc((argc + 1) * sizeof(char*));
+  char(*paths)[MAX_PATH_LEN] = malloc(argc * MAX_PATH_LEN);
+  if (abs_args == NULL || paths == NULL) {
+    free(abs_args);
+    free(paths);
+    P_ERRNO = FS_MALLOC_FAIL;
+    return -1;
+  }
+  int result = 0;
+  for (size_t i = 0; i < argc; i++) {
+    bool host = i == 0 || strcmp(args[i], "-h") == 0 ||
+                strcmp(args[i - 1], "-h") == 0;
+    abs_args[i] = host ? args[i] : (char*)s_abspath(args[i], paths[i]);
+    if (abs_args[i] == NULL) {
+      result = -1;
+    }
+  }
+  abs_args[argc] = NULL;
+  if (result == 0) {
+    result = k_cp(abs_args);
+  }
+  free(abs_args);
+  free(paths);
+  return result;
 }
 
 int s_cat(char** args) {
-  char buffer[BUFFER_SIZE];
-  ssize_t bytes_read;
-
   // Case 1: No arguments provided -> Read from STDIN
   if (args[1] == NULL) {
-    while ((bytes_read = s_read(STDIN_FILENO, BUFFER_SIZE, buffer)) > 0) {
-      if (s_write(STDOUT_FILENO, buffer, bytes_read) != bytes_read) {
-        P_ERRNO = FS_IO_ERROR;
-        return -1;
-      }
-    }
-    if (bytes_read < 0) {
-      return -1;
-    }
-    return 0;
+    return s_sendfile(STDOUT_FILENO, STDIN_FILENO, SIZE_MAX) < 0 ? -1 : 0;
   }
 
   // Case 2: Arguments provided -> Read from each file
@@ -188,17 +667,16 @@ int s_cat(char** args) {
       continue;
     }
 
-    while ((bytes_read = s_read(fd, BUFFER_SIZE, buffer)) > 0) {
-      if (s_write(STDOUT_FILENO, buffer, bytes_read) != bytes_read) {
-        P_ERRNO = FS_IO_ERROR;
-        s_close(fd);
-        return -1;
-      }
-    }
-
+    // the kernel moves the whole file; nothing is copied through here
+    ssize_t copied = s_sendfile(STDOUT_FILENO, fd, SIZE_MAX);
+    int err = P_ERRNO;
     s_close(fd);
 
-    if (bytes_read < 0) {
+    if (copied < 0) {
+      if (err == P_EPIPE || err == FS_DISK_FULL) {
+        P_ERRNO = err;  // the output is gone: the other files would fail too
+        return -1;
+      }
       char error_msg[256];
       snprintf(error_msg, sizeof(error_msg), "cat: Error reading %s\n",
                args[i]);
@@ -211,9 +689,63 @@ int s_cat(char** args) {
 }
 
 int s_chmod(const char* fname, int mode) {
-  return k_chmod_update(fname, (uint8_t)mode);
+  char path[MAX_PATH_LEN];
+  fname = s_abspath(fname, path);
+  return fname != NULL ? k_chmod_update(fname, (uint8_t)mode) : -1;
 }
 
 int s_check_executable(const char* fname) {
-  return k_check_executable(fname);
+  char path[MAX_PATH_LEN];
+  fname = s_abspath(fname, path);
+  return fname != NULL ? k_check_executable(fname) : -1;
+}
+
+int s_mkdir(const char* path) {
+  char abs[MAX_PATH_LEN];
+  path = s_abspath(path, abs);
+  return path != NULL ? k_mkdir(path) : -1;
+}
+
+int s_rmdir(const char* path) {
+  char abs[MAX_PATH_LEN];
+  path = s_abspath(path, abs);
+  return path != NULL ? k_rmdir(path) : -1;
+}
+
+int s_chdir(const char* path) {
+  pcb_t* proc = get_current_process();
+  if (proc == NULL) {
+    P_ERRNO = P_EPID;
+    return -1;
+  }
+  char abs[MAX_PATH_LEN];
+  if (s_abspath(path, abs) == NULL) {
+    return -1;
+  }
+
+  dir_entry_t entry;
+  off_t dirent_off;
+  if (k_stat(abs, &entry, &dirent_off) < 0) {
+    return -1;
+  }
+  if (entry.type != 2) {
+    P_ERRNO = FS_NOT_A_DIR;
+    return -1;
+  }
+  memcpy(proc->cwd, abs, MAX_PATH_LEN);
+  return 0;
+}
+
+int s_getcwd(char* buf, size_t size) {
+  pcb_t* proc = get_current_process();
+  if (proc == NULL) {
+    P_ERRNO = P_EPID;
+    return -1;
+  }
+  if (strlen(proc->cwd) >= size) {
+    P_ERRNO = P_EINVAL;
+    return -1;
+  }
+  strcpy(buf, proc->cwd);
+  return 0;
 }
@@ -2,7 +2,10 @@
 #define FAT_SYSCALLS_H_
 
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <time.h>
+#include <sys/uio.h>
 #include "./util/struct.h"
 
 #define F_READ 0x01
@@ -73,6 +76,133 @@ ssize_t s_write(int fd, const char* str, int n);
  */
 int s_close(int fd);
 
+/**
+ * @brief Reads into several buffers with one call.
+ *
+ * Fills the buffers in order, stopping at end of file (or, for a pipe,
+ * after the first buffer that got data).
+ *
+ * @param fd The local file descriptor.
+ * @param iov The buffers.
+ * @param iovcnt The number of buffers.
+ * @return The total number of bytes read, 0 on EOF, or -1 on error.
+ */
+ssize_t s_readv(int fd, const struct iovec* iov, int iovcnt);
+
+/**
+ * @brief Writes several buffers with one call.
+ *
+ * @param fd The local file descriptor.
+ * @param iov The buffers, written in order.
+ * @param iovcnt The number of buffers.
+ * @return The total number of bytes written, or -1 on error.
+ */
+ssize_t s_writev(int fd, const struct iovec* iov, int iovcnt);
+
+/**
+ * @brief Copies data from one open file to another inside the kernel.
+ *
+ * Works between any two local file descriptors (PennFAT files, pipes,
+ * stdin/stdout), in large transfers and without a user buffer.
+ *
+ * @param out_fd The local file descriptor to write to.
+ * @param in_fd The local file descriptor to read from.
+ * @param count The most bytes to copy; SIZE_MAX copies up to end of input.
+ * @return The number of bytes copied (less than count only at end of
+ * input), or -1 on error.
+ */
+ssize_t s_sendfile(int out_fd, int in_fd, size_t count);
+
+/**
+ * @brief Creates a pipe.
+ *
+ * Installs both ends of a new in-kernel pipe in the current process's file
+ * descriptor table. s_read() on fds[0] blocks until there is data, and
+ * returns 0 once every write end is closed; s_write() on fds[1] blocks while
+ * the pipe is full. Pass the ends to children with s_spawn_piped().
+ *
+ * @param fds Set to the read end (fds[0]) and the write end (fds[1]).
+ * @return 0 on success, or -1 on error (P_EMFILE, FS_GDT_FULL, ...).
+ */
+int s_pipe(int fds[2]);
+
+/** @brief s_setvbuf() mode: flush at each newline (default on the terminal) */
+#define S_BUF_LINE 0
+/** @brief s_setvbuf() mode: flush only when full (default otherwise) */
+#define S_BUF_FULL 1
+
+/**
+ * @brief Formats into the calling process's output buffer for @p fd.
+ *
+ * Output to the terminal is flushed at each newline, output to files and
+ * pipes once OBUF_SIZE bytes are pending. Pending output is also flushed by
+ * s_flush(), s_close(), s_exit() and s_spawn(), and before any unbuffered
+ * s_write(), s_writev() or s_lseek() on the same descriptor, so the two can
+ * be mixed. It is lost if the process is killed by a signal.
+ *
+ * @param fd The local file descriptor.
+ * @param fmt printf-style format string.
+ * @return The number of bytes formatted, or -1 on error (the write error of
+ * a flush, FS_BAD_FD, FS_MALLOC_FAIL).
+ */
+int s_printf(int fd, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief Buffered s_write(): appends @p n bytes to the output buffer for
+ * @p fd, flushing as s_printf() does.
+ *
+ * @return @p n on success, or -1 on error.
+ */
+ssize_t s_bwrite(int fd, const char* str, size_t n);
+
+/**
+ * @brief Writes out whatever is pending in the output buffer for @p fd.
+ *
+ * @return 0 on success (also if nothing was pending), or -1 on error.
+ */
+int s_flush(int fd);
+
+/**
+ * @brief Flushes every output buffer of the calling process.
+ */
+void s_flush_all(void);
+
+/**
+ * @brief Chooses when the output buffer for @p fd is flushed.
+ *
+ * E.g. a built-in that prints a long report to the terminal switches its
+ * STDOUT to S_BUF_FULL and lets s_exit() write the report out in a few
+ * OBUF_SIZE chunks instead of one host write per line.
+ *
+ * @param fd The local file descriptor.
+ * @param mode S_BUF_LINE or S_BUF_FULL.
+ * @return 0 on success, or -1 on error.
+ */
+int s_setvbuf(int fd, int mode);
+
+/** @brief What s_stat() reports about a file */
+typedef struct file_stat {
+  off_t id;              // identifies the file while it exists (dirent offset)
+  uint32_t size;         // size in bytes
+  uint16_t first_block;  // first data block, 0 if empty
+  uint8_t type;          // 1: regular file, 2: directory
+  uint8_t perm;          // permission bits (4: read, 2: write, 1: execute)
+  time_t mtime;          // last modification time
+} file_stat_t;
+
+/**
+ * @brief Looks up a file without opening it.
+ *
+ * The size and mtime of a file that is being written are current, even if
+ * its directory entry has not been written back yet.
+ *
+ * @param fname The name of the file.
+ * @param st Receives the file's attributes.
+ * @return 0 on success, or -1 on error (FS_FILE_NOT_FOUND, ...).
+ */
+int s_stat(const char* fname, file_stat_t* st);
+
 /**
  * @brief Deletes a file from the file system.
  *
@@ -97,17 +227,70 @@ int s_unlink(const char* fname);
  */
 off_t s_lseek(int fd, int offset, int whence);
 
+/**
+ * @brief Flushes a file's pending metadata and data to the filesystem image.
+ *
+ * Writes keep the new file size in memory; it reaches the directory entry
+ * on close, on a periodic sync by the scheduler, or when this is called.
+ *
+ * @param fd The local file descriptor.
+ * @return 0 on success, or -1 on error.
+ */
+int s_fsync(int fd);
+
 /**
  * @brief Lists files in a directory.
  *
  * Lists all files in the specified directory (or current directory if filename
  * is NULL/empty) and writes the output to STDOUT.
  *
+ * Entries are read READDIR_BATCH at a time with s_readdir() and written
+ * through the output buffer of STDOUT (see s_bwrite()); a write error ends
+ * the listing early.
+ *
  * @param filename The name of the directory to list (or file to stat).
  * @return 0 on success, or -1 on error.
  */
 int s_ls(const char* filename);
 
+/** @brief A directory opened with s_opendir() */
+typedef struct dir_stream dir_stream_t;
+
+/**
+ * @brief Opens a directory for reading its entries.
+ *
+ * @param path The path of the directory, or NULL for the current one.
+ * @return The stream, to be released with s_closedir(), or NULL on error
+ * (FS_NOT_A_DIR, FS_FILE_NOT_FOUND, FS_MALLOC_FAIL, ...).
+ */
+dir_stream_t* s_opendir(const char* path);
+
+/** @brief One entry returned by s_readdir() */
+typedef struct s_dirent {
+  char name[MAX_NAME_LEN];
+  file_stat_t st;  // as s_stat() would report it
+} s_dirent_t;
+
+/**
+ * @brief Reads the next batch of entries of an open directory.
+ *
+ * The directory is read a block at a time as the batches need it, so a
+ * listing takes one block of memory however large the directory is.
+ * "." and ".." are returned too; deleted entries are not.
+ *
+ * @param dir The stream from s_opendir().
+ * @param entries Receives up to @p max entries.
+ * @param max Capacity of @p entries.
+ * @return The number of entries stored (possibly fewer than @p max before
+ * the end), 0 at the end, or -1 on error.
+ */
+ssize_t s_readdir(dir_stream_t* dir, s_dirent_t* entries, size_t max);
+
+/**
+ * @brief Closes a stream from s_opendir().
+ */
+void s_closedir(dir_stream_t* dir);
+
 /**
  * @brief Renames or moves a file.
  *
@@ -160,4 +343,45 @@ int s_chmod(const char* fname, int mode);
  */
 int s_check_executable(const char* fname);
 
+/**
+ * @brief Creates an empty directory.
+ *
+ * @param path The path of the new directory; like every path given to these
+ * calls, relative to the current directory of the process unless it starts
+ * with '/'.
+ * @return 0 on success, or -1 on error (FS_FILE_EXISTS, FS_FILE_NOT_FOUND,
+ * FS_NOT_A_DIR, FS_DISK_FULL, ...).
+ */
+int s_mkdir(const char* path);
+
+/**
+ * @brief Removes an empty directory.
+ *
+ * @param path The path of the directory.
+ * @return 0 on success, or -1 on error (FS_DIR_NOT_EMPTY, FS_NOT_A_DIR,
+ * FS_FILE_NOT_FOUND, FS_INVALID_ARG for the root, ...).
+ */
+int s_rmdir(const char* path);
+
+/**
+ * @brief Changes the current directory of the calling process.
+ *
+ * Children inherit it at spawn.
+ *
+ * @param path The path of the new current directory.
+ * @return 0 on success, or -1 on error (FS_FILE_NOT_FOUND, FS_NOT_A_DIR,
+ * P_ENAMETOOLONG, ...).
+ */
+int s_chdir(const char* path);
+
+/**
+ * @brief Copies the current directory of the calling process, an absolute
+ * path, into @p buf.
+ *
+ * @param buf Receives the path.
+ * @param size Size of @p buf.
+ * @return 0 on success, or -1 on error (P_EINVAL if it does not fit).
+ */
+int s_getcwd(char* buf, size_t size);
+
 #endif
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include "./util/bulk.h"
 #include "./util/parser.h"
 #include "./util/struct.h"
 #include "fat_kernel.h"
@@ -74,21 +75,36 @@ int main(int argc, char* argv[]) {
     ////////////////////////////////////////////////////////////
     char** args = parsed_cmd->commands[0];
     if (strcmp(args[0], "mkfs") == 0) {  // mkfs
-      if (!args[1] || !args[2] || !args[3]) {
+      // optional fourth argument: -p preallocates the image instead of
+      // leaving it sparse
+      if (!args[1] || !args[2] || !args[3] ||
+          (args[4] && strcmp(args[4], "-p") != 0)) {
         const char* msg = "mkfs: invalid arguments\n";
         k_write(STDERR_FILENO, msg, strlen(msg));
       } else {
         if (mkfs(args[1], (int)strtol(args[2], NULL, 10),
-                 (int)strtol(args[3], NULL, 10)) == -1) {
+                 (int)strtol(args[3], NULL, 10), args[4] != NULL) == -1) {
           // error handled by mkfs
         }
       }
     } else if (strcmp(args[0], "mount") == 0) {  // mount
-      if (!args[1]) {
+      // optional second argument: block cache capacity, or -m to map the
+      // whole image
+      fs_config_t config;
+      k_fs_config_default(&config);
+      char* end = NULL;
+      long cache = 0;
+      if (args[1] && args[2] && strcmp(args[2], "-m") == 0) {
+        config.map_data = true;
+      } else if (args[1] && args[2]) {
+        cache = strtol(args[2], &end, 10);
+        config.cache_blocks = (size_t)cache;
+      }
+      if (!args[1] || (end && (*end != '\0' || cache < 0))) {
         const char* msg = "mount: invalid arguments\n";
         k_write(STDERR_FILENO, msg, strlen(msg));
       } else {
-        if (mount(args[1]) == -1) {
+        if (mount(args[1], &config) == -1) {
           // error handled by mount
         }
       }
@@ -102,9 +118,32 @@ int main(int argc, char* argv[]) {
         }
       }
     } else if (strcmp(args[0], "ls") == 0) {  // ls
-      if (k_ls(NULL) == -1) {
+      if (k_ls(args[1]) == -1) {
         f_perror("ls");
       }
+    } else if (strcmp(args[0], "mkdir") == 0 ||
+               strcmp(args[0], "rmdir") == 0) {  // mkdir / rmdir
+      bool make = strcmp(args[0], "mkdir") == 0;
+      if (!args[1]) {
+        int len = snprintf(log_buf, sizeof(log_buf),
+                           "%s: invalid arguments\n", args[0]);
+        k_write(STDERR_FILENO, log_buf, len);
+      }
+      for (int i = 1; args[i]; i++) {
+        if ((make ? k_mkdir(args[i]) : k_rmdir(args[i])) == -1) {
+          int len = snprintf(log_buf, sizeof(log_buf), "%s: '%s': ",
+                             args[0], args[i]);
+          k_write(STDERR_FILENO, log_buf, len);
+          f_perror(NULL);
+        }
+      }
+    } else if (strcmp(args[0], "cd") == 0) {  // cd
+      if (args[1] && args[2]) {
+        const char* msg = "cd: invalid arguments\n";
+        k_write(STDERR_FILENO, msg, strlen(msg));
+      } else if (k_chdir(args[1] ? args[1] : "/") == -1) {
+        f_perror("cd");
+      }
     } else if (strcmp(args[0], "touch") == 0) {  // touch
       if (!args[1]) {
         const char* msg = "touch: invalid arguments\n";
@@ -188,6 +227,48 @@ int main(int argc, char* argv[]) {
           f_perror("cp");
         }
       }
+    } else if (strcmp(args[0], "import") == 0 ||
+               strcmp(args[0], "export") == 0) {  // import / export
+      // import HOSTPATH...: host files and directory contents into the root;
+      // export HOSTDIR [FILE...]: the named files (default: all) to HOSTDIR
+      bool import = strcmp(args[0], "import") == 0;
+      if (!args[1]) {
+        int len = snprintf(log_buf, sizeof(log_buf), "%s: invalid arguments\n",
+                           args[0]);
+        k_write(STDERR_FILENO, log_buf, len);
+      } else {
+        bulk_stats_t stats;
+        int result = import ? k_bulk_import(&args[1], &stats)
+                            : k_bulk_export(args[1], &args[2], &stats);
+        if (result == -1 && stats.files == 0 && stats.failed == 0) {
+          f_perror(args[0]);  // nothing was tried
+        } else {
+          int len = snprintf(log_buf, sizeof(log_buf),
+                             "%zu files %sed (%llu bytes), %zu failed\n",
+                             stats.files, args[0],
+                             (unsigned long long)stats.bytes, stats.failed);
+          k_write(STDOUT_FILENO, log_buf, len);
+        }
+      }
+    } else if (strcmp(args[0], "defrag") == 0) {  // defrag
+      size_t moved;
+      if (k_defrag(&moved) == -1) {
+        f_perror("defrag");
+      } else {
+        int len = snprintf(log_buf, sizeof(log_buf), "%zu blocks moved\n",
+                           moved);
+        k_write(STDOUT_FILENO, log_buf, len);
+      }
+    } else if (strcmp(args[0], "df") == 0) {  // df
+      size_t free_blocks, total_blocks;
+      if (k_block_usage(&free_blocks, &total_blocks) == -1) {
+        f_perror("df");
+      } else {
+        int len = snprintf(log_buf, sizeof(log_buf),
+                           "%zu of %zu blocks free (%zu bytes)\n", free_blocks,
+                           total_blocks, free_blocks * FS_BLOCK_SIZE);
+        k_write(STDOUT_FILENO, log_buf, len);
+      }
     } else {
       int len = snprintf(log_buf, sizeof(log_buf), "command not found: %s\n",
                          args[0]);
@@ -1,16 +1,21 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "./util/script_cache.h"
 #include "./util/struct.h"
 #include "fat_kernel.h"
 #include "process.h"
 #include "scheduler.h"
 
 // Initialize all kernel data structures (queues, tables, FAT mount)
-static void k_init(const char* fatfs_name, const char* log_fname) {
+static void k_init(const char* fatfs_name,
+                   const fs_config_t* fs_config,
+                   const sched_config_t* config) {
   // Initialize scheduler (which will initialize queues)
-  k_scheduler_init(log_fname);
+  k_scheduler_init(config);
 
   // Mount FAT filesystem
-  if (mount(fatfs_name) != FS_SUCCESS) {
+  if (mount(fatfs_name, fs_config) != FS_SUCCESS) {
     fprintf(stderr, "Failed to mount filesystem: %s\n", fatfs_name);
     exit(1);
   }
@@ -18,15 +23,78 @@ static void k_init(const char* fatfs_name, const char* log_fname) {
 
 int main(int argc, char* argv[]) {
   if (argc < 2) {
-    fprintf(stderr, "Usage: %s <fatfs_name> [log_fname]\n", argv[0]);
+    fprintf(stderr,
+            "Usage: %s <fatfs_name> [log_fname] [-b] [-q ms] [-p policy] "
+            "[-w weights] [-c blocks] [-m] [-f]\n",
+            argv[0]);
+    fprintf(stderr, "  -b          record a binary trace (decode with trace_decode)\n");
+    fprintf(stderr, "  -q ms       scheduler time slice (default %d ms)\n",
+            SCHED_DEFAULT_QUANTUM_MS);
+    fprintf(stderr, "  -p policy   queue selection: stride (default) or table\n");
+    fprintf(stderr, "  -w weights  per-queue stride weights (default 9,6,4)\n");
+    fprintf(stderr, "  -c blocks   filesystem block cache size (default %d, 0 = off)\n",
+            FS_DEFAULT_CACHE_BLOCKS);
+    fprintf(stderr, "  -m          memory-map the whole filesystem image\n");
+    fprintf(stderr, "  -f          multilevel-feedback priorities (demote, promote, age)\n");
     return 1;
   }
 
   const char* fatfs_name = argv[1];
-  const char* log_fname = (argc >= 3) ? argv[2] : NULL;
+  fs_config_t fs_config;
+  k_fs_config_default(&fs_config);
+  sched_config_t config;
+  k_scheduler_config_default(&config);
+
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "-b") == 0) {
+      config.binary_log = true;
+    } else if (strcmp(argv[i], "-q") == 0) {
+      char* end = NULL;
+      long ms = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : 0;
+      if (end == NULL || *end != '\0' || ms <= 0 || ms > 10000) {
+        fprintf(stderr, "-q expects a time slice between 1 and 10000 ms\n");
+        return 1;
+      }
+      config.quantum_ms = (unsigned int)ms;
+      i++;
+    } else if (strcmp(argv[i], "-p") == 0) {
+      config.policy = i + 1 < argc ? k_policy_lookup(argv[i + 1]) : NULL;
+      if (config.policy == NULL) {
+        fprintf(stderr, "-p expects a policy: stride or table\n");
+        return 1;
+      }
+      i++;
+    } else if (strcmp(argv[i], "-w") == 0) {
+      if (i + 1 >= argc ||
+          !k_policy_parse_weights(argv[i + 1], config.weights)) {
+        fprintf(stderr, "-w expects %d positive weights, e.g. 9,6,4\n",
+                NUM_PRIO);
+        return 1;
+      }
+      i++;
+    } else if (strcmp(argv[i], "-c") == 0) {
+      char* end = NULL;
+      long blocks = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : -1;
+      if (end == NULL || *end != '\0' || blocks < 0 || blocks > 65535) {
+        fprintf(stderr, "-c expects a cache size between 0 and 65535 blocks\n");
+        return 1;
+      }
+      fs_config.cache_blocks = (size_t)blocks;
+      i++;
+    } else if (strcmp(argv[i], "-m") == 0) {
+      fs_config.map_data = true;
+    } else if (strcmp(argv[i], "-f") == 0) {
+      config.feedback = true;
+    } else if (config.log_fname == NULL) {
+      config.log_fname = argv[i];
+    } else {
+      fprintf(stderr, "Unexpected argument: %s\n", argv[i]);
+      return 1;
+    }
+  }
 
   // Initialize kernel with filesystem and log file
-  k_init(fatfs_name, log_fname);
+  k_init(fatfs_name, &fs_config, &config);
 
   // Start the init process (which will spawn the shell)
   k_start_init_process();
@@ -37,6 +105,9 @@ int main(int argc, char* argv[]) {
   // Cleanup all remaining processes
   k_kill_all_processes();
 
+  // Free the parsed scripts
+  script_cache_clear();
+
   // Cleanup scheduler queues
   k_scheduler_cleanup();
 
@@ -4,13 +4,16 @@
 #include <string.h>
 #include <unistd.h>
 #include "./util/job.h"
+#include "./util/kstat.h"
 #include "./util/p_errno.h"
 #include "./util/p_handler.h"
 #include "./util/p_signal.h"
 #include "./util/parser.h"
 #include "./util/queue.h"
+#include "./util/script_cache.h"
 #include "./util/spthread.h"
 #include "./util/stress.h"
+#include "fat_kernel.h"
 #include "fat_syscalls.h"
 #include "scheduler.h"
 #include "syscall.h"
@@ -20,8 +23,58 @@
 #define MAX_LINE_LEN 4096
 typedef void* (*program_entry_fn)(void*);  // Program entry point signature
 
-static process_table pcb_table;
-static pid_t next_pid = 1;
+/** @brief A built-in command and the function that runs it */
+typedef struct built_in {
+  const char* name;
+  program_entry_fn entry;
+} built_in_t;
+
+// Built-ins spawned as a process of their own. Sorted by name (strcmp) for
+// find_built_in(); keep it that way when adding one.
+static const built_in_t BUILT_IN_PROGRAMS[] = {
+    {"busy", u_busy},           {"cat", u_cat},
+    {"chmod", u_chmod},         {"cp", u_cp},
+    {"crash", crash},           {"echo", u_echo},
+    {"hang", hang},             {"kill", u_kill},
+    {"ls", u_ls},               {"mkdir", u_mkdir},
+    {"mv", u_mv},               {"nohang", nohang},
+    {"orphanify", u_orphanify}, {"ps", u_ps},
+    {"pwd", u_pwd},             {"recur", recur},
+    {"rm", u_rm},               {"rmdir", u_rmdir},
+    {"schedstat", u_schedstat}, {"sleep", u_sleep},
+    {"stat", u_stat},           {"touch", u_touch},
+    {"zombify", u_zombify},
+};
+
+// Built-ins the shell runs itself, sorted the same way. nice is handled
+// by run_parsed_command() since it wraps another command.
+static const built_in_t SHELL_BUILT_INS[] = {
+    {"bg", u_bg},     {"cd", u_cd},         {"fg", u_fg},
+    {"jobs", u_jobs}, {"logout", u_logout}, {"man", u_man},
+    {"nice_pid", u_nice_pid},
+};
+
+#define PCB_SLAB_SIZE 64    // PCBs carved out of one allocation
+#define PROC_TABLE_INIT 64  // first size of pcb_table (grows by doubling)
+#define PCB_ARENA_KEEP 1024  // larger spawn arenas are freed at reap time
+
+/** @brief One allocation holding PCB_SLAB_SIZE PCBs */
+typedef struct pcb_slab {
+  struct pcb_slab* next;
+  pcb_t pcbs[PCB_SLAB_SIZE];
+} pcb_slab_t;
+
+static pcb_t** pcb_table = NULL;  // pid -> PCB, pcb_table_len entries
+static size_t pcb_table_len = 0;
+static pcb_slab_t* pcb_slabs = NULL;  // every slab, freed at shutdown
+static pcb_t* pcb_free = NULL;  // unused PCBs, linked through q_next
+// Free PIDs, oldest first: a reaped PID is handed out again only after every
+// other free PID, so stale PIDs held by a job or a script stay unambiguous
+// for as long as possible.
+static pid_t* free_pids = NULL;  // ring of pcb_table_len entries
+static size_t free_head = 0;
+static size_t free_len = 0;
+static uint64_t next_gen = 1;  // next pcb->gen
 static pid_t g_terminal_pgrp_id = PID_INVALID;
 static volatile bool g_shutdown_requested = false;
 
@@ -32,21 +85,72 @@ static volatile bool g_shutdown_requested = false;
 /**
  * @brief Parses and executes a single command line.
  *
- * This function parses the input line, handles shell built-in commands
- * (nice, man, nice_pid, bg, fg, jobs, logout) directly, or spawns a new process
- * for other commands. It manages foreground and background execution,
- * job control updates, and process waiting.
- *
  * @param line The command line string to parse and execute.
  * @return Returns 0 on success.
  */
 static int run_command_line(char* line);
 
+/**
+ * @brief Executes a parsed command line.
+ *
+ * This function handles shell built-in commands (nice, man, nice_pid, bg,
+ * fg, jobs, logout) directly, or spawns a new process for other commands
+ * (one per stage of a pipeline, see run_pipeline()). It manages foreground
+ * and background execution, job control updates, and process waiting.
+ * @p pcmd is not modified, so a script's cached lines can be run again.
+ *
+ * @param pcmd The parsed command line (at least one command).
+ */
+static void run_parsed_command(struct parsed_command* pcmd);
+
+/**
+ * @brief Spawn one command: a built-in program, or else a script run by a
+ * sub-shell. Prints "command not found" if neither exists.
+ *
+ * @param argv       The command and its arguments.
+ * @param stdin_file Input redirection file, or NULL.
+ * @param stdout_file Output redirection file, or NULL.
+ * @param is_append  Whether @p stdout_file is appended to.
+ * @param pipe_in    Local fd of a pipe end to use as stdin, or -1.
+ * @param pipe_out   Local fd of a pipe end to use as stdout, or -1.
+ * @return The child's PID, or -1 if it could not be spawned.
+ */
+static pid_t spawn_command(char** argv,
+                           const char* stdin_file,
+                           const char* stdout_file,
+                           int is_append,
+                           int pipe_in,
+                           int pipe_out);
+
+/**
+ * @brief Run `a | b | ...`: spawn every stage with a pipe between each pair
+ * of neighbors, then wait for the pipeline unless it runs in the background.
+ *
+ * The input redirection goes to the first stage, the output redirection to
+ * the last one, and nice to the first one. The last stage is the job.
+ *
+ * @param pcmd         The parsed command line (num_commands > 1).
+ * @param argv         The first stage's argv (past a nice prefix).
+ * @param priority     Priority requested by nice, or -1.
+ * @param command_name Name of the pipeline in the job table.
+ */
+static void run_pipeline(struct parsed_command* pcmd,
+                         char** argv,
+                         int priority,
+                         const char* command_name);
+
+/**
+ * @brief Add a process that was stopped in the foreground to the job table
+ * and report it.
+ */
+static void shell_job_stopped(pid_t pid, const char* command_name);
+
 /**
  * @brief Runs the shell in script mode.
  *
- * Opens the specified script file, reads it line by line, and executes
- * each line using run_command_line.
+ * Takes the parsed lines of the script from the script cache (which reads
+ * and parses the file only if it changed since it was last run) and
+ * executes each of them using run_parsed_command.
  *
  * @param script_name The path to the script file to execute.
  * @return NULL (typically called in a thread context).
@@ -65,16 +169,21 @@ static void* shell_run_script(const char* script_name);
 static void* shell_run_interactive(void);
 
 /**
- * @brief Compares two strings.
- *
- * A helper function to compare two null-terminated strings.
+ * @brief Binary search for a built-in in a table sorted by name.
  *
- * @param s1 The first string.
- * @param s2 The second string.
- * @return An integer less than, equal to, or greater than zero if s1 is found,
- *         respectively, to be less than, to match, or be greater than s2.
+ * @param table The table (BUILT_IN_PROGRAMS or SHELL_BUILT_INS).
+ * @param len   Number of entries in @p table.
+ * @param name  The command name.
+ * @return The built-in's entry function, or NULL if there is none.
+ */
+static program_entry_fn find_built_in(const built_in_t* table,
+                                      size_t len,
+                                      const char* name);
+
+/**
+ * @brief bsearch() comparator: a command name against a built_in_t.
  */
-static int str_compare(const char* s1, const char* s2);
+static int built_in_compare(const void* key, const void* entry);
 
 /**
  * @brief Retrieves the function pointer for a built-in program.
@@ -87,6 +196,56 @@ static int str_compare(const char* s1, const char* s2);
  */
 static program_entry_fn get_built_in_program(const char* command_name);
 
+/**
+ * @brief Take a PCB from the free list, carving a new slab if it is empty.
+ *
+ * @return An uninitialized PCB, or NULL if memory is exhausted.
+ */
+static pcb_t* k_pcb_alloc(void);
+
+/**
+ * @brief Return a PCB to the free list. Its spawn arena is kept for reuse.
+ */
+static void k_pcb_free(pcb_t* proc);
+
+/**
+ * @brief Append @p child to the child list of @p parent in O(1).
+ */
+static void k_child_link(pcb_t* parent, pcb_t* child);
+
+/**
+ * @brief Unlink @p child from its parent's child list (and wait events) in
+ * O(1). It is a no-op if it has no parent.
+ */
+static void k_child_unlink(pcb_t* child);
+
+/**
+ * @brief Take the oldest free PID, growing the process table if none is left.
+ *
+ * @return A PID, or PID_INVALID if MAX_PROC processes are alive.
+ */
+static pid_t k_pid_alloc(void);
+
+/**
+ * @brief Put a reaped PID at the back of the free PID ring.
+ */
+static void k_pid_free(pid_t pid);
+
+/**
+ * @brief Double the process table (up to MAX_PROC) and queue the new PIDs.
+ *
+ * @return 0 on success, -1 if it is full or memory is exhausted.
+ */
+static int k_proc_table_grow(void);
+
+/**
+ * @brief Close every pipe end in the fd table of @p proc.
+ *
+ * Done as soon as a process dies, not when it is reaped, so that the other
+ * end sees EOF (or P_EPIPE) right away.
+ */
+static void k_proc_close_pipes(pcb_t* proc);
+
 //////////////////////////////////////////////////////////////////////////////
 // =================== Public API Implementation =================== ////////
 ////////////////////////////////////////////////////////////////////////////
@@ -102,23 +261,36 @@ void* shell_main(void* arg) {
 }
 
 pcb_t* k_proc_create(pcb_t* parent) {
-  pcb_t* new_pcb = (pcb_t*)malloc(sizeof(struct pcb));
+  pid_t pid = k_pid_alloc();
+  if (pid == PID_INVALID) {
+    return NULL;
+  }
+  pcb_t* new_pcb = k_pcb_alloc();
   if (!new_pcb) {
     perror("k_proc_create");
+    k_pid_free(pid);
     return NULL;
   }
 
   pcb_init(new_pcb);
-  new_pcb->pid = next_pid++;
+  new_pcb->pid = pid;
+  new_pcb->gen = next_gen++;
   if (parent) {
-    new_pcb->ppid = parent->pid;  // if no parent then ppid = 0
-    new_pcb->parent = parent;
-    vec_push_back(&parent->childs, new_pcb);  // update parent's child array.
+    // update parent's child list (and ppid; with no parent it stays 0)
+    k_child_link(parent, new_pcb);
 
-    // Inherit file descriptors from parent (especially stdin/stdout/stderr)
+    // Inherit file descriptors from parent (especially stdin/stdout/stderr).
+    // A pipe end is only open while some process holds it, so the child gets
+    // its own end; ends above stderr are not inherited at all, or a reader
+    // would never see EOF while a sibling holds a stray write end.
     for (int i = 0; i < MAX_FD; i++) {
-      new_pcb->fd_table[i] = parent->fd_table[i];
+      int kfd = parent->fd_table[i];
+      if (k_is_pipe(kfd)) {
+        kfd = i <= STDERR_FILENO ? k_pipe_dup(kfd) : -1;
+      }
+      new_pcb->fd_table[i] = kfd;
     }
+    memcpy(new_pcb->cwd, parent->cwd, MAX_PATH_LEN);
   }
 
   pcb_table[new_pcb->pid] = new_pcb;  // add process to global pcb table
@@ -129,30 +301,41 @@ pcb_t* k_proc_create(pcb_t* parent) {
 void k_proc_cleanup(pcb_t* proc) {
   if (proc->pid != PID_INIT) {
     // Remove process from its parent's child list (if it had one)
-    if (proc->parent) {
-      vec_remove(&proc->parent->childs, proc);
-    }
+    k_child_unlink(proc);
     // Note: k_adopt_orphans is now called in k_terminate, not here
     // This ensures orphans are adopted immediately when parent becomes zombie
   }
 
-  // Wait for the thread to finish and free its resources (spthread_meta_t)
-  spthread_join(proc->process, NULL);
+  // Never leave a dangling PCB linked into a scheduler queue
+  k_remove_from_queues(proc);
+  k_proc_close_pipes(proc);  // a zombie has none left; a failed spawn might
 
-  // Remove the process from global pcb table
-  pcb_table[proc->pid] = NULL;
+  // Output still buffered now was never flushed (killed by a signal)
+  for (int i = 0; i < MAX_FD; i++) {
+    free(proc->obuf[i]);
+    proc->obuf[i] = NULL;
+  }
 
-  if (proc->args != NULL) {
-    for (int i = 0; proc->args[i] != NULL; i++) {
-      free(proc->args[i]);
-    }
-    free(proc->args);
-    proc->args = NULL;
+  // Wait for the thread to finish, then park it for the next s_spawn (or
+  // join it and free its spthread_meta_t)
+  if (proc->process.meta != NULL) {
+    spthread_pool_release(proc->process);
+  }
+
+  // Remove the process from global pcb table and recycle its PID
+  pcb_table[proc->pid] = NULL;
+  k_pid_free(proc->pid);
+
+  // argv and the redirection data all live in the spawn arena
+  proc->args = NULL;
+  if (proc->arena_size > PCB_ARENA_KEEP) {
+    free(proc->arena);
+    proc->arena = NULL;
+    proc->arena_size = 0;
   }
 
-  // Deallocate memories
-  vec_destroy(&proc->childs);
-  free(proc);
+  // Back to the slab
+  k_pcb_free(proc);
 }
 
 void k_terminate(pcb_t* proc) {
@@ -162,17 +345,18 @@ void k_terminate(pcb_t* proc) {
 
   // Log SIGNALED event if process was terminated by signal
   if (proc->exit_status == P_EXIT_SIGNALED) {
-    k_log_event("SIGNALED", proc);
+    k_log_event(LOG_SIGNALED, proc);
     // Cancel the process to prevent it from running
     spthread_cancel(proc->process);
   }
 
   // Remove process from any queue it might be in before changing state
   k_remove_from_queues(proc);
+  k_proc_close_pipes(proc);
 
   proc->state = P_ZOMBIE;
   // Log the zombie event
-  k_log_event("ZOMBIE", proc);
+  k_log_event(LOG_ZOMBIE, proc);
 
   // Adopt orphans immediately when process becomes zombie
   // This ensures children are transferred to init right away
@@ -180,10 +364,8 @@ void k_terminate(pcb_t* proc) {
     k_adopt_orphans(proc);
   }
 
-  pcb_t* parent = proc->parent;
-  if (parent && parent->state == P_BLOCKED && parent->wake_tick == 0) {
-    k_unblock(parent);
-  }
+  // Report the zombie to the parent's waitpid (and wake it up)
+  k_wait_event_push(proc);
 
   // if (proc == current) {
   //   k_scheduler_tick();
@@ -194,40 +376,31 @@ void k_reap_zombie(pcb_t* proc, pid_t childpid) {
   if (!proc)
     return;
 
-  for (int i = 0; i < vec_len(&proc->childs); i++) {
-    pcb_t* child = vec_get(&proc->childs, i);
-
-    if (child->pid == childpid && child->state == P_ZOMBIE) {
-      vec_erase(&proc->childs, i);
-      k_log_event("WAITED", child);
-      k_proc_cleanup(child);
-      break;
-    }
+  // the PID indexes the child directly; no scan of the child list
+  pcb_t* child = get_process_by_pid(childpid);
+  if (child && child->parent == proc && child->state == P_ZOMBIE) {
+    k_log_event(LOG_WAITED, child);
+    k_proc_cleanup(child);  // also unlinks it and drops its wait event
+    KSTAT_INC(KSTAT_REAPS);
   }
 }
 
 void k_adopt_orphans(pcb_t* proc) {
   pcb_t* init = pcb_table[PID_INIT];
-  bool has_zombie = false;
 
-  // Reassign the process's childs to process init
-  for (int i = 0; i < vec_len(&proc->childs); i++) {
-    pcb_t* child = vec_get(&proc->childs, i);
-    child->parent = init;
-    child->ppid = PID_INIT;
-    vec_push_back(&init->childs, child);
-    k_log_event("ORPHAN", child);
-
-    // Check if this orphan is already a zombie
-    if (child->state == P_ZOMBIE) {
-      has_zombie = true;
+  // Reassign the process's childs to process init. Pending state changes
+  // (e.g. children that are zombies already) move along and wake init up to
+  // reap them.
+  while (proc->child_head) {
+    pcb_t* child = proc->child_head;
+    bool pending = child->w_queued;
+    k_child_unlink(child);
+    k_child_link(init, child);
+    k_log_event(LOG_ORPHAN, child);
+    if (pending) {
+      k_wait_event_push(child);
     }
   }
-
-  // If any zombie children were adopted, wake up init to reap them
-  if (has_zombie && init->state == P_BLOCKED && init->wake_tick == 0) {
-    k_unblock(init);
-  }
 }
 
 void k_start_init_process(void) {
@@ -249,7 +422,7 @@ void k_start_init_process(void) {
   init->fd_table[2] = 2;  // STDERR
 
   // Log the CREATE event now that cmd_name is set
-  k_log_event("CREATE", init);
+  k_log_event(LOG_CREATE, init);
 
   // Create spthread for INIT process
   // Shell will be created in k_INIT_main
@@ -344,7 +517,7 @@ pcb_t* get_current_process(void) {
 }
 
 pcb_t* get_process_by_pid(pid_t pid) {
-  if (pid < 0 || pid >= MAX_PROC) {
+  if (pid < 0 || (size_t)pid >= pcb_table_len) {
     return NULL;
   }
   return pcb_table[pid];
@@ -380,25 +553,44 @@ bool k_is_shutdown_requested(void) {
 
 void k_kill_all_processes(void) {
   // 1. Cancel all non-zombie processes
-  for (int i = 0; i < MAX_PROC; i++) {
+  for (size_t i = 0; i < pcb_table_len; i++) {
     if (pcb_table[i] && pcb_table[i]->state != P_ZOMBIE) {
       spthread_cancel(pcb_table[i]->process);
     }
   }
 
   // 2. Break parent pointers to avoid invalid accesses during cleanup
-  for (int i = 0; i < MAX_PROC; i++) {
+  for (size_t i = 0; i < pcb_table_len; i++) {
     if (pcb_table[i]) {
       pcb_table[i]->parent = NULL;
     }
   }
 
   // 3. Cleanup all processes
-  for (int i = 0; i < MAX_PROC; i++) {
+  for (size_t i = 0; i < pcb_table_len; i++) {
     if (pcb_table[i]) {
       k_proc_cleanup(pcb_table[i]);
     }
   }
+
+  // 4. Release the parked threads, the slabs and the process table
+  spthread_pool_destroy();
+  while (pcb_slabs) {
+    pcb_slab_t* next = pcb_slabs->next;
+    for (size_t i = 0; i < PCB_SLAB_SIZE; i++) {
+      free(pcb_slabs->pcbs[i].arena);
+    }
+    free(pcb_slabs);
+    pcb_slabs = next;
+  }
+  pcb_free = NULL;
+  free(pcb_table);
+  free(free_pids);
+  pcb_table = NULL;
+  free_pids = NULL;
+  pcb_table_len = 0;
+  free_head = 0;
+  free_len = 0;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -423,6 +615,22 @@ static int run_command_line(char* line) {
     return 0;
   }
 
+  if (strcmp(pcmd->commands[0][0], "logout") == 0) {
+    // u_logout() exits the shell and never comes back to free it
+    free(pcmd);
+    u_logout(NULL);
+    return 0;
+  }
+
+  run_parsed_command(pcmd);
+
+  // Free the parsed command
+  free(pcmd);
+  pcmd = NULL;
+  return 0;
+}
+
+static void run_parsed_command(struct parsed_command* pcmd) {
   // Check for shell built-in commands that run as shell subroutines
   char** argv = pcmd->commands[0];
   int priority = -1;  // flag for nice command
@@ -432,48 +640,28 @@ static int run_command_line(char* line) {
     if (argv[1] == NULL || argv[2] == NULL) {
       const char* msg = "nice: usage: nice <priority> <command> [args...]\n";
       s_write(STDERR_FILENO, msg, strlen(msg));
-      free(pcmd);
-      return 0;
+      return;
     }
 
     priority = atoi(argv[1]);
-    if (priority < 0 || priority > 2) {
+    if (priority < 0 || priority >= NUM_PRIO) {
       const char* msg = "nice: invalid priority\n";
       s_write(STDERR_FILENO, msg, strlen(msg));
-      free(pcmd);
-      return 0;
+      return;
     }
 
     argv = argv + 2;  // Skip the first two arguments (nice and priority)
-  } else if (strcmp(argv[0], "man") == 0) {
-    u_man(argv);
-    free(pcmd);
-    return 0;
-  } else if (strcmp(argv[0], "nice_pid") == 0) {
-    u_nice_pid(argv);
-    free(pcmd);
-    return 0;
-  } else if (strcmp(argv[0], "bg") == 0) {
-    u_bg(argv);
-    free(pcmd);
-    return 0;
-  } else if (strcmp(argv[0], "fg") == 0) {
-    u_fg(argv);
-    free(pcmd);
-    return 0;
-  } else if (strcmp(argv[0], "jobs") == 0) {
-    u_jobs(argv);
-    free(pcmd);
-    return 0;
-  } else if (strcmp(argv[0], "logout") == 0) {
-    free(pcmd);
-    u_logout(argv);
-    return 0;
+  } else {
+    program_entry_fn shell_built_in =
+        find_built_in(SHELL_BUILT_INS,
+                      sizeof(SHELL_BUILT_INS) / sizeof(SHELL_BUILT_INS[0]),
+                      argv[0]);
+    if (shell_built_in != NULL) {
+      shell_built_in(argv);
+      return;
+    }
   }
 
-  // Execute Command (Spawn Child)
-  program_entry_fn program_entry = get_built_in_program(argv[0]);
-
   // Build command name for job tracking
   char command_name[64];
   const char* cmd = argv[0];
@@ -485,19 +673,15 @@ static int run_command_line(char* line) {
     snprintf(command_name, sizeof(command_name), "%s", cmd);
   }
 
-  pid_t child_pid = -1;
-
-  if (program_entry == NULL) {
-    // Not a built-in command - try to execute as a script via sub-shell
-    char* shell_argv[] = {"shell", argv[0], NULL};
-    child_pid = s_spawn(shell_main, shell_argv, pcmd->stdin_file,
-                        pcmd->stdout_file, pcmd->is_file_append);
-  } else {
-    // Built-in command
-    child_pid = s_spawn(program_entry, argv, pcmd->stdin_file,
-                        pcmd->stdout_file, pcmd->is_file_append);
+  if (pcmd->num_commands > 1) {
+    run_pipeline(pcmd, argv, priority, command_name);
+    return;
   }
 
+  // Execute Command (Spawn Child)
+  pid_t child_pid = spawn_command(argv, pcmd->stdin_file, pcmd->stdout_file,
+                                  pcmd->is_file_append, -1, -1);
+
   if (child_pid > 0) {
     pcb_t* child_pcb = get_process_by_pid(child_pid);
 
@@ -512,15 +696,7 @@ static int run_command_line(char* line) {
       s_waitpid(child_pid, &wstatus, false);  // Blocking wait (false = block)
       if (P_WIFSTOPPED(wstatus)) {
         // Process was stopped, add it to the job table as STOPPED
-        int job_id = jobs_add(child_pid, child_pcb, command_name);
-        job_t* job = jobs_find_by_pid(child_pid);
-        if (job) {
-          job->state = JOB_STOPPED;
-          char buf[128];
-          int len = snprintf(buf, sizeof(buf), "\n[%d] Stopped %s\n", job_id,
-                             command_name);
-          s_write(STDOUT_FILENO, buf, len);
-        }
+        shell_job_stopped(child_pid, command_name);
       } else if (P_WIFSIGNALED(wstatus)) {
         s_write(STDOUT_FILENO, "\n", 1);  // Newline for Ctrl-C termination
       }
@@ -540,68 +716,151 @@ static int run_command_line(char* line) {
         s_kill(child_pid, 1);
       }
     }
-  } else {
-    // Spawn failed
-    if (program_entry == NULL) {
-      char buf[128];
-      int len =
-          snprintf(buf, sizeof(buf), "shell: command not found: %s\n", argv[0]);
-      s_write(STDERR_FILENO, buf, len);
-    }
   }
-
-  // Free the parsed command
-  free(pcmd);
-  pcmd = NULL;
-  return 0;
 }
 
-static void* shell_run_script(const char* script_name) {
-  // Check execute permission first
-  if (s_check_executable(script_name) < 0 && P_ERRNO != P_ENOENT) {
-    char buf[128];
-    int len = snprintf(buf, sizeof(buf), "shell: permission denied: %s\n",
-                       script_name);
-    s_write(STDERR_FILENO, buf, len);
-    s_exit();
-    return NULL;
+static pid_t spawn_command(char** argv,
+                           const char* stdin_file,
+                           const char* stdout_file,
+                           int is_append,
+                           int pipe_in,
+                           int pipe_out) {
+  program_entry_fn program_entry = get_built_in_program(argv[0]);
+  pid_t child_pid = -1;
+
+  if (program_entry == NULL) {
+    // Not a built-in command - try to execute as a script via sub-shell
+    char* shell_argv[] = {"shell", argv[0], NULL};
+    child_pid = s_spawn_piped(shell_main, shell_argv, stdin_file, stdout_file,
+                              is_append, pipe_in, pipe_out);
+  } else {
+    // Built-in command
+    child_pid = s_spawn_piped(program_entry, argv, stdin_file, stdout_file,
+                              is_append, pipe_in, pipe_out);
   }
 
-  // Try to open the script file from PennFAT
-  int fd = s_open(script_name, F_READ);
-  if (fd < 0) {
+  if (child_pid <= 0 && program_entry == NULL) {
     char buf[128];
-    int len = snprintf(buf, sizeof(buf), "shell: script not found: %s\n",
-                       script_name);
+    int len =
+        snprintf(buf, sizeof(buf), "shell: command not found: %s\n", argv[0]);
     s_write(STDERR_FILENO, buf, len);
-    s_exit();
-    return NULL;
   }
+  return child_pid;
+}
 
-  char buffer[4096];
-  ssize_t bytes_read;
-
-  // Read and execute the script line by line
-  while ((bytes_read = s_read(fd, sizeof(buffer) - 1, buffer)) > 0) {
-    buffer[bytes_read] = '\0';
+static void run_pipeline(struct parsed_command* pcmd,
+                         char** argv,
+                         int priority,
+                         const char* command_name) {
+  size_t n = pcmd->num_commands;
+  pid_t pids[n];
+  int prev_in = -1;  // read end of the pipe from the previous stage
+
+  for (size_t i = 0; i < n; i++) {
+    int fds[2] = {-1, -1};
+    if (i + 1 < n && s_pipe(fds) < 0) {
+      u_perror("pipe");
+      n = i;  // the stages so far lose their reader and end on P_EPIPE
+      break;
+    }
 
-    char* line_start = buffer;
-    char* newline;
+    char** stage = i == 0 ? argv : pcmd->commands[i];
+    pids[i] = spawn_command(stage, i == 0 ? pcmd->stdin_file : NULL,
+                            i + 1 == n ? pcmd->stdout_file : NULL,
+                            pcmd->is_file_append, prev_in, fds[1]);
+    if (i == 0 && pids[0] > 0 && priority != -1) {
+      s_nice(pids[0], priority);
+    }
 
-    // Process each line in the buffer
-    while ((newline = strchr(line_start, '\n')) != NULL) {
-      *newline = '\0';
+    // The children hold their own ends now. The shell must not keep a write
+    // end open, or the next stage would never see EOF.
+    if (prev_in != -1) {
+      s_close(prev_in);
+    }
+    if (fds[1] != -1) {
+      s_close(fds[1]);
+    }
+    prev_in = fds[0];
+  }
+  if (prev_in != -1) {
+    s_close(prev_in);  // the loop stopped before spawning its reader
+  }
 
-      // Skip empty lines
-      if (strlen(line_start) > 0) {
-        run_command_line(line_start);
+  if (pcmd->is_background) {
+    // The last stage stands for the pipeline in the job table; the others
+    // are reaped with the other zombies when they are done.
+    if (n > 0 && pids[n - 1] > 0) {
+      pid_t last = pids[n - 1];
+      int job_id = jobs_add(last, get_process_by_pid(last), command_name);
+      job_t* job = jobs_find_by_pid(last);
+      if (job) {
+        job->state = JOB_BACKGROUND;
+        char buf[64];
+        int len = snprintf(buf, sizeof(buf), "[%d] %d\n", job_id, last);
+        s_write(STDOUT_FILENO, buf, len);
       }
+    }
+    return;
+  }
+
+  // Foreground: wait for the stages from the last one back, giving each the
+  // terminal in turn. Once a stage is killed the ones before it are too; once
+  // one is stopped it becomes the job and the others are left alone.
+  bool signaled = false;
+  for (size_t i = n; i-- > 0;) {
+    if (pids[i] <= 0) {
+      continue;
+    }
+    if (signaled) {
+      s_kill(pids[i], P_SIGTERM);
+    }
 
-      line_start = newline + 1;
+    int wstatus = 0;
+    k_set_terminal_pgrp_id(pids[i]);
+    if (s_waitpid(pids[i], &wstatus, false) != pids[i]) {
+      continue;
+    }
+    if (P_WIFSTOPPED(wstatus)) {
+      shell_job_stopped(pids[i], command_name);
+      return;
+    }
+    if (P_WIFSIGNALED(wstatus) && !signaled) {
+      signaled = true;
+      s_write(STDOUT_FILENO, "\n", 1);  // Newline for Ctrl-C termination
+    }
+  }
+}
+
+static void shell_job_stopped(pid_t pid, const char* command_name) {
+  int job_id = jobs_add(pid, get_process_by_pid(pid), command_name);
+  job_t* job = jobs_find_by_pid(pid);
+  if (job) {
+    job->state = JOB_STOPPED;
+    char buf[128];
+    int len = snprintf(buf, sizeof(buf), "\n[%d] Stopped %s\n", job_id,
+                       command_name);
+    s_write(STDOUT_FILENO, buf, len);
+  }
+}
+
+static void* shell_run_script(const char* script_name) {
+  script_t* script = script_cache_get(script_name);
+  if (script == NULL) {
+    if (P_ERRNO == P_ENOENT) {
+      s_printf(STDERR_FILENO, "shell: script not found: %s\n", script_name);
+    } else {
+      s_printf(STDERR_FILENO, "shell: permission denied: %s\n", script_name);
     }
+    s_exit();
+    return NULL;
+  }
+
+  // Execute the script line by line
+  for (size_t i = 0; i < script->num_lines; i++) {
+    run_parsed_command(script->lines[i]);
   }
 
-  s_close(fd);
+  script_cache_put(script);
   s_exit();  // Script finished
   return NULL;
 }
@@ -662,17 +921,16 @@ static void* shell_run_interactive(void) {
   }
 }
 
-static int str_compare(const char* s1, const char* s2) {
-  if (s1 == NULL || s2 == NULL) {
-    return (s1 == s2) ? 0 : 1;
-  }
-
-  while (*s1 && (*s1 == *s2)) {
-    s1++;
-    s2++;
-  }
+static int built_in_compare(const void* key, const void* entry) {
+  return strcmp((const char*)key, ((const built_in_t*)entry)->name);
+}
 
-  return *(const unsigned char*)s1 - *(const unsigned char*)s2;
+static program_entry_fn find_built_in(const built_in_t* table,
+                                      size_t len,
+                                      const char* name) {
+  const built_in_t* entry =
+      bsearch(name, table, len, sizeof(built_in_t), built_in_compare);
+  return entry != NULL ? entry->entry : NULL;
 }
 
 static program_entry_fn get_built_in_program(const char* command_name) {
@@ -682,47 +940,153 @@ static program_entry_fn get_built_in_program(const char* command_name) {
 
   // --- Process-Running Built-ins (Using the 'u_' prefix from user_function.h)
   // ---
+  return find_built_in(
+      BUILT_IN_PROGRAMS,
+      sizeof(BUILT_IN_PROGRAMS) / sizeof(BUILT_IN_PROGRAMS[0]), command_name);
+}
 
-  if (str_compare(command_name, "cat") == 0)
-    return u_cat;
-  else if (str_compare(command_name, "sleep") == 0)
-    return u_sleep;
-  else if (str_compare(command_name, "busy") == 0)
-    return u_busy;
-  else if (str_compare(command_name, "echo") == 0)
-    return u_echo;
-  else if (str_compare(command_name, "ls") == 0)
-    return u_ls;
-  else if (str_compare(command_name, "touch") == 0)
-    return u_touch;
-  else if (str_compare(command_name, "mv") == 0)
-    return u_mv;
-  else if (str_compare(command_name, "cp") == 0)
-    return u_cp;
-  else if (str_compare(command_name, "rm") == 0)
-    return u_rm;
-  else if (str_compare(command_name, "chmod") == 0)
-    return u_chmod;
-  else if (str_compare(command_name, "ps") == 0)
-    return u_ps;
-  else if (str_compare(command_name, "kill") == 0)
-    return u_kill;
-  else if (str_compare(command_name, "zombify") == 0)
-    return u_zombify;
-  else if (str_compare(command_name, "orphanify") == 0)
-    return u_orphanify;
-  else if (str_compare(command_name, "hang") == 0)
-    return hang;
-  else if (str_compare(command_name, "nohang") == 0)
-    return nohang;
-  else if (str_compare(command_name, "recur") == 0)
-    return recur;
-  else if (str_compare(command_name, "crash") == 0)
-    return crash;
+void* k_proc_arena(pcb_t* proc, size_t size) {
+  if (size <= proc->arena_size) {
+    return proc->arena;
+  }
 
-  return NULL;
+  // the old contents are not needed, so no realloc()
+  void* arena = malloc(size);
+  if (!arena) {
+    return NULL;
+  }
+  free(proc->arena);
+  proc->arena = arena;
+  proc->arena_size = size;
+  return arena;
 }
 
-pcb_t** get_all_process(void) {
+pcb_t** get_all_process(size_t* len) {
+  *len = pcb_table_len;
   return pcb_table;
 }
+
+static pcb_t* k_pcb_alloc(void) {
+  if (!pcb_free) {
+    // calloc: the spawn arenas start out empty
+    pcb_slab_t* slab = calloc(1, sizeof(pcb_slab_t));
+    if (!slab) {
+      return NULL;
+    }
+    slab->next = pcb_slabs;
+    pcb_slabs = slab;
+    for (size_t i = PCB_SLAB_SIZE; i-- > 0;) {
+      slab->pcbs[i].q_next = pcb_free;
+      pcb_free = &slab->pcbs[i];
+    }
+  }
+
+  pcb_t* proc = pcb_free;
+  pcb_free = proc->q_next;
+  proc->q_next = NULL;
+  return proc;
+}
+
+static void k_pcb_free(pcb_t* proc) {
+  proc->pid = PID_INVALID;  // fails any pid check made through a stale pointer
+  proc->q_prev = NULL;
+  proc->q_next = pcb_free;
+  pcb_free = proc;
+}
+
+static pid_t k_pid_alloc(void) {
+  if (free_len == 0 && k_proc_table_grow() != 0) {
+    return PID_INVALID;
+  }
+
+  pid_t pid = free_pids[free_head];
+  free_head = (free_head + 1) % pcb_table_len;
+  free_len--;
+  return pid;
+}
+
+static void k_pid_free(pid_t pid) {
+  free_pids[(free_head + free_len) % pcb_table_len] = pid;
+  free_len++;
+}
+
+static void k_proc_close_pipes(pcb_t* proc) {
+  for (int i = 0; i < MAX_FD; i++) {
+    if (k_is_pipe(proc->fd_table[i])) {
+      k_close(proc->fd_table[i]);
+      proc->fd_table[i] = -1;
+    }
+  }
+}
+
+static int k_proc_table_grow(void) {
+  size_t old_len = pcb_table_len;
+  size_t new_len = old_len == 0 ? PROC_TABLE_INIT : old_len * 2;
+  if (new_len > MAX_PROC) {
+    new_len = MAX_PROC;
+  }
+  if (new_len <= old_len) {
+    return -1;  // MAX_PROC processes alive
+  }
+
+  pcb_t** table = realloc(pcb_table, new_len * sizeof(pcb_t*));
+  if (!table) {
+    return -1;
+  }
+  pcb_table = table;
+  pid_t* ring = realloc(free_pids, new_len * sizeof(pid_t));
+  if (!ring) {
+    return -1;  // the bigger table is kept but stays unused
+  }
+  free_pids = ring;
+
+  // only called with the ring empty, so it can restart at slot 0
+  for (size_t i = old_len; i < new_len; i++) {
+    pcb_table[i] = NULL;
+  }
+  free_head = 0;
+  free_len = 0;
+  for (size_t pid = old_len == 0 ? PID_INIT : old_len; pid < new_len; pid++) {
+    free_pids[free_len++] = (pid_t)pid;
+  }
+  pcb_table_len = new_len;
+  return 0;
+}
+
+static void k_child_link(pcb_t* parent, pcb_t* child) {
+  child->parent = parent;
+  child->ppid = parent->pid;
+  child->sib_prev = parent->child_tail;
+  child->sib_next = NULL;
+  if (parent->child_tail) {
+    parent->child_tail->sib_next = child;
+  } else {
+    parent->child_head = child;
+  }
+  parent->child_tail = child;
+  parent->num_childs++;
+}
+
+static void k_child_unlink(pcb_t* child) {
+  pcb_t* parent = child->parent;
+  if (!parent) {
+    return;
+  }
+
+  k_wait_event_remove(child);
+  if (child->sib_prev) {
+    child->sib_prev->sib_next = child->sib_next;
+  } else {
+    parent->child_head = child->sib_next;
+  }
+  if (child->sib_next) {
+    child->sib_next->sib_prev = child->sib_prev;
+  } else {
+    parent->child_tail = child->sib_prev;
+  }
+  parent->num_childs--;
+
+  child->sib_prev = NULL;
+  child->sib_next = NULL;
+  child->parent = NULL;
+}
@@ -19,22 +19,25 @@ void* shell_main(void* arg);
 /**
  * @brief Allocates and initializes a new Process Control Block (PCB).
  *
- * This function allocates memory for a new PCB, initializes it with default
- * values, and sets up the parent-child relationship if a parent is provided. It
- * also inherits file descriptors from the parent.
+ * This function takes a PCB from the PCB slab and the oldest free PID,
+ * initializes it with default values, and sets up the parent-child
+ * relationship if a parent is provided. It also inherits file descriptors from
+ * the parent.
  *
  * @param parent The parent process's PCB. Can be NULL for the root process
  * (init).
- * @return A pointer to the newly created PCB, or NULL on failure.
+ * @return A pointer to the newly created PCB, or NULL on failure (out of
+ * memory, or MAX_PROC processes alive).
  */
 pcb_t* k_proc_create(pcb_t* parent);
 
 /**
  * @brief Cleans up and deallocates a process's resources.
  *
- * This function frees the memory associated with the PCB, including its
- * argument strings and child vector. It also joins the underlying thread. Note:
- * It does NOT handle orphan adoption; that is done in k_terminate.
+ * This function unlinks the PCB from its parent's child list and returns it,
+ * with its spawn arena, to the PCB slab. It also releases the underlying
+ * thread. Note: It does NOT handle orphan adoption; that is done in
+ * k_terminate.
  *
  * @param proc The PCB of the process to cleanup.
  */
@@ -55,9 +58,9 @@ void k_terminate(pcb_t* proc);
 /**
  * @brief Reaps a specific zombie child process.
  *
- * Iterates through the parent's list of children to find the zombie child with
- * the specified PID. If found, it removes the child from the list, logs the
- * "WAITED" event, and cleans up the child's resources.
+ * Looks the child up by PID in O(1). If it is a zombie child of @p proc, it
+ * removes the child from the list, logs the "WAITED" event, and cleans up the
+ * child's resources.
  *
  * @param proc The PCB of the parent process.
  * @param childpid The PID of the zombie child to reap.
@@ -67,8 +70,9 @@ void k_reap_zombie(pcb_t* proc, pid_t childpid);
 /**
  * @brief Adopts the children of a terminating process.
  *
- * Transfers all children of the given process to the init process.
- * If any adopted child is already a zombie, it wakes up init to reap them.
+ * Transfers all children of the given process to the init process, along
+ * with their unreported state changes. If any adopted child is already a
+ * zombie, it wakes up init to reap them.
  *
  * @param proc The PCB of the process whose children are being orphaned.
  */
@@ -156,11 +160,30 @@ pcb_t* get_current_process(void);
  */
 pcb_t* get_process_by_pid(pid_t pid);
 
+/**
+ * @brief Returns the spawn arena of a process, grown to at least @p size
+ * bytes.
+ *
+ * The arena holds everything s_spawn copies for the process (argv and the
+ * redirection data). It is owned by the PCB and released, or kept for the
+ * next process using the PCB, when the process is reaped.
+ *
+ * @param proc The process.
+ * @param size Number of bytes needed; the previous contents are lost when the
+ *             arena has to grow.
+ * @return The arena, or NULL if memory is exhausted.
+ */
+void* k_proc_arena(pcb_t* proc, size_t size);
+
 /**
  * @brief Retrieves the global process table.
  *
+ * The table is indexed by PID and grows as more processes are alive at once,
+ * so it is only valid until the next spawn.
+ *
+ * @param len Set to the number of entries in the table.
  * @return A pointer to the array of PCB pointers.
  */
-pcb_t** get_all_process(void);
+pcb_t** get_all_process(size_t* len);
 
 #endif
@@ -2,12 +2,21 @@
 #include "scheduler.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
 
+#include "./util/logger.h"
 #include "./util/p_handler.h"
+#include "./util/policy.h"
 #include "./util/queue.h"
 #include "./util/struct.h"
 #include "fat_kernel.h"
@@ -16,57 +25,148 @@
 uint64_t tick;  /** Global tick counter */
 pcb_t* current; /** Current running process */
 static sigset_t scheduler_mask;
+static pthread_t scheduler_thread;  // thread running k_scheduler_run()
+static volatile sig_atomic_t timer_expired = 0;   // SIGALRM since last reset
+static volatile sig_atomic_t wake_requested = 0;  // current gave up the CPU
 static const char* LOG_FILENAME = "log/log.txt";  // Default log file name
-static const int schedule[] =
-    {  // Fixed schedule array corresponding to 9:6:4 ratio
-        0, 1, 0, 2, 0, 1, 0, 2, 0, 1, 0, 1, 0, 2, 0, 1, 0, 2, 1};
-static int idx = 0;  // The 'pointer' to the next prio in schedule.
+static const sched_policy_t* policy = &SCHED_POLICY_STRIDE;  // queue picker
+static unsigned int quantum_ms = SCHED_DEFAULT_QUANTUM_MS;  // time slice
+static sched_totals_t totals;  // system-wide counters and histograms
+static uint64_t last_sync_tick = 0;  // tick of the last k_sync()
+static bool feedback = false;  // multilevel-feedback priorities (see -f)
 
 /**
- * @brief Does nothing (as intended)
+ * @brief Records that a quantum boundary has passed.
  */
-static void alarm_handler(int signo) {}
+static void alarm_handler(int signo) {
+  timer_expired = 1;
+}
 
 /**
- * @brief Choose a runnable priority queue using weighted random selection.
- *
- * This function inspects the three ready queues (priority 0, 1, and 2)
- * and returns the priority of the queue to schedule from.
+ * @brief Does nothing (as intended); only interrupts sigsuspend().
+ */
+static void wakeup_handler(int signo) {}
+
+/**
+ * @brief Arm ITIMER_REAL to fire after @p ticks quanta, then every quantum.
  *
- * If more than one queue is non-empty, it performs a weighted random
- * selection with weights 9:6:4 for priorities 0, 1, and 2 respectively,
- * corresponding to an effective scheduling ratio of 2.25 : 1.5 : 1.
+ * Re-arming restarts the period, so the next SIGALRM is a full @p ticks
+ * quanta away.
  *
- * If exactly one queue is non-empty, that queue is always chosen.
- * If all queues are empty, 0 is returned (the caller is expected to
- * handle the "no runnable process" case, e.g., by idling).
+ * @param ticks Number of quanta until the first SIGALRM (at least 1).
+ */
+static void k_arm_timer(uint64_t ticks);
+
+/**
+ * @brief Milliseconds elapsed on the monotonic clock since @p start.
+ */
+static uint64_t k_elapsed_ms(const struct timespec* start);
+
+/**
+ * @brief Current monotonic time in nanoseconds.
+ */
+static uint64_t k_now_ns(void);
+
+/**
+ * @brief Histogram bucket of @p value: 0 for 0, else floor(log2(value)) + 1,
+ * clamped to the last bucket.
+ */
+static int k_hist_bucket(uint64_t value);
+
+/**
+ * @brief Append one printf-style line to the histogram/stat report buffer.
  *
- * @pre The random number generator should be initialized (e.g. with srand()).
- * @return An integer priority in the range [0, 2] indicating which
- *         priority queue to use next.
+ * @return The new length, never more than size - 1.
+ */
+static size_t k_stats_appendf(char* buf,
+                              size_t size,
+                              size_t len,
+                              const char* fmt,
+                              ...);
+
+/**
+ * @brief Append the non-empty buckets of a histogram to the report.
+ */
+static size_t k_stats_append_hist(char* buf,
+                                  size_t size,
+                                  size_t len,
+                                  const char* title,
+                                  const uint64_t hist[SCHED_HIST_BUCKETS]);
+
+/**
+ * @brief Feedback mode: demote @p proc after a full slice, or promote it if
+ * it blocked before the slice ended.
+ */
+static void k_feedback_adjust(pcb_t* proc, bool full_slice);
+
+/**
+ * @brief Feedback mode: promote every process that has waited at least
+ * SCHED_AGING_TICKS on a ready queue below the top one.
+ */
+static void k_feedback_age(void);
+
+/**
+ * @brief Write back pending filesystem metadata every SCHED_SYNC_TICKS
+ * ticks, so files that stay open do not keep stale dirents forever.
+ */
+static void k_sync_check(void);
+
+/**
+ * @brief Write the statistics report next to the log file (<log>.stats).
  */
-static int k_pick_queue();
+static void k_sched_stats_dump(void);
 
 //////////////////////////////////////////////////////////////////////////////
 // =================== Public API Implementation =================== ////////
 ////////////////////////////////////////////////////////////////////////////
 
-void k_scheduler_init(const char* log_fname) {
-  if (log_fname != NULL) {
-    LOG_FILENAME = log_fname;
+void k_scheduler_config_default(sched_config_t* config) {
+  *config = (sched_config_t){
+      .log_fname = NULL,
+      .binary_log = false,
+      .quantum_ms = SCHED_DEFAULT_QUANTUM_MS,
+      .policy = &SCHED_POLICY_STRIDE,
+      .feedback = false,
+  };
+
+  unsigned int weight = SCHED_DEFAULT_WEIGHT;
+  for (int i = 0; i < NUM_PRIO; i++) {
+    config->weights[i] = weight;
+    weight = (2 * weight + 1) / 3;  // 9, 6, 4, 3, 2, 1, 1, ...
   }
+}
 
-  // Truncate the log file to start fresh on each run
-  FILE* fp = fopen(LOG_FILENAME, "w");
-  if (fp != NULL) {
-    fclose(fp);
+void k_scheduler_init(const sched_config_t* config) {
+  if (config->log_fname != NULL) {
+    LOG_FILENAME = config->log_fname;
+  }
+  quantum_ms = config->quantum_ms > 0 ? config->quantum_ms
+                                      : SCHED_DEFAULT_QUANTUM_MS;
+  policy = config->policy != NULL ? config->policy : &SCHED_POLICY_STRIDE;
+  policy->init(config->weights);
+  feedback = config->feedback;
+
+  // Open (and truncate) the log file once; it stays open until cleanup
+  if (k_log_open(LOG_FILENAME, config->binary_log) != 0) {
+    perror("k_scheduler_init: cannot open log file");
   }
 
   // initialize global value
   tick = 0;
+  last_sync_tick = 0;
   current = NULL;
+  scheduler_thread = pthread_self();
+  timer_expired = 0;
+  wake_requested = 0;
+  totals = (sched_totals_t){0};
   sigfillset(&scheduler_mask);
   sigdelset(&scheduler_mask, SIGALRM);
+  sigdelset(&scheduler_mask, SCHED_WAKE_SIGNAL);
+  // let the host's Ctrl-C / Ctrl-Z in while waiting, or they stay pending
+  // until some thread happens to unblock them (see k_host_signals_pending())
+  sigdelset(&scheduler_mask, HOST_SIGINT);
+  sigdelset(&scheduler_mask, HOST_SIGTSTP);
+  sigdelset(&scheduler_mask, HOST_SIGQUIT);
   k_queues_init();
 
   // just to make sure that
@@ -77,6 +177,15 @@ void k_scheduler_init(const char* log_fname) {
       .sa_flags = SA_RESTART,
   };
   sigaction(SIGALRM, &act, NULL);
+  act.sa_handler = wakeup_handler;
+  sigaction(SCHED_WAKE_SIGNAL, &act, NULL);
+
+  // the wakeup signal stays blocked outside sigsuspend(), so one sent while
+  // the scheduler is busy is kept pending instead of being lost
+  sigset_t wake_set;
+  sigemptyset(&wake_set);
+  sigaddset(&wake_set, SCHED_WAKE_SIGNAL);
+  pthread_sigmask(SIG_BLOCK, &wake_set, NULL);
 
   // make sure SIGALRM is unblocked
   sigset_t alarm_set;
@@ -85,15 +194,14 @@ void k_scheduler_init(const char* log_fname) {
   pthread_sigmask(SIG_UNBLOCK, &alarm_set, NULL);
 
   // set up timer
-  struct itimerval it;
-  it.it_interval = (struct timeval){.tv_usec = 100000};
-  it.it_value = it.it_interval;
-  setitimer(ITIMER_REAL, &it, NULL);
+  k_arm_timer(1);
 }
 
 void k_scheduler_run() {
   pcb_t* last_scheduled = NULL;  // Track last scheduled process
   (void)last_scheduled;
+  uint64_t quantum_ns = (uint64_t)quantum_ms * 1000000;
+  uint64_t tick_start_ns = k_now_ns();  // wall time the current tick began
 
   while (1) {
     // Check for deferred host signals
@@ -106,123 +214,358 @@ void k_scheduler_run() {
     }
 
     // pick next runnable process
-    pcb_t* next = k_dequeue(k_pick_queue());
+    pcb_t* next = k_dequeue(policy->pick(k_ready_mask()));
 
     if (!next) {
-      // no runnable process: can idle
-      k_idle();
+      // no runnable process: idle until the earliest sleeper is due. The
+      // sleep check runs on the last tick of the idle period, exactly as if
+      // we had idled one quantum at a time.
+      uint64_t idle_ticks = k_idle();
+      if (idle_ticks == 0) {
+        continue;  // a host signal arrived within the first quantum
+      }
+      totals.idle_ticks += idle_ticks;
+      tick += idle_ticks - 1;
       k_tick_sleep_check(tick);
+      k_log_flush();
+      k_sync_check();
       tick++;
+      tick_start_ns = k_now_ns();
       continue;
     }
 
     current = next;
     current->state = P_RUNNING;
 
+    uint64_t waited = tick - current->stats.ready_since;
+    current->stats.ticks_waiting += waited;
+    totals.wait_hist[k_hist_bucket(waited)]++;
+
     // Only log if we're switching to a different process
     // if (current != last_scheduled) {
-    k_log_event("SCHEDULE", current);
+    k_log_event(LOG_SCHEDULE, current);
     //   last_scheduled = current;
     // }
 
-    // continue the thread, hang, and suspend it again
+    // continue the thread, hang until the quantum ends or it gives up the
+    // CPU (k_yield), and suspend it again. The timer is armed afresh so the
+    // slice gets a whole quantum, however the previous one ended.
+    uint64_t start_ns = k_now_ns();
+    uint64_t slice_start_ns = start_ns;
+    k_arm_timer(1);
+    timer_expired = 0;
+    wake_requested = 0;
     spthread_continue(current->process);
-    sigsuspend(&scheduler_mask);
+    uint64_t switch_ns = k_now_ns() - start_ns;
+    // A host signal preempts it: the signal is relayed at the top of the
+    // loop, not a quantum later
+    while (!timer_expired && !wake_requested && !k_host_signals_pending()) {
+      sigsuspend(&scheduler_mask);  // a stale wakeup just loops again
+    }
+    start_ns = k_now_ns();
     spthread_suspend(current->process);
+    switch_ns += k_now_ns() - start_ns;
+
+    // account the slice
+    current->stats.switch_ns += switch_ns;
+    current->stats.run_ns += start_ns - slice_start_ns;
+    if (wake_requested) {
+      current->stats.voluntary++;
+    } else {
+      current->stats.involuntary++;
+    }
+    totals.switches++;
+    totals.switch_hist[k_hist_bucket(switch_ns / 1000)]++;
 
     // afterward cleanup:
     k_tick_sleep_check(tick);
 
-    // if process normally used up its time slice, requeue it
-    if (current->state == P_RUNNING) {
-      current->state = P_READY;
-      k_enqueue(current);
+    pcb_t* prev = current;
+    current = NULL;
+    k_log_flush();
+    k_sync_check();
+    // tick counts wall time in quanta: a slice cut short by k_yield() leaves
+    // its time to the next one, so sleeps are neither shortened nor stretched
+    uint64_t ticks = (k_now_ns() - tick_start_ns) / quantum_ns;
+    tick += ticks;
+    tick_start_ns += ticks * quantum_ns;
+    if (feedback) {
+      // measured rather than read off SIGALRM: the slice ran a whole quantum
+      bool full_slice = k_now_ns() - slice_start_ns >= quantum_ns;
+      k_feedback_adjust(prev, full_slice && prev->state == P_RUNNING);
+      if (ticks > 0) {
+        k_feedback_age();
+      }
     }
 
-    current = NULL;
-    tick++;
+    // if process normally used up its time slice, requeue it (after the tick
+    // moved on, so its ready-queue wait starts at the new tick)
+    if (prev->state == P_RUNNING) {
+      prev->state = P_READY;
+      k_enqueue(prev);
+    }
   }
 
   // Have exited the main while loop. OS is shutting down.
+  k_sched_stats_dump();
 }
 
-void k_idle() {
-  sigsuspend(&scheduler_mask);
+int k_sched_stats_format(char* buf, size_t size) {
+  if (buf == NULL || size == 0) {
+    return -1;
+  }
+  buf[0] = '\0';
+
+  // RUN is in ticks too, summed from the measured length of every slice
+  uint64_t quantum_ns = (uint64_t)quantum_ms * 1000000;
+  size_t len = k_stats_appendf(buf, size, 0, "%6s %-12s %4s %8s %8s %6s %6s %10s\n",
+                               "PID", "CMD", "PRI", "RUN", "WAIT", "VOL",
+                               "INVOL", "SWITCH_US");
+  size_t table_len = 0;
+  pcb_t** table = get_all_process(&table_len);
+  for (size_t i = 0; i < table_len; i++) {
+    pcb_t* p = table[i];
+    if (p == NULL) {
+      continue;
+    }
+    const sched_stats_t* st = &p->stats;
+    len = k_stats_appendf(buf, size, len,
+                          "%6d %-12.12s %4d %8lu %8lu %6lu %6lu %10lu\n", p->pid,
+                          p->cmd_name, p->prio, st->run_ns / quantum_ns,
+                          st->ticks_waiting, st->voluntary, st->involuntary,
+                          st->switch_ns / 1000);
+  }
+
+  len = k_stats_appendf(buf, size, len,
+                        "\n%lu context switches, %lu idle ticks, tick %lu\n",
+                        totals.switches, totals.idle_ticks, tick);
+  len = k_stats_append_hist(buf, size, len, "Ready-queue wait (ticks)",
+                            totals.wait_hist);
+  len = k_stats_append_hist(buf, size, len, "Context switch cost (us)",
+                            totals.switch_hist);
+  return (int)len;
 }
 
-void k_scheduler_cleanup() {
-  k_queues_destroy();
+unsigned int k_get_quantum_ms() {
+  return quantum_ms;
 }
 
-void k_log_event(const char* event, pcb_t* pcb) {
-  if (!event || !pcb) {
-    return;
+uint64_t k_idle() {
+  // Sleep through as many quanta as possible instead of waking every tick.
+  // Host signals end the wait at once, so the bound only keeps the periodic
+  // work (log flush, k_sync) going.
+  uint64_t ticks = SCHED_MAX_IDLE_TICKS;
+  uint64_t wake_tick = k_next_wake_tick();
+  if (wake_tick > 0) {
+    ticks = wake_tick > tick ? wake_tick - tick + 1 : 1;
+    if (ticks > SCHED_MAX_IDLE_TICKS) {
+      ticks = SCHED_MAX_IDLE_TICKS;
+    }
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  k_arm_timer(ticks);  // back to a periodic quantum after the first alarm
+  timer_expired = 0;
+  while (!timer_expired && !k_host_signals_pending()) {
+    sigsuspend(&scheduler_mask);
+  }
+
+  if (!timer_expired) {
+    // cut short by a host signal: count whole quanta only and go back to
+    // the periodic quantum
+    k_arm_timer(1);
+    return k_elapsed_ms(&start) / quantum_ms;
   }
 
-  // Open log file in append mode
-  FILE* log_file = fopen(LOG_FILENAME, "a");
-  if (log_file == NULL) {
+  // SIGALRM ended the wait, so at least one quantum boundary has passed
+  uint64_t elapsed = (k_elapsed_ms(&start) + quantum_ms / 2) / quantum_ms;
+  return elapsed > 0 ? elapsed : 1;
+}
+
+void k_scheduler_wake() {
+  wake_requested = 1;
+  k_scheduler_kick();
+}
+
+void k_scheduler_kick() {
+  pthread_kill(scheduler_thread, SCHED_WAKE_SIGNAL);
+}
+
+void k_yield() {
+  spthread_t self;
+  if (!spthread_self(&self)) {
     return;
   }
 
-  // Log the event with process information
-  fprintf(log_file, "[%5lu] %-10s %-5d %-4d %s\n", tick, event, pcb->pid,
-          pcb->prio, pcb->cmd_name);
+  // Keep the scheduler from suspending us between the wakeup and our own
+  // suspend; sigsuspend() in spthread_suspend_self() lets SIGPTHD in again.
+  spthread_disable_interrupts_self();
+  k_scheduler_wake();
+  spthread_suspend_self();
+  spthread_enable_interrupts_self();
+}
 
-  fclose(log_file);
+void k_scheduler_cleanup() {
+  k_queues_destroy();
+  k_log_close();
 }
 
-void k_log_nice_event(pcb_t* pcb, int old_prio, int new_prio) {
+void k_log_event(log_event_t event, pcb_t* pcb) {
   if (!pcb) {
     return;
   }
 
-  // Open log file in append mode
-  FILE* log_file = fopen(LOG_FILENAME, "a");
-  if (log_file == NULL) {
+  // Log the event with process information
+  k_log_record(event, tick, pcb->pid, pcb->prio, 0, pcb->cmd_name);
+}
+
+void k_log_nice_event(pcb_t* pcb, int old_prio, int new_prio) {
+  if (!pcb) {
     return;
   }
 
-  // Log format: [ticks] NICE PID OLD_NICE_VALUE NEW_NICE_VALUE PROCESS_NAME
-  fprintf(log_file, "[%5lu] %-10s %-3d %-3d %-2d %s\n", tick, "NICE", pcb->pid,
-          old_prio, new_prio, pcb->cmd_name);
-
-  fclose(log_file);
+  k_log_record(LOG_NICE, tick, pcb->pid, new_prio, old_prio, pcb->cmd_name);
 }
 
 //////////////////////////////////////////////////////////////////////////////
 // =================== Static Function Implementations =================== //
 ////////////////////////////////////////////////////////////////////////////
 
-static int k_pick_queue() {
-  // check if any queue is empty
-  bool has0 = !is_pq_empty(0);
-  bool has1 = !is_pq_empty(1);
-  bool has2 = !is_pq_empty(2);
+static void k_feedback_adjust(pcb_t* proc, bool full_slice) {
+  if (full_slice) {
+    k_set_priority(proc, proc->prio + 1);  // no-op at the lowest level
+  } else if (proc->state == P_BLOCKED) {
+    k_set_priority(proc, proc->prio - 1);  // no-op at the highest level
+  }
+}
+
+static void k_feedback_age(void) {
+  // Each queue is in arrival order, so only its head can be due. A process
+  // moved by nice keeps its arrival tick and may be aged a little late.
+  for (int prio = 1; prio < NUM_PRIO; prio++) {
+    pcb_t* p;
+    while ((p = k_ready_head(prio)) != NULL) {
+      uint64_t since = p->stats.ready_since > p->aged_tick
+                           ? p->stats.ready_since
+                           : p->aged_tick;
+      if (tick - since < SCHED_AGING_TICKS) {
+        break;
+      }
+      p->aged_tick = tick;
+      k_set_priority(p, prio - 1);  // to the tail of the next queue up
+    }
+  }
+}
+
+static void k_sync_check(void) {
+  if (tick - last_sync_tick < SCHED_SYNC_TICKS) {
+    return;
+  }
+  last_sync_tick = tick;
+  if (IS_FS_MOUNTED) {
+    k_sync();
+  }
+}
+
+static void k_arm_timer(uint64_t ticks) {
+  uint64_t first_us = ticks * quantum_ms * 1000;
+
+  struct itimerval it;
+  it.it_interval = (struct timeval){
+      .tv_sec = quantum_ms / 1000,
+      .tv_usec = (quantum_ms % 1000) * 1000,
+  };
+  it.it_value = (struct timeval){
+      .tv_sec = first_us / 1000000,
+      .tv_usec = first_us % 1000000,
+  };
+  setitimer(ITIMER_REAL, &it, NULL);
+}
 
-  // When all queues are empty, just return an arbitrary prio
-  if (!has0 && !has1 && !has2) {
+static uint64_t k_now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int k_hist_bucket(uint64_t value) {
+  if (value == 0) {
     return 0;
   }
+  int bucket = 64 - __builtin_clzll(value);
+  return bucket < SCHED_HIST_BUCKETS ? bucket : SCHED_HIST_BUCKETS - 1;
+}
+
+static size_t k_stats_appendf(char* buf,
+                              size_t size,
+                              size_t len,
+                              const char* fmt,
+                              ...) {
+  if (len >= size - 1) {
+    return len;  // already full
+  }
 
-  const int size = sizeof(schedule) / sizeof(schedule[0]);
-  // Iterate through the schedule to find the next available queue
-  // We loop up to 'size' times to ensure we check everyone if needed
-  for (int i = 0; i < size; i++) {
-    int q = schedule[idx];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf + len, size - len, fmt, ap);
+  va_end(ap);
 
-    // Always advance the index to maintain the "time slot" logic
-    idx = (idx + 1) % size;
+  if (n < 0) {
+    return len;
+  }
+  len += (size_t)n;
+  return len < size ? len : size - 1;
+}
+
+static size_t k_stats_append_hist(char* buf,
+                                  size_t size,
+                                  size_t len,
+                                  const char* title,
+                                  const uint64_t hist[SCHED_HIST_BUCKETS]) {
+  len = k_stats_appendf(buf, size, len, "%s:\n", title);
+  for (int b = 0; b < SCHED_HIST_BUCKETS; b++) {
+    if (hist[b] == 0) {
+      continue;
+    }
+    if (b <= 1) {
+      len = k_stats_appendf(buf, size, len, "  %13d : %lu\n", b, hist[b]);
+    } else if (b == SCHED_HIST_BUCKETS - 1) {
+      len = k_stats_appendf(buf, size, len, "  >= %10lu : %lu\n",
+                            1UL << (b - 1), hist[b]);
+    } else {
+      char range[32];
+      snprintf(range, sizeof(range), "%lu-%lu", 1UL << (b - 1),
+               (1UL << b) - 1);
+      len = k_stats_appendf(buf, size, len, "  %13s : %lu\n", range, hist[b]);
+    }
+  }
+  return len;
+}
 
-    // If the scheduled queue has processes, pick it
-    if (q == 0 && has0)
-      return 0;
-    if (q == 1 && has1)
-      return 1;
-    if (q == 2 && has2)
-      return 2;
+static void k_sched_stats_dump(void) {
+  char* report = malloc(SCHED_STATS_REPORT_SIZE);
+  if (report == NULL) {
+    return;
   }
+  int len = k_sched_stats_format(report, SCHED_STATS_REPORT_SIZE);
+
+  char path[512];
+  snprintf(path, sizeof(path), "%s.stats", LOG_FILENAME);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd != -1 && len > 0) {
+    // best effort, like the log itself
+    (void)!write(fd, report, len);
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  free(report);
+}
 
-  // Fallback: This part should logically not be reached.
-  return 0;
+static uint64_t k_elapsed_ms(const struct timespec* start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)(now.tv_sec - start->tv_sec) * 1000 +
+         (now.tv_nsec - start->tv_nsec) / 1000000;
 }
\ No newline at end of file
@@ -1,45 +1,109 @@
 #ifndef SCHEDULER_H
 #define SCHEDULER_H
 
+#include <signal.h>
+#include "./util/logger.h"
+#include "./util/policy.h"
 #include "./util/struct.h"
 
-// Global scheduler state (defined in scheduler.c)
+/** Default length of a scheduling time slice, in milliseconds */
+#define SCHED_DEFAULT_QUANTUM_MS 100
+/** Upper bound on the number of quanta a single tickless idle may last */
+#define SCHED_MAX_IDLE_TICKS 10
+/** Ticks between write-backs of pending PennFAT metadata (see k_sync()) */
+#define SCHED_SYNC_TICKS 10
+/** Signal a process sends to end its time slice early (see k_yield()) */
+#define SCHED_WAKE_SIGNAL SIGUSR2
+/** Number of log2 buckets in each scheduler histogram */
+#define SCHED_HIST_BUCKETS 16
+/** Ticks a process waits on a ready queue before feedback mode ages it up */
+#define SCHED_AGING_TICKS 20
+/** Buffer size that always fits a full k_sched_stats_format() report */
+#define SCHED_STATS_REPORT_SIZE (128 * 1024)
+
+// Global scheduler state (defined in scheduler.c). There is a single CPU:
+// exactly one spthread runs at a time, and the rest of the kernel relies on
+// that instead of locking.
 extern uint64_t tick;
 extern pcb_t* current;
 
+/**
+ * @brief System-wide scheduler counters.
+ *
+ * Histogram bucket 0 counts zero values and bucket b > 0 counts values in
+ * [2^(b-1), 2^b); the last bucket holds everything larger.
+ */
+typedef struct sched_totals {
+  uint64_t switches;    // time slices handed out
+  uint64_t idle_ticks;  // ticks with nothing runnable
+  uint64_t wait_hist[SCHED_HIST_BUCKETS];    // ready-queue wait, in ticks
+  uint64_t switch_hist[SCHED_HIST_BUCKETS];  // continue+suspend cost, in us
+} sched_totals_t;
+
+/** @brief Boot-time scheduler options */
+typedef struct sched_config {
+  const char* log_fname;               // log path, NULL for "log/log.txt"
+  bool binary_log;                     // binary trace instead of text
+  unsigned int quantum_ms;             // time slice, 0 for the default
+  const sched_policy_t* policy;        // queue selection, NULL for stride
+  unsigned int weights[NUM_PRIO];      // per-queue CPU share for the policy
+  bool feedback;                       // multilevel-feedback priorities
+} sched_config_t;
+
+/**
+ * @brief Fill @p config with the default options (text log at the default
+ * path, SCHED_DEFAULT_QUANTUM_MS, stride policy, weights from SCHED_DEFAULT_WEIGHT,
+ * fixed priorities).
+ *
+ * @param config The configuration to initialize.
+ */
+void k_scheduler_config_default(sched_config_t* config);
+
 /**
  * @brief Initialize the PennOS scheduler and start the periodic timer.
  *
  * This function sets up all global scheduler state and installs the SIGALRM
  * handler used for time-sliced scheduling:
  *
+ * - Opens (and truncates) the log file, which stays open until
+ *   k_scheduler_cleanup().
  * - Initializes the global tick counter, current running process, the scheduler
  *   signal mask (scheduler_mask) so that SIGALRM is the only signal unblocked
  *   during sigsuspend().
  * - Calls k_queues_init() to initialize all scheduler-managed queues
  *   (ready queues, blocked queue).
  * - Install empty handler for SIGALRM and unblocks SIGALRM.
- * - Install timer to deliver SIGALRM every 100 ms, which defines the scheduling
- *   time slice.
+ * - Initializes the queue selection policy with the configured weights.
+ * - Install timer to deliver SIGALRM every quantum_ms ms, which defines the
+ *   scheduling time slice.
  *
  * @note This function should be called once during kernel startup, before
  * entering the main scheduling loop k_scheduler_run().
+ *
+ * @param config Boot options, see k_scheduler_config_default().
  */
-void k_scheduler_init(const char* log_fname);
+void k_scheduler_init(const sched_config_t* config);
 
 /**
  * @brief Main scheduler loop for PennOS.
  *
  * This function implements the core time-sliced scheduling logic:
  *
- * - Dequeues the next runnable process from the ready queues using
- *   k_pick_queue() and k_dequeue().
+ * - Dequeues the next runnable process from the ready queue chosen by the
+ *   configured policy (see policy.h) and k_dequeue().
  * - If no process is runnable, calls k_idle() to put the system into
- *   an idle state (e.g., waiting for the next SIGALRM or wake-up event).
- * - Run the chosen process for a time slice.
+ *   an idle state until the earliest sleeper is due, then advances the tick
+ *   counter by the number of quanta that elapsed.
+ * - Run the chosen process for a time slice, or until it blocks, exits or
+ *   yields (see k_yield()); a slice cut short does not advance the tick.
  * - After each tick, wake any processes whose sleep interval has expired.
  * - If the current process used up its time slice and is still in
  *   state P_RUNNING, it is marked P_READY and enqueued again.
+ * - In feedback mode, a process that used up its slice is demoted one level
+ *   and one that blocked before the slice ended is promoted one level. Every
+ *   tick, processes that have waited SCHED_AGING_TICKS on a ready queue are
+ *   promoted too. All of these go through k_set_priority(), so they are
+ *   logged as NICE events.
  * - Increments the global tick counter after each iteration.
  *
  * @note This function is intended to run on the main kernel thread and
@@ -49,12 +113,72 @@ void k_scheduler_init(const char* log_fname);
 void k_scheduler_run();
 
 /**
- * @brief Idles the cpu until a signal is delivered.
+ * @brief Format the scheduler statistics report.
+ *
+ * The report lists the per-process counters (ticks run, ticks spent waiting
+ * on a ready queue, voluntary and involuntary switches and the time spent
+ * in spthread_continue/suspend) followed by the system-wide histograms. The
+ * same report is written to "<log>.stats" when the scheduler shuts down.
+ *
+ * @param buf  Output buffer; SCHED_STATS_REPORT_SIZE bytes always suffice.
+ * @param size Size of @p buf.
+ * @return The length of the report (truncated to fit), or -1 if @p buf is
+ * NULL or @p size is 0.
+ */
+int k_sched_stats_format(char* buf, size_t size);
+
+/**
+ * @brief Get the scheduler time slice chosen at boot.
+ *
+ * @return The length of one tick in milliseconds.
+ */
+unsigned int k_get_quantum_ms();
+
+/**
+ * @brief Idles the cpu without waking up on every tick (tickless idle).
+ *
+ * The timer is programmed for the earliest sleeper's deadline (bounded by
+ * SCHED_MAX_IDLE_TICKS, which is also used when nothing sleeps), and the
+ * periodic quantum resumes after it fires.
+ *
+ * A host signal (see k_host_signals_pending()) ends the idle period early
+ * and restarts the periodic quantum.
+ *
+ * @return The number of quanta that elapsed while idle: at least 1, unless
+ * a host signal cut it short.
+ */
+uint64_t k_idle();
+
+/**
+ * @brief Ends the current time slice early.
+ *
+ * Wakes the scheduler thread so that it suspends the running process and
+ * picks the next one right away, instead of waiting for the next SIGALRM.
+ * The caller is expected to suspend itself (or exit) right after.
+ */
+void k_scheduler_wake();
+
+/**
+ * @brief Interrupts the scheduler's wait without ending the time slice.
+ *
+ * Unlike k_scheduler_wake() it only sends SCHED_WAKE_SIGNAL, so it is
+ * async-signal-safe; the scheduler then rechecks why it waits (e.g.
+ * k_host_signals_pending()).
+ */
+void k_scheduler_kick();
+
+/**
+ * @brief Give up the CPU for the rest of the current time slice.
+ *
+ * The calling process suspends itself and the scheduler is woken up to run
+ * the next process immediately. If the caller is still P_RUNNING it is put
+ * back on its ready queue; if it has just blocked it stays blocked.
+ * It is a no-op when not called from an spthread.
  */
-void k_idle();
+void k_yield();
 
 /**
- * @brief Cleans up scheduler-related stuff
+ * @brief Cleans up scheduler-related stuff, flushing and closing the log.
  */
 void k_scheduler_cleanup();
 
@@ -62,19 +186,19 @@ void k_scheduler_cleanup();
  * @brief Log a scheduler or process-related event to a file.
  *
  * This function appends a single log entry describing an event associated
- * with a given process. Each entry includes:
+ * with a given process to the in-memory log buffer, which the scheduler
+ * flushes to the file in batches on tick boundaries. Each entry includes:
  *
  * - The current global tick value.
- * - A short event string (e.g., "SCHEDULE", "BLOCKED", "UNBLOCKED").
- * - The process ID (PID) and parent PID (PPID).
- * - The process state and priority.
+ * - The event kind (e.g., LOG_SCHEDULE, LOG_BLOCKED, LOG_UNBLOCKED).
+ * - The process ID (PID), priority and command name.
  *
- * The function is a no-op if either @p event or @p pcb is NULL.
+ * The function is a no-op if @p pcb is NULL.
  *
- * @param event A human-readable description of the event to log.
+ * @param event The kind of event to log.
  * @param pcb   Pointer to the process control block associated with the event.
  */
-void k_log_event(const char* event, pcb_t* pcb);
+void k_log_event(log_event_t event, pcb_t* pcb);
 
 /**
  * @brief Log a NICE (priority change) event.
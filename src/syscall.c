@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include "./util/kstat.h"
 #include "./util/p_errno.h"
 #include "./util/p_signal.h"
 #include "./util/queue.h"
@@ -46,7 +47,7 @@ static void* spawn_wrapper(void* arg);
  * @brief Cleanup function for the spawn wrapper.
  *
  * Restores the original stdin and stdout file descriptors.
- * Registers the cleanup handler with pthread_cleanup_push.
+ * Registered with spthread_cleanup_set, so it also runs on cancellation.
  *
  * @param arg A pointer to a spawn_wrapper_args_t structure containing the
  *            original function pointer, arguments, and redirection file paths.
@@ -54,16 +55,38 @@ static void* spawn_wrapper(void* arg);
 static void spawn_cleanup(void* arg);
 
 /**
- * @brief Creates a deep copy of an argument vector (argv).
+ * @brief Copies argv and the redirection file names into the child's spawn
+ * arena (see k_proc_arena) with a single allocation at most.
  *
- * Allocates memory for a new array of string pointers and copies each string
- * from the source argv. The new array is NULL-terminated.
+ * The arena is laid out as the wrapper args (only if there is a redirection),
+ * the NULL-terminated argv array, then the strings. child->args points to the
+ * copied argv (NULL if @p argv is NULL).
  *
- * @param argv The null-terminated array of strings to copy.
- * @return A pointer to the new copy of argv, or NULL if memory allocation
- * fails. Sets P_ERRNO to P_ENOMEM on failure.
+ * @param child       The process being spawned.
+ * @param argv        The null-terminated array of strings to copy, or NULL.
+ * @param stdin_file  Input redirection file, or NULL.
+ * @param stdout_file Output redirection file, or NULL.
+ * @param wrapper     Set to the wrapper args in the arena, or NULL if there is
+ *                    no redirection. Only the file names are filled in.
+ * @return 0 on success, -1 if memory allocation fails. Sets P_ERRNO to
+ * P_ENOMEM on failure.
  */
-static char** deep_copy_args(char** argv);
+static int spawn_pack_args(pcb_t* child,
+                           char** argv,
+                           const char* stdin_file,
+                           const char* stdout_file,
+                           spawn_wrapper_args_t** wrapper);
+
+/**
+ * @brief Make descriptor @p child_fd of @p child a new end of the pipe that
+ * local descriptor @p fd of @p parent is an end of.
+ *
+ * An end the child inherited at @p child_fd is closed first.
+ *
+ * @return 0 on success (or if @p fd is -1), -1 on error. Sets P_ERRNO to
+ * P_EBADF if @p fd is not a pipe end of @p parent.
+ */
+static int spawn_attach_pipe(pcb_t* parent, int fd, pcb_t* child, int child_fd);
 
 //////////////////////////////////////////////////////////////////////////////
 // =================== Public API Implementation =================== ////////
@@ -74,8 +97,20 @@ pid_t s_spawn(void* (*func)(void*),
               const char* stdin_file,
               const char* stdout_file,
               int is_append) {
+  return s_spawn_piped(func, argv, stdin_file, stdout_file, is_append, -1, -1);
+}
+
+pid_t s_spawn_piped(void* (*func)(void*),
+                    char* argv[],
+                    const char* stdin_file,
+                    const char* stdout_file,
+                    int is_append,
+                    int pipe_in,
+                    int pipe_out) {
   // Get the current (parent) process
   pcb_t* parent = get_current_process();
+  // Output the parent buffered so far comes before anything the child writes
+  s_flush_all();
   // Create a new child process
   pcb_t* child = k_proc_create(parent);
   if (!child) {
@@ -84,6 +119,13 @@ pid_t s_spawn(void* (*func)(void*),
   }
   child->prio = 1;
 
+  // Give the child its own ends of the pipes it reads from / writes to
+  if (spawn_attach_pipe(parent, pipe_in, child, STDIN_FILENO) != 0 ||
+      spawn_attach_pipe(parent, pipe_out, child, STDOUT_FILENO) != 0) {
+    k_proc_cleanup(child);  // also closes the ends attached so far
+    return -1;
+  }
+
   // Set command name from argv[0]
   if (argv && argv[0]) {
     snprintf(child->cmd_name, MAX_NAME_LEN, "%s", argv[0]);
@@ -92,44 +134,31 @@ pid_t s_spawn(void* (*func)(void*),
   }
 
   // Log the CREATE event now that cmd_name is set
-  k_log_event("CREATE", child);
+  k_log_event(LOG_CREATE, child);
 
-  // Deep copy arguments
-  if (argv != NULL) {
-    child->args = deep_copy_args(argv);
-    if (child->args == NULL) {
-      k_proc_cleanup(child);
-      return -1;  // P_ERRNO is set inside deep_copy_args
-    }
-  } else {
-    child->args = NULL;
+  // Deep copy arguments (and the redirection data) into the spawn arena
+  spawn_wrapper_args_t* wrapper_args = NULL;
+  if (spawn_pack_args(child, argv, stdin_file, stdout_file, &wrapper_args) !=
+      0) {
+    k_proc_cleanup(child);
+    return -1;  // P_ERRNO is set inside spawn_pack_args
   }
 
   // Prepare wrapper arguments if redirection is needed
   void* (*thread_func)(void*) = func;
   void* thread_arg = (void*)child->args;
 
-  if (stdin_file != NULL || stdout_file != NULL) {
-    spawn_wrapper_args_t* wrapper_args = malloc(sizeof(spawn_wrapper_args_t));
-    if (!wrapper_args) {
-      k_proc_cleanup(child);
-      perror("malloc");
-      P_ERRNO = P_ENOMEM;
-      return -1;
-    }
-
+  if (wrapper_args != NULL) {
     wrapper_args->func = func;
     wrapper_args->argv = child->args;
-    wrapper_args->stdin_file = stdin_file ? strdup(stdin_file) : NULL;
-    wrapper_args->stdout_file = stdout_file ? strdup(stdout_file) : NULL;
     wrapper_args->is_append = is_append;
 
     thread_func = spawn_wrapper;
     thread_arg = wrapper_args;
   }
 
-  // Create the spthread for this process
-  int ret = spthread_create(&child->process, NULL, thread_func, thread_arg);
+  // Create the spthread for this process (a parked one if there is any)
+  int ret = spthread_pool_create(&child->process, thread_func, thread_arg);
   if (ret != 0) {
     k_proc_cleanup(child);
     P_ERRNO = P_ETHREAD;
@@ -137,6 +166,7 @@ pid_t s_spawn(void* (*func)(void*),
   }
   child->state = P_READY;
   k_enqueue(child);
+  KSTAT_INC(KSTAT_SPAWNS);
   return child->pid;
 }
 
@@ -148,26 +178,33 @@ pid_t s_waitpid(pid_t pid, int* wstatus, bool nohang) {
   }
 
   // Check if parent has any children
-  if (vec_len(&parent->childs) == 0) {
+  if (parent->num_childs == 0) {
     P_ERRNO = P_ECHILD;
     return -1;
   }
 
+  // A specific child is found through the process table, not the child list
+  pcb_t* target = NULL;
+  if (pid != -1) {
+    target = get_process_by_pid(pid);
+    if (!target || target->parent != parent) {
+      P_ERRNO = P_ECHILD;
+      return -1;
+    }
+  }
+
   while (1) {
-    // Look for a zombie child or a child that has changed state
-    for (int i = 0; i < vec_len(&parent->childs); i++) {
-      pcb_t* child = vec_get(&parent->childs, i);
-
-      // If pid is -1, wait for any child
-      // If pid is positive, wait for specific child
-      if (pid != -1 && child->pid != pid) {
-        continue;
-      }
+    // Children with an unreported state change are queued by k_terminate and
+    // k_stop, so there is nothing to scan
+    pcb_t* child = target ? (target->w_queued ? target : NULL)
+                          : k_wait_event_peek(parent);
+
+    if (child != NULL) {
+      pid_t child_pid = child->pid;
+      k_wait_event_remove(child);
 
       // Check if child is a zombie (terminated)
       if (child->state == P_ZOMBIE) {
-        pid_t child_pid = child->pid;
-
         // Set the wait status
         if (wstatus) {
           *wstatus = 0;
@@ -191,16 +228,11 @@ pid_t s_waitpid(pid_t pid, int* wstatus, bool nohang) {
         return child_pid;
       }
 
-      // Check if child has been stopped (state change)
-      if (child->state == P_STOPPED) {
-        if (!child->stopped_reported) {
-          if (wstatus) {
-            *wstatus = W_STOPPED;  // Stopped
-          }
-          child->stopped_reported = true;
-          return child->pid;
-        }
+      // Otherwise the child has been stopped (state change)
+      if (wstatus) {
+        *wstatus = W_STOPPED;  // Stopped
       }
+      return child_pid;
     }
 
     // If nohang is true, return immediately if no child has changed state
@@ -211,7 +243,7 @@ pid_t s_waitpid(pid_t pid, int* wstatus, bool nohang) {
     // Block the parent process until a child changes state
     parent->wake_tick = 0;  // Wait indefinitely (not a timed sleep)
     k_block(parent);
-    spthread_suspend_self();  // Actually suspend this thread
+    k_yield();  // Actually suspend this thread and let the next one run
 
     // When we get here, we've been unblocked by a child state change
     // Loop again to find and reap the child
@@ -258,17 +290,27 @@ void s_exit(void) {
     return;
   }
 
+  // Buffered output goes out while we can still block on a full pipe
+  s_flush_all();
+
+  // SIGPTHD stays blocked from here on: once we are a zombie the scheduler
+  // never continues us again, so being suspended halfway through exiting
+  // would leave the parent's join waiting forever.
+  spthread_disable_interrupts_self();
+
   // Set exit status to normal exit
   current->exit_status = P_EXIT_EXITED;
 
   // Log the exit event
-  k_log_event("EXITED", current);
+  k_log_event(LOG_EXITED, current);
 
   // Terminate the process (makes it a zombie)
   k_terminate(current);
 
   // The process is now a zombie and will be reaped by its parent
-  // The scheduler will not schedule this process again
+  // The scheduler will not schedule this process again, so hand the rest of
+  // the slice back.
+  k_scheduler_wake();
   spthread_exit(NULL);  // Exit the thread
 }
 
@@ -311,20 +353,49 @@ void s_sleep(unsigned int ticks) {
   // to 0).
   while (proc->wake_tick > 0 && tick < (uint64_t)proc->wake_tick) {
     k_block(proc);
-    spthread_suspend_self();  // Actually suspend this thread
+    k_yield();  // Actually suspend this thread and let the next one run
   }
 
   // When the process is unblocked by the scheduler after the sleep time,
   // execution will continue here
 }
 
+void s_yield(void) {
+  k_yield();
+}
+
+int s_sched_stats(char* buf, size_t size) {
+  int len = k_sched_stats_format(buf, size);
+  if (len < 0) {
+    P_ERRNO = P_EINVAL;
+    return -1;
+  }
+  return len;
+}
+
+int s_kstat(char* buf, size_t size, bool reset) {
+  int len = k_kstat_format(buf, size);
+  if (len < 0) {
+    P_ERRNO = P_EINVAL;
+    return -1;
+  }
+  if (reset) {
+    k_kstat_reset();
+  }
+  return len;
+}
+
+unsigned int s_tick_ms(void) {
+  return k_get_quantum_ms();
+}
+
 pid_t s_getpid(void) {
   // Directly call the kernel function to retrieve the PID.
   return k_getpid();
 }
 
-pcb_t** s_get_all_process(void) {
-  return get_all_process();
+pcb_t** s_get_all_process(size_t* len) {
+  return get_all_process(len);
 }
 
 void s_shutdown(void) {
@@ -360,10 +431,7 @@ static void spawn_cleanup(void* arg) {
     }
   }
 
-  // Free memory
-  if (wrapper_args->stdin_file) free(wrapper_args->stdin_file);
-  if (wrapper_args->stdout_file) free(wrapper_args->stdout_file);
-  free(wrapper_args);
+  // wrapper_args lives in the spawn arena, which is released at reap time
 }
 
 // Wrapper function that handles file redirection before calling the actual
@@ -373,9 +441,6 @@ static void* spawn_wrapper(void* arg) {
   pcb_t* current_proc = get_current_process();
 
   if (!current_proc) {
-    free(wrapper_args->stdin_file);
-    free(wrapper_args->stdout_file);
-    free(wrapper_args);
     return NULL;
   }
 
@@ -386,9 +451,6 @@ static void* spawn_wrapper(void* arg) {
     s_write(STDERR_FILENO,
             "Error: Input and output files cannot be the same in append mode.\n",
             65);
-    free(wrapper_args->stdin_file);
-    free(wrapper_args->stdout_file);
-    free(wrapper_args);
     s_exit();
     return NULL;
   }
@@ -399,8 +461,9 @@ static void* spawn_wrapper(void* arg) {
 
   void* result = NULL;
 
-  // Register cleanup handler
-  pthread_cleanup_push(spawn_cleanup, wrapper_args);
+  // Register cleanup handler. Not pthread_cleanup_push(): the thread may be
+  // pooled, and then s_exit() does not unwind through this frame.
+  spthread_cleanup_set(spawn_cleanup, wrapper_args);
 
   // Handle stdout redirection FIRST (to allow truncation if not append)
   if (wrapper_args->stdout_file != NULL) {
@@ -435,42 +498,86 @@ static void* spawn_wrapper(void* arg) {
     }
   }
 
-  // Call the actual function
+  // Call the actual function; spawn_cleanup runs once it is over
   result = wrapper_args->func((void*)wrapper_args->argv);
 
-  // We should not reach here, but the macro requires it to close some brackets
-  // (I have no idea why)
-  pthread_cleanup_pop(1);
-
   return result;
 }
 
-static char** deep_copy_args(char** argv) {
-  if (argv == NULL) {
-    return NULL;
+static int spawn_pack_args(pcb_t* child,
+                           char** argv,
+                           const char* stdin_file,
+                           const char* stdout_file,
+                           spawn_wrapper_args_t** wrapper) {
+  bool redirect = stdin_file != NULL || stdout_file != NULL;
+  size_t argc = 0;
+  size_t strings = 0;  // bytes of all copied strings
+  if (argv != NULL) {
+    for (; argv[argc] != NULL; argc++) {
+      strings += strlen(argv[argc]) + 1;
+    }
+  }
+  size_t in_len = stdin_file ? strlen(stdin_file) + 1 : 0;
+  size_t out_len = stdout_file ? strlen(stdout_file) + 1 : 0;
+  strings += in_len + out_len;
+
+  // the wrapper holds pointers, so the argv array after it stays aligned
+  size_t head = redirect ? sizeof(spawn_wrapper_args_t) : 0;
+  size_t vec = argv != NULL ? (argc + 1) * sizeof(char*) : 0;
+  child->args = NULL;
+  *wrapper = NULL;
+  if (head + vec + strings == 0) {
+    return 0;
   }
 
-  int argc = 0;
-  while (argv[argc] != NULL)
-    argc++;
-
-  char** new_args = malloc((argc + 1) * sizeof(char*));
-  if (new_args == NULL) {
+  char* arena = k_proc_arena(child, head + vec + strings);
+  if (arena == NULL) {
     P_ERRNO = P_ENOMEM;
-    return NULL;
+    return -1;
   }
+  char* next = arena + head + vec;  // where the next string goes
 
-  for (int i = 0; i < argc; i++) {
-    new_args[i] = strdup(argv[i]);
-    if (new_args[i] == NULL) {
-      // Cleanup partially allocated args
-      for (int j = 0; j < i; j++)
-        free(new_args[j]);
-      free(new_args);
-      P_ERRNO = P_ENOMEM;
-      return NULL;
+  if (argv != NULL) {
+    char** new_args = (char**)(arena + head);
+    for (size_t i = 0; i < argc; i++) {
+      size_t len = strlen(argv[i]) + 1;
+      new_args[i] = memcpy(next, argv[i], len);
+      next += len;
     }
+    new_args[argc] = NULL;
+    child->args = new_args;
+  }
+
+  if (redirect) {
+    spawn_wrapper_args_t* args = (spawn_wrapper_args_t*)arena;
+    args->stdin_file = stdin_file ? memcpy(next, stdin_file, in_len) : NULL;
+    next += in_len;
+    args->stdout_file =
+        stdout_file ? memcpy(next, stdout_file, out_len) : NULL;
+    *wrapper = args;
+  }
+  return 0;
+}
+
+static int spawn_attach_pipe(pcb_t* parent,
+                             int fd,
+                             pcb_t* child,
+                             int child_fd) {
+  if (fd == -1) {
+    return 0;
+  }
+  if (!parent || fd < 0 || fd >= MAX_FD || !k_is_pipe(parent->fd_table[fd])) {
+    P_ERRNO = P_EBADF;
+    return -1;
   }
-  new_args[argc] = NULL;
-  return new_args;
+
+  int kfd = k_pipe_dup(parent->fd_table[fd]);
+  if (kfd < 0) {
+    return -1;  // k_pipe_dup set P_ERRNO
+  }
+  if (k_is_pipe(child->fd_table[child_fd])) {
+    k_close(child->fd_table[child_fd]);
+  }
+  child->fd_table[child_fd] = kfd;
+  return 0;
 }
@@ -42,12 +42,39 @@ pid_t s_spawn(void* (*func)(void*),
               const char* stdout_file,
               int is_append);
 
+/**
+ * @brief s_spawn() with the child's stdin and / or stdout connected to a
+ * pipe (see s_pipe()).
+ *
+ * The child gets its own end of the pipe, so the caller can (and should)
+ * close its @p pipe_in / @p pipe_out once the child is spawned. A file
+ * redirection takes precedence over a pipe.
+ *
+ * @param pipe_in  Local fd of a pipe end that becomes the child's stdin, or
+ * -1 to inherit stdin.
+ * @param pipe_out Local fd of a pipe end that becomes the child's stdout, or
+ * -1 to inherit stdout.
+ * @return pid_t The process ID of the created child process, or -1 on error
+ * (P_EBADF if a fd is not a pipe end).
+ */
+pid_t s_spawn_piped(void* (*func)(void*),
+                    char* argv[],
+                    const char* stdin_file,
+                    const char* stdout_file,
+                    int is_append,
+                    int pipe_in,
+                    int pipe_out);
+
 /**
  * @brief Wait on a child of the calling process, until it changes state.
  * If `nohang` is true, this will not block the calling process and return
  * immediately.
  *
- * @param pid Process ID of the child to wait for.
+ * State changes are queued per parent as they happen, so `pid == -1` reports
+ * children in the order they exited or stopped, in O(1).
+ *
+ * @param pid Process ID of the child to wait for, or -1 for any child. Fails
+ * with P_ECHILD if it is not a child of the caller.
  * @param wstatus Pointer to an integer variable where the status will be
  * stored.
  * @param nohang If true, return immediately if no child has exited.
@@ -74,7 +101,7 @@ void s_exit(void);
  * @brief Set the priority of the specified thread.
  *
  * @param pid Process ID of the target thread.
- * @param priority The new priority value of the thread (0, 1, or 2)
+ * @param priority The new priority value of the thread, in [0, NUM_PRIO)
  * @return 0 on success, -1 on failure.
  */
 int s_nice(pid_t pid, int priority);
@@ -93,6 +120,45 @@ int s_nice(pid_t pid, int priority);
  */
 void s_sleep(unsigned int ticks);
 
+/**
+ * @brief Give up the CPU for the rest of the current time slice.
+ *
+ * The calling process stays runnable and is put back on its ready queue, and
+ * the scheduler immediately runs the next process.
+ */
+void s_yield(void);
+
+/**
+ * @brief User-level system call to get the scheduler statistics report.
+ *
+ * @param buf  Output buffer; SCHED_STATS_REPORT_SIZE bytes always suffice.
+ * @param size Size of @p buf.
+ * @return The length of the report on success, or -1 on error (P_ERRNO set
+ * to P_EINVAL).
+ */
+int s_sched_stats(char* buf, size_t size);
+
+/**
+ * @brief User-level system call to get the kernel profiling counters.
+ *
+ * @param buf   Output buffer; KSTAT_REPORT_SIZE bytes always suffice.
+ * @param size  Size of @p buf.
+ * @param reset Zero the counters once they have been read.
+ * @return The length of the report on success, or -1 on error (P_ERRNO set
+ * to P_EINVAL).
+ */
+int s_kstat(char* buf, size_t size, bool reset);
+
+/**
+ * @brief User-level system call to get the length of a clock tick.
+ *
+ * The tick length is the scheduler time slice chosen at boot, so programs
+ * should use this to convert wall-clock durations into ticks for s_sleep().
+ *
+ * @return The duration of one tick in milliseconds.
+ */
+unsigned int s_tick_ms(void);
+
 /**
  * @brief User-level system call to get the calling process's PID.
  * * This function serves as the interface for PennOS programs to retrieve
@@ -129,9 +195,11 @@ void s_shutdown(void);
  * This function allows user-level access to the process table for commands like
  * ps.
  *
+ * @param len Set to the number of entries in the table (unused PIDs are
+ *            NULL).
  * @return A pointer to the array of PCB pointers.
  */
-pcb_t** s_get_all_process(void);
+pcb_t** s_get_all_process(size_t* len);
 
 /**
  * @brief Lists files in a directory.
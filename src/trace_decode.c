@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <string.h>
+#include "./util/logger.h"
+
+//////////////////////////////////////////////////////////////////////////////
+// Offline decoder for PennOS binary traces (pennos <fs> <log> -b).
+// Prints every record in the same text format as the regular PennOS log.
+////////////////////////////////////////////////////////////////////////////
+
+/** @brief Trace string table, filled from the TRACE_STRING records */
+static char names[TRACE_MAX_NAMES][TRACE_NAME_LEN];
+
+int main(int argc, char* argv[]) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "Usage: %s <trace_fname> [out_fname]\n", argv[0]);
+    return 1;
+  }
+
+  FILE* in = fopen(argv[1], "rb");
+  if (in == NULL) {
+    perror("trace_decode: cannot open trace");
+    return 1;
+  }
+  FILE* out = stdout;
+  if (argc == 3 && (out = fopen(argv[2], "w")) == NULL) {
+    perror("trace_decode: cannot open output");
+    fclose(in);
+    return 1;
+  }
+
+  trace_header_t header;
+  if (fread(&header, sizeof(header), 1, in) != 1 ||
+      header.magic != TRACE_MAGIC || header.version != TRACE_VERSION ||
+      header.record_size != sizeof(trace_record_t)) {
+    fprintf(stderr, "trace_decode: %s is not a PennOS trace\n", argv[1]);
+    fclose(in);
+    if (out != stdout)
+      fclose(out);
+    return 1;
+  }
+
+  int status = 0;
+  trace_record_t rec;
+  char line[128];
+
+  while (fread(&rec, sizeof(rec), 1, in) == 1) {
+    if (rec.event == TRACE_STRING) {
+      // string table definition: the name follows the record
+      char name[TRACE_NAME_LEN];
+      if (fread(name, TRACE_NAME_LEN, 1, in) != 1) {
+        fprintf(stderr, "trace_decode: truncated string table entry\n");
+        status = 1;
+        break;
+      }
+      if (rec.name_id < TRACE_MAX_NAMES) {
+        memcpy(names[rec.name_id], name, TRACE_NAME_LEN);
+        names[rec.name_id][TRACE_NAME_LEN - 1] = '\0';
+      }
+      continue;
+    }
+
+    const char* name =
+        (rec.name_id < TRACE_MAX_NAMES) ? names[rec.name_id] : "<unknown>";
+    int len = k_log_format(&rec, name, line, sizeof(line));
+    if (len < 0) {
+      fprintf(stderr, "trace_decode: bad event %u at tick %u\n", rec.event,
+              rec.tick);
+      status = 1;
+      continue;
+    }
+    fputs(line, out);
+  }
+
+  fclose(in);
+  if (out != stdout)
+    fclose(out);
+  return status;
+}
@@ -4,11 +4,13 @@
 #include <string.h>
 #include <unistd.h>
 #include "./util/job.h"
+#include "./util/kstat.h"
 #include "./util/p_errno.h"
 #include "./util/p_signal.h"
 #include "./util/struct.h"
 #include "fat_syscalls.h"
 #include "process.h"
+#include "scheduler.h"
 #include "syscall.h"
 
 void* u_sleep(void* arg) {
@@ -23,15 +25,16 @@ void* u_sleep(void* arg) {
 
   int seconds = atoi(argv[1]);
   if (seconds <= 0) {
-    char buf[64];
-    int len = snprintf(buf, sizeof(buf), "sleep: invalid time interval '%s'\n",
-                       argv[1]);
-    s_write(STDERR_FILENO, buf, len);
+    s_printf(STDERR_FILENO, "sleep: invalid time interval '%s'\n", argv[1]);
     s_exit();
     return NULL;
   }
 
-  unsigned int ticks = seconds * 10;
+  // the tick length depends on the time slice chosen at boot
+  unsigned int ticks = (unsigned int)seconds * 1000 / s_tick_ms();
+  if (ticks == 0) {
+    ticks = 1;
+  }
   s_sleep(ticks);
 
   s_exit();
@@ -41,16 +44,17 @@ void* u_sleep(void* arg) {
 void* u_ps(void* arg) {
   (void)arg;
 
+  size_t table_len = 0;
   pcb_t** global_table =
-      s_get_all_process();  // Retrieve the global process table to iterate
-                            // through all processes
+      s_get_all_process(&table_len);  // Retrieve the global process table to
+                                      // iterate through all processes
 
-  char header[128];
-  int len = snprintf(header, sizeof(header), "     %-6s %-6s %-4s %-6s %s\n",
-                     "PID", "PPID", "PRI", "STAT", "CMD");
-  s_write(STDOUT_FILENO, header, len);
+  // One report: written out in OBUF_SIZE chunks (at s_exit), not per line
+  s_setvbuf(STDOUT_FILENO, S_BUF_FULL);
+  s_printf(STDOUT_FILENO, "     %-6s %-6s %-4s %-6s %s\n", "PID", "PPID", "PRI",
+           "STAT", "CMD");
 
-  for (int i = 0; i < MAX_PROC; i++) {
+  for (size_t i = 0; i < table_len; i++) {
     if (global_table[i] == NULL) {
       continue;
     }
@@ -77,19 +81,16 @@ void* u_ps(void* arg) {
     }
 
     const char* cmd_name = p->cmd_name;
-    char line[256];
     if (p->state == P_ZOMBIE && cmd_name[0] != '\0') {
-      len = snprintf(line, sizeof(line), "     %-6d %-6d %-4d %c      %s \n",
-                     p->pid, p->ppid, p->prio, state, cmd_name);
+      s_printf(STDOUT_FILENO, "     %-6d %-6d %-4d %c      %s \n", p->pid,
+               p->ppid, p->prio, state, cmd_name);
     } else if (cmd_name[0] != '\0') {
-      len = snprintf(line, sizeof(line), "     %-6d %-6d %-4d %c      %s\n",
-                     p->pid, p->ppid, p->prio, state, cmd_name);
+      s_printf(STDOUT_FILENO, "     %-6d %-6d %-4d %c      %s\n", p->pid,
+               p->ppid, p->prio, state, cmd_name);
     } else {
-      len = snprintf(line, sizeof(line),
-                     "     %-6d %-6d %-4d %c      <unknown>\n", p->pid, p->ppid,
-                     p->prio, state);
+      s_printf(STDOUT_FILENO, "     %-6d %-6d %-4d %c      <unknown>\n",
+               p->pid, p->ppid, p->prio, state);
     }
-    s_write(STDOUT_FILENO, line, len);
   }
 
   s_exit();
@@ -117,10 +118,7 @@ void* u_kill(void* arg) {
     } else if (strcmp(argv[1], "-cont") == 0) {
       signal = P_SIGCONT;
     } else {
-      char buf[64];
-      int len =
-          snprintf(buf, sizeof(buf), "kill: invalid signal '%s'\n", argv[1]);
-      s_write(STDERR_FILENO, buf, len);
+      s_printf(STDERR_FILENO, "kill: invalid signal '%s'\n", argv[1]);
       s_exit();
       return NULL;
     }
@@ -137,10 +135,7 @@ void* u_kill(void* arg) {
   while (argv[idx] != NULL) {
     pid_t target = atoi(argv[idx]);
     if (target <= 0) {
-      char buf[64];
-      int len =
-          snprintf(buf, sizeof(buf), "kill: invalid pid '%s'\n", argv[idx]);
-      s_write(STDERR_FILENO, buf, len);
+      s_printf(STDERR_FILENO, "kill: invalid pid '%s'\n", argv[idx]);
     } else {
       if (s_kill(target, signal) < 0) {  // Invoke the kill system call to send
                                          // the signal to the target process
@@ -172,12 +167,26 @@ void* u_echo(void* arg) {
     return NULL;
   }
 
-  for (int i = 1; argv[i] != NULL; i++) {
-    if (i > 1)
-      s_write(STDOUT_FILENO, " ", 1);
-    s_write(STDOUT_FILENO, argv[i], strlen(argv[i]));
+  // One s_writev for the whole line: the words with a separator after each
+  // (a space, or the final newline)
+  int argc = 0;
+  while (argv[argc + 1] != NULL) {
+    argc++;
   }
-  s_write(STDOUT_FILENO, "\n", 1);
+  if (argc == 0) {
+    s_write(STDOUT_FILENO, "\n", 1);
+    s_exit();
+    return NULL;
+  }
+
+  struct iovec iov[2 * argc];
+  for (int i = 0; i < argc; i++) {
+    iov[2 * i].iov_base = argv[i + 1];
+    iov[2 * i].iov_len = strlen(argv[i + 1]);
+    iov[2 * i + 1].iov_base = i + 1 < argc ? " " : "\n";
+    iov[2 * i + 1].iov_len = 1;
+  }
+  s_writev(STDOUT_FILENO, iov, 2 * argc);
 
   s_exit();
   return NULL;
@@ -196,6 +205,7 @@ void* u_ls(void* arg) {
   if (argv != NULL && argv[1] != NULL) {
     filename = argv[1];
   }
+  s_setvbuf(STDOUT_FILENO, S_BUF_FULL);  // a few writes for the listing
   if (s_ls(filename) < 0) {
     u_perror("ls");
   }
@@ -265,6 +275,53 @@ void* u_rm(void* arg) {
   return NULL;
 }
 
+void* u_mkdir(void* arg) {
+  char** argv = (char**)arg;
+  if (argv == NULL || argv[1] == NULL) {
+    const char* msg = "mkdir: missing operand\n";
+    s_write(STDERR_FILENO, msg, strlen(msg));
+    s_exit();
+    return NULL;
+  }
+  for (int i = 1; argv[i] != NULL; i++) {
+    if (s_mkdir(argv[i]) < 0) {
+      u_perror("mkdir");
+    }
+  }
+  s_exit();
+  return NULL;
+}
+
+void* u_rmdir(void* arg) {
+  char** argv = (char**)arg;
+  if (argv == NULL || argv[1] == NULL) {
+    const char* msg = "rmdir: missing operand\n";
+    s_write(STDERR_FILENO, msg, strlen(msg));
+    s_exit();
+    return NULL;
+  }
+  for (int i = 1; argv[i] != NULL; i++) {
+    if (s_rmdir(argv[i]) < 0) {
+      u_perror("rmdir");
+    }
+  }
+  s_exit();
+  return NULL;
+}
+
+void* u_pwd(void* arg) {
+  (void)arg;
+  char cwd[MAX_PATH_LEN + 1];
+  if (s_getcwd(cwd, MAX_PATH_LEN) < 0) {
+    u_perror("pwd");
+  } else {
+    strcat(cwd, "\n");
+    s_write(STDOUT_FILENO, cwd, strlen(cwd));
+  }
+  s_exit();
+  return NULL;
+}
+
 void* u_chmod(void* arg) {
   char** argv = (char**)arg;
   if (argv == NULL || argv[1] == NULL || argv[2] == NULL) {
@@ -293,10 +350,7 @@ void* u_chmod(void* arg) {
           mask |= 1;
           break;
         default: {
-          char buf[64];
-          int len = snprintf(buf, sizeof(buf), "chmod: invalid mode: %c\n",
-                             mode_str[i]);
-          s_write(STDERR_FILENO, buf, len);
+          s_printf(STDERR_FILENO, "chmod: invalid mode: %c\n", mode_str[i]);
           s_exit();
           return NULL;
         }
@@ -312,10 +366,7 @@ void* u_chmod(void* arg) {
     }
   } else {
     if (strspn(mode_str, "01234567") != strlen(mode_str)) {
-      char buf[64];
-      int len =
-          snprintf(buf, sizeof(buf), "chmod: invalid mode: '%s'\n", mode_str);
-      s_write(STDERR_FILENO, buf, len);
+      s_printf(STDERR_FILENO, "chmod: invalid mode: '%s'\n", mode_str);
       s_exit();
       return NULL;
     }
@@ -373,7 +424,7 @@ void* u_nice_pid(void* arg) {
   }
 
   int priority = atoi(argv[1]);
-  if (priority < 0 || priority > 2) {
+  if (priority < 0 || priority >= NUM_PRIO) {
     const char* msg = "nice_pid: invalid priority\n";
     s_write(STDERR_FILENO, msg, strlen(msg));
     return NULL;
@@ -394,12 +445,53 @@ void* u_nice_pid(void* arg) {
   return NULL;
 }
 
+void* u_schedstat(void* arg) {
+  (void)arg;
+
+  char* report = malloc(SCHED_STATS_REPORT_SIZE);
+  if (report == NULL) {
+    const char* msg = "schedstat: out of memory\n";
+    s_write(STDERR_FILENO, msg, strlen(msg));
+    s_exit();
+    return NULL;
+  }
+
+  int len = s_sched_stats(report, SCHED_STATS_REPORT_SIZE);
+  if (len < 0) {
+    u_perror("schedstat");
+  } else {
+    s_write(STDOUT_FILENO, report, len);
+  }
+
+  free(report);
+  s_exit();
+  return NULL;
+}
+
+void* u_stat(void* arg) {
+  char** argv = (char**)arg;
+  bool reset = argv[1] != NULL && strcmp(argv[1], "-r") == 0;
+
+  char report[KSTAT_REPORT_SIZE];
+  int len = s_kstat(report, sizeof(report), reset);
+  if (len < 0) {
+    u_perror("stat");
+  } else {
+    s_write(STDOUT_FILENO, report, len);
+  }
+
+  s_exit();
+  return NULL;
+}
+
 void* u_man(void* arg) {
   (void)arg;
   const char* help_text =
       "PennOS Shell Commands:\n\n"
       "Process Management:\n"
       "  ps                        - List all processes\n"
+      "  schedstat                 - Show scheduler statistics\n"
+      "  stat [-r]                 - Show kernel counters (-r: then reset)\n"
       "  kill <signal> <pid> ...   - Send signal to process (default: -term)\n"
       "  nice <pri> <cmd>          - Run command with priority (0-2)\n"
       "  nice_pid <pri> <pid>      - Change priority of existing process\n"
@@ -407,9 +499,13 @@ void* u_man(void* arg) {
       "  busy                      - Busy wait indefinitely\n\n"
       "File System:\n"
       "  cat <file> ...            - Concatenate and print files\n"
-      "  ls [file]                 - List directory contents\n"
+      "  ls [file|dir]             - List directory contents\n"
+      "  cd [dir]                  - Change directory (default: /)\n"
+      "  pwd                       - Print the current directory\n"
+      "  mkdir <dir> ...           - Create directories\n"
+      "  rmdir <dir> ...           - Remove empty directories\n"
       "  touch <file> ...          - Create empty files or update timestamps\n"
-      "  mv <src> <dst>            - Move/rename file\n"
+      "  mv <src> <dst>            - Move/rename file (into <dst> if a dir)\n"
       "  cp <src> <dst>            - Copy file (use -h for host, -a for "
       "append)\n"
       "  rm <file> ...             - Remove files\n"
@@ -456,20 +552,15 @@ void* u_bg(void* arg) {
   }
 
   if (job->state == JOB_RUNNING || job->state == JOB_BACKGROUND) {
-    char msg[256];
-    int len =
-        snprintf(msg, sizeof(msg), "[%d] %s already running in background\n",
-                 job->job_id, job->cmd);
-    s_write(STDOUT_FILENO, msg, len);
+    s_printf(STDOUT_FILENO, "[%d] %s already running in background\n",
+             job->job_id, job->cmd);
     job->state = JOB_BACKGROUND;
     return NULL;
   }
 
   if (job->state == JOB_STOPPED) {
     job->state = JOB_BACKGROUND;
-    char msg[256];
-    int len = snprintf(msg, sizeof(msg), "[%d] %s\n", job->job_id, job->cmd);
-    s_write(STDOUT_FILENO, msg, len);
+    s_printf(STDOUT_FILENO, "[%d] %s\n", job->job_id, job->cmd);
 
     if (s_kill(job->pid, 2) <
         0) {  // Send SIGCONT (2) to resume the stopped job in the background
@@ -506,11 +597,10 @@ void* u_fg(void* arg) {
   }
 
   job->state = JOB_RUNNING;
-  char msg[256];
-  int len = snprintf(msg, sizeof(msg), "%s\n", job->cmd);
-  s_write(STDOUT_FILENO, msg, len);
+  s_printf(STDOUT_FILENO, "%s\n", job->cmd);
 
-  if (job->pcb->state == P_STOPPED) {
+  if (job->pcb && job->pcb->gen == job->gen &&
+      job->pcb->state == P_STOPPED) {
     if (s_kill(job->pid, 2) < 0) {
       u_perror("fg: failed to continue process");
     }
@@ -525,10 +615,7 @@ void* u_fg(void* arg) {
   if (P_WIFSTOPPED(wstatus)) {  // Check if the child process was stopped (e.g.,
                                 // by Ctrl-Z)
     job->state = JOB_STOPPED;
-    char buf[128];
-    int len = snprintf(buf, sizeof(buf), "\n[%d] Stopped %s\n", job->job_id,
-                       job->cmd);
-    s_write(STDOUT_FILENO, buf, len);
+    s_printf(STDOUT_FILENO, "\n[%d] Stopped %s\n", job->job_id, job->cmd);
   } else if (P_WIFSIGNALED(wstatus)) {  // Check if the child process was
                                         // terminated by a signal
     jobs_remove(job->pid);
@@ -556,16 +643,26 @@ void* u_jobs(void* arg) {
                      : (job_table[i].state == JOB_BACKGROUND) ? "Background"
                                                               : "Done";
 
-    char line[256];
-    int len =
-        snprintf(line, sizeof(line), "[%d] %-2d %-12s %s\n",
-                 job_table[i].job_id, job_table[i].pid, st, job_table[i].cmd);
-    s_write(STDOUT_FILENO, line, len);
+    s_printf(STDOUT_FILENO, "[%d] %-2d %-12s %s\n", job_table[i].job_id,
+             job_table[i].pid, st, job_table[i].cmd);
   }
 
   return NULL;
 }
 
+void* u_cd(void* arg) {
+  char** argv = (char**)arg;
+  if (argv[1] != NULL && argv[2] != NULL) {
+    const char* msg = "cd: too many arguments\n";
+    s_write(STDERR_FILENO, msg, strlen(msg));
+    return NULL;
+  }
+  if (s_chdir(argv[1] != NULL ? argv[1] : "/") < 0) {
+    u_perror("cd");
+  }
+  return NULL;
+}
+
 void* u_logout(void* arg) {
   (void)arg;
   const char* msg = "Logging out...\n";
@@ -25,6 +25,23 @@ void* u_sleep(void* arg);
  */
 void* u_ps(void* arg);
 
+/**
+ * @brief Print per-process scheduler counters and latency histograms.
+ * @param arg Unused.
+ * @return NULL.
+ */
+void* u_schedstat(void* arg);
+
+/**
+ * @brief Print the kernel profiling counters (see util/kstat.h).
+ *
+ * `stat -r` zeroes them after printing, to measure a single command.
+ *
+ * @param arg Argument vector.
+ * @return NULL.
+ */
+void* u_stat(void* arg);
+
 /**
  * @brief Send a signal to terminate a process by PID.
  * @param arg Pointer to argument string containing target PID.
@@ -90,6 +107,27 @@ void* u_cp(void* arg);
  */
 void* u_rm(void* arg);
 
+/**
+ * @brief Create directories.
+ * @param arg Pointer to argument string containing directory path(s).
+ * @return NULL on success, or error code on failure.
+ */
+void* u_mkdir(void* arg);
+
+/**
+ * @brief Remove empty directories.
+ * @param arg Pointer to argument string containing directory path(s).
+ * @return NULL on success, or error code on failure.
+ */
+void* u_rmdir(void* arg);
+
+/**
+ * @brief Print the current directory.
+ * @param arg Unused argument pointer.
+ * @return NULL on success, or error code on failure.
+ */
+void* u_pwd(void* arg);
+
 /**
  * @brief Change file permissions.
  * @param arg Pointer to argument string containing permissions and file path.
@@ -159,6 +197,15 @@ void* u_fg(void* arg);
  */
 void* u_jobs(void* arg);
 
+/**
+ * @brief Change the current directory of the shell, which the commands it
+ * spawns inherit.
+ * @param arg Pointer to argument string containing the directory (optional,
+ * default "/").
+ * @return NULL.
+ */
+void* u_cd(void* arg);
+
 /**
  * @brief Exit the shell and terminate the session.
  * @param arg Unused argument pointer.
@@ -0,0 +1,448 @@
+#include "bcache.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "spthread.h"
+
+#define BCACHE_NONE (-1)
+#define BCACHE_MAX_RUN 64  // most blocks moved by one preadv / pwritev
+
+/** @brief One cached block */
+typedef struct bcache_slot {
+  uint16_t blk;  // block held by this slot (if valid)
+  bool valid;    // holds a block
+  bool dirty;    // modified since it was read / last written back
+  bool ref;      // CLOCK reference bit
+  bool pinned;   // being filled; must not be evicted
+  char* data;    // block_size bytes
+} bcache_slot_t;
+
+// Slots are only touched with interrupts disabled
+// (spthread_disable_interrupts_nested()), so a process is never suspended
+// while it holds slot pointers.
+static int cache_fd = -1;           // image the cache sits on
+static off_t cache_base = 0;        // byte offset of block 1
+static size_t cache_bs = 0;         // block size
+static size_t cache_nblocks = 0;    // valid blocks are 1..cache_nblocks-1
+static bcache_slot_t* slots = NULL;  // the cache itself
+static size_t nslots = 0;           // 0: cache disabled
+static char* pool = NULL;           // backing memory of all slots
+static int32_t* slot_of = NULL;     // block -> slot, or BCACHE_NONE
+static size_t* scratch = NULL;      // nslots entries, used by flush
+static size_t hand = 0;             // CLOCK hand
+static uint64_t hits = 0;
+static uint64_t misses = 0;
+static char* image_map = NULL;      // whole image when mapped, else NULL
+static size_t image_size = 0;       // size of image_map
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Static Function Declarations =================== /////
+////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Pick a slot to reuse with the CLOCK algorithm, writing it back if
+ * it is dirty.
+ *
+ * @return The now empty slot, or BCACHE_NONE if none could be freed.
+ */
+static int k_bcache_evict(void);
+
+/**
+ * @brief Read @p run adjacent uncached blocks from @p blk on with a single
+ * preadv into freshly evicted slots.
+ *
+ * @return The slot now holding @p blk, or BCACHE_NONE on I/O error.
+ */
+static int k_bcache_load(uint16_t blk, size_t run);
+
+/**
+ * @brief Write the dirty slots @p idx[0..count) (adjacent blocks, in order)
+ * back with a single pwritev.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int k_bcache_writeback(const size_t* idx, size_t count);
+
+/**
+ * @brief qsort comparator ordering slot indices by block number.
+ */
+static int k_bcache_cmp_blk(const void* a, const void* b);
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Public API Implementation =================== ////////
+////////////////////////////////////////////////////////////////////////////
+
+int k_bcache_init(int fd,
+                  off_t data_start,
+                  size_t block_size,
+                  size_t num_blocks,
+                  size_t capacity,
+                  char* map,
+                  size_t map_size) {
+  k_bcache_destroy();
+
+  cache_fd = fd;
+  cache_base = data_start;
+  cache_bs = block_size;
+  cache_nblocks = num_blocks;
+  hand = 0;
+  hits = 0;
+  misses = 0;
+  image_map = map;
+  image_size = map_size;
+  if (capacity == 0 || map != NULL) {
+    return 0;
+  }
+
+  slots = calloc(capacity, sizeof(bcache_slot_t));
+  pool = malloc(capacity * block_size);
+  slot_of = malloc(num_blocks * sizeof(int32_t));
+  scratch = malloc(capacity * sizeof(size_t));
+  if (!slots || !pool || !slot_of || !scratch) {
+    k_bcache_destroy();
+    return -1;
+  }
+
+  for (size_t i = 0; i < capacity; i++) {
+    slots[i].data = pool + i * block_size;
+  }
+  for (size_t b = 0; b < num_blocks; b++) {
+    slot_of[b] = BCACHE_NONE;
+  }
+  nslots = capacity;
+  return 0;
+}
+
+void k_bcache_destroy(void) {
+  if (nslots > 0) {
+    k_bcache_flush();
+  }
+
+  free(slots);
+  free(pool);
+  free(slot_of);
+  free(scratch);
+  slots = NULL;
+  pool = NULL;
+  slot_of = NULL;
+  scratch = NULL;
+  nslots = 0;
+  image_map = NULL;
+  image_size = 0;
+}
+
+ssize_t k_bcache_read(void* buf, size_t len, off_t off) {
+  if (image_map != NULL) {
+    if ((size_t)off >= image_size) {
+      return -1;
+    }
+    len = len < image_size - (size_t)off ? len : image_size - (size_t)off;
+    memcpy(buf, image_map + off, len);
+    return (ssize_t)len;
+  }
+  if (nslots == 0 || off < cache_base) {
+    return pread(cache_fd, buf, len, off);
+  }
+
+  bool locked = spthread_disable_interrupts_nested();
+  size_t done = 0;
+  while (done < len) {
+    off_t rel = off + (off_t)done - cache_base;
+    size_t blk = (size_t)rel / cache_bs + 1;
+    size_t in = (size_t)rel % cache_bs;
+    size_t chunk = cache_bs - in < len - done ? cache_bs - in : len - done;
+    if (blk >= cache_nblocks) {
+      break;
+    }
+
+    int s = slot_of[blk];
+    if (s == BCACHE_NONE) {
+      // fetch every block of the request that is missing right after it
+      size_t need = (in + (len - done) + cache_bs - 1) / cache_bs;
+      size_t limit = nslots < BCACHE_MAX_RUN ? nslots : BCACHE_MAX_RUN;
+      size_t run = 1;
+      while (run < need && run < limit && blk + run < cache_nblocks &&
+             slot_of[blk + run] == BCACHE_NONE) {
+        run++;
+      }
+      s = k_bcache_load((uint16_t)blk, run);
+      if (s == BCACHE_NONE) {
+        break;
+      }
+    } else {
+      hits++;
+    }
+
+    memcpy((char*)buf + done, slots[s].data + in, chunk);
+    slots[s].ref = true;
+    done += chunk;
+  }
+  spthread_restore_interrupts(locked);
+
+  return (done > 0 || len == 0) ? (ssize_t)done : -1;
+}
+
+ssize_t k_bcache_write(const void* buf, size_t len, off_t off) {
+  if (image_map != NULL) {
+    if ((size_t)off >= image_size) {
+      return -1;
+    }
+    len = len < image_size - (size_t)off ? len : image_size - (size_t)off;
+    memcpy(image_map + off, buf, len);
+    return (ssize_t)len;
+  }
+  if (nslots == 0 || off < cache_base) {
+    return pwrite(cache_fd, buf, len, off);
+  }
+
+  bool locked = spthread_disable_interrupts_nested();
+  size_t done = 0;
+  while (done < len) {
+    off_t rel = off + (off_t)done - cache_base;
+    size_t blk = (size_t)rel / cache_bs + 1;
+    size_t in = (size_t)rel % cache_bs;
+    size_t chunk = cache_bs - in < len - done ? cache_bs - in : len - done;
+    if (blk >= cache_nblocks) {
+      break;
+    }
+
+    int s = slot_of[blk];
+    if (s == BCACHE_NONE && chunk == cache_bs) {
+      // overwritten as a whole: no need to read the old contents
+      s = k_bcache_evict();
+      if (s == BCACHE_NONE) {
+        break;
+      }
+      slots[s].blk = (uint16_t)blk;
+      slots[s].valid = true;
+      slot_of[blk] = s;
+      misses++;
+    } else if (s == BCACHE_NONE) {
+      s = k_bcache_load((uint16_t)blk, 1);
+      if (s == BCACHE_NONE) {
+        break;
+      }
+    } else {
+      hits++;
+    }
+
+    memcpy(slots[s].data + in, (const char*)buf + done, chunk);
+    slots[s].dirty = true;
+    slots[s].ref = true;
+    done += chunk;
+  }
+  spthread_restore_interrupts(locked);
+
+  return (done > 0 || len == 0) ? (ssize_t)done : -1;
+}
+
+void k_bcache_refresh(const void* buf, size_t len, off_t off) {
+  if (nslots == 0 || off < cache_base) {
+    return;  // no copies (a mapping sees the write by itself)
+  }
+
+  bool locked = spthread_disable_interrupts_nested();
+  size_t done = 0;
+  while (done < len) {
+    off_t rel = off + (off_t)done - cache_base;
+    size_t blk = (size_t)rel / cache_bs + 1;
+    size_t in = (size_t)rel % cache_bs;
+    size_t chunk = cache_bs - in < len - done ? cache_bs - in : len - done;
+    if (blk >= cache_nblocks) {
+      break;
+    }
+    if (slot_of[blk] != BCACHE_NONE) {
+      memcpy(slots[slot_of[blk]].data + in, (const char*)buf + done, chunk);
+    }
+    done += chunk;
+  }
+  spthread_restore_interrupts(locked);
+}
+
+size_t k_bcache_prefetch(uint16_t blk, size_t count) {
+  if (blk == 0 || blk >= cache_nblocks || count == 0) {
+    return 0;
+  }
+  if (count > cache_nblocks - blk) {
+    count = cache_nblocks - blk;
+  }
+
+  off_t off = cache_base + (off_t)(blk - 1) * cache_bs;
+  size_t len = count * cache_bs;
+  if (image_map != NULL) {
+    if ((size_t)off >= image_size) {
+      return 0;
+    }
+    len = len < image_size - (size_t)off ? len : image_size - (size_t)off;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)off & ~(page - 1);
+    madvise(image_map + start, (size_t)off + len - start, MADV_WILLNEED);
+    return count;
+  }
+  if (nslots == 0) {
+    posix_fadvise(cache_fd, off, (off_t)len, POSIX_FADV_WILLNEED);
+    return count;
+  }
+
+  // leave room for everything else that is cached
+  if (count > nslots / 2) {
+    count = nslots / 2;
+  }
+  bool locked = spthread_disable_interrupts_nested();
+  size_t loaded = 0;
+  size_t i = 0;
+  while (i < count) {
+    if (slot_of[blk + i] != BCACHE_NONE) {
+      i++;
+      continue;
+    }
+    size_t run = 1;
+    while (i + run < count && run < BCACHE_MAX_RUN &&
+           slot_of[blk + i + run] == BCACHE_NONE) {
+      run++;
+    }
+    if (k_bcache_load((uint16_t)(blk + i), run) == BCACHE_NONE) {
+      break;
+    }
+    loaded += run;
+    i += run;
+  }
+  spthread_restore_interrupts(locked);
+
+  return loaded;
+}
+
+int k_bcache_flush(void) {
+  if (nslots == 0) {
+    return 0;
+  }
+
+  bool locked = spthread_disable_interrupts_nested();
+  size_t count = 0;
+  for (size_t i = 0; i < nslots; i++) {
+    if (slots[i].valid && slots[i].dirty) {
+      scratch[count++] = i;
+    }
+  }
+  qsort(scratch, count, sizeof(size_t), k_bcache_cmp_blk);
+
+  // one pwritev per run of adjacent blocks
+  int result = 0;
+  size_t start = 0;
+  while (start < count) {
+    size_t end = start + 1;
+    while (end < count && end - start < BCACHE_MAX_RUN &&
+           slots[scratch[end]].blk == slots[scratch[end - 1]].blk + 1) {
+      end++;
+    }
+    if (k_bcache_writeback(scratch + start, end - start) != 0) {
+      result = -1;
+    }
+    start = end;
+  }
+  spthread_restore_interrupts(locked);
+
+  return result;
+}
+
+void k_bcache_stats(uint64_t* hits_out, uint64_t* misses_out) {
+  *hits_out = hits;
+  *misses_out = misses;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Static Function Implementations =================== //
+////////////////////////////////////////////////////////////////////////////
+
+static int k_bcache_evict(void) {
+  // two sweeps are enough to clear every reference bit
+  for (size_t n = 0; n < 2 * nslots + 1; n++) {
+    size_t s = hand;
+    bcache_slot_t* slot = &slots[s];
+    hand = (hand + 1) % nslots;
+
+    if (slot->pinned) {
+      continue;
+    }
+    if (slot->valid && slot->ref) {
+      slot->ref = false;  // second chance
+      continue;
+    }
+    if (slot->valid && slot->dirty && k_bcache_writeback(&s, 1) != 0) {
+      continue;  // cannot drop data we failed to save
+    }
+
+    if (slot->valid) {
+      slot_of[slot->blk] = BCACHE_NONE;
+    }
+    slot->valid = false;
+    slot->dirty = false;
+    slot->ref = false;
+    return (int)s;
+  }
+  return BCACHE_NONE;
+}
+
+static int k_bcache_load(uint16_t blk, size_t run) {
+  struct iovec iov[BCACHE_MAX_RUN];
+  int idx[BCACHE_MAX_RUN];
+  size_t n = 0;
+
+  for (; n < run; n++) {
+    int s = k_bcache_evict();
+    if (s == BCACHE_NONE) {
+      break;
+    }
+    slots[s].pinned = true;
+    idx[n] = s;
+    iov[n].iov_base = slots[s].data;
+    iov[n].iov_len = cache_bs;
+  }
+  if (n == 0) {
+    return BCACHE_NONE;
+  }
+
+  ssize_t r =
+      preadv(cache_fd, iov, (int)n, cache_base + (off_t)(blk - 1) * cache_bs);
+  size_t got = r > 0 ? (size_t)r / cache_bs : 0;
+  misses += n;
+
+  for (size_t i = 0; i < n; i++) {
+    bcache_slot_t* slot = &slots[idx[i]];
+    slot->pinned = false;
+    if (i < got) {
+      slot->blk = (uint16_t)(blk + i);
+      slot->valid = true;
+      slot->ref = true;
+      slot_of[blk + i] = idx[i];
+    }
+  }
+  return got > 0 ? idx[0] : BCACHE_NONE;
+}
+
+static int k_bcache_writeback(const size_t* idx, size_t count) {
+  struct iovec iov[BCACHE_MAX_RUN];
+  for (size_t i = 0; i < count; i++) {
+    iov[i].iov_base = slots[idx[i]].data;
+    iov[i].iov_len = cache_bs;
+  }
+
+  off_t off = cache_base + (off_t)(slots[idx[0]].blk - 1) * cache_bs;
+  if (pwritev(cache_fd, iov, (int)count, off) != (ssize_t)(count * cache_bs)) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    slots[idx[i]].dirty = false;
+  }
+  return 0;
+}
+
+static int k_bcache_cmp_blk(const void* a, const void* b) {
+  uint16_t ba = slots[*(const size_t*)a].blk;
+  uint16_t bb = slots[*(const size_t*)b].blk;
+  return (ba > bb) - (ba < bb);
+}
@@ -0,0 +1,96 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Block buffer cache for the PennFAT data region.
+//
+// Blocks are numbered the PennFAT way: block b (b >= 1) lives at byte
+// data_start + (b - 1) * block_size of the image. Reads and writes of any
+// byte range in the data region go through the cache. Replacement uses the
+// CLOCK algorithm. Dirty blocks are written back when they are evicted or
+// on k_bcache_flush(). Runs of adjacent misses are read with one preadv,
+// and runs of adjacent dirty blocks are written with one pwritev.
+//
+// When the whole image is memory mapped, the cache steps aside: reads and
+// writes become plain memcpy()s on the mapping and the host page cache does
+// the caching.
+
+/**
+ * @brief Set up the cache for a freshly mounted image.
+ *
+ * @param fd         Host file descriptor of the image.
+ * @param data_start Byte offset of block 1 (i.e. the size of the FAT).
+ * @param block_size Size of one block in bytes.
+ * @param num_blocks Number of FAT entries; valid blocks are 1..num_blocks-1.
+ * @param capacity   Number of blocks to cache; 0 bypasses the cache.
+ * @param map        Mapping of the whole image, or NULL. When given, the
+ *                   cache is not used and @p capacity is ignored.
+ * @param map_size   Size of @p map in bytes.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+int k_bcache_init(int fd,
+                  off_t data_start,
+                  size_t block_size,
+                  size_t num_blocks,
+                  size_t capacity,
+                  char* map,
+                  size_t map_size);
+
+/**
+ * @brief Flush all dirty blocks and release the cache.
+ */
+void k_bcache_destroy(void);
+
+/**
+ * @brief pread() through the cache.
+ *
+ * @return Number of bytes read, or -1 if nothing could be read.
+ */
+ssize_t k_bcache_read(void* buf, size_t len, off_t off);
+
+/**
+ * @brief pwrite() through the cache (write-back).
+ *
+ * Blocks that are overwritten completely are never read from disk.
+ *
+ * @return Number of bytes written, or -1 if nothing could be written.
+ */
+ssize_t k_bcache_write(const void* buf, size_t len, off_t off);
+
+/**
+ * @brief Bring cached copies up to date with bytes the caller has just
+ * written to the image itself (the journal does, see journal.h).
+ *
+ * Uncached blocks are left alone, and cached ones keep their dirty state.
+ */
+void k_bcache_refresh(const void* buf, size_t len, off_t off);
+
+/**
+ * @brief Read @p count adjacent blocks from @p blk on ahead of their use.
+ *
+ * Missing blocks are loaded into the cache with one preadv per run of them,
+ * never taking more than half of the cache. Without a cache the host is
+ * asked to read them in the background instead (posix_fadvise, or madvise
+ * on a mapped image).
+ *
+ * @return Number of blocks loaded or handed to the host.
+ */
+size_t k_bcache_prefetch(uint16_t blk, size_t count);
+
+/**
+ * @brief Write every dirty block back to the image.
+ *
+ * @return 0 on success, -1 if a write failed (the block stays dirty).
+ */
+int k_bcache_flush(void);
+
+/**
+ * @brief Cache hit / miss counters since k_bcache_init().
+ */
+void k_bcache_stats(uint64_t* hits, uint64_t* misses);
+
+#endif
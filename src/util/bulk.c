@@ -0,0 +1,730 @@
+#include "bulk.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../fat_kernel.h"
+#include "p_errno.h"
+
+typedef struct bulk_file {
+  char* host;               // host path
+  char name[MAX_NAME_LEN];  // PennFAT name
+} bulk_file_t;
+
+typedef struct bulk_chunk {
+  size_t file;  // index into the job's files; nfiles ends the stream
+  size_t len;   // bytes of data in use
+  bool last;    // the file ends with this chunk
+  bool failed;  // the producer gave up on the file (already reported)
+  char* data;   // BULK_CHUNK bytes
+} bulk_chunk_t;
+
+typedef struct bulk_job {
+  const char* verb;  // "import" or "export", for messages
+  bulk_file_t* files;
+  size_t nfiles;
+  size_t cap;
+
+  // One producer fills ring[(head + filled) % BULK_BUFFERS] while the
+  // consumer drains ring[head]; only head and filled need the lock.
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  bulk_chunk_t ring[BULK_BUFFERS];
+  size_t head;
+  size_t filled;
+
+  // kept by the consumer, read once both stages are done
+  bulk_stats_t stats;
+  int last_err;  // P_ERRNO of the last file that failed
+} bulk_job_t;
+
+// the job k_bulk_collect_dirent() adds to, its host directory, and whether
+// adding failed
+static bulk_job_t* collecting = NULL;
+static const char* collect_dir = NULL;
+static bool collect_failed = false;
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Static Function Declarations =================== /////
+////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Set up an empty job with its ring buffers.
+ *
+ * @return 0 on success, -1 with P_ERRNO = FS_MALLOC_FAIL.
+ */
+static int k_bulk_job_init(bulk_job_t* job, const char* verb);
+
+/**
+ * @brief Release everything k_bulk_job_init() and k_bulk_add() allocated.
+ */
+static void k_bulk_job_free(bulk_job_t* job);
+
+/**
+ * @brief Append the file @p name, whose host copy is @p dir/@p name, to the
+ * job.
+ *
+ * @return 0 on success, -1 with P_ERRNO = FS_MALLOC_FAIL.
+ */
+static int k_bulk_add(bulk_job_t* job, const char* dir, const char* name);
+
+/**
+ * @brief qsort() comparator ordering files by PennFAT name.
+ */
+static int k_bulk_compare_files(const void* a, const void* b);
+
+/**
+ * @brief Add a host file, or the regular files directly inside a host
+ * directory, to an import job. Paths that cannot be used are reported and
+ * counted as failed.
+ *
+ * @return 0 on success, -1 with P_ERRNO = FS_MALLOC_FAIL.
+ */
+static int k_bulk_add_host(bulk_job_t* job, const char* path);
+
+/**
+ * @brief k_scan_dir() callback adding a PennFAT file to the job being
+ * collected for an export.
+ */
+static void k_bulk_collect_dirent(const dir_entry_t* entry);
+
+/**
+ * @brief Wait for a free buffer and hand it to the producer.
+ */
+static bulk_chunk_t* k_bulk_fill_begin(bulk_job_t* job);
+
+/**
+ * @brief Pass the buffer from k_bulk_fill_begin() on to the consumer.
+ */
+static void k_bulk_fill_end(bulk_job_t* job);
+
+/**
+ * @brief Wait for the oldest filled buffer and hand it to the consumer.
+ */
+static bulk_chunk_t* k_bulk_drain_begin(bulk_job_t* job);
+
+/**
+ * @brief Give the buffer from k_bulk_drain_begin() back to the producer.
+ */
+static void k_bulk_drain_end(bulk_job_t* job);
+
+/**
+ * @brief Queue a chunk saying the producer gave up on a file.
+ */
+static void k_bulk_fill_failed(bulk_job_t* job, size_t file);
+
+/**
+ * @brief Account for a file the consumer is done with.
+ */
+static void k_bulk_done(bulk_job_t* job, bool ok, uint64_t bytes, int err);
+
+/**
+ * @brief Print "verb: 'what': why" on STDERR.
+ */
+static void k_bulk_report(const char* verb, const char* what, const char* why);
+
+/**
+ * @brief Print "verb: 'name': " and the message for P_ERRNO on STDERR.
+ */
+static void k_bulk_report_fs(const char* verb, const char* name);
+
+/**
+ * @brief Write all of @p len bytes to a PennFAT file.
+ *
+ * @return 0 on success, -1 with P_ERRNO set (FS_DISK_FULL if the image
+ * filled up).
+ */
+static int k_bulk_write_fs(int fd, const char* data, size_t len);
+
+/**
+ * @brief Write all of @p len bytes to a host file.
+ *
+ * @return 0 on success, -1 with errno set.
+ */
+static int k_bulk_write_host(int fd, const char* data, size_t len);
+
+/**
+ * @brief Import producer: read the host files into the ring.
+ */
+static void* k_bulk_host_reader(void* arg);
+
+/**
+ * @brief Export consumer: write the ring out to the host files.
+ */
+static void* k_bulk_host_writer(void* arg);
+
+/**
+ * @brief Fill in @p stats and, if a file failed, P_ERRNO.
+ *
+ * @return 0 if every file was copied, -1 otherwise.
+ */
+static int k_bulk_finish(bulk_job_t* job, bulk_stats_t* stats);
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Public API Implementation =================== ////////
+////////////////////////////////////////////////////////////////////////////
+
+int k_bulk_import(char** paths, bulk_stats_t* stats) {
+  memset(stats, 0, sizeof(*stats));
+  if (!IS_FS_MOUNTED) {
+    P_ERRNO = FS_NOT_MOUNTED;
+    return -1;
+  }
+  if (paths == NULL || paths[0] == NULL) {
+    P_ERRNO = FS_INVALID_ARG;
+    return -1;
+  }
+
+  bulk_job_t job;
+  if (k_bulk_job_init(&job, "import") != 0) {
+    return -1;
+  }
+  for (size_t i = 0; paths[i] != NULL; i++) {
+    if (k_bulk_add_host(&job, paths[i]) != 0) {
+      k_bulk_job_free(&job);
+      return -1;
+    }
+  }
+
+  pthread_t reader;
+  if (pthread_create(&reader, NULL, k_bulk_host_reader, &job) != 0) {
+    k_bulk_job_free(&job);
+    P_ERRNO = P_ETHREAD;
+    return -1;
+  }
+
+  // PennFAT side: allocate and write while the reader fetches the next chunk
+  size_t cur = SIZE_MAX;
+  int fd = -1;
+  bool ok = false;
+  uint64_t written = 0;
+  int err = FS_SUCCESS;
+  while (true) {
+    bulk_chunk_t* chunk = k_bulk_drain_begin(&job);
+    if (chunk->file == job.nfiles) {
+      k_bulk_drain_end(&job);
+      break;
+    }
+    const bulk_file_t* file = &job.files[chunk->file];
+
+    if (chunk->file != cur) {  // first chunk of the next file
+      cur = chunk->file;
+      written = 0;
+      ok = !chunk->failed;
+      err = FS_IO_ERROR;
+      if (ok) {
+        fd = k_open(file->name, F_WRITE);
+        if (fd < 0) {
+          k_bulk_report_fs(job.verb, file->name);
+          err = P_ERRNO;
+          ok = false;
+        }
+      }
+    }
+    if (chunk->failed) {
+      ok = false;
+      err = FS_IO_ERROR;
+    }
+    if (ok && chunk->len > 0) {
+      if (k_bulk_write_fs(fd, chunk->data, chunk->len) != 0) {
+        k_bulk_report_fs(job.verb, file->name);
+        err = P_ERRNO;
+        ok = false;
+      } else {
+        written += chunk->len;
+      }
+    }
+
+    if (chunk->last || chunk->failed) {
+      if (fd >= 0) {
+        if (k_close(fd) < 0 && ok) {
+          k_bulk_report_fs(job.verb, file->name);
+          err = P_ERRNO;
+          ok = false;
+        }
+        if (!ok) {
+          k_unlink(file->name);  // no half-imported files
+        }
+        fd = -1;
+      }
+      k_bulk_done(&job, ok, written, err);
+    }
+    k_bulk_drain_end(&job);
+  }
+
+  pthread_join(reader, NULL);
+  int result = k_bulk_finish(&job, stats);
+  k_bulk_job_free(&job);
+  return result;
+}
+
+int k_bulk_export(const char* host_dir, char** names, bulk_stats_t* stats) {
+  memset(stats, 0, sizeof(*stats));
+  if (!IS_FS_MOUNTED) {
+    P_ERRNO = FS_NOT_MOUNTED;
+    return -1;
+  }
+  if (host_dir == NULL) {
+    P_ERRNO = FS_INVALID_ARG;
+    return -1;
+  }
+
+  bulk_job_t job;
+  if (k_bulk_job_init(&job, "export") != 0) {
+    return -1;
+  }
+  int collected = 0;
+  if (names == NULL || names[0] == NULL) {
+    collecting = &job;
+    collect_dir = host_dir;
+    collect_failed = false;
+    collected = k_scan_dir(NULL, k_bulk_collect_dirent);
+    collecting = NULL;
+    collect_dir = NULL;
+    if (collected == 0 && collect_failed) {
+      P_ERRNO = FS_MALLOC_FAIL;
+      collected = -1;
+    }
+  } else {
+    for (size_t i = 0; names[i] != NULL && collected == 0; i++) {
+      if (strlen(names[i]) >= MAX_NAME_LEN) {
+        P_ERRNO = P_ENAMETOOLONG;
+        k_bulk_report_fs(job.verb, names[i]);
+        job.stats.failed++;
+        job.last_err = P_ENAMETOOLONG;
+        continue;
+      }
+      collected = k_bulk_add(&job, host_dir, names[i]);
+    }
+  }
+  if (collected != 0) {
+    k_bulk_job_free(&job);
+    return -1;
+  }
+
+  pthread_t writer;
+  if (pthread_create(&writer, NULL, k_bulk_host_writer, &job) != 0) {
+    k_bulk_job_free(&job);
+    P_ERRNO = P_ETHREAD;
+    return -1;
+  }
+
+  // PennFAT side: read the next chunk while the writer stores the last one
+  int fs_err = FS_SUCCESS;
+  for (size_t i = 0; i < job.nfiles; i++) {
+    const bulk_file_t* file = &job.files[i];
+    int fd = k_open(file->name, F_READ);
+    if (fd < 0) {
+      k_bulk_report_fs(job.verb, file->name);
+      fs_err = P_ERRNO;
+      k_bulk_fill_failed(&job, i);
+      continue;
+    }
+
+    bool last = false;
+    while (!last) {
+      bulk_chunk_t* chunk = k_bulk_fill_begin(&job);
+      chunk->file = i;
+      chunk->len = 0;
+      chunk->failed = false;
+      while (chunk->len < BULK_CHUNK) {
+        ssize_t n = k_read(fd, (int)(BULK_CHUNK - chunk->len),
+                           chunk->data + chunk->len);
+        if (n < 0) {
+          k_bulk_report_fs(job.verb, file->name);
+          fs_err = P_ERRNO;
+          chunk->failed = true;
+          break;
+        }
+        if (n == 0) {
+          break;
+        }
+        chunk->len += (size_t)n;
+      }
+      last = chunk->failed || chunk->len < BULK_CHUNK;
+      chunk->last = last;
+      k_bulk_fill_end(&job);
+    }
+    k_close(fd);
+  }
+  bulk_chunk_t* end = k_bulk_fill_begin(&job);
+  end->file = job.nfiles;
+  k_bulk_fill_end(&job);
+
+  pthread_join(writer, NULL);
+  int result = k_bulk_finish(&job, stats);
+  if (result != 0 && fs_err != FS_SUCCESS) {
+    P_ERRNO = fs_err;  // more telling than the writer's FS_IO_ERROR
+  }
+  k_bulk_job_free(&job);
+  return result;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Static Function Implementations =================== //
+////////////////////////////////////////////////////////////////////////////
+
+static int k_bulk_job_init(bulk_job_t* job, const char* verb) {
+  memset(job, 0, sizeof(*job));
+  job->verb = verb;
+  for (size_t i = 0; i < BULK_BUFFERS; i++) {
+    job->ring[i].data = malloc(BULK_CHUNK);
+    if (job->ring[i].data == NULL) {
+      k_bulk_job_free(job);
+      P_ERRNO = FS_MALLOC_FAIL;
+      return -1;
+    }
+  }
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->changed, NULL);
+  return 0;
+}
+
+static void k_bulk_job_free(bulk_job_t* job) {
+  for (size_t i = 0; i < job->nfiles; i++) {
+    free(job->files[i].host);
+  }
+  free(job->files);
+  for (size_t i = 0; i < BULK_BUFFERS; i++) {
+    free(job->ring[i].data);
+  }
+  pthread_mutex_destroy(&job->lock);
+  pthread_cond_destroy(&job->changed);
+}
+
+static int k_bulk_add(bulk_job_t* job, const char* dir, const char* name) {
+  if (job->nfiles == job->cap) {
+    size_t new_cap = job->cap == 0 ? 16 : 2 * job->cap;
+    bulk_file_t* files = realloc(job->files, new_cap * sizeof(bulk_file_t));
+    if (files == NULL) {
+      P_ERRNO = FS_MALLOC_FAIL;
+      return -1;
+    }
+    job->files = files;
+    job->cap = new_cap;
+  }
+
+  bulk_file_t* file = &job->files[job->nfiles];
+  size_t len = strlen(dir) + strlen(name) + 2;
+  file->host = malloc(len);
+  if (file->host == NULL) {
+    P_ERRNO = FS_MALLOC_FAIL;
+    return -1;
+  }
+  snprintf(file->host, len, "%s/%s", dir, name);
+  snprintf(file->name, sizeof(file->name), "%s", name);
+  job->nfiles++;
+  return 0;
+}
+
+static int k_bulk_compare_files(const void* a, const void* b) {
+  return strcmp(((const bulk_file_t*)a)->name, ((const bulk_file_t*)b)->name);
+}
+
+static int k_bulk_add_host(bulk_job_t* job, const char* path) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    k_bulk_report(job->verb, path, strerror(errno));
+    job->stats.failed++;
+    job->last_err = FS_FILE_NOT_FOUND;
+    return 0;
+  }
+
+  if (S_ISREG(st.st_mode)) {
+    const char* slash = strrchr(path, '/');
+    const char* name = slash != NULL ? slash + 1 : path;
+    if (strlen(name) >= MAX_NAME_LEN) {
+      k_bulk_report(job->verb, path, "file name too long");
+      job->stats.failed++;
+      job->last_err = P_ENAMETOOLONG;
+      return 0;
+    }
+    if (slash == NULL) {
+      return k_bulk_add(job, ".", name);
+    }
+    char* dir = strndup(path, (size_t)(slash - path));
+    if (dir == NULL) {
+      P_ERRNO = FS_MALLOC_FAIL;
+      return -1;
+    }
+    int result = k_bulk_add(job, slash == path ? "" : dir, name);
+    free(dir);
+    return result;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    k_bulk_report(job->verb, path, "not a regular file or directory");
+    job->stats.failed++;
+    job->last_err = FS_NOT_A_FILE;
+    return 0;
+  }
+
+  DIR* dir = opendir(path);
+  if (dir == NULL) {
+    k_bulk_report(job->verb, path, strerror(errno));
+    job->stats.failed++;
+    job->last_err = FS_IO_ERROR;
+    return 0;
+  }
+  size_t first = job->nfiles;
+  size_t path_len = strlen(path);
+  struct dirent* ent;
+  int result = 0;
+  while (result == 0 && (ent = readdir(dir)) != NULL) {
+    size_t name_len = strlen(ent->d_name);
+    char* host = malloc(path_len + name_len + 2);
+    if (host == NULL) {
+      P_ERRNO = FS_MALLOC_FAIL;
+      result = -1;
+      break;
+    }
+    snprintf(host, path_len + name_len + 2, "%s/%s", path, ent->d_name);
+    if (stat(host, &st) == 0 && S_ISREG(st.st_mode)) {  // skips . and ..
+      if (name_len >= MAX_NAME_LEN) {
+        k_bulk_report(job->verb, host, "file name too long");
+        job->stats.failed++;
+        job->last_err = P_ENAMETOOLONG;
+      } else {
+        result = k_bulk_add(job, path, ent->d_name);
+      }
+    }
+    free(host);
+  }
+  closedir(dir);
+
+  qsort(job->files + first, job->nfiles - first, sizeof(bulk_file_t),
+        k_bulk_compare_files);
+  return result;
+}
+
+static void k_bulk_collect_dirent(const dir_entry_t* entry) {
+  if (collect_failed || entry->type != 1) {
+    return;
+  }
+  if (k_bulk_add(collecting, collect_dir, entry->name) != 0) {
+    collect_failed = true;
+  }
+}
+
+static bulk_chunk_t* k_bulk_fill_begin(bulk_job_t* job) {
+  pthread_mutex_lock(&job->lock);
+  while (job->filled == BULK_BUFFERS) {
+    pthread_cond_wait(&job->changed, &job->lock);
+  }
+  bulk_chunk_t* chunk = &job->ring[(job->head + job->filled) % BULK_BUFFERS];
+  pthread_mutex_unlock(&job->lock);
+  return chunk;
+}
+
+static void k_bulk_fill_end(bulk_job_t* job) {
+  pthread_mutex_lock(&job->lock);
+  job->filled++;
+  pthread_cond_broadcast(&job->changed);
+  pthread_mutex_unlock(&job->lock);
+}
+
+static bulk_chunk_t* k_bulk_drain_begin(bulk_job_t* job) {
+  pthread_mutex_lock(&job->lock);
+  while (job->filled == 0) {
+    pthread_cond_wait(&job->changed, &job->lock);
+  }
+  bulk_chunk_t* chunk = &job->ring[job->head];
+  pthread_mutex_unlock(&job->lock);
+  return chunk;
+}
+
+static void k_bulk_drain_end(bulk_job_t* job) {
+  pthread_mutex_lock(&job->lock);
+  job->head = (job->head + 1) % BULK_BUFFERS;
+  job->filled--;
+  pthread_cond_broadcast(&job->changed);
+  pthread_mutex_unlock(&job->lock);
+}
+
+static void k_bulk_fill_failed(bulk_job_t* job, size_t file) {
+  bulk_chunk_t* chunk = k_bulk_fill_begin(job);
+  chunk->file = file;
+  chunk->len = 0;
+  chunk->last = true;
+  chunk->failed = true;
+  k_bulk_fill_end(job);
+}
+
+static void k_bulk_done(bulk_job_t* job, bool ok, uint64_t bytes, int err) {
+  if (ok) {
+    job->stats.files++;
+    job->stats.bytes += bytes;
+  } else {
+    job->stats.failed++;
+    job->last_err = err;
+  }
+}
+
+static void k_bulk_report(const char* verb, const char* what, const char* why) {
+  char buf[512];
+  int len = snprintf(buf, sizeof(buf), "%s: '%s': %s\n", verb, what, why);
+  if (len > (int)sizeof(buf) - 1) {
+    len = sizeof(buf) - 1;
+  }
+  k_write(STDERR_FILENO, buf, len);
+}
+
+static void k_bulk_report_fs(const char* verb, const char* name) {
+  char buf[MAX_NAME_LEN + 32];
+  int len = snprintf(buf, sizeof(buf), "%s: '%s': ", verb, name);
+  if (len > (int)sizeof(buf) - 1) {
+    len = sizeof(buf) - 1;
+  }
+  int err = P_ERRNO;
+  k_write(STDERR_FILENO, buf, len);
+  P_ERRNO = err;
+  f_perror(NULL);
+}
+
+static int k_bulk_write_fs(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = k_write(fd, data, (int)len);
+    if (n == 0) {
+      P_ERRNO = FS_DISK_FULL;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+static int k_bulk_write_host(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+static void* k_bulk_host_reader(void* arg) {
+  bulk_job_t* job = arg;
+  for (size_t i = 0; i < job->nfiles; i++) {
+    const bulk_file_t* file = &job->files[i];
+    int hfd = open(file->host, O_RDONLY);
+    if (hfd < 0) {
+      k_bulk_report(job->verb, file->host, strerror(errno));
+      k_bulk_fill_failed(job, i);
+      continue;
+    }
+    posix_fadvise(hfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    bool last = false;
+    while (!last) {
+      bulk_chunk_t* chunk = k_bulk_fill_begin(job);
+      chunk->file = i;
+      chunk->len = 0;
+      chunk->failed = false;
+      while (chunk->len < BULK_CHUNK) {
+        ssize_t n =
+            read(hfd, chunk->data + chunk->len, BULK_CHUNK - chunk->len);
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        if (n < 0) {
+          k_bulk_report(job->verb, file->host, strerror(errno));
+          chunk->failed = true;
+          break;
+        }
+        if (n == 0) {
+          break;
+        }
+        chunk->len += (size_t)n;
+      }
+      last = chunk->failed || chunk->len < BULK_CHUNK;
+      chunk->last = last;
+      k_bulk_fill_end(job);
+    }
+    close(hfd);
+  }
+
+  bulk_chunk_t* end = k_bulk_fill_begin(job);
+  end->file = job->nfiles;
+  k_bulk_fill_end(job);
+  return NULL;
+}
+
+static void* k_bulk_host_writer(void* arg) {
+  bulk_job_t* job = arg;
+  size_t cur = SIZE_MAX;
+  int hfd = -1;
+  bool ok = false;
+  uint64_t written = 0;
+  while (true) {
+    bulk_chunk_t* chunk = k_bulk_drain_begin(job);
+    if (chunk->file == job->nfiles) {
+      k_bulk_drain_end(job);
+      break;
+    }
+    const bulk_file_t* file = &job->files[chunk->file];
+
+    if (chunk->file != cur) {  // first chunk of the next file
+      cur = chunk->file;
+      written = 0;
+      ok = !chunk->failed;
+      if (ok) {
+        hfd = open(file->host, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+        if (hfd < 0) {
+          k_bulk_report(job->verb, file->host, strerror(errno));
+          ok = false;
+        }
+      }
+    }
+    if (chunk->failed) {
+      ok = false;
+    }
+    if (ok && chunk->len > 0) {
+      if (k_bulk_write_host(hfd, chunk->data, chunk->len) != 0) {
+        k_bulk_report(job->verb, file->host, strerror(errno));
+        ok = false;
+      } else {
+        written += chunk->len;
+      }
+    }
+
+    if (chunk->last || chunk->failed) {
+      if (hfd >= 0) {
+        if (close(hfd) != 0 && ok) {
+          k_bulk_report(job->verb, file->host, strerror(errno));
+          ok = false;
+        }
+        if (!ok) {
+          unlink(file->host);  // no half-exported files
+        }
+        hfd = -1;
+      }
+      k_bulk_done(job, ok, written, FS_IO_ERROR);
+    }
+    k_bulk_drain_end(job);
+  }
+  return NULL;
+}
+
+static int k_bulk_finish(bulk_job_t* job, bulk_stats_t* stats) {
+  *stats = job->stats;
+  if (stats->failed > 0) {
+    P_ERRNO = job->last_err;
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef BULK_H
+#define BULK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bulk copies between the host and a mounted PennFAT image, for the
+// standalone pennfat tool.
+//
+// A copy is a two-stage pipeline over a ring of BULK_BUFFERS buffers of
+// BULK_CHUNK bytes. A helper thread does the host side (reading the source
+// files on import, writing the destination files on export) while the
+// calling thread does the PennFAT side (block allocation and image writes
+// on import, image reads on export), so the two overlap instead of taking
+// turns. Only the calling thread ever touches the filesystem.
+
+/** @brief Size of one pipeline buffer */
+#define BULK_CHUNK (1024 * 1024)
+/** @brief Buffers in flight between the two stages */
+#define BULK_BUFFERS 4
+
+/** @brief What a bulk copy did */
+typedef struct bulk_stats {
+  size_t files;    // files copied in full
+  size_t failed;   // files that could not be copied
+  uint64_t bytes;  // bytes copied, counting only the files copied in full
+} bulk_stats_t;
+
+/**
+ * @brief Copy host files into the current directory of the mounted image.
+ *
+ * Every regular file named in @p paths, and every regular file directly
+ * inside a directory named in @p paths (in name order), is copied to a
+ * PennFAT file of the same base name, created or truncated. A file that
+ * cannot be read or written is reported on STDERR and removed from the
+ * image, and the copy goes on with the next one.
+ *
+ * @param paths NULL-terminated list of host files and directories.
+ * @param stats Filled with the outcome.
+ * @return 0 if every file was copied, -1 otherwise; P_ERRNO is set to
+ * FS_NOT_MOUNTED, FS_INVALID_ARG (no path), FS_MALLOC_FAIL or P_ETHREAD
+ * when nothing could be tried, else to the error of the last file that
+ * failed.
+ */
+int k_bulk_import(char** paths, bulk_stats_t* stats);
+
+/**
+ * @brief Copy PennFAT files into a host directory.
+ *
+ * Each file is written to @p host_dir under its own name, created or
+ * truncated. A file that cannot be read or written is reported on STDERR
+ * and the copy goes on with the next one.
+ *
+ * @param host_dir Existing host directory.
+ * @param names    NULL-terminated list of PennFAT files, or NULL (or an
+ *                 empty list) for every file in the current directory.
+ * @param stats    Filled with the outcome.
+ * @return 0 if every file was copied, -1 otherwise; P_ERRNO as for
+ * k_bulk_import().
+ */
+int k_bulk_export(const char* host_dir, char** names, bulk_stats_t* stats);
+
+#endif
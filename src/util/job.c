@@ -50,6 +50,7 @@ int jobs_add(pid_t pid, pcb_t* pcb, const char* cmd) {
       job_table[i].used = 1;
       job_table[i].pid = pid;
       job_table[i].pcb = pcb;
+      job_table[i].gen = pcb ? pcb->gen : 0;
       job_table[i].state = JOB_RUNNING;
       job_table[i].job_id = next_job_id++;
 
@@ -113,10 +114,8 @@ void jobs_print() {
                      : (job_table[i].state == JOB_BACKGROUND) ? "Background"
                                                               : "Done";
 
-    char buf[512];
-    int len = snprintf(buf, sizeof(buf), "[%d] %d %-10s %s\n", job_table[i].job_id,
-                       job_table[i].pid, st, job_table[i].cmd);
-    s_write(STDOUT_FILENO, buf, len);
+    s_printf(STDOUT_FILENO, "[%d] %d %-10s %s\n", job_table[i].job_id,
+             job_table[i].pid, st, job_table[i].cmd);
   }
 }
 
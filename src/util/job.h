@@ -43,6 +43,8 @@ typedef struct job {
   pid_t pid;    /**< Process id associated with this job. */
   pcb_t* pcb;   /**< Pointer to the process control block for quick access to
                    process state. */
+  uint64_t gen; /**< pcb->gen at the time the job was added; the PCB belongs
+                   to another process once they differ (PCBs are recycled). */
   char cmd[64]; /**< Short copy of the command line used to launch the job
                    (NUL-terminated). */
   job_state_t state; /**< Current job state. */
@@ -0,0 +1,249 @@
+#include "journal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// The running transaction: count staged blocks, block i being the image
+// data[i * block_size] of the block at homes[i]. Both arrays only grow.
+static int journal_fd = -1;
+static off_t journal_region = 0;
+static size_t journal_bs = 0;
+static uint64_t* homes = NULL;
+static char* data = NULL;
+static size_t count = 0;
+static size_t capacity = 0;
+static size_t last_hit = 0;  // k_journal_find() tends to ask for it again
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Static Function Declarations =================== /////
+////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief FNV-1a hash of a record's home offsets and block images.
+ */
+static uint32_t k_journal_checksum(const uint64_t* offs,
+                                   const char* blocks,
+                                   size_t n,
+                                   size_t block_size);
+
+/**
+ * @brief pwrite() all of @p len bytes.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int k_journal_pwrite(const void* buf, size_t len, off_t off);
+
+/**
+ * @brief Mark the journal region as holding nothing to replay.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int k_journal_clear(void);
+
+/**
+ * @brief Replay the record in the journal region, if it is complete.
+ *
+ * @return Number of blocks written back, or -1 on I/O error.
+ */
+static ssize_t k_journal_replay(void);
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Public API Implementation =================== ////////
+////////////////////////////////////////////////////////////////////////////
+
+int k_journal_init(int fd, off_t region, size_t block_size, size_t* replayed) {
+  k_journal_destroy();
+  journal_fd = fd;
+  journal_region = region;
+  journal_bs = block_size;
+
+  ssize_t n = k_journal_replay();
+  if (n < 0) {
+    return -1;
+  }
+  *replayed = (size_t)n;
+  return 0;
+}
+
+void k_journal_destroy(void) {
+  free(homes);
+  free(data);
+  homes = NULL;
+  data = NULL;
+  count = 0;
+  capacity = 0;
+  last_hit = 0;
+  journal_fd = -1;
+}
+
+char* k_journal_find(off_t home) {
+  if (last_hit < count && homes[last_hit] == (uint64_t)home) {
+    return data + last_hit * journal_bs;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (homes[i] == (uint64_t)home) {
+      last_hit = i;
+      return data + i * journal_bs;
+    }
+  }
+  return NULL;
+}
+
+char* k_journal_add(off_t home, const void* init) {
+  if (count == capacity) {
+    size_t new_cap = capacity == 0 ? 8 : 2 * capacity;
+    uint64_t* new_homes = realloc(homes, new_cap * sizeof(uint64_t));
+    if (new_homes == NULL) {
+      return NULL;
+    }
+    homes = new_homes;
+    char* new_data = realloc(data, new_cap * journal_bs);
+    if (new_data == NULL) {
+      return NULL;
+    }
+    data = new_data;
+    capacity = new_cap;
+  }
+
+  homes[count] = (uint64_t)home;
+  char* block = data + count * journal_bs;
+  memcpy(block, init, journal_bs);
+  last_hit = count++;
+  return block;
+}
+
+bool k_journal_empty(void) {
+  return count == 0;
+}
+
+int k_journal_commit(void (*applied)(off_t home, const void* block)) {
+  if (count == 0) {
+    return 0;
+  }
+
+  // 1. the record, header last, on disk before any home block changes. The
+  // checksum catches a record only partly on disk, so one sync suffices.
+  off_t homes_off = journal_region + (off_t)sizeof(journal_header_t);
+  off_t data_off = homes_off + (off_t)(count * sizeof(uint64_t));
+  journal_header_t header = {
+      .magic = JOURNAL_MAGIC,
+      .count = (uint32_t)count,
+      .block_size = (uint32_t)journal_bs,
+      .checksum = k_journal_checksum(homes, data, count, journal_bs),
+  };
+  if (k_journal_pwrite(homes, count * sizeof(uint64_t), homes_off) != 0 ||
+      k_journal_pwrite(data, count * journal_bs, data_off) != 0 ||
+      k_journal_pwrite(&header, sizeof(header), journal_region) != 0 ||
+      fdatasync(journal_fd) != 0) {
+    return -1;
+  }
+
+  // 2. home locations
+  for (size_t i = 0; i < count; i++) {
+    if (k_journal_pwrite(data + i * journal_bs, journal_bs, (off_t)homes[i]) !=
+        0) {
+      return -1;  // the record stays valid, so a crash now still replays it
+    }
+    if (applied != NULL) {
+      applied((off_t)homes[i], data + i * journal_bs);
+    }
+  }
+
+  // 3. done, once the home blocks are on disk: a cleared header reaching the
+  // disk before them would lose the commit
+  if (fdatasync(journal_fd) != 0) {
+    return -1;
+  }
+  count = 0;
+  last_hit = 0;
+  return k_journal_clear();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Static Function Implementations =================== //
+////////////////////////////////////////////////////////////////////////////
+
+static uint32_t k_journal_checksum(const uint64_t* offs,
+                                   const char* blocks,
+                                   size_t n,
+                                   size_t block_size) {
+  uint32_t hash = 2166136261u;
+  const unsigned char* p = (const unsigned char*)offs;
+  for (size_t i = 0; i < n * sizeof(uint64_t); i++) {
+    hash = (hash ^ p[i]) * 16777619u;
+  }
+  p = (const unsigned char*)blocks;
+  for (size_t i = 0; i < n * block_size; i++) {
+    hash = (hash ^ p[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static int k_journal_pwrite(const void* buf, size_t len, off_t off) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pwrite(journal_fd, (const char*)buf + done, len - done,
+                       off + (off_t)done);
+    if (n <= 0) {
+      return -1;
+    }
+    done += (size_t)n;
+  }
+  return 0;
+}
+
+static int k_journal_clear(void) {
+  uint32_t magic = 0;
+  return k_journal_pwrite(&magic, sizeof(magic), journal_region);
+}
+
+static ssize_t k_journal_replay(void) {
+  journal_header_t header;
+  ssize_t n = pread(journal_fd, &header, sizeof(header), journal_region);
+  if (n != (ssize_t)sizeof(header) || header.magic != JOURNAL_MAGIC) {
+    return 0;  // no journal yet (older image), or nothing to replay
+  }
+  if (header.block_size != journal_bs || header.count == 0 ||
+      (uint64_t)header.count * journal_bs > (uint64_t)journal_region) {
+    return k_journal_clear() == 0 ? 0 : -1;  // not ours: nothing to trust
+  }
+
+  size_t nblocks = header.count;
+  uint64_t* offs = malloc(nblocks * sizeof(uint64_t));
+  char* blocks = malloc(nblocks * journal_bs);
+  if (offs == NULL || blocks == NULL) {
+    free(offs);
+    free(blocks);
+    return -1;
+  }
+
+  off_t homes_off = journal_region + (off_t)sizeof(journal_header_t);
+  off_t data_off = homes_off + (off_t)(nblocks * sizeof(uint64_t));
+  ssize_t result = 0;
+  if (pread(journal_fd, offs, nblocks * sizeof(uint64_t), homes_off) !=
+          (ssize_t)(nblocks * sizeof(uint64_t)) ||
+      pread(journal_fd, blocks, nblocks * journal_bs, data_off) !=
+          (ssize_t)(nblocks * journal_bs) ||
+      k_journal_checksum(offs, blocks, nblocks, journal_bs) !=
+          header.checksum) {
+    nblocks = 0;  // torn record: its commit never happened
+  }
+  for (size_t i = 0; i < nblocks; i++) {
+    if (offs[i] + journal_bs > (uint64_t)journal_region) {
+      continue;
+    }
+    if (k_journal_pwrite(blocks + i * journal_bs, journal_bs, (off_t)offs[i]) !=
+        0) {
+      result = -1;
+      break;
+    }
+    result++;
+  }
+  free(offs);
+  free(blocks);
+
+  if (result >= 0 && (fdatasync(journal_fd) != 0 || k_journal_clear() != 0)) {
+    return -1;
+  }
+  return result;
+}
@@ -0,0 +1,97 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Write-ahead metadata journal for PennFAT.
+//
+// Metadata (FAT blocks and root directory blocks) is not modified in place.
+// Changed blocks are staged in memory as whole blocks keyed by their byte
+// offset in the image, and a commit writes them out as one record:
+//
+//   1. the record (home offsets, block images, checksum) is written to the
+//      journal region, its header last, and the image is fdatasync()ed;
+//   2. every block is written to its home location, and the image is
+//      fdatasync()ed again;
+//   3. the header is cleared.
+//
+// A crash before 3 leaves a complete record that k_journal_init() replays at
+// the next mount; a crash during 1 leaves a record whose checksum does not
+// match, which is dropped. The two syncs keep that true when the host itself
+// crashes and the disk saw the writes out of order. Either way the image
+// holds the metadata of one commit or the next, never a mix.
+//
+// The journal region sits right after the last data block. Images made
+// before it existed simply end there; the region appears with the first
+// commit.
+
+/** @brief "PFJ1": a committed record follows the header */
+#define JOURNAL_MAGIC 0x314a4650u
+
+/** @brief Header of the record at the start of the journal region */
+typedef struct journal_header {
+  uint32_t magic;       // JOURNAL_MAGIC, or 0 when there is nothing to replay
+  uint32_t count;       // blocks in the record
+  uint32_t block_size;  // size of every block image
+  uint32_t checksum;    // FNV-1a over the home offsets and the block images
+} journal_header_t;
+
+/**
+ * @brief Replay the record a crash left behind, if any, and start with an
+ * empty transaction.
+ *
+ * Must be called before the FAT or any directory block is read.
+ *
+ * @param fd         Host file descriptor of the image.
+ * @param region     Byte offset of the journal region.
+ * @param block_size Size of one block in bytes.
+ * @param replayed   Set to the number of blocks written back by the replay
+ *                   (0 if the image was clean).
+ * @return 0 on success, -1 on I/O error or if memory could not be allocated.
+ */
+int k_journal_init(int fd, off_t region, size_t block_size, size_t* replayed);
+
+/**
+ * @brief Drop the staged blocks (without committing them) and release the
+ * journal.
+ */
+void k_journal_destroy(void);
+
+/**
+ * @brief Look up the staged copy of a block.
+ *
+ * @param home Byte offset of the block in the image.
+ * @return The block image, or NULL if the block is not part of the running
+ * transaction. The pointer is valid until the next k_journal_add().
+ */
+char* k_journal_find(off_t home);
+
+/**
+ * @brief Add a block to the running transaction.
+ *
+ * @param home Byte offset of the block in the image.
+ * @param init Its current contents, copied into the staged image.
+ * @return The staged image (see k_journal_find()), or NULL if memory could
+ * not be allocated.
+ */
+char* k_journal_add(off_t home, const void* init);
+
+/**
+ * @brief Whether the running transaction has no staged block.
+ */
+bool k_journal_empty(void);
+
+/**
+ * @brief Commit the running transaction (see above) and start a new one.
+ *
+ * @param applied Called for every block once it is at its home location,
+ *                or NULL.
+ * @return 0 on success (also if nothing was staged), -1 on I/O error. On
+ * error the blocks stay staged and the next commit retries them.
+ */
+int k_journal_commit(void (*applied)(off_t home, const void* block));
+
+#endif
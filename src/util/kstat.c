@@ -0,0 +1,94 @@
+#include "kstat.h"
+#include <stdio.h>
+#include <string.h>
+#include "bcache.h"
+
+#ifdef DISABLE_KSTAT
+
+int k_kstat_format(char* buf, size_t size) {
+  if (buf == NULL || size == 0) {
+    return -1;
+  }
+  int n = snprintf(buf, size, "kstat: counters compiled out (RELEASE=1)\n");
+  return n < (int)size ? n : (int)size - 1;
+}
+
+void k_kstat_reset(void) {}
+
+#else
+
+uint64_t KSTAT_COUNTERS[KSTAT_NUM_COUNTERS];
+uint64_t KSTAT_TIMER_CALLS[KSTAT_NUM_TIMERS];
+uint64_t KSTAT_TIMER_CYCLES[KSTAT_NUM_TIMERS];
+
+static const char* const COUNTER_NAMES[KSTAT_NUM_COUNTERS] = {
+    [KSTAT_READ_CALLS] = "fs.read.calls",
+    [KSTAT_READ_BYTES] = "fs.read.bytes",
+    [KSTAT_WRITE_CALLS] = "fs.write.calls",
+    [KSTAT_WRITE_BYTES] = "fs.write.bytes",
+    [KSTAT_FAT_STEPS] = "fs.fat.chain_steps",
+    [KSTAT_READAHEAD] = "fs.readahead.blocks",
+    [KSTAT_FIND_CALLS] = "fs.find.calls",
+    [KSTAT_FIND_SCANNED] = "fs.find.scanned",
+    [KSTAT_ALLOC_SCANS] = "fs.alloc.scans",
+    [KSTAT_ALLOC_SCANNED] = "fs.alloc.scanned",
+    [KSTAT_SPAWNS] = "proc.spawns",
+    [KSTAT_REAPS] = "proc.reaps",
+    [KSTAT_SIGNALS] = "proc.signals",
+};
+
+static const char* const TIMER_NAMES[KSTAT_NUM_TIMERS] = {
+    [KSTAT_T_READ] = "fs.read",
+    [KSTAT_T_WRITE] = "fs.write",
+    [KSTAT_T_FIND] = "fs.find",
+};
+
+static uint64_t load(const uint64_t* counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+int k_kstat_format(char* buf, size_t size) {
+  if (buf == NULL || size == 0) {
+    return -1;
+  }
+
+  size_t len = 0;
+  int n;
+#define APPENDF(...)                                           \
+  do {                                                         \
+    n = len < size ? snprintf(buf + len, size - len, __VA_ARGS__) : 0; \
+    len += n > 0 ? (size_t)n : 0;                              \
+  } while (0)
+
+  for (int c = 0; c < KSTAT_NUM_COUNTERS; c++) {
+    APPENDF("%-20s %14lu\n", COUNTER_NAMES[c], load(&KSTAT_COUNTERS[c]));
+  }
+
+  uint64_t hits, misses;
+  k_bcache_stats(&hits, &misses);
+  APPENDF("%-20s %14lu\n%-20s %14lu\n", "fs.bcache.hits", hits,
+          "fs.bcache.misses", misses);
+
+  APPENDF("\n%-20s %14s %14s %10s\n", "TIMER", "CALLS", "CYCLES", "AVG");
+  for (int t = 0; t < KSTAT_NUM_TIMERS; t++) {
+    uint64_t calls = load(&KSTAT_TIMER_CALLS[t]);
+    uint64_t cycles = load(&KSTAT_TIMER_CYCLES[t]);
+    APPENDF("%-20s %14lu %14lu %10lu\n", TIMER_NAMES[t], calls, cycles,
+            calls ? cycles / calls : 0);
+  }
+#undef APPENDF
+
+  return (int)(len < size ? len : size - 1);
+}
+
+void k_kstat_reset(void) {
+  for (int c = 0; c < KSTAT_NUM_COUNTERS; c++) {
+    __atomic_store_n(&KSTAT_COUNTERS[c], 0, __ATOMIC_RELAXED);
+  }
+  for (int t = 0; t < KSTAT_NUM_TIMERS; t++) {
+    __atomic_store_n(&KSTAT_TIMER_CALLS[t], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&KSTAT_TIMER_CYCLES[t], 0, __ATOMIC_RELAXED);
+  }
+}
+
+#endif
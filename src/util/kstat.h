@@ -0,0 +1,101 @@
+#ifndef KSTAT_H
+#define KSTAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Kernel hot-path profiling counters.
+//
+// Each counter is a single relaxed atomic add, so they are cheap enough to
+// leave in the fast paths (bulk copies run filesystem calls off the
+// scheduler's CPU, hence the atomics). Timers add up cycles from the
+// processor's cycle counter between KSTAT_TIMER_START and KSTAT_TIMER_STOP.
+//
+// Building with -DDISABLE_KSTAT (`make RELEASE=1`) compiles every counter
+// and timer out; k_kstat_format() then only says so.
+
+/** Buffer size that always fits a full k_kstat_format() report */
+#define KSTAT_REPORT_SIZE 4096
+
+typedef enum kstat_counter {
+  KSTAT_READ_CALLS,     // k_read() calls on PennFAT files
+  KSTAT_READ_BYTES,     // bytes they returned
+  KSTAT_WRITE_CALLS,    // k_write() calls on PennFAT files
+  KSTAT_WRITE_BYTES,    // bytes they wrote
+  KSTAT_FAT_STEPS,      // FAT entries followed while walking chains
+  KSTAT_READAHEAD,      // blocks read ahead for sequential readers
+  KSTAT_FIND_CALLS,     // name lookups (k_find_file() and path walks)
+  KSTAT_FIND_SCANNED,   // directory index entries compared by them
+  KSTAT_ALLOC_SCANS,    // free-block searches (single blocks and runs)
+  KSTAT_ALLOC_SCANNED,  // bitmap words / blocks those searches looked at
+  KSTAT_SPAWNS,         // processes created by s_spawn()
+  KSTAT_REAPS,          // zombies reaped by s_waitpid()
+  KSTAT_SIGNALS,        // signals delivered to processes
+  KSTAT_NUM_COUNTERS
+} kstat_counter_t;
+
+typedef enum kstat_timer {
+  KSTAT_T_READ,   // k_read() on PennFAT files
+  KSTAT_T_WRITE,  // k_write() on PennFAT files
+  KSTAT_T_FIND,   // name lookups
+  KSTAT_NUM_TIMERS
+} kstat_timer_t;
+
+#ifdef DISABLE_KSTAT
+
+#define KSTAT_ADD(counter, n) ((void)(n))
+#define KSTAT_INC(counter) ((void)0)
+#define KSTAT_TIMER_START(var) ((void)0)
+#define KSTAT_TIMER_STOP(timer, var) ((void)0)
+
+#else
+
+extern uint64_t KSTAT_COUNTERS[KSTAT_NUM_COUNTERS];
+extern uint64_t KSTAT_TIMER_CALLS[KSTAT_NUM_TIMERS];
+extern uint64_t KSTAT_TIMER_CYCLES[KSTAT_NUM_TIMERS];
+
+#define KSTAT_ADD(counter, n)                                      \
+  __atomic_fetch_add(&KSTAT_COUNTERS[counter], (uint64_t)(n), \
+                     __ATOMIC_RELAXED)
+#define KSTAT_INC(counter) KSTAT_ADD(counter, 1)
+
+/** @brief Cycle counter (nanoseconds where there is none) */
+static inline uint64_t kstat_cycles(void) {
+#if __has_builtin(__builtin_readcyclecounter)
+  return __builtin_readcyclecounter();
+#elif defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+#define KSTAT_TIMER_START(var) uint64_t var = kstat_cycles()
+#define KSTAT_TIMER_STOP(timer, var)                                      \
+  do {                                                                    \
+    __atomic_fetch_add(&KSTAT_TIMER_CALLS[timer], 1, __ATOMIC_RELAXED);   \
+    __atomic_fetch_add(&KSTAT_TIMER_CYCLES[timer],                        \
+                       kstat_cycles() - (var),                            \
+                       __ATOMIC_RELAXED);                                 \
+  } while (0)
+
+#endif
+
+/**
+ * @brief Format every counter and timer, plus the block cache hit rate.
+ *
+ * @param buf  Output buffer; KSTAT_REPORT_SIZE bytes always suffice.
+ * @param size Size of @p buf.
+ * @return The length of the report, or -1 if @p buf is NULL or @p size is 0.
+ */
+int k_kstat_format(char* buf, size_t size);
+
+/**
+ * @brief Zero every counter and timer.
+ */
+void k_kstat_reset(void);
+
+#endif
@@ -0,0 +1,230 @@
+#include "logger.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "spthread.h"
+
+static int log_fd = -1;                 // log file, open for the OS lifetime
+static char log_buf[LOG_BUFFER_SIZE];   // pending bytes, oldest first
+static size_t log_len = 0;              // number of pending bytes
+static bool log_binary = false;         // binary trace instead of text
+
+// Trace string table: open-addressing hash set of command names. The slot a
+// name lands in is its name_id in the trace.
+static char trace_names[TRACE_MAX_NAMES][TRACE_NAME_LEN];
+static bool trace_used[TRACE_MAX_NAMES];
+
+static const char* const log_event_names[LOG_EVENT_MAX] = {
+    [LOG_CREATE] = "CREATE",       [LOG_SCHEDULE] = "SCHEDULE",
+    [LOG_BLOCKED] = "BLOCKED",     [LOG_UNBLOCKED] = "UNBLOCKED",
+    [LOG_STOPPED] = "STOPPED",     [LOG_CONTINUED] = "CONTINUED",
+    [LOG_EXITED] = "EXITED",       [LOG_SIGNALED] = "SIGNALED",
+    [LOG_ZOMBIE] = "ZOMBIE",       [LOG_WAITED] = "WAITED",
+    [LOG_ORPHAN] = "ORPHAN",       [LOG_NICE] = "NICE",
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Static Function Declarations =================== /////
+////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Write all pending bytes to the log file and empty the buffer.
+ *
+ * @pre Interrupts are disabled (spthread_disable_interrupts_nested()).
+ */
+static void k_log_drain(void);
+
+/**
+ * @brief Copy bytes into the buffer, draining it as needed.
+ *
+ * @pre Interrupts are disabled (spthread_disable_interrupts_nested()), so
+ * the scheduler never sees a half-appended entry.
+ */
+static void k_log_push(const void* data, size_t len);
+
+/**
+ * @brief Look up (or add) @p name in the trace string table.
+ *
+ * The first time a name is added, its TRACE_STRING definition is pushed to
+ * the log so that the decoder learns it before any record refers to it.
+ *
+ * @pre Interrupts are disabled (spthread_disable_interrupts_nested()).
+ * @return The name_id of @p name, or TRACE_NAME_NONE if the table is full.
+ */
+static uint16_t k_log_intern(const char* name);
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Public API Implementation =================== ////////
+////////////////////////////////////////////////////////////////////////////
+
+int k_log_open(const char* fname, bool binary) {
+  if (log_fd != -1) {
+    k_log_close();
+  }
+
+  log_fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666);
+  log_len = 0;
+  log_binary = binary;
+  memset(trace_used, 0, sizeof(trace_used));
+  if (log_fd == -1) {
+    return -1;
+  }
+
+  if (log_binary) {
+    trace_header_t header = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .record_size = sizeof(trace_record_t),
+    };
+    k_log_append(&header, sizeof(header));
+  }
+  return 0;
+}
+
+void k_log_record(log_event_t event,
+                  uint64_t tick,
+                  pid_t pid,
+                  int prio,
+                  int old_prio,
+                  const char* name) {
+  if (log_fd == -1) {
+    return;
+  }
+
+  bool locked = spthread_disable_interrupts_nested();
+
+  trace_record_t rec = {
+      .tick = (uint32_t)tick,
+      .pid = pid,
+      .name_id = TRACE_NAME_NONE,
+      .event = (uint8_t)event,
+      .prio = (int8_t)prio,
+      .old_prio = (int8_t)old_prio,
+  };
+
+  if (log_binary) {
+    rec.name_id = k_log_intern(name);
+    k_log_push(&rec, sizeof(rec));
+  } else {
+    char line[128];
+    int len = k_log_format(&rec, name, line, sizeof(line));
+    if (len > 0) {
+      k_log_push(line, (size_t)len < sizeof(line) ? len : sizeof(line) - 1);
+    }
+  }
+
+  spthread_restore_interrupts(locked);
+}
+
+int k_log_format(const trace_record_t* rec,
+                 const char* name,
+                 char* buf,
+                 size_t size) {
+  if (rec->event >= LOG_EVENT_MAX) {
+    return -1;
+  }
+
+  unsigned long tick = rec->tick;
+  if (rec->event == LOG_NICE) {
+    // [ticks] NICE PID OLD_NICE_VALUE NEW_NICE_VALUE PROCESS_NAME
+    return snprintf(buf, size, "[%5lu] %-10s %-3d %-3d %-2d %s\n", tick,
+                    log_event_names[rec->event], rec->pid, rec->old_prio,
+                    rec->prio, name);
+  }
+  // [ticks] EVENT PID PRIO PROCESS_NAME
+  return snprintf(buf, size, "[%5lu] %-10s %-5d %-4d %s\n", tick,
+                  log_event_names[rec->event], rec->pid, rec->prio, name);
+}
+
+void k_log_append(const void* data, size_t len) {
+  if (log_fd == -1 || len == 0) {
+    return;
+  }
+
+  bool locked = spthread_disable_interrupts_nested();
+  k_log_push(data, len);
+  spthread_restore_interrupts(locked);
+}
+
+void k_log_flush(void) {
+  if (log_fd == -1 || log_len == 0) {
+    return;
+  }
+
+  bool locked = spthread_disable_interrupts_nested();
+  k_log_drain();
+  spthread_restore_interrupts(locked);
+}
+
+void k_log_close(void) {
+  if (log_fd == -1) {
+    return;
+  }
+
+  k_log_flush();
+  close(log_fd);
+  log_fd = -1;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Static Function Implementations =================== //
+////////////////////////////////////////////////////////////////////////////
+
+static void k_log_drain(void) {
+  if (log_len == 0) {
+    return;
+  }
+
+  // The log is best effort: a failed write simply drops the batch.
+  (void)!write(log_fd, log_buf, log_len);
+  log_len = 0;
+}
+
+static void k_log_push(const void* data, size_t len) {
+  if (len > LOG_BUFFER_SIZE - log_len) {
+    k_log_drain();
+  }
+
+  if (len > LOG_BUFFER_SIZE) {
+    // does not fit at all: bypass the buffer
+    (void)!write(log_fd, data, len);
+    return;
+  }
+
+  memcpy(log_buf + log_len, data, len);
+  log_len += len;
+
+  if (log_len >= LOG_FLUSH_THRESHOLD) {
+    k_log_drain();
+  }
+}
+
+static uint16_t k_log_intern(const char* name) {
+  // FNV-1a over the (bounded) name
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < TRACE_NAME_LEN && name[i] != '\0'; i++) {
+    hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+  }
+
+  for (size_t probe = 0; probe < TRACE_MAX_NAMES; probe++) {
+    size_t slot = (hash + probe) % TRACE_MAX_NAMES;
+
+    if (!trace_used[slot]) {
+      // first sighting: remember it and emit its definition
+      trace_used[slot] = true;
+      memset(trace_names[slot], 0, TRACE_NAME_LEN);
+      strncpy(trace_names[slot], name, TRACE_NAME_LEN - 1);
+
+      trace_record_t def = {.name_id = (uint16_t)slot, .event = TRACE_STRING};
+      k_log_push(&def, sizeof(def));
+      k_log_push(trace_names[slot], TRACE_NAME_LEN);
+      return (uint16_t)slot;
+    }
+    if (strncmp(trace_names[slot], name, TRACE_NAME_LEN - 1) == 0) {
+      return (uint16_t)slot;
+    }
+  }
+
+  return TRACE_NAME_NONE;
+}
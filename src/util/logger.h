@@ -0,0 +1,137 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/** Capacity of the in-memory log buffer (in bytes) */
+#define LOG_BUFFER_SIZE (64 * 1024)
+/** Once this many bytes are buffered, the buffer is flushed right away */
+#define LOG_FLUSH_THRESHOLD (48 * 1024)
+
+/** Scheduler and process events recorded in the log */
+typedef enum {
+  LOG_CREATE,
+  LOG_SCHEDULE,
+  LOG_BLOCKED,
+  LOG_UNBLOCKED,
+  LOG_STOPPED,
+  LOG_CONTINUED,
+  LOG_EXITED,
+  LOG_SIGNALED,
+  LOG_ZOMBIE,
+  LOG_WAITED,
+  LOG_ORPHAN,
+  LOG_NICE,
+  LOG_EVENT_MAX  // Sentinel: number of event kinds
+} log_event_t;
+
+// Binary trace format:
+//   trace_header_t, then a stream of trace_record_t. The first time a command
+//   name is seen, a record with event == TRACE_STRING is emitted, immediately
+//   followed by TRACE_NAME_LEN bytes holding the (NUL-padded) name for
+//   string-table slot name_id. Later records refer to that slot by index.
+#define TRACE_MAGIC 0x52544E50  // "PNTR" in little endian
+#define TRACE_VERSION 1
+#define TRACE_STRING 0xFF
+#define TRACE_NAME_LEN 32
+#define TRACE_MAX_NAMES 1024
+#define TRACE_NAME_NONE 0xFFFF  // string table was full
+
+/** @brief Header at the start of every binary trace file */
+typedef struct trace_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t record_size;
+} trace_header_t;
+
+/** @brief One fixed-size binary trace record (16 bytes) */
+typedef struct trace_record {
+  uint32_t tick;     // global tick of the event
+  int32_t pid;       // process id
+  uint16_t name_id;  // index into the trace string table
+  uint8_t event;     // log_event_t, or TRACE_STRING
+  int8_t prio;       // priority (new priority for NICE)
+  int8_t old_prio;   // old priority, only meaningful for NICE
+  uint8_t reserved[3];
+} trace_record_t;
+
+/**
+ * @brief Open the log file for the whole lifetime of the OS.
+ *
+ * The file is created if needed and truncated so that each run starts fresh.
+ * Entries appended afterwards are collected in an in-memory buffer and
+ * only reach the file on k_log_flush() (or once LOG_FLUSH_THRESHOLD is hit).
+ *
+ * @param fname  Path of the log file.
+ * @param binary If true, events are recorded in the compact binary trace
+ *               format instead of text lines.
+ * @return 0 on success, -1 if the file could not be opened.
+ */
+int k_log_open(const char* fname, bool binary);
+
+/**
+ * @brief Record one event.
+ *
+ * In text mode the event is formatted with k_log_format(); in binary mode a
+ * trace_record_t is appended as-is, so no formatting happens on the hot path.
+ *
+ * @param event    The event kind.
+ * @param tick     The current global tick.
+ * @param pid      PID of the process the event is about.
+ * @param prio     Its priority (the new priority for LOG_NICE).
+ * @param old_prio The old priority for LOG_NICE, ignored otherwise.
+ * @param name     Its command name.
+ */
+void k_log_record(log_event_t event,
+                  uint64_t tick,
+                  pid_t pid,
+                  int prio,
+                  int old_prio,
+                  const char* name);
+
+/**
+ * @brief Format a trace record as a text log line (including the newline).
+ *
+ * This is the single definition of the text log format, shared by the text
+ * logger and the offline trace decoder.
+ *
+ * @param rec  The record to format.
+ * @param name The command name @p rec refers to.
+ * @param buf  Output buffer.
+ * @param size Size of @p buf.
+ * @return Number of characters written (as snprintf), or -1 on a bad event.
+ */
+int k_log_format(const trace_record_t* rec,
+                 const char* name,
+                 char* buf,
+                 size_t size);
+
+/**
+ * @brief Append raw bytes (usually one formatted log line) to the buffer.
+ *
+ * It is a no-op if no log file is open. If the buffer does not have room for
+ * @p len bytes, it is flushed first; entries that are bigger than the whole
+ * buffer are written straight through.
+ *
+ * @param data Bytes to append.
+ * @param len  Number of bytes in @p data.
+ */
+void k_log_append(const void* data, size_t len);
+
+/**
+ * @brief Write everything currently buffered to the log file.
+ *
+ * Called by the scheduler on every tick boundary; the whole batch goes out
+ * in a single write().
+ */
+void k_log_flush(void);
+
+/**
+ * @brief Flush the remaining entries and close the log file.
+ */
+void k_log_close(void);
+
+#endif
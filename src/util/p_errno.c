@@ -36,6 +36,8 @@ static const char* const p_errstr[] = {
     [P_EBUSY] = "file is in use",
     [P_EACCES] = "permission denied",
     [P_EMFILE] = "too many open files",
+    [P_ENOTDIR] = "not a directory",
+    [P_ENOTEMPTY] = "directory not empty",
 
     /* Signal errors */
     [P_SIGINT] = "failed to set SIGINT handler",
@@ -43,6 +45,8 @@ static const char* const p_errstr[] = {
 
     [P_ENAMETOOLONG] = "file name too long",
     [P_E2BIG] = "argument list too long",
+    [P_EPIPE] = "broken pipe",
+    [P_ESPIPE] = "illegal seek",
 
     // TODO: When adding new error codes to p_errno_t,
     // remember to also add their string representations here.
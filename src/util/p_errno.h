@@ -36,6 +36,8 @@ typedef enum {
   P_EBUSY,   // Device or resource busy (FS_FILE_IN_USE)
   P_EACCES,  // Permission denied (FS_NO_PERMISSION)
   P_EMFILE,  // Too many open files (Process limit)
+  P_ENOTDIR,    // Not a directory (when it should be)
+  P_ENOTEMPTY,  // Directory not empty
 
   /* Signal errors */
   P_SIGINT,   // failed to set SIGINT handler
@@ -44,6 +46,8 @@ typedef enum {
   /* Other errors */
   P_ENAMETOOLONG,  // File name too long
   P_E2BIG,         // Argument list too long
+  P_EPIPE,         // Write to a pipe with no reader left
+  P_ESPIPE,        // Seek on a pipe
 
   /* TODO: You can extend this section with future errno. */
 
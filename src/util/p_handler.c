@@ -1,15 +1,26 @@
 #define _GNU_SOURCE
 #include "p_handler.h"
+#include <errno.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
 #include "../process.h"
+#include "../scheduler.h"
 #include "../syscall.h"
 #include "p_signal.h"
 #include "struct.h"
 
-// Signal flag to defer processing
-volatile int pending_host_signal = 0;
+// Host signals caught but not relayed yet, one HOST_PENDING_* bit each. The
+// handler only ORs bits in and the scheduler swaps the whole mask out, so
+// neither side takes a lock, and a Ctrl-Z right after a Ctrl-C is kept
+// instead of overwriting it (a repeated signal coalesces, as on the host).
+#define HOST_PENDING_INT 0x1u
+#define HOST_PENDING_TSTP 0x2u
+
+_Static_assert(ATOMIC_INT_LOCK_FREE == 2,
+               "the host signal mailbox must be lock-free");
+static atomic_uint pending_host_signals = 0;
 
 /**
  * @brief Host OS signal handler for SIGINT (Ctrl-C), SIGQUIT (Ctrl-Backslash)
@@ -22,18 +33,33 @@ volatile int pending_host_signal = 0;
  * HOST_SIGTSTP).
  */
 void host_sig_handler(int signum) {
-  // Only set the flag, do not perform complex operations here
-  pending_host_signal = signum;
+  // Only post the signal, do not perform complex operations here
+  unsigned int bit = signum == HOST_SIGINT    ? HOST_PENDING_INT
+                     : signum == HOST_SIGTSTP ? HOST_PENDING_TSTP
+                                              : 0;
+  if (bit == 0) {
+    return;  // Ignore other signals
+  }
+
+  int saved_errno = errno;
+  atomic_fetch_or(&pending_host_signals, bit);
+  // End the scheduler's wait now instead of at the end of the quantum
+  k_scheduler_kick();
+  errno = saved_errno;
+}
+
+bool k_host_signals_pending(void) {
+  return atomic_load_explicit(&pending_host_signals, memory_order_relaxed) !=
+         0;
 }
 
 void k_check_host_signals(void) {
-  if (pending_host_signal == 0) {
+  if (!k_host_signals_pending()) {
     return;
   }
 
-  // Atomically read and reset the signal
-  int signum = pending_host_signal;
-  pending_host_signal = 0;
+  // Atomically take every signal posted so far
+  unsigned int pending = atomic_exchange(&pending_host_signals, 0);
 
   // Get the PID of the process currently controlling the terminal.
   pid_t fg_pid = k_get_terminal_pgrp_id();
@@ -43,20 +69,14 @@ void k_check_host_signals(void) {
     return;
   }
 
-  // Map host signal to PennOS signal
-  int signal_num;
-  if (signum == HOST_SIGINT) {
-    // Ctrl-C maps to P_SIGTERM (signal 0)
-    signal_num = 0;
-  } else if (signum == HOST_SIGTSTP) {
-    // Ctrl-Z maps to P_SIGSTOP (signal 1)
-    signal_num = 1;
-  } else {
-    return;  // Ignore other signals
+  // Relay the PennOS signals: Ctrl-C maps to P_SIGTERM (signal 0), Ctrl-Z
+  // to P_SIGSTOP (signal 1). Stopping a process just terminated is a no-op.
+  if (pending & HOST_PENDING_INT) {
+    s_kill(fg_pid, 0);
+  }
+  if (pending & HOST_PENDING_TSTP) {
+    s_kill(fg_pid, 1);
   }
-
-  // Relay the PennOS signal
-  s_kill(fg_pid, signal_num);
 }
 
 void setup_host_signals(void) {
@@ -28,4 +28,12 @@ void setup_host_signals(void);
  */
 void k_check_host_signals(void);
 
+/**
+ * @brief Whether a host signal has been caught and not relayed yet.
+ *
+ * The scheduler polls this to cut a quantum or an idle period short, so
+ * Ctrl-C / Ctrl-Z reach the foreground process right away.
+ */
+bool k_host_signals_pending(void);
+
 #endif  // P_HANDLER_H
@@ -1,12 +1,14 @@
 #include "p_signal.h"
 #include <stdio.h>
 #include "../process.h"
+#include "kstat.h"
 #include "queue.h"
 
 void k_signal_deliver(pcb_t* proc, psignal_t signal) {
   if (!proc) {
     return;
   }
+  KSTAT_INC(KSTAT_SIGNALS);
 
   switch (signal) {
     case P_SIGTERM:
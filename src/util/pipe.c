@@ -0,0 +1,218 @@
+#include "pipe.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../fat_kernel.h"
+#include "../process.h"
+#include "../scheduler.h"
+#include "p_errno.h"
+#include "queue.h"
+#include "spthread.h"
+
+// Readers sleep in p->rd_wait and writers in p->wr_wait, so a write only
+// wakes readers and a read only wakes writers, without looking at anyone
+// else blocked in the system.
+// Pipe state is only touched with interrupts disabled
+// (spthread_disable_interrupts_nested()), since other processes may be
+// blocked on it.
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Static Function Declarations =================== /////
+////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Block the calling process in @p waitq until it is woken, with
+ * interrupts enabled while it is away.
+ *
+ * @return false if the caller is not a PennOS process and cannot block.
+ */
+static bool k_pipe_wait(pcb_queue_t* waitq, bool* locked);
+
+/**
+ * @brief Copy up to @p n bytes into the ring.
+ *
+ * @return Bytes copied (0 if the ring is full).
+ */
+static size_t k_ring_put(pipe_t* p, const char* src, size_t n);
+
+/**
+ * @brief Copy up to @p n bytes out of the ring.
+ *
+ * @return Bytes copied (0 if the ring is empty).
+ */
+static size_t k_ring_get(pipe_t* p, char* dst, size_t n);
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Public API Implementation =================== ////////
+////////////////////////////////////////////////////////////////////////////
+
+pipe_t* k_pipe_create(void) {
+  return calloc(1, sizeof(pipe_t));
+}
+
+void k_pipe_attach(pipe_t* p, open_file_t* end) {
+  bool locked = spthread_disable_interrupts_nested();
+  end->pipe = p;
+  if (end->flag & F_READ) {
+    p->readers++;
+  } else {
+    p->writers++;
+  }
+  spthread_restore_interrupts(locked);
+}
+
+ssize_t k_pipe_read(open_file_t* end, size_t n, char* buf) {
+  pipe_t* p = end->pipe;
+  if (n == 0) {
+    return 0;
+  }
+
+  bool locked = spthread_disable_interrupts_nested();
+  size_t got = 0;
+  while (true) {
+    if (p->rd_end == end && p->rd_dst == NULL) {
+      // a writer filled the buffer we posted
+      got = p->rd_got;
+      p->rd_end = NULL;
+      break;
+    }
+    if (p->len > 0) {
+      got = k_ring_get(p, buf, n);
+      k_wakeup(&p->wr_wait);
+      break;
+    }
+    if (p->writers == 0) {
+      break;  // EOF
+    }
+
+    // Empty: post our buffer unless another reader already has
+    if (p->rd_end == NULL) {
+      p->rd_end = end;
+      p->rd_dst = buf;
+      p->rd_cap = n;
+      p->rd_got = 0;
+    }
+    if (!k_pipe_wait(&p->rd_wait, &locked)) {
+      break;
+    }
+  }
+
+  if (p->rd_end == end && p->rd_dst != NULL) {
+    p->rd_end = NULL;  // never filled (EOF): withdraw it
+    p->rd_dst = NULL;
+  }
+  spthread_restore_interrupts(locked);
+  return (ssize_t)got;
+}
+
+ssize_t k_pipe_write(open_file_t* end, const char* str, size_t n) {
+  pipe_t* p = end->pipe;
+  bool locked = spthread_disable_interrupts_nested();
+  size_t done = 0;
+  while (done < n) {
+    if (p->readers == 0) {
+      break;
+    }
+
+    if (p->rd_dst != NULL && p->len == 0) {
+      // a reader is waiting on an empty pipe: hand the bytes over directly
+      size_t chunk = n - done < p->rd_cap ? n - done : p->rd_cap;
+      memcpy(p->rd_dst, str + done, chunk);
+      p->rd_got = chunk;
+      p->rd_dst = NULL;
+      done += chunk;
+      k_wakeup(&p->rd_wait);
+      continue;
+    }
+
+    size_t put = k_ring_put(p, str + done, n - done);
+    if (put > 0) {
+      done += put;
+      k_wakeup(&p->rd_wait);
+      continue;
+    }
+
+    // full until a reader drains it
+    if (!k_pipe_wait(&p->wr_wait, &locked)) {
+      break;
+    }
+  }
+  spthread_restore_interrupts(locked);
+
+  if (done == 0 && n > 0) {
+    P_ERRNO = P_EPIPE;
+    return -1;
+  }
+  return (ssize_t)done;
+}
+
+void k_pipe_detach(open_file_t* end) {
+  pipe_t* p = end->pipe;
+  if (p == NULL) {
+    return;
+  }
+
+  bool locked = spthread_disable_interrupts_nested();
+  end->pipe = NULL;
+  if (end->flag & F_READ) {
+    p->readers--;
+    if (p->rd_end == end) {
+      p->rd_end = NULL;
+      p->rd_dst = NULL;
+    }
+    k_wakeup(&p->wr_wait);  // they get P_EPIPE once no reader is left
+  } else {
+    p->writers--;
+    k_wakeup(&p->rd_wait);  // they get EOF once no writer is left
+  }
+  bool last = p->readers == 0 && p->writers == 0;
+  spthread_restore_interrupts(locked);
+
+  if (last) {
+    free(p);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Static Function Implementations =================== //
+////////////////////////////////////////////////////////////////////////////
+
+static bool k_pipe_wait(pcb_queue_t* waitq, bool* locked) {
+  pcb_t* self = get_current_process();
+  spthread_t thread;
+  if (self == NULL || !spthread_self(&thread)) {
+    return false;
+  }
+
+  k_sleep_on(self, waitq);
+  spthread_restore_interrupts(*locked);
+  k_yield();  // back once k_wakeup(waitq) made us ready and we were picked
+  *locked = spthread_disable_interrupts_nested();
+  return true;
+}
+
+static size_t k_ring_put(pipe_t* p, const char* src, size_t n) {
+  size_t space = PIPE_BUF_SIZE - p->len;
+  if (n > space) {
+    n = space;
+  }
+  size_t tail = (p->head + p->len) % PIPE_BUF_SIZE;
+  size_t first = PIPE_BUF_SIZE - tail < n ? PIPE_BUF_SIZE - tail : n;
+  memcpy(p->buf + tail, src, first);
+  memcpy(p->buf, src + first, n - first);
+  p->len += n;
+  return n;
+}
+
+static size_t k_ring_get(pipe_t* p, char* dst, size_t n) {
+  if (n > p->len) {
+    n = p->len;
+  }
+  size_t first = PIPE_BUF_SIZE - p->head < n ? PIPE_BUF_SIZE - p->head : n;
+  memcpy(dst, p->buf + p->head, first);
+  memcpy(dst + first, p->buf, n - first);
+  p->head = (p->head + n) % PIPE_BUF_SIZE;
+  p->len -= n;
+  return n;
+}
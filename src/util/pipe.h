@@ -0,0 +1,88 @@
+#ifndef PIPE_H
+#define PIPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "struct.h"
+
+// In-kernel pipes.
+//
+// A pipe is a bounded ring buffer shared by the open_file_t entries of its
+// ends (see k_pipe() in fat_kernel.h). Readers block while it is empty and
+// writers while it is full; both sleep in the pipe's own wait queues
+// (k_sleep_on / k_wakeup), so a blocked end costs no CPU and waking it
+// does not scan the other blocked processes.
+//
+// A reader that finds the pipe empty posts its own buffer, and the next
+// writer copies straight into it instead of into the ring. A stream whose
+// reader keeps up is thus copied once, not twice.
+
+/** @brief Capacity of a pipe's ring buffer in bytes */
+#define PIPE_BUF_SIZE 4096
+
+typedef struct pipe {
+  char buf[PIPE_BUF_SIZE];
+  size_t head;  // index of the oldest byte in buf
+  size_t len;   // bytes in buf
+
+  uint32_t readers;  // open_file_t entries of the read end
+  uint32_t writers;  // open_file_t entries of the write end
+
+  pcb_queue_t rd_wait;  // readers blocked until there are bytes (or EOF)
+  pcb_queue_t wr_wait;  // writers blocked until there is room
+
+  // Buffer posted by a blocked reader (see above). rd_end is the read end
+  // it posted through. A writer fills it, sets rd_got and clears rd_dst;
+  // the reader collects the bytes and clears rd_end.
+  open_file_t* rd_end;
+  char* rd_dst;
+  size_t rd_cap;
+  size_t rd_got;
+} pipe_t;
+
+/**
+ * @brief Allocate an empty pipe with no ends attached.
+ *
+ * @return The pipe, or NULL if memory could not be allocated.
+ */
+pipe_t* k_pipe_create(void);
+
+/**
+ * @brief Attach an open file entry to a pipe as a read or write end.
+ *
+ * @param p   The pipe.
+ * @param end The entry; its flag (F_READ or F_WRITE) says which end.
+ */
+void k_pipe_attach(pipe_t* p, open_file_t* end);
+
+/**
+ * @brief Read up to @p n bytes from a pipe, blocking while it is empty.
+ *
+ * @param end The read end.
+ * @param n   Maximum number of bytes to read.
+ * @param buf Where the bytes go.
+ * @return Bytes read, 0 once the pipe is empty and has no writer left.
+ */
+ssize_t k_pipe_read(open_file_t* end, size_t n, char* buf);
+
+/**
+ * @brief Write @p n bytes to a pipe, blocking while it is full.
+ *
+ * @param end The write end.
+ * @param str The bytes to write.
+ * @param n   Number of bytes to write.
+ * @return @p n, fewer if the last reader went away in between, or -1 with
+ * P_ERRNO set to P_EPIPE if there was no reader to begin with.
+ */
+ssize_t k_pipe_write(open_file_t* end, const char* str, size_t n);
+
+/**
+ * @brief Detach an end from its pipe, waking whoever waits on the other
+ * end. The pipe is freed with its last end.
+ *
+ * @param end The end to detach; end->pipe is cleared.
+ */
+void k_pipe_detach(open_file_t* end);
+
+#endif
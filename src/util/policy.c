@@ -0,0 +1,146 @@
+#include "policy.h"
+#include <stdlib.h>
+#include <string.h>
+
+/** Fixed-point "one": the pass distance of a queue with weight 1 */
+#define STRIDE_ONE (1u << 20)
+
+// stride policy state
+static uint64_t stride[NUM_PRIO];  // pass increment per pick
+static uint64_t pass[NUM_PRIO];    // virtual time of each queue
+static uint64_t global_pass = 0;   // pass of the most recent pick
+
+// table policy state
+static const int schedule[] =
+    {  // Fixed schedule array corresponding to 9:6:4 ratio
+        0, 1, 0, 2, 0, 1, 0, 2, 0, 1, 0, 1, 0, 2, 0, 1, 0, 2, 1};
+static int idx = 0;  // The 'pointer' to the next prio in schedule.
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Static Function Declarations =================== /////
+////////////////////////////////////////////////////////////////////////////
+
+static void stride_init(const unsigned int weights[NUM_PRIO]);
+static int stride_pick(uint32_t ready);
+static void table_init(const unsigned int weights[NUM_PRIO]);
+static int table_pick(uint32_t ready);
+
+const sched_policy_t SCHED_POLICY_STRIDE = {
+    .name = "stride",
+    .init = stride_init,
+    .pick = stride_pick,
+};
+
+const sched_policy_t SCHED_POLICY_TABLE = {
+    .name = "table",
+    .init = table_init,
+    .pick = table_pick,
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Public API Implementation =================== ////////
+////////////////////////////////////////////////////////////////////////////
+
+const sched_policy_t* k_policy_lookup(const char* name) {
+  if (strcmp(name, SCHED_POLICY_STRIDE.name) == 0) {
+    return &SCHED_POLICY_STRIDE;
+  }
+  if (strcmp(name, SCHED_POLICY_TABLE.name) == 0) {
+    return &SCHED_POLICY_TABLE;
+  }
+  return NULL;
+}
+
+bool k_policy_parse_weights(const char* spec, unsigned int weights[NUM_PRIO]) {
+  unsigned int parsed[NUM_PRIO];
+  const char* p = spec;
+
+  for (int i = 0; i < NUM_PRIO; i++) {
+    char* end = NULL;
+    long w = strtol(p, &end, 10);
+    if (end == p || w <= 0 || w > STRIDE_ONE) {
+      return false;
+    }
+    parsed[i] = (unsigned int)w;
+
+    // weights are separated by commas, and there must be exactly NUM_PRIO
+    if (i < NUM_PRIO - 1) {
+      if (*end != ',') {
+        return false;
+      }
+      p = end + 1;
+    } else if (*end != '\0') {
+      return false;
+    }
+  }
+
+  memcpy(weights, parsed, sizeof(parsed));
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Static Function Implementations =================== //
+////////////////////////////////////////////////////////////////////////////
+
+static void stride_init(const unsigned int weights[NUM_PRIO]) {
+  for (int i = 0; i < NUM_PRIO; i++) {
+    stride[i] = STRIDE_ONE / weights[i];
+    // start one stride in, so the heaviest queue goes first
+    pass[i] = stride[i];
+  }
+  global_pass = 0;
+}
+
+static int stride_pick(uint32_t ready) {
+  if (ready == 0) {
+    return -1;
+  }
+
+  int best = -1;
+  for (uint32_t bits = ready; bits != 0; bits &= bits - 1) {
+    int q = __builtin_ctz(bits);
+
+    // A queue that sat empty must not bank the time it missed, or it would
+    // monopolize the CPU once it has work again.
+    if (pass[q] < global_pass) {
+      pass[q] = global_pass;
+    }
+    // ties go to the lower (more interactive) priority
+    if (best < 0 || pass[q] < pass[best]) {
+      best = q;
+    }
+  }
+
+  global_pass = pass[best];
+  pass[best] += stride[best];
+  return best;
+}
+
+static void table_init(const unsigned int weights[NUM_PRIO]) {
+  (void)weights;
+  idx = 0;
+}
+
+static int table_pick(uint32_t ready) {
+  if (ready == 0) {
+    return -1;
+  }
+
+  const int size = sizeof(schedule) / sizeof(schedule[0]);
+  // Iterate through the schedule to find the next available queue
+  // We loop up to 'size' times to ensure we check everyone if needed
+  for (int i = 0; i < size; i++) {
+    int q = schedule[idx];
+
+    // Always advance the index to maintain the "time slot" logic
+    idx = (idx + 1) % size;
+
+    // If the scheduled queue has processes, pick it
+    if (ready & (1u << q)) {
+      return q;
+    }
+  }
+
+  // queues the table never names (NUM_PRIO > 3): lowest non-empty one
+  return __builtin_ctz(ready);
+}
@@ -0,0 +1,75 @@
+#ifndef POLICY_H
+#define POLICY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "struct.h"
+
+_Static_assert(NUM_PRIO <= 32, "the ready bitmap holds at most 32 queues");
+
+/**
+ * Default weight of queue 0. Every further queue gets two thirds of the one
+ * before it (at least 1), giving the classic 9:6:4 for the first three.
+ */
+#define SCHED_DEFAULT_WEIGHT 9
+
+/**
+ * @brief A pluggable queue-selection policy.
+ *
+ * The scheduler asks the policy which ready queue to run next, passing a
+ * bitmap in which bit i is set when priority queue i is non-empty.
+ */
+typedef struct sched_policy {
+  const char* name;  // name used to select the policy at boot
+
+  /**
+   * @brief Reset the policy state.
+   *
+   * @param weights Relative share of the CPU for each priority queue; every
+   *                entry is at least 1.
+   */
+  void (*init)(const unsigned int weights[NUM_PRIO]);
+
+  /**
+   * @brief Choose the priority queue to dequeue from.
+   *
+   * @param ready Bitmap of non-empty priority queues.
+   * @return The chosen priority, or -1 if @p ready is 0.
+   */
+  int (*pick)(uint32_t ready);
+} sched_policy_t;
+
+/**
+ * @brief Stride scheduling over the priority queues (the default).
+ *
+ * Each queue advances a virtual "pass" by STRIDE_ONE / weight whenever it
+ * is picked, and the non-empty queue with the smallest pass runs next. The
+ * work done per pick is bounded by NUM_PRIO, and any number of queues works.
+ */
+extern const sched_policy_t SCHED_POLICY_STRIDE;
+
+/**
+ * @brief The original fixed 19-slot 9:6:4 schedule table.
+ *
+ * Weights are ignored. It assumes the default three priority queues.
+ */
+extern const sched_policy_t SCHED_POLICY_TABLE;
+
+/**
+ * @brief Look up a policy by name.
+ *
+ * @param name "stride" or "table".
+ * @return The policy, or NULL if @p name is unknown.
+ */
+const sched_policy_t* k_policy_lookup(const char* name);
+
+/**
+ * @brief Parse a comma separated list of NUM_PRIO weights, e.g. "9,6,4".
+ *
+ * @param spec    The string to parse.
+ * @param weights Output array; only written on success.
+ * @return true on success, false if @p spec is malformed or a weight is 0.
+ */
+bool k_policy_parse_weights(const char* spec, unsigned int weights[NUM_PRIO]);
+
+#endif
@@ -2,38 +2,115 @@
 #include <stdlib.h>
 
 #include "../scheduler.h"
-#include "Vec.h"  // Vec implementation
+#include "panic.h"
 #include "queue.h"
 #include "struct.h"
 
 static priority_queues_t prio_q;
 static blocked_queue_t blocked_q;
+static uint32_t ready_mask = 0;  // bit i set <=> prio_q[i] is non-empty
+
+// Timed sleepers live in a binary min-heap keyed by wake_tick instead of the
+// blocked queue, which only holds processes waiting without a deadline. Each
+// PCB records its heap slot in sleep_idx so it can be removed in O(log n).
+// The heap grows with the number of sleepers, like the process table.
+static pcb_t** sleep_heap = NULL;
+static size_t sleep_len = 0;
+static size_t sleep_cap = 0;
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Static Function Declarations =================== /////
+////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Append a PCB at the tail of an intrusive queue in O(1).
+ *
+ * If the PCB is still linked into another queue it is unlinked first, so a
+ * PCB can never end up in two queues at once.
+ */
+static void pcb_queue_push(pcb_queue_t* q, pcb_t* proc);
+
+/**
+ * @brief Remove and return the head of an intrusive queue in O(1).
+ *
+ * @return The head PCB, or NULL if the queue is empty.
+ */
+static pcb_t* pcb_queue_pop(pcb_queue_t* q);
+
+/**
+ * @brief Unlink a PCB from whatever queue it is in, in O(1).
+ *
+ * It is a no-op if the PCB is not queued.
+ */
+static void pcb_queue_unlink(pcb_t* proc);
+
+/**
+ * @brief Refresh the ready_mask bit of @p q if it is one of the prio queues.
+ */
+static void update_ready_mask(const pcb_queue_t* q);
+
+/**
+ * @brief Insert a sleeping PCB into the sleep heap, keyed by its wake_tick.
+ *
+ * If the PCB is already in the heap it is removed first.
+ */
+static void sleep_heap_push(pcb_t* proc);
+
+/**
+ * @brief Remove a PCB from the sleep heap.
+ *
+ * It is a no-op if the PCB is not in the heap.
+ */
+static void sleep_heap_remove(pcb_t* proc);
+
+/**
+ * @brief Restore the heap order around slot @p i after its key changed.
+ */
+static void sleep_heap_fix(size_t i);
+
+/**
+ * @brief Place @p proc in heap slot @p i and record the slot in the PCB.
+ */
+static void sleep_heap_set(size_t i, pcb_t* proc);
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Public API Implementation =================== ////////
+////////////////////////////////////////////////////////////////////////////
 
 // Initialize all queues
 void k_queues_init() {
   // priority queue
   for (int i = 0; i < NUM_PRIO; i++) {
-    prio_q[i] = vec_new(16, NULL);
+    prio_q[i] = (pcb_queue_t){0};
   }
+  ready_mask = 0;
   // blocked queue
-  blocked_q.blocked_queue = vec_new(16, NULL);
+  blocked_q.blocked_queue = (pcb_queue_t){0};
+  // sleep heap
+  sleep_len = 0;
 }
 
 // Destroy all queues
 void k_queues_destroy() {
-  for (int i = 0; i < NUM_PRIO; i++) {
-    vec_destroy(&prio_q[i]);
-  }
-  vec_destroy(&blocked_q.blocked_queue);
+  // The queues own no PCBs; those are freed by the process code, so just
+  // forget about them.
+  k_queues_init();
+  free(sleep_heap);
+  sleep_heap = NULL;
+  sleep_cap = 0;
 }
 
 // --- Ready Queue Operations ---
 bool is_pq_empty(int prio) {
-  return vec_len(&prio_q[prio]) == 0;
+  return prio_q[prio].len == 0;
+}
+
+uint32_t k_ready_mask() {
+  return ready_mask;
 }
 
 bool is_bq_empty() {
-  return vec_len(&blocked_q.blocked_queue) == 0;
+  return blocked_q.blocked_queue.len == 0 && sleep_len == 0;
 }
 
 void k_enqueue(pcb_t* proc) {
@@ -44,16 +121,24 @@ void k_enqueue(pcb_t* proc) {
   if (prio < 0 || prio >= NUM_PRIO)
     return;
 
-  vec_push_back(&prio_q[prio], proc);
+  if (!proc->queue) {
+    proc->stats.ready_since = tick;  // a priority move keeps waiting
+  }
+  pcb_queue_push(&prio_q[prio], proc);
 }
 
 pcb_t* k_dequeue(int prio) {
-  if (prio < 0 || prio >= NUM_PRIO || vec_len(&prio_q[prio]) == 0)
+  if (prio < 0 || prio >= NUM_PRIO)
     return NULL;
 
-  pcb_t* p = vec_get(&prio_q[prio], 0);
-  vec_erase(&prio_q[prio], 0);
-  return p;
+  return pcb_queue_pop(&prio_q[prio]);
+}
+
+pcb_t* k_ready_head(int prio) {
+  if (prio < 0 || prio >= NUM_PRIO)
+    return NULL;
+
+  return prio_q[prio].head;
 }
 
 void k_block(pcb_t* proc) {
@@ -61,23 +146,46 @@ void k_block(pcb_t* proc) {
     return;
 
   proc->state = P_BLOCKED;
-  vec_remove(&prio_q[proc->prio], proc);
-  vec_push_back(&blocked_q.blocked_queue, proc);
+  if (proc->wake_tick > 0) {
+    // timed sleep: only the sleep heap needs to know about it
+    pcb_queue_unlink(proc);
+    sleep_heap_push(proc);
+  } else {
+    sleep_heap_remove(proc);
+    pcb_queue_push(&blocked_q.blocked_queue, proc);
+  }
 
   // Log the blocking event
-  k_log_event("BLOCKED", proc);
+  k_log_event(LOG_BLOCKED, proc);
 }
 
 void k_unblock(pcb_t* proc) {
   if (!proc)
     return;
 
-  vec_remove(&blocked_q.blocked_queue, proc);
+  pcb_queue_unlink(proc);
+  sleep_heap_remove(proc);
   proc->state = P_READY;
   k_enqueue(proc);
 
   // Log the unblocking event
-  k_log_event("UNBLOCKED", proc);
+  k_log_event(LOG_UNBLOCKED, proc);
+}
+
+void k_sleep_on(pcb_t* proc, pcb_queue_t* waitq) {
+  if (!proc) {
+    return;
+  }
+
+  proc->wake_tick = 0;  // no deadline: it stays until k_wakeup(waitq)
+  k_block(proc);
+  pcb_queue_push(waitq, proc);  // moves it off the blocked queue
+}
+
+void k_wakeup(pcb_queue_t* waitq) {
+  while (waitq->head) {
+    k_unblock(waitq->head);  // unlinks it
+  }
 }
 
 void k_stop(pcb_t* proc) {
@@ -85,48 +193,45 @@ void k_stop(pcb_t* proc) {
     return;
 
   proc->state = P_STOPPED;
-  proc->stopped_reported = false;
-  vec_remove(&prio_q[proc->prio], proc);
 
   // scheduler will sleep-check the blocked queue, so when a process is stopped
   // it should be removed from the blocked queue (since it's no longer
-  // 'sleeping').
-  vec_remove(&blocked_q.blocked_queue, proc);
-  pcb_t* parent = proc->parent;
-  if (parent && parent->state == P_BLOCKED && parent->wake_tick == 0) {
-    k_unblock(parent);
-  }
+  // 'sleeping') as well as from its ready queue.
+  pcb_queue_unlink(proc);
+  sleep_heap_remove(proc);
+  k_wait_event_push(proc);
 
   // Log the stopped event
-  k_log_event("STOPPED", proc);
+  k_log_event(LOG_STOPPED, proc);
 }
 
 void k_continue(pcb_t* proc) {
   if (proc && proc->state == P_STOPPED) {
+    k_wait_event_remove(proc);  // an unreported stop is void now
     proc->state = P_READY;
     k_enqueue(proc);
 
     // Log the continued event
-    k_log_event("CONTINUED", proc);
+    k_log_event(LOG_CONTINUED, proc);
   }
 }
 
 void k_tick_sleep_check(uint64_t tick) {
-  size_t i = 0;
-  while (i < vec_len(&blocked_q.blocked_queue)) {
-    pcb_t* proc = (pcb_t*)vec_get(&blocked_q.blocked_queue, i);
-
-    if (proc->wake_tick > 0 && proc->wake_tick <= tick) {
-      proc->wake_tick = 0;
-      k_unblock(proc);
-    } else {
-      i++;
-    }
+  // Only the sleepers that are due are touched; the heap top is always the
+  // earliest deadline.
+  while (sleep_len > 0 && (uint64_t)sleep_heap[0]->wake_tick <= tick) {
+    pcb_t* proc = sleep_heap[0];
+    proc->wake_tick = 0;
+    k_unblock(proc);  // also pops it off the heap
   }
 }
 
+uint64_t k_next_wake_tick() {
+  return sleep_len > 0 ? (uint64_t)sleep_heap[0]->wake_tick : 0;
+}
+
 void k_set_priority(pcb_t* proc, int prio) {
-  if (!proc || prio < 0 || prio > 2 || proc->prio == prio) {
+  if (!proc || prio < 0 || prio >= NUM_PRIO || proc->prio == prio) {
     return;
   }
 
@@ -137,21 +242,203 @@ void k_set_priority(pcb_t* proc, int prio) {
   k_log_nice_event(proc, old_prio, prio);
 
   if (proc->state == P_READY) {
-    vec_remove(&prio_q[old_prio], proc);
-    k_enqueue(proc);
+    k_enqueue(proc);  // moves it from prio_q[old_prio]
+  }
+}
+
+void k_wait_event_push(pcb_t* child) {
+  pcb_t* parent = child ? child->parent : NULL;
+  if (!parent) {
+    return;
+  }
+
+  if (!child->w_queued) {
+    pcb_queue_t* q = &parent->wait_events;
+    child->w_prev = q->tail;
+    child->w_next = NULL;
+    if (q->tail) {
+      q->tail->w_next = child;
+    } else {
+      q->head = child;
+    }
+    q->tail = child;
+    q->len++;
+    child->w_queued = true;
+  }
+
+  if (parent->state == P_BLOCKED && parent->wake_tick == 0) {
+    k_unblock(parent);
   }
 }
 
+pcb_t* k_wait_event_peek(pcb_t* parent) {
+  return parent ? parent->wait_events.head : NULL;
+}
+
+void k_wait_event_remove(pcb_t* child) {
+  if (!child || !child->w_queued || !child->parent) {
+    return;
+  }
+
+  pcb_queue_t* q = &child->parent->wait_events;
+  if (child->w_prev) {
+    child->w_prev->w_next = child->w_next;
+  } else {
+    q->head = child->w_next;
+  }
+  if (child->w_next) {
+    child->w_next->w_prev = child->w_prev;
+  } else {
+    q->tail = child->w_prev;
+  }
+  q->len--;
+
+  child->w_prev = NULL;
+  child->w_next = NULL;
+  child->w_queued = false;
+}
+
 void k_remove_from_queues(pcb_t* proc) {
   if (!proc) {
     return;
   }
 
-  // Try to remove from ready queues
-  for (int i = 0; i < NUM_PRIO; i++) {
-    vec_remove(&prio_q[i], proc);
+  // Remove from the ready / blocked queue it is linked into, if any
+  pcb_queue_unlink(proc);
+  sleep_heap_remove(proc);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Static Function Implementations =================== //
+////////////////////////////////////////////////////////////////////////////
+
+static void pcb_queue_push(pcb_queue_t* q, pcb_t* proc) {
+  pcb_queue_unlink(proc);
+
+  proc->q_prev = q->tail;
+  proc->q_next = NULL;
+  if (q->tail) {
+    q->tail->q_next = proc;
+  } else {
+    q->head = proc;
+  }
+  q->tail = proc;
+  q->len++;
+  proc->queue = q;
+  update_ready_mask(q);
+}
+
+static pcb_t* pcb_queue_pop(pcb_queue_t* q) {
+  pcb_t* proc = q->head;
+  pcb_queue_unlink(proc);
+  return proc;
+}
+
+static void pcb_queue_unlink(pcb_t* proc) {
+  if (!proc || !proc->queue) {
+    return;
+  }
+
+  pcb_queue_t* q = proc->queue;
+  if (proc->q_prev) {
+    proc->q_prev->q_next = proc->q_next;
+  } else {
+    q->head = proc->q_next;
+  }
+  if (proc->q_next) {
+    proc->q_next->q_prev = proc->q_prev;
+  } else {
+    q->tail = proc->q_prev;
+  }
+  q->len--;
+  update_ready_mask(q);
+
+  proc->q_prev = NULL;
+  proc->q_next = NULL;
+  proc->queue = NULL;
+}
+
+static void update_ready_mask(const pcb_queue_t* q) {
+  if (q < prio_q || q >= prio_q + NUM_PRIO) {
+    return;  // the blocked queue
+  }
+
+  uint32_t bit = 1u << (q - prio_q);
+  if (q->len > 0) {
+    ready_mask |= bit;
+  } else {
+    ready_mask &= ~bit;
   }
+}
 
-  // Try to remove from blocked queue
-  vec_remove(&blocked_q.blocked_queue, proc);
-}
\ No newline at end of file
+static void sleep_heap_push(pcb_t* proc) {
+  sleep_heap_remove(proc);
+  if (sleep_len == sleep_cap) {
+    size_t cap = sleep_cap == 0 ? 16 : sleep_cap * 2;
+    pcb_t** heap = realloc(sleep_heap, cap * sizeof(pcb_t*));
+    if (!heap) {
+      panic("sleep_heap_push: reallocation failed!\n");
+    }
+    sleep_heap = heap;
+    sleep_cap = cap;
+  }
+
+  sleep_heap_set(sleep_len, proc);
+  sleep_len++;
+  sleep_heap_fix(sleep_len - 1);
+}
+
+static void sleep_heap_remove(pcb_t* proc) {
+  if (!proc || proc->sleep_idx < 0) {
+    return;
+  }
+
+  size_t i = (size_t)proc->sleep_idx;
+  proc->sleep_idx = -1;
+  sleep_len--;
+  if (i == sleep_len) {
+    return;  // it was the last slot
+  }
+
+  // move the last element into the hole and re-heapify from there
+  sleep_heap_set(i, sleep_heap[sleep_len]);
+  sleep_heap_fix(i);
+}
+
+static void sleep_heap_fix(size_t i) {
+  pcb_t* proc = sleep_heap[i];
+
+  // sift up
+  while (i > 0) {
+    size_t parent = (i - 1) / 2;
+    if (sleep_heap[parent]->wake_tick <= proc->wake_tick) {
+      break;
+    }
+    sleep_heap_set(i, sleep_heap[parent]);
+    i = parent;
+  }
+
+  // sift down
+  while (true) {
+    size_t child = 2 * i + 1;
+    if (child >= sleep_len) {
+      break;
+    }
+    if (child + 1 < sleep_len &&
+        sleep_heap[child + 1]->wake_tick < sleep_heap[child]->wake_tick) {
+      child++;
+    }
+    if (proc->wake_tick <= sleep_heap[child]->wake_tick) {
+      break;
+    }
+    sleep_heap_set(i, sleep_heap[child]);
+    i = child;
+  }
+
+  sleep_heap_set(i, proc);
+}
+
+static void sleep_heap_set(size_t i, pcb_t* proc) {
+  sleep_heap[i] = proc;
+  proc->sleep_idx = (int)i;
+}
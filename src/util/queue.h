@@ -2,6 +2,7 @@
 #define QUEUE_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include "struct.h"
 
 /**
@@ -23,7 +24,14 @@ void k_queues_destroy();
 bool is_pq_empty(int prio);
 
 /**
- * @brief Inspect if the blocked queue is empty
+ * @brief Get a bitmap of the non-empty priority queues.
+ *
+ * @return A mask in which bit i is set if priority queue i is non-empty.
+ */
+uint32_t k_ready_mask();
+
+/**
+ * @brief Inspect if the blocked queue and the sleep heap are both empty
  *
  * @return true if the queue is empty, false otherwise
  */
@@ -54,9 +62,21 @@ void k_enqueue(pcb_t* proc);
  */
 pcb_t* k_dequeue(int prio);
 
+/**
+ * @brief Peek at the process that has been on a priority queue the longest.
+ *
+ * @param prio The priority level, in [0, NUM_PRIO).
+ * @return The head of the queue, still queued, or NULL if it is empty or
+ *         @p prio is out of range.
+ */
+pcb_t* k_ready_head(int prio);
+
 /**
  * @brief Block a process and move it from the ready queue to the blocked queue.
  *
+ * A process with a pending wake_tick (a timed sleep) goes into the sleep heap
+ * instead, so that processes waiting indefinitely (e.g. in s_waitpid) are
+ * never looked at by k_tick_sleep_check().
  * It is a no-op if @p proc is NULL.
  *
  * @param proc Pointer to the process control block to block.
@@ -72,6 +92,27 @@ void k_block(pcb_t* proc);
  */
 void k_unblock(pcb_t* proc);
 
+/**
+ * @brief Block a process in the wait queue @p waitq until someone calls
+ * k_wakeup() on it.
+ *
+ * The caller still has to k_yield(). Wakeups may be spurious (e.g. after a
+ * stop / continue), so callers re-check their condition in a loop.
+ *
+ * @param proc  The process to block.
+ * @param waitq The queue of what it waits for (e.g. a pipe's readers); it
+ *              takes the place of the blocked queue.
+ */
+void k_sleep_on(pcb_t* proc, pcb_queue_t* waitq);
+
+/**
+ * @brief Unblock every process sleeping in @p waitq (see k_sleep_on()), in
+ * O(woken processes).
+ *
+ * @param waitq The queue the sleepers passed to k_sleep_on().
+ */
+void k_wakeup(pcb_queue_t* waitq);
+
 /**
  * @brief Stop a process without placing it in any ready or blocked queue.
  *
@@ -92,22 +133,61 @@ void k_stop(pcb_t* proc);
 void k_continue(pcb_t* proc);
 
 /**
- * @brief Checks the blocked queue and wakes any processes whose sleep timer has
- * expired.
+ * @brief Wakes any processes whose sleep timer has expired.
+ *
+ * Sleepers are kept in a min-heap keyed by wake_tick, so the cost is
+ * proportional to the number of processes that actually wake up.
+ *
+ * @param tick The current global tick.
  */
 void k_tick_sleep_check(uint64_t tick);
 
+/**
+ * @brief Get the deadline of the earliest timed sleeper.
+ *
+ * @return The smallest pending wake_tick, or 0 if no process is sleeping.
+ */
+uint64_t k_next_wake_tick();
+
 /**
  * @brief Update the priority level of a process. If the process was in ready
  * queue, move it accordingly.
  *
  * @param proc The target PCB.
- * @param prio The new priority level (0, 1, or 2).
+ * @param prio The new priority level, in [0, NUM_PRIO).
  */
 void k_set_priority(pcb_t* proc, int prio);
 
 /**
- * @brief Remove a process from all queues (ready and blocked).
+ * @brief Record a state change (zombie or stopped) of @p child for its
+ * parent's waitpid, in O(1).
+ *
+ * The parent is woken if it is blocked without a deadline. A child already
+ * waiting to be reported keeps its place in the queue.
+ *
+ * @param child The child whose state changed.
+ */
+void k_wait_event_push(pcb_t* child);
+
+/**
+ * @brief Oldest unreported child state change of @p parent.
+ *
+ * @param parent The waiting process.
+ * @return The child, still queued, or NULL if there is none.
+ */
+pcb_t* k_wait_event_peek(pcb_t* parent);
+
+/**
+ * @brief Withdraw the pending state change of @p child, in O(1).
+ *
+ * It is a no-op if nothing is pending for it.
+ *
+ * @param child The child whose state change was reported or undone.
+ */
+void k_wait_event_remove(pcb_t* child);
+
+/**
+ * @brief Remove a process from all queues (ready, blocked and sleep heap).
  *
  * This is used when a process becomes a zombie and should no longer
  * be in any scheduling queue.
@@ -0,0 +1,241 @@
+#include "script_cache.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../fat_kernel.h"
+#include "../fat_syscalls.h"
+#include "p_errno.h"
+#include "spthread.h"
+
+// Several shells may run scripts at once, so the table and the reference
+// counts are only touched with the scheduler kept out
+// (spthread_disable_interrupts_nested()). Reading and parsing a script
+// happens outside of it.
+static script_t* cache[SCRIPT_CACHE_SIZE];
+static uint64_t use_clock = 0;
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Static Function Declarations =================== /////
+////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Find the cached entry for exactly this version of a file.
+ *
+ * @return The entry, or NULL.
+ */
+static script_t* script_cache_find(const file_stat_t* st);
+
+/**
+ * @brief Cache @p script, replacing an older version of the same file or
+ * else the least recently used entry.
+ */
+static void script_cache_insert(script_t* script);
+
+/**
+ * @brief Drop one reference to @p script, freeing it with the last one.
+ */
+static void script_unref(script_t* script);
+
+/**
+ * @brief Read a script in full and parse its lines.
+ *
+ * @return A script with one reference, or NULL with P_ERRNO set.
+ */
+static script_t* script_load(const char* fname, const file_stat_t* st);
+
+/**
+ * @brief Free a script and its parsed lines.
+ */
+static void script_free(script_t* script);
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Public API Implementation =================== ////////
+////////////////////////////////////////////////////////////////////////////
+
+script_t* script_cache_get(const char* fname) {
+  file_stat_t st;
+  if (s_stat(fname, &st) < 0) {
+    return NULL;
+  }
+  if (st.type != 1) {
+    P_ERRNO = FS_NOT_A_FILE;
+    return NULL;
+  }
+  if (!(st.perm & 1)) {
+    P_ERRNO = FS_NO_PERMISSION;
+    return NULL;
+  }
+
+  bool locked = spthread_disable_interrupts_nested();
+  script_t* script = script_cache_find(&st);
+  if (script != NULL) {
+    script->refs++;
+    script->last_use = ++use_clock;
+  }
+  spthread_restore_interrupts(locked);
+  if (script != NULL) {
+    return script;
+  }
+
+  script_t* loaded = script_load(fname, &st);
+  if (loaded == NULL || st.size > SCRIPT_CACHE_MAX_SIZE) {
+    return loaded;
+  }
+
+  locked = spthread_disable_interrupts_nested();
+  script = script_cache_find(&st);  // another shell may have been quicker
+  if (script != NULL) {
+    script->refs++;
+    script->last_use = ++use_clock;
+  } else {
+    script_cache_insert(loaded);
+  }
+  spthread_restore_interrupts(locked);
+
+  if (script != NULL) {
+    script_free(loaded);
+    return script;
+  }
+  return loaded;
+}
+
+void script_cache_put(script_t* script) {
+  if (script == NULL) {
+    return;
+  }
+  bool locked = spthread_disable_interrupts_nested();
+  script_unref(script);
+  spthread_restore_interrupts(locked);
+}
+
+void script_cache_clear(void) {
+  bool locked = spthread_disable_interrupts_nested();
+  for (size_t i = 0; i < SCRIPT_CACHE_SIZE; i++) {
+    if (cache[i] != NULL) {
+      script_unref(cache[i]);
+      cache[i] = NULL;
+    }
+  }
+  spthread_restore_interrupts(locked);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// =================== Static Function Implementations =================== //
+////////////////////////////////////////////////////////////////////////////
+
+static script_t* script_cache_find(const file_stat_t* st) {
+  for (size_t i = 0; i < SCRIPT_CACHE_SIZE; i++) {
+    script_t* script = cache[i];
+    if (script != NULL && script->id == st->id &&
+        script->mtime == st->mtime && script->size == st->size &&
+        script->first_block == st->first_block) {
+      return script;
+    }
+  }
+  return NULL;
+}
+
+static void script_cache_insert(script_t* script) {
+  size_t slot = 0;
+  for (size_t i = 0; i < SCRIPT_CACHE_SIZE; i++) {
+    if (cache[i] == NULL || cache[i]->id == script->id) {
+      slot = i;  // free, or an outdated version of the same file
+      break;
+    }
+    if (cache[i]->last_use < cache[slot]->last_use) {
+      slot = i;
+    }
+  }
+
+  if (cache[slot] != NULL) {
+    script_unref(cache[slot]);  // shells still running it keep it alive
+  }
+  script->refs++;  // the cache's reference
+  script->last_use = ++use_clock;
+  cache[slot] = script;
+}
+
+static void script_unref(script_t* script) {
+  if (--script->refs == 0) {
+    script_free(script);
+  }
+}
+
+static script_t* script_load(const char* fname, const file_stat_t* st) {
+  script_t* script = calloc(1, sizeof(script_t));
+  char* text = malloc((size_t)st->size + 1);
+  if (script == NULL || text == NULL) {
+    free(script);
+    free(text);
+    P_ERRNO = FS_MALLOC_FAIL;
+    return NULL;
+  }
+  script->id = st->id;
+  script->mtime = st->mtime;
+  script->size = st->size;
+  script->first_block = st->first_block;
+  script->refs = 1;
+
+  // Read the whole file
+  int fd = s_open(fname, F_READ);
+  if (fd < 0) {
+    free(script);
+    free(text);
+    return NULL;
+  }
+  size_t len = 0;
+  ssize_t n;
+  while (len < st->size &&
+         (n = s_read(fd, (int)(st->size - len), text + len)) > 0) {
+    len += (size_t)n;
+  }
+  s_close(fd);
+  text[len] = '\0';
+
+  // Parse every line that ends in a newline. Lines that do not parse are
+  // skipped, as run_command_line() does.
+  size_t cap = 0;
+  char* line = text;
+  char* newline;
+  while ((newline = strchr(line, '\n')) != NULL) {
+    *newline = '\0';
+    struct parsed_command* pcmd = NULL;
+    if (line[0] != '\0' && parse_command(line, &pcmd) == 0 && pcmd != NULL) {
+      if (pcmd->num_commands == 0 || pcmd->commands[0] == NULL ||
+          pcmd->commands[0][0] == NULL) {
+        free(pcmd);
+      } else {
+        if (script->num_lines == cap) {
+          size_t new_cap = cap == 0 ? 8 : 2 * cap;
+          struct parsed_command** lines =
+              realloc(script->lines, new_cap * sizeof(*lines));
+          if (lines == NULL) {
+            free(pcmd);
+            free(text);
+            script_free(script);
+            P_ERRNO = FS_MALLOC_FAIL;
+            return NULL;
+          }
+          script->lines = lines;
+          cap = new_cap;
+        }
+        script->lines[script->num_lines++] = pcmd;
+      }
+    } else {
+      free(pcmd);
+    }
+    line = newline + 1;
+  }
+
+  free(text);
+  return script;
+}
+
+static void script_free(script_t* script) {
+  for (size_t i = 0; i < script->num_lines; i++) {
+    free(script->lines[i]);  // one block per parsed command
+  }
+  free(script->lines);
+  free(script);
+}
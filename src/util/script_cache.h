@@ -0,0 +1,60 @@
+#ifndef SCRIPT_CACHE_H
+#define SCRIPT_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include "parser.h"
+
+// Parsed shell scripts.
+//
+// A script is read and parsed once, and the parsed lines are kept for the
+// next run. A cache entry is keyed by the file's dirent offset together
+// with its mtime, size and first block, so editing, truncating or replacing
+// the file makes the next run read it again.
+
+/** @brief Number of scripts kept parsed at once */
+#define SCRIPT_CACHE_SIZE 16
+/** @brief Scripts larger than this are parsed for every run, not cached */
+#define SCRIPT_CACHE_MAX_SIZE (64 * 1024)
+
+typedef struct script {
+  // key: the file and the version of it that was parsed
+  off_t id;
+  time_t mtime;
+  uint32_t size;
+  uint16_t first_block;
+
+  size_t num_lines;
+  struct parsed_command** lines;  // the non-empty lines that parse, in order
+
+  uint32_t refs;      // shells running it, plus one while it is cached
+  uint64_t last_use;  // for LRU eviction
+} script_t;
+
+/**
+ * @brief Get the parsed lines of an executable script, reading and parsing
+ * it only if the cache has no entry for its current version.
+ *
+ * As before, only lines ending in a newline are run.
+ *
+ * @param fname The script's file name.
+ * @return The script, to be released with script_cache_put(), or NULL with
+ * P_ERRNO set (FS_FILE_NOT_FOUND, FS_NO_PERMISSION if it is not executable,
+ * FS_NOT_A_FILE, FS_MALLOC_FAIL, or a read error).
+ */
+script_t* script_cache_get(const char* fname);
+
+/**
+ * @brief Release a script obtained from script_cache_get().
+ */
+void script_cache_put(script_t* script);
+
+/**
+ * @brief Drop every cached script. Scripts still running stay valid until
+ * they are put.
+ */
+void script_cache_clear(void);
+
+#endif
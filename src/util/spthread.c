@@ -1,16 +1,23 @@
 #define _GNU_SOURCE
 
 #include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <setjmp.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include "./spthread.h"
 
 #define MILISEC_IN_NANO 100000
 
+// most threads kept parked by spthread_pool_release
+#define SPTHREAD_POOL_MAX 16
+
 ///////////////////////////////////////////////////////////////////////////////
 // definitions and  thread_local globals
 ///////////////////////////////////////////////////////////////////////////////
@@ -42,14 +49,13 @@ typedef struct spthread_fwd_args_st {
 
 // struct used to send signal to spthread
 // and so that the thread can set "ack"
-// to acknowledge that it is going to stop/continue
+// to acknowledge that it is going to stop/continue.
+// ack is a futex word: the sender sleeps on it and
+// the handler wakes the sender as soon as it is set,
+// instead of the sender polling with nanosleep.
 typedef struct spthread_signal_args_st {
   const int signal;
-  volatile sig_atomic_t ack;
-  pthread_mutex_t shutup_mutex;
-  // mutex to make helgrind shutup about data races
-  // This mutex is probably not necessary, but
-  // here for now. Problaby should use <stdatmoic.h>
+  int ack;
 } spthread_signal_args;
 
 // meta information necessary for
@@ -69,6 +75,18 @@ typedef struct spthread_meta_st {
 
   // for data races
   pthread_mutex_t meta_mutex;
+
+  // thread pool (see spthread_pool_create)
+  bool pooled;              // returns to the pool instead of exiting
+  bool in_job;              // running a routine (spthread_exit jumps back)
+  sigjmp_buf pool_env;      // where spthread_exit lands in a pooled thread
+  pthread_fn job_routine;   // next routine, NULL while parked without work
+  void* job_arg;
+  int parked;               // futex word: 1 once parked and reusable
+
+  // spthread_cleanup_set
+  void (*cleanup_fn)(void*);
+  void* cleanup_arg;
 } spthread_meta_t;
 
 // Defines the various states
@@ -91,6 +109,11 @@ typedef struct spthread_meta_st {
 // points to a heap allocated meta struct
 static _Thread_local spthread_meta_t* my_meta = NULL;
 
+// parked pooled threads, guarded by pool_mutex
+static spthread_t pool[SPTHREAD_POOL_MAX];
+static size_t pool_len = 0;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 ///////////////////////////////////////////////////////////////////////////////
 // helper declarations
 ///////////////////////////////////////////////////////////////////////////////
@@ -98,6 +121,14 @@ static _Thread_local spthread_meta_t* my_meta = NULL;
 // handler for SIGPTHD to suspend or continue the thrad
 static void sigpthd_handler(int signum, siginfo_t*, void*);
 
+// sends SIGPTHD carrying the given request to thread and
+// blocks until the thread acknowledges it (or exits)
+static int send_and_wait_ack(spthread_t thread, int signal);
+
+// called from the handler: publish the ack and wake the sender.
+// Only uses a raw futex syscall, which is async-signal-safe.
+static void post_ack(spthread_signal_args* args);
+
 // the function that the created thread first runs to
 // start off suspended and setup the sigpthd handler
 static void* spthread_start(void* arg);
@@ -107,6 +138,25 @@ static void* spthread_start(void* arg);
 // sets itself to be in the "terminated" status
 static void mark_self_terminated(void* arg);
 
+// spthread_create with the pooled flag of the new thread
+static int spthread_create_meta(spthread_t* thread,
+                                const pthread_attr_t* attr,
+                                pthread_fn start_routine,
+                                void* arg,
+                                bool pooled);
+
+// body of a pooled thread: run the job, park, repeat. Only left
+// through cancellation.
+static void spthread_pool_loop(void);
+
+// park the calling pooled thread (SIGPTHD blocked) until it has been
+// handed a new routine and continued. Requests that reach it meanwhile
+// are acknowledged without running anything.
+static void spthread_park(void);
+
+// run and clear the spthread_cleanup_set registration, if any
+static void run_cleanup(void);
+
 ///////////////////////////////////////////////////////////////////////////////
 // public function definitions
 ///////////////////////////////////////////////////////////////////////////////
@@ -115,10 +165,25 @@ int spthread_create(spthread_t* thread,
                     const pthread_attr_t* attr,
                     pthread_fn start_routine,
                     void* arg) {
+  return spthread_create_meta(thread, attr, start_routine, arg, false);
+}
+
+static int spthread_create_meta(spthread_t* thread,
+                                const pthread_attr_t* attr,
+                                pthread_fn start_routine,
+                                void* arg,
+                                bool pooled) {
   spthread_meta_t* child_meta = malloc(sizeof(spthread_meta_t));
   if (child_meta == NULL) {
     return EAGAIN;
   }
+  child_meta->pooled = pooled;
+  child_meta->in_job = false;
+  child_meta->job_routine = NULL;
+  child_meta->job_arg = NULL;
+  child_meta->parked = 0;
+  child_meta->cleanup_fn = NULL;
+  child_meta->cleanup_arg = NULL;
 
   spthread_fwd_args* fwd_args = malloc(sizeof(spthread_fwd_args));
   if (fwd_args == NULL) {
@@ -175,50 +240,7 @@ int spthread_suspend(spthread_t thread) {
     return spthread_suspend_self();
   }
 
-  spthread_signal_args args = (spthread_signal_args){
-      .signal = SPTHREAD_SIG_SUSPEND,
-      .ack = 0,
-  };
-  pthread_mutex_init(&args.shutup_mutex, NULL);
-
-  int ret = pthread_sigqueue(thread.thread, SIGPTHD,
-                             (union sigval){
-                                 .sival_ptr = &args,
-                             });
-  if (ret != 0) {
-    pthread_mutex_destroy(&args.shutup_mutex);
-    // handles the case where the thread is already dead.
-    return ret;
-  }
-
-  // wait for our signal to be ack'd
-
-  // setting up args to nanosleep
-  const struct timespec t = (struct timespec){
-      .tv_nsec = MILISEC_IN_NANO,
-  };
-
-  nanosleep(&t, NULL);
-
-  pthread_mutex_lock(&args.shutup_mutex);
-  while (args.ack != 1) {
-    // wait for a mili second
-    pthread_mutex_unlock(&args.shutup_mutex);
-
-    nanosleep(&t, NULL);
-
-    // fprintf(stderr, "susp checking...\n");
-    pthread_mutex_lock(&args.shutup_mutex);
-
-    if (thread.meta->state == SPTHREAD_TERMINATED_STATE) {
-      // child called exit, can break
-      break;
-    }
-  }
-  pthread_mutex_unlock(&args.shutup_mutex);
-
-  pthread_mutex_destroy(&args.shutup_mutex);
-  return ret;
+  return send_and_wait_ack(thread, SPTHREAD_SIG_SUSPEND);
 }
 
 int spthread_suspend_self() {
@@ -246,47 +268,7 @@ int spthread_continue(spthread_t thread) {
     return 0;
   }
 
-  spthread_signal_args args = (spthread_signal_args){
-      .signal = SPTHREAD_SIG_CONTINUE,
-      .ack = 0,
-  };
-  pthread_mutex_init(&args.shutup_mutex, NULL);
-
-  int ret = pthread_sigqueue(thread.thread, SIGPTHD,
-                             (union sigval){
-                                 .sival_ptr = &args,
-                             });
-  if (ret != 0) {
-    pthread_mutex_destroy(&args.shutup_mutex);
-    // handles the case where the thread is already dead.
-    return ret;
-  }
-
-  // wait for our signal to be ack'd
-
-  // setting up args to nanosleep
-  const struct timespec t = (struct timespec){
-      .tv_nsec = MILISEC_IN_NANO,
-  };
-
-  pthread_mutex_lock(&args.shutup_mutex);
-  while (args.ack != 1) {
-    // wait for a mili second
-    pthread_mutex_unlock(&args.shutup_mutex);
-
-    nanosleep(&t, NULL);
-
-    // fprintf(stderr, "susp checking...\n");
-    pthread_mutex_lock(&args.shutup_mutex);
-
-    if (thread.meta->state == SPTHREAD_TERMINATED_STATE) {
-      // child called exit, can break
-      break;
-    }
-  }
-  pthread_mutex_unlock(&args.shutup_mutex);
-  pthread_mutex_destroy(&args.shutup_mutex);
-  return ret;
+  return send_and_wait_ack(thread, SPTHREAD_SIG_CONTINUE);
 }
 
 int spthread_cancel(spthread_t thread) {
@@ -312,6 +294,11 @@ int spthread_join(spthread_t thread, void** retval) {
 }
 
 void spthread_exit(void* status) {
+  if (my_meta != NULL && my_meta->pooled && my_meta->in_job) {
+    // back to spthread_pool_loop, which parks the thread
+    siglongjmp(my_meta->pool_env, 1);
+  }
+
   // necessary cleanup is registered
   // in a cleanup routine
   // that is pushed at start of an spthread
@@ -359,6 +346,96 @@ int spthread_enable_interrupts_self() {
   return 0;
 }
 
+bool spthread_disable_interrupts_nested() {
+  if (my_meta == NULL) {
+    return false;  // not an spthread: nothing can suspend us
+  }
+  sigset_t cur;
+  if (pthread_sigmask(SIG_BLOCK, NULL, &cur) != 0 ||
+      sigismember(&cur, SIGPTHD)) {
+    return false;  // already disabled by a caller: leave enabling to it
+  }
+  return spthread_disable_interrupts_self() == 0;
+}
+
+void spthread_restore_interrupts(bool disabled) {
+  if (disabled) {
+    spthread_enable_interrupts_self();
+  }
+}
+
+int spthread_pool_create(spthread_t* thread,
+                         pthread_fn start_routine,
+                         void* arg) {
+  pthread_mutex_lock(&pool_mutex);
+  if (pool_len == 0) {
+    pthread_mutex_unlock(&pool_mutex);
+    return spthread_create_meta(thread, NULL, start_routine, arg, true);
+  }
+  spthread_t reused = pool[--pool_len];
+  pthread_mutex_unlock(&pool_mutex);
+
+  // The thread sits in spthread_park() and looks at job_routine when the
+  // scheduler first continues it, exactly like a fresh thread waiting in
+  // spthread_start().
+  spthread_meta_t* meta = reused.meta;
+  meta->job_arg = arg;
+  meta->state = SPTHREAD_SUSPENDED_STATE;
+  __atomic_store_n(&meta->parked, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&meta->job_routine, start_routine, __ATOMIC_RELEASE);
+
+  *thread = reused;
+  return 0;
+}
+
+int spthread_pool_release(spthread_t thread) {
+  spthread_meta_t* meta = thread.meta;
+  if (!meta->pooled) {
+    return spthread_join(thread, NULL);
+  }
+
+  // like spthread_join, wait for the routine to be over
+  const struct timespec t = (struct timespec){
+      .tv_nsec = MILISEC_IN_NANO,
+  };
+  while (__atomic_load_n(&meta->parked, __ATOMIC_ACQUIRE) == 0) {
+    if (meta->state == SPTHREAD_TERMINATED_STATE) {
+      return spthread_join(thread, NULL);  // cancelled
+    }
+    syscall(SYS_futex, &meta->parked, FUTEX_WAIT_PRIVATE, 0, &t, NULL, 0);
+  }
+
+  pthread_mutex_lock(&pool_mutex);
+  if (pool_len < SPTHREAD_POOL_MAX) {
+    pool[pool_len++] = thread;
+    pthread_mutex_unlock(&pool_mutex);
+    return 0;
+  }
+  pthread_mutex_unlock(&pool_mutex);
+
+  pthread_cancel(thread.thread);
+  return spthread_join(thread, NULL);
+}
+
+void spthread_pool_destroy() {
+  pthread_mutex_lock(&pool_mutex);
+  while (pool_len > 0) {
+    spthread_t thread = pool[--pool_len];
+    pthread_cancel(thread.thread);  // sigwaitinfo() is a cancellation point
+    spthread_join(thread, NULL);
+  }
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+int spthread_cleanup_set(void (*fn)(void*), void* arg) {
+  if (my_meta == NULL) {
+    return ESRCH;
+  }
+  my_meta->cleanup_fn = fn;
+  my_meta->cleanup_arg = arg;
+  return 0;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // helper definitions
 ///////////////////////////////////////////////////////////////////////////////
@@ -396,13 +473,13 @@ static void sigpthd_handler(int signum,
 
   spthread_signal_args* args =
       ((spthread_signal_args*)info->si_value.sival_ptr);
-  pthread_mutex_lock(&args->shutup_mutex);
   int s_val = args->signal;
 
+  // args lives on the sender's stack and may be gone
+  // right after post_ack(), so read everything first
   if (s_val == SPTHREAD_SIG_SUSPEND) {
     my_meta->state = SPTHREAD_SUSPENDED_STATE;
-    args->ack = 1;
-    pthread_mutex_unlock(&args->shutup_mutex);
+    post_ack(args);
     do {
       // man 7 signal-saftey says
       // this function is safe for signal handlers;
@@ -410,13 +487,55 @@ static void sigpthd_handler(int signum,
     } while (my_meta->state == SPTHREAD_SUSPENDED_STATE);
   } else if (s_val == SPTHREAD_SIG_CONTINUE) {
     my_meta->state = SPTHREAD_RUNNING_STATE;
-    args->ack = 1;
-    pthread_mutex_unlock(&args->shutup_mutex);
-  } else {
-    pthread_mutex_unlock(&args->shutup_mutex);
+    post_ack(args);
   }
 }
 
+static int send_and_wait_ack(spthread_t thread, int signal) {
+  spthread_signal_args args = (spthread_signal_args){
+      .signal = signal,
+      .ack = 0,
+  };
+
+  int ret = pthread_sigqueue(thread.thread, SIGPTHD,
+                             (union sigval){
+                                 .sival_ptr = &args,
+                             });
+  if (ret != 0) {
+    // handles the case where the thread is already dead.
+    return ret;
+  }
+
+  // wait for our signal to be ack'd. The timeout only matters
+  // if the thread exits before handling the signal, in which
+  // case nobody will ever post the ack.
+  const struct timespec t = (struct timespec){
+      .tv_nsec = MILISEC_IN_NANO,
+  };
+
+  while (__atomic_load_n(&args.ack, __ATOMIC_ACQUIRE) != 1) {
+    if (thread.meta->state == SPTHREAD_TERMINATED_STATE) {
+      // child called exit, can break
+      break;
+    }
+    // sleeps only while ack is still 0
+    syscall(SYS_futex, &args.ack, FUTEX_WAIT_PRIVATE, 0, &t, NULL, 0);
+  }
+
+  return ret;
+}
+
+static void post_ack(spthread_signal_args* args) {
+  // we run inside the handler: don't clobber the errno
+  // of whatever the interrupted thread was doing
+  int saved_errno = errno;
+  __atomic_store_n(&args->ack, 1, __ATOMIC_RELEASE);
+  // a wake on a stale address is harmless: futex waiters
+  // always re-check their condition
+  syscall(SYS_futex, &args->ack, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  errno = saved_errno;
+}
+
 static void* spthread_start(void* arg) {
   spthread_fwd_args* args = (spthread_fwd_args*)arg;
   spthread_fwd_args func = *args;
@@ -457,7 +576,13 @@ static void* spthread_start(void* arg) {
   } while (my_meta->state == SPTHREAD_SUSPENDED_STATE);
 
   // run the desired function
-  res = func.actual_routine(func.actual_arg);
+  if (my_meta->pooled) {
+    my_meta->job_routine = func.actual_routine;
+    my_meta->job_arg = func.actual_arg;
+    spthread_pool_loop();
+  } else {
+    res = func.actual_routine(func.actual_arg);
+  }
 
   pthread_cleanup_pop(1);
 
@@ -472,5 +597,72 @@ static void mark_self_terminated(void* arg) {
   sigaddset(&mask, SIGPTHD);
   pthread_sigmask(SIG_BLOCK, &mask, NULL);
 
+  run_cleanup();
   my_meta->state = SPTHREAD_TERMINATED_STATE;
+  // spthread_pool_release may be waiting for us to park
+  syscall(SYS_futex, &my_meta->parked, FUTEX_WAKE_PRIVATE, INT_MAX, NULL,
+          NULL, 0);
+}
+
+static void spthread_pool_loop(void) {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGPTHD);
+
+  while (true) {
+    my_meta->in_job = true;
+    if (sigsetjmp(my_meta->pool_env, 0) == 0) {
+      my_meta->job_routine(my_meta->job_arg);
+    }
+    my_meta->in_job = false;
+
+    // spthread_exit() callers have SIGPTHD blocked already
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    run_cleanup();
+    spthread_park();
+  }
+}
+
+static void spthread_park(void) {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGPTHD);
+
+  __atomic_store_n(&my_meta->job_routine, NULL, __ATOMIC_RELAXED);
+  __atomic_store_n(&my_meta->parked, 1, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &my_meta->parked, FUTEX_WAKE_PRIVATE, INT_MAX, NULL,
+          NULL, 0);
+
+  // SIGPTHD stays blocked and is taken with sigwaitinfo(), so a request
+  // the scheduler sent just before we finished (e.g. the suspend at the end
+  // of our last slice) is answered here instead of reaching the handler
+  // once the next routine unblocks it.
+  while (true) {
+    siginfo_t info;
+    if (sigwaitinfo(&mask, &info) != SIGPTHD || info.si_code != SI_QUEUE) {
+      continue;
+    }
+    spthread_signal_args* args =
+        ((spthread_signal_args*)info.si_value.sival_ptr);
+    if (args->signal == SPTHREAD_SIG_CONTINUE &&
+        __atomic_load_n(&my_meta->job_routine, __ATOMIC_ACQUIRE) != NULL) {
+      my_meta->state = SPTHREAD_RUNNING_STATE;
+      post_ack(args);
+      break;
+    }
+    if (args->signal == SPTHREAD_SIG_SUSPEND) {
+      my_meta->state = SPTHREAD_SUSPENDED_STATE;
+    }
+    post_ack(args);
+  }
+
+  pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+}
+
+static void run_cleanup(void) {
+  void (*fn)(void*) = my_meta->cleanup_fn;
+  my_meta->cleanup_fn = NULL;
+  if (fn != NULL) {
+    fn(my_meta->cleanup_arg);
+  }
 }
\ No newline at end of file
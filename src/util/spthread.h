@@ -219,4 +219,60 @@ int spthread_disable_interrupts_self();
 // returns 0 on success, or -1 on error
 int spthread_enable_interrupts_self();
 
+// For kernel code that may be reached with interrupts already
+// disabled: disables them for the calling spthread unless a caller
+// further up already did (e.g. s_exit()), or the caller is not an
+// spthread at all (the scheduler, pennfat), in which case nothing
+// can suspend it anyway.
+//
+// returns true if interrupts were disabled here, in which case the
+// result must be passed to spthread_restore_interrupts() afterwards
+bool spthread_disable_interrupts_nested();
+
+// Undoes spthread_disable_interrupts_nested(): re-enables interrupts
+// if `disabled` is true, and leaves them alone otherwise.
+void spthread_restore_interrupts(bool disabled);
+
+// spthread_pool_create:
+// works like spthread_create (the thread starts out suspended and
+// must be continued first), but the thread is taken from a pool of
+// parked threads when one is available.
+//
+// A pooled thread does not terminate when its routine returns or
+// calls spthread_exit(). It parks instead and is handed back to the pool
+// by spthread_pool_release(), so the next spthread_pool_create() skips
+// pthread_create() and the setup handshake. Cancellation still ends the
+// thread for good.
+//
+// Because spthread_exit() does not unwind a pooled thread, handlers
+// registered with pthread_cleanup_push(3) inside the routine only run on
+// cancellation. Use spthread_cleanup_set() for cleanup that must always
+// run.
+//
+// returns 0 on success, or an error number like spthread_create.
+int spthread_pool_create(spthread_t* thread,
+                         void* (*start_routine)(void*),
+                         void* arg);
+
+// The counterpart of spthread_join for threads from
+// spthread_pool_create: waits until the routine of the thread has
+// finished, then parks the thread in the pool. A thread that was
+// cancelled, or that does not fit in the pool, is joined instead. Any
+// other spthread is simply joined.
+//
+// returns 0 on success, or an error number like spthread_join.
+int spthread_pool_release(spthread_t thread);
+
+// Cancels and joins every parked thread. Call it once no
+// spthread_pool_create or spthread_pool_release can happen anymore.
+void spthread_pool_destroy();
+
+// Registers fn(arg) to run once when the calling spthread leaves its
+// routine: by returning, by spthread_exit(), or by being cancelled. It
+// replaces any earlier registration, and fn == NULL removes it.
+// The function runs with SIGPTHD blocked.
+//
+// returns 0 on success, or ESRCH if the caller is not an spthread.
+int spthread_cleanup_set(void (*fn)(void*), void* arg);
+
 #endif  // SPTHREAD_H_
\ No newline at end of file
@@ -58,8 +58,7 @@ static void* spawn(bool nohang) {
 
     // may need to change the arg of the function to make it work
     // that is ok
-    s_write(STDERR_FILENO, argv[0], strlen(argv[0]));
-    s_write(STDERR_FILENO, " was spawned\n", strlen(" was spawned\n"));
+    s_printf(STDERR_FILENO, "%s was spawned\n", argv[0]);
 
     // can use dprintf to test without integrating fat
     // dprintf(STDERR_FILENO, "%s was spawned\n", *argv);
@@ -78,15 +77,9 @@ static void* spawn(bool nohang) {
       continue;
     }
 
-    // snprintf is ok: it just prints to a string
-    char child_num_str[4];
-    snprintf(child_num_str, 4, "%d", cpid - pid);
-
     // may need to change the arg of the function to make it work
     // that is ok
-    s_write(STDERR_FILENO, "child_", strlen("child_ "));
-    s_write(STDERR_FILENO, child_num_str, strlen(child_num_str));
-    s_write(STDERR_FILENO, " was reaped\n", strlen(" was reaped\n"));
+    s_printf(STDERR_FILENO, "child_%d was reaped\n", cpid - pid);
 
     // can use dprintf to test without integrating fat
     // dprintf(STDERR_FILENO, "child_%d was reaped\n", cpid - pid);
@@ -119,8 +112,7 @@ static void* spawn_r(void* arg) {
 
     // may need to change the arg of the function to make it work
     // that is ok
-    s_write(STDERR_FILENO, argv[0], strlen(argv[0]));
-    s_write(STDERR_FILENO, " was spawned\n", strlen(" was spawned\n"));
+    s_printf(STDERR_FILENO, "%s was spawned\n", argv[0]);
 
     // can use dprintf to test without integrating fat
     // dprintf(STDERR_FILENO, "%s was spawned\n", *argv);
@@ -129,8 +121,7 @@ static void* spawn_r(void* arg) {
   }
 
   if (pid > 0 && pid == s_waitpid(pid, NULL, false)) {
-    s_write(STDERR_FILENO, argv[0], strlen(argv[0]));
-    s_write(STDERR_FILENO, " was reaped\n", strlen(" was reaped\n"));
+    s_printf(STDERR_FILENO, "%s was reaped\n", argv[0]);
     // dprintf(STDERR_FILENO, "%s was reaped\n", *argv);
   }
 
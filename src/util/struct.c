@@ -5,19 +5,37 @@
 void pcb_init(pcb_t* pcb) {
   if (!pcb)
     return;
+  pcb->process = (spthread_t){0};  // no thread yet
   pcb->state = P_READY;
   pcb->prio = 1;  // Default priority
+  pcb->aged_tick = 0;
   pcb->wake_tick = 0;
-  pcb->stopped_reported = false;
   pcb->ppid = 0;
+  pcb->gen = 0;
   pcb->parent = NULL;
   pcb->exit_status = P_EXIT_NONE;  // Haven't exited yet.
-  pcb->childs = vec_new(5, NULL);
+  pcb->child_head = NULL;
+  pcb->child_tail = NULL;
+  pcb->num_childs = 0;
+  pcb->sib_prev = NULL;
+  pcb->sib_next = NULL;
+  pcb->wait_events = (pcb_queue_t){0};
+  pcb->w_prev = NULL;
+  pcb->w_next = NULL;
+  pcb->w_queued = false;
   for (int i = 0; i < MAX_FD; i++) {
     pcb->fd_table[i] = -1;
+    pcb->obuf[i] = NULL;
   }
   pcb->cmd_name[0] = '\0';  // Empty command name
+  pcb->cwd[0] = '/';        // the root directory
+  pcb->cwd[1] = '\0';
   pcb->args = NULL;
+  pcb->q_prev = NULL;
+  pcb->q_next = NULL;
+  pcb->queue = NULL;
+  pcb->sleep_idx = -1;
+  pcb->stats = (sched_stats_t){0};
 }
 
 // Initialize an open file entry
@@ -25,12 +43,23 @@ void open_file_init(open_file_t* file) {
   if (!file)
     return;
   file->name[0] = '\0';
-  file->size = 0;
   file->perm = 0;
 
-  file->first_block = 0x0000;
-  file->dirent_offset = 0;
+  file->inode = NULL;
 
   file->offset = 0;
   file->flag = 0;
+
+  file->cur_block = 0;
+  file->cur_index = 0;
+  file->cur_gen = 0;
+
+  file->ra_next = 0;
+  file->ra_window = 0;
+  file->ra_end = 0;
+
+  file->resv_start = 0;
+  file->resv_len = 0;
+
+  file->pipe = NULL;
 }
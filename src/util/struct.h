@@ -4,13 +4,24 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/types.h>
-#include "./Vec.h"
+#include <time.h>
 #include "./spthread.h"
 
+// Number of priority queues. Queues past the third get the stride policy's
+// default weights too, so this can be raised at build time (-DNUM_PRIO=...).
+#ifndef NUM_PRIO
 #define NUM_PRIO 3
+#endif
 #define MAX_FD 32
 #define MAX_NAME_LEN 32
+// longest PennFAT path, the current directory of a process included
+#define MAX_PATH_LEN 256
+// Most processes alive at once (PIDs are 1..MAX_PROC-1 and are reused once
+// reaped). The process table grows on demand, so the limit can be raised at
+// build time (-DMAX_PROC=...) without paying for it up front.
+#ifndef MAX_PROC
 #define MAX_PROC 1024
+#endif
 #define PID_INVALID 0
 #define PID_INIT 1
 
@@ -24,58 +35,152 @@ typedef enum {
   P_EXIT_STOPPED
 } pexit_t;
 
+/**
+ * @brief In-memory state of an open file, shared by all of its descriptors.
+ *
+ * There is one per dirent that is open at least once, so every descriptor
+ * of a file sees the same size and first block.
+ */
+typedef struct open_inode {
+  off_t dirent_offset;   // fast reference to dirent (identifies the file)
+  uint32_t size;         // cached file size
+  uint16_t first_block;  // fast reference to file block
+
+  bool dirty;    // size / first_block / mtime not yet in the dirent
+  time_t mtime;  // time of the last change (valid while dirty)
+
+  uint32_t refs;        // open_file_t instances pointing here
+  uint32_t writers;     // ... of which opened with F_WRITE / F_APPEND
+  uint32_t generation;  // bumped on truncation, invalidates block cursors
+
+  struct open_inode* hash_next;  // next inode in the same hash bucket
+} open_inode_t;
+
 typedef struct open_file {
   char name[MAX_NAME_LEN];  // cached file name
-  uint32_t size;            // cached file size
   uint8_t perm;             // cached file perm
 
-  uint16_t first_block;  // fast reference to file block
-  off_t dirent_offset;   // fast reference to dirent
+  open_inode_t* inode;  // shared file state (NULL for STDIN/STDOUT/STDERR)
 
   uint64_t offset;  // fd-specific offset
   uint8_t flag;     // fd-specific F_READ/F_WRITE/F_APPEND
+
+  uint16_t cur_block;  // cached block of the last access (0: none)
+  uint32_t cur_index;  // index of cur_block within the file
+  uint32_t cur_gen;    // inode generation the cursor belongs to
+
+  uint64_t ra_next;    // offset a sequential read would start at
+  uint32_t ra_window;  // read-ahead window in blocks (0: not sequential)
+  uint32_t ra_end;     // index of the first block not read ahead yet
+
+  uint16_t resv_start;  // first block of the preallocated extent (writers)
+  uint16_t resv_len;    // blocks left in the preallocated extent
+
+  struct pipe* pipe;  // pipe this is one end of (flag says which), or NULL
 } open_file_t;
 
+/** @brief Capacity of a process's output buffer for one descriptor */
+#define OBUF_SIZE 4096
+
+/**
+ * @brief Output buffered for one of a process's descriptors by s_printf()
+ * and s_bwrite() (see fat_syscalls.h).
+ */
+typedef struct obuf {
+  size_t len;                // bytes pending in data
+  bool line;                 // flush at each newline, not only when full
+  char data[OBUF_SIZE + 1];  // +1 for vsnprintf's terminator
+} obuf_t;
+
+/** @brief Per-process scheduler statistics */
+typedef struct sched_stats {
+  uint64_t run_ns;         // wall time of its slices, however they ended
+  uint64_t ticks_waiting;  // ticks spent READY in a queue
+  uint64_t ready_since;    // tick it was last put on a ready queue
+  uint64_t voluntary;      // slices it ended itself (block, exit, yield)
+  uint64_t involuntary;    // slices ended by the timer
+  uint64_t switch_ns;      // wall time in spthread_continue/suspend for it
+} sched_stats_t;
+
+struct pcb;
+
+/**
+ * @brief Intrusive FIFO queue of PCBs.
+ *
+ * PCBs are linked through their own q_prev/q_next fields, so enqueue, dequeue
+ * and removal of an arbitrary PCB are all O(1) and never allocate.
+ */
+typedef struct pcb_queue {
+  struct pcb* head;
+  struct pcb* tail;
+  size_t len;
+} pcb_queue_t;
+
 typedef struct pcb {
   // Process identity
   spthread_t process;           // spthread handle for the process
   char cmd_name[MAX_NAME_LEN];  // Process name/command brief
-  char** args;                  // Deep-copied arguments
+  char** args;                  // Deep-copied arguments (in arena)
+  void* arena;        // argv and redirection data copied by s_spawn
+  size_t arena_size;  // capacity of arena, kept while the PCB is recycled
   pid_t pid;
+  uint64_t gen;  // spawn sequence number; tells apart PCBs that reused a PID
   pstate_t state;
   int prio;               // Priority: 0, 1, or 2
+  uint64_t aged_tick;     // tick it was last aged up (feedback mode), or 0
   int wake_tick;          // Used while sleeping (in clock ticks)
-  bool stopped_reported;  // If STOPPED state has been reported to waitpid
 
   // Parent process
   pid_t ppid;
   struct pcb* parent;
 
-  // Child processes
-  Vec childs;
+  // Child processes in creation order, linked through their sib_prev/sib_next
+  struct pcb* child_head;
+  struct pcb* child_tail;
+  size_t num_childs;
+  struct pcb* sib_prev;
+  struct pcb* sib_next;
+
+  // Children whose state change (zombie, stopped) waitpid has not reported
+  // yet, oldest first. A child is linked into its parent's wait_events
+  // through w_prev/w_next.
+  pcb_queue_t wait_events;
+  struct pcb* w_prev;
+  struct pcb* w_next;
+  bool w_queued;
 
   // Local File Descriptor Table (Stores KFD index instead of a pointer)
   int fd_table[MAX_FD];
+  obuf_t* obuf[MAX_FD];  // pending buffered output per local fd, or NULL
+  char cwd[MAX_PATH_LEN];  // current directory: absolute, normalized
 
   // Exit status
   pexit_t exit_status;
 
-} pcb_t;
+  // Scheduler statistics
+  sched_stats_t stats;
 
-/** @brief Process table */
-typedef pcb_t* process_table[MAX_PROC];
+  // Scheduler queue linkage (a process is in at most one queue at a time)
+  struct pcb* q_prev;
+  struct pcb* q_next;
+  pcb_queue_t* queue;  // queue this PCB is linked into, NULL if none
+  int sleep_idx;       // slot in the sleep heap, -1 if not sleeping
+
+} pcb_t;
 
 /** @brief Priority queues */
-typedef Vec priority_queues_t[NUM_PRIO];  // default 3
+typedef pcb_queue_t priority_queues_t[NUM_PRIO];  // default 3
 
 /** @brief Blocked queue */
 typedef struct {
-  Vec blocked_queue;  // Queue of blocked processes
+  pcb_queue_t blocked_queue;  // Queue of blocked processes
 } blocked_queue_t;
 
 /**
  * @brief Initialize a PCB.
  *
+ * The spawn arena of a recycled PCB is kept for reuse.
+ *
  * @param pcb The PCB to initialize.
  */
 void pcb_init(pcb_t* pcb);
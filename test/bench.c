@@ -0,0 +1,411 @@
+// Microbenchmarks for the scheduler and filesystem hot paths.
+//
+//   bin/bench [BENCH...]
+//
+// runs the named benchmarks (default: all of them) and prints one JSON
+// object per measurement on stdout:
+//
+//   {"bench":"find_file","param":"files","value":512,"ops":200000,
+//    "ns_per_op":61.2}
+//
+// Throughput benchmarks add "mb_per_s". Kernel status messages (mkfs,
+// mount, ...) are dropped so the output stays machine-readable. The images
+// are temporary files under /tmp.
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fat_kernel.h"
+#include "process.h"
+#include "scheduler.h"
+#include "syscall.h"
+#include "util/queue.h"
+#include "util/spthread.h"
+#include "util/struct.h"
+
+#define CTX_ROUNDS 20000
+#define SPAWN_ROUNDS 2000
+#define QUEUE_ROUNDS 1000000
+#define FIND_LOOKUPS 200000
+#define IO_CHUNK 4096
+#define IO_MAX_BYTES (8 * 1024 * 1024)
+
+static FILE* out;  // the real stdout
+
+///////////////////////////////////////////////////////////////////////////////
+// helpers
+///////////////////////////////////////////////////////////////////////////////
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// deterministic, so runs are comparable
+static uint32_t rng_state = 12345;
+static uint32_t rng(void) {
+  rng_state = rng_state * 1103515245u + 12345u;
+  return rng_state >> 8;
+}
+
+static void report(const char* bench,
+                   const char* param,
+                   long value,
+                   uint64_t ops,
+                   uint64_t ns,
+                   uint64_t bytes) {
+  fprintf(out,
+          "{\"bench\":\"%s\",\"param\":\"%s\",\"value\":%ld,\"ops\":%llu,"
+          "\"ns_per_op\":%.1f",
+          bench, param, value, (unsigned long long)ops,
+          ops ? (double)ns / (double)ops : 0.0);
+  if (bytes > 0) {
+    fprintf(out, ",\"mb_per_s\":%.1f",
+            ns ? (double)bytes / (1024.0 * 1024.0) / ((double)ns / 1e9) : 0.0);
+  }
+  fprintf(out, "}\n");
+  fflush(out);
+}
+
+static void fail(const char* what) {
+  fprintf(stderr, "bench: %s failed (P_ERRNO %d)\n", what, P_ERRNO);
+  exit(1);
+}
+
+// a fresh, empty file under /tmp
+static void tmp_path(char* path) {
+  strcpy(path, "/tmp/pennos-bench-XXXXXX");
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    fail("mkstemp");
+  }
+  close(fd);
+}
+
+// a fresh image under /tmp, mounted
+static void fs_setup(char* path, int blocks_in_fat, int block_size_config) {
+  tmp_path(path);
+  if (mkfs(path, blocks_in_fat, block_size_config, false) != 0) {
+    fail("mkfs");
+  }
+  fs_config_t config;
+  k_fs_config_default(&config);
+  if (mount(path, &config) != FS_SUCCESS) {
+    fail("mount");
+  }
+}
+
+static void fs_teardown(const char* path) {
+  unmount();
+  unlink(path);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// spthread context switch
+///////////////////////////////////////////////////////////////////////////////
+
+static volatile bool ctx_stop = false;
+
+static void* ctx_spin(void* arg) {
+  (void)arg;
+  while (!ctx_stop) {
+  }
+  return NULL;
+}
+
+// continue + suspend, as the scheduler does around every quantum
+static void bench_ctx_switch(void) {
+  spthread_t thread;
+  if (spthread_create(&thread, NULL, ctx_spin, NULL) != 0) {
+    fail("spthread_create");
+  }
+  uint64_t start = now_ns();
+  for (int i = 0; i < CTX_ROUNDS; i++) {
+    spthread_continue(thread);
+    spthread_suspend(thread);
+  }
+  uint64_t ns = now_ns() - start;
+  ctx_stop = true;
+  spthread_continue(thread);
+  spthread_join(thread, NULL);
+  report("ctx_switch", "rounds", CTX_ROUNDS, CTX_ROUNDS, ns, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// spawn + waitpid, inside a running PennOS kernel
+///////////////////////////////////////////////////////////////////////////////
+
+static uint64_t spawn_ns = 0;
+static int spawn_done = 0;
+
+static void* spawn_child(void* arg) {
+  (void)arg;
+  s_exit();
+  return NULL;
+}
+
+// plays init: spawns and reaps children one at a time, then shuts down
+static void* spawn_main(void* arg) {
+  (void)arg;
+  char* argv[] = {"bench-child", NULL};
+  uint64_t start = now_ns();
+  for (; spawn_done < SPAWN_ROUNDS; spawn_done++) {
+    pid_t pid = s_spawn(spawn_child, argv, NULL, NULL, 0);
+    int status;
+    if (pid < 0 || s_waitpid(pid, &status, false) != pid) {
+      break;
+    }
+  }
+  spawn_ns = now_ns() - start;
+  s_shutdown();
+  s_exit();
+  return NULL;
+}
+
+static void bench_spawn(void) {
+  sched_config_t config;
+  k_scheduler_config_default(&config);
+  char log[64];
+  tmp_path(log);
+  config.log_fname = log;
+  k_scheduler_init(&config);
+  char path[64];
+  fs_setup(path, 1, 0);  // the file descriptor table comes with the mount
+
+  pcb_t* init = k_proc_create(NULL);
+  if (init == NULL) {
+    fail("k_proc_create");
+  }
+  init->prio = 0;
+  snprintf(init->cmd_name, MAX_NAME_LEN, "bench");
+  for (int i = 0; i < 3; i++) {
+    init->fd_table[i] = i;
+  }
+  if (spthread_create(&init->process, NULL, spawn_main, NULL) != 0) {
+    fail("spthread_create");
+  }
+  k_enqueue(init);
+  k_scheduler_run();
+  k_kill_all_processes();
+  k_scheduler_cleanup();
+  fs_teardown(path);
+  unlink(log);
+  char stats[80];
+  snprintf(stats, sizeof(stats), "%s.stats", log);  // the shutdown report
+  unlink(stats);
+
+  if (spawn_done < SPAWN_ROUNDS) {
+    fail("s_spawn / s_waitpid");
+  }
+  report("spawn_wait", "rounds", SPAWN_ROUNDS, SPAWN_ROUNDS, spawn_ns, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ready queues
+///////////////////////////////////////////////////////////////////////////////
+
+// steady state with n processes queued: dequeue the head of a queue and
+// enqueue it again, as the scheduler does at every quantum
+static void bench_queue(void) {
+  static const long sizes[] = {16, 256, 4096};
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    long n = sizes[s];
+    pcb_t* pcbs = calloc(n, sizeof(pcb_t));
+    if (pcbs == NULL) {
+      fail("calloc");
+    }
+    k_queues_init();
+    for (long i = 0; i < n; i++) {
+      pcb_init(&pcbs[i]);
+      pcbs[i].prio = (int)(i % NUM_PRIO);
+      k_enqueue(&pcbs[i]);
+    }
+
+    uint64_t start = now_ns();
+    for (long i = 0; i < QUEUE_ROUNDS; i++) {
+      pcb_t* p = k_dequeue((int)(i % NUM_PRIO));
+      k_enqueue(p);
+    }
+    uint64_t ns = now_ns() - start;
+    report("queue_cycle", "procs", n, QUEUE_ROUNDS, ns, 0);
+
+    k_queues_destroy();
+    free(pcbs);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// k_find_file
+///////////////////////////////////////////////////////////////////////////////
+
+static void bench_find_file(void) {
+  static const long sizes[] = {16, 512, 4096};
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    long n = sizes[s];
+    char path[64];
+    fs_setup(path, 32, 4);
+
+    char name[MAX_NAME_LEN];
+    for (long i = 0; i < n; i++) {
+      snprintf(name, sizeof(name), "f%06ld", i);
+      int fd = k_open(name, F_WRITE);
+      if (fd < 0 || k_close(fd) != FS_SUCCESS) {
+        fail("k_open");
+      }
+    }
+
+    uint64_t start = now_ns();
+    for (long i = 0; i < FIND_LOOKUPS; i++) {
+      snprintf(name, sizeof(name), "f%06ld", (long)(rng() % n));
+      off_t off;
+      if (!k_find_file(name, &off)) {
+        fail("k_find_file");
+      }
+    }
+    uint64_t ns = now_ns() - start;
+    report("find_file", "files", n, FIND_LOOKUPS, ns, 0);
+
+    fs_teardown(path);
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// k_read / k_write throughput
+///////////////////////////////////////////////////////////////////////////////
+
+static void bench_io_one(int config, char* buf) {
+  long bs = (long)BLOCK_SIZE_MAP[config];
+  char path[64];
+  fs_setup(path, 32, config);
+
+  // half the data region, so allocation never runs dry
+  size_t data = (size_t)bs * (32 * (size_t)bs / 2 - 1);
+  size_t size = data / 2 < IO_MAX_BYTES ? data / 2 : IO_MAX_BYTES;
+  size -= size % IO_CHUNK;
+  size_t chunks = size / IO_CHUNK;
+
+  // sequential write, close (and its commit) included
+  uint64_t start = now_ns();
+  int fd = k_open("data", F_WRITE);
+  for (size_t i = 0; i < chunks; i++) {
+    if (fd < 0 || k_write(fd, buf, IO_CHUNK) != IO_CHUNK) {
+      fail("k_write");
+    }
+  }
+  k_close(fd);
+  report("seq_write", "block_size", bs, chunks, now_ns() - start, size);
+
+  start = now_ns();
+  fd = k_open("data", F_READ);
+  for (size_t i = 0; i < chunks; i++) {
+    if (fd < 0 || k_read(fd, IO_CHUNK, buf) != IO_CHUNK) {
+      fail("k_read");
+    }
+  }
+  k_close(fd);
+  report("seq_read", "block_size", bs, chunks, now_ns() - start, size);
+
+  start = now_ns();
+  fd = k_open("data", F_READ);
+  for (size_t i = 0; i < chunks; i++) {
+    int off = (int)((rng() % chunks) * IO_CHUNK);
+    if (fd < 0 || k_lseek(fd, off, F_SEEK_SET) != FS_SUCCESS ||
+        k_read(fd, IO_CHUNK, buf) != IO_CHUNK) {
+      fail("k_read (random)");
+    }
+  }
+  k_close(fd);
+  report("rand_read", "block_size", bs, chunks, now_ns() - start, size);
+
+  // F_APPEND keeps the data; the seek decides where each write goes
+  start = now_ns();
+  fd = k_open("data", F_APPEND);
+  for (size_t i = 0; i < chunks; i++) {
+    int off = (int)((rng() % chunks) * IO_CHUNK);
+    if (fd < 0 || k_lseek(fd, off, F_SEEK_SET) != FS_SUCCESS ||
+        k_write(fd, buf, IO_CHUNK) != IO_CHUNK) {
+      fail("k_write (random)");
+    }
+  }
+  k_close(fd);
+  report("rand_write", "block_size", bs, chunks, now_ns() - start, size);
+
+  fs_teardown(path);
+}
+
+static void bench_io(void) {
+  char* buf = malloc(IO_CHUNK);
+  if (buf == NULL) {
+    fail("malloc");
+  }
+  memset(buf, 'x', IO_CHUNK);
+  for (size_t c = 0; c < sizeof(BLOCK_SIZE_MAP) / sizeof(BLOCK_SIZE_MAP[0]);
+       c++) {
+    bench_io_one((int)c, buf);
+  }
+  free(buf);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// main
+///////////////////////////////////////////////////////////////////////////////
+
+typedef struct bench {
+  const char* name;
+  void (*run)(void);
+} bench_t;
+
+static const bench_t BENCHES[] = {
+    {"ctx_switch", bench_ctx_switch}, {"spawn", bench_spawn},
+    {"queue", bench_queue},           {"find_file", bench_find_file},
+    {"io", bench_io},
+};
+#define NUM_BENCHES (sizeof(BENCHES) / sizeof(BENCHES[0]))
+
+int main(int argc, char* argv[]) {
+  for (int i = 1; i < argc; i++) {
+    size_t b = 0;
+    while (b < NUM_BENCHES && strcmp(argv[i], BENCHES[b].name) != 0) {
+      b++;
+    }
+    if (b == NUM_BENCHES) {
+      fprintf(stderr, "usage: %s [", argv[0]);
+      for (b = 0; b < NUM_BENCHES; b++) {
+        fprintf(stderr, "%s%s", b ? "|" : "", BENCHES[b].name);
+      }
+      fprintf(stderr, "]...\n");
+      return 1;
+    }
+  }
+
+  // results go to the real stdout, kernel chatter to /dev/null
+  out = fdopen(dup(STDOUT_FILENO), "w");
+  int devnull = open("/dev/null", O_WRONLY);
+  if (out == NULL || devnull < 0) {
+    perror("bench");
+    return 1;
+  }
+  dup2(devnull, STDOUT_FILENO);
+  close(devnull);
+
+  for (size_t b = 0; b < NUM_BENCHES; b++) {
+    bool wanted = argc == 1;
+    for (int i = 1; i < argc && !wanted; i++) {
+      wanted = strcmp(argv[i], BENCHES[b].name) == 0;
+    }
+    if (wanted) {
+      BENCHES[b].run();
+    }
+  }
+  fclose(out);
+  return 0;
+}